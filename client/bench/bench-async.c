@@ -0,0 +1,118 @@
+/*
+ * bench-async: lookup throughput of a single client against a running
+ * server, synchronously and with up to window asynchronous requests in
+ * flight, to show how many are needed to keep the server's threads busy.
+ *
+ * Usage: bench-async [-n requests] server_socket [windows...]
+ *        (default: 100000 requests, windows 1 4 16 64 256 1024)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FILES 256
+
+char paths[FILES][MAX_INPUT_SIZE];
+int tickets[TFS_MAX_PENDING];
+
+/*
+ * Creates the files looked up (they may exist from a previous run).
+ */
+void build()
+{
+  tfsCreate("/async", 'd');
+  for (int i = 0; i < FILES; i++)
+  {
+    sprintf(paths[i], "/async/f%d", i);
+    tfsCreate(paths[i], 'f');
+  }
+}
+
+/*
+ * Looks up n files synchronously and prints the throughput.
+ */
+void runSync(long n)
+{
+  double start = now_ns(), elapsed;
+
+  for (long i = 0; i < n; i++)
+  {
+    if (tfsLookup(paths[i % FILES]) < 0)
+    {
+      fprintf(stderr, "lookup failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  elapsed = now_ns() - start;
+  printf("sync        %10.0f ops/s %8.2f us/op\n", n / (elapsed / 1e9), elapsed / 1e3 / n);
+}
+
+/*
+ * Looks up n files keeping window requests in flight, and prints the
+ * throughput.
+ */
+void runAsync(long n, int window)
+{
+  double start = now_ns(), elapsed;
+
+  for (long i = 0; i < n + window; i++)
+  {
+    /* claim the oldest request before reusing its place */
+    if (i >= window && tfsWait(tickets[i % window]) < 0)
+    {
+      fprintf(stderr, "lookup failed\n");
+      exit(EXIT_FAILURE);
+    }
+    if (i < n && (tickets[i % window] = tfsLookupAsync(paths[i % FILES])) < 0)
+    {
+      fprintf(stderr, "request failed: %d\n", tickets[i % window]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  elapsed = now_ns() - start;
+  printf("window %4d %10.0f ops/s %8.2f us/op\n", window, n / (elapsed / 1e9), elapsed / 1e3 / n);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, defaults[] = {1, 4, 16, 64, 256, 1024}, window;
+  long n = 100000;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1)
+  {
+    if (opt != 'n' || (n = atol(optarg)) <= 0)
+      optind = argc + 1; /* print usage */
+  }
+  if (optind >= argc)
+  {
+    fprintf(stderr, "Usage: %s [-n requests] server_socket [windows...]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (tfsMount(argv[optind]) != SUCCESS)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  build();
+  runSync(n);
+  if (optind + 1 == argc)
+  {
+    for (int i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+      runAsync(n, defaults[i]);
+  }
+  for (int i = optind + 1; i < argc; i++)
+  {
+    if ((window = atoi(argv[i])) < 1 || window > TFS_MAX_PENDING)
+    {
+      fprintf(stderr, "Invalid window: %s\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+    runAsync(n, window);
+  }
+  tfsUnmount();
+  return 0;
+}
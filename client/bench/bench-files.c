@@ -0,0 +1,115 @@
+/*
+ * bench-files: file contents. Writes a file sequentially, in writes of a
+ * given size, then reads it back the same way, and prints the bandwidth of
+ * each; then makes small writes at random offsets of it and prints their
+ * rate. The data read back is checked.
+ *
+ * Usage: bench-files [-m megabytes] [-b blocksize] [-n smallwrites]
+ *                    [-w smallsize] server_socket
+ *        (default: 64 MB, 65536 byte writes and reads, 100000 writes of
+ *        64 bytes)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_PATH "/bench-files"
+
+/*
+ * Exits if a request did not do all it should.
+ */
+void checkResult(char *what, int result, int expected)
+{
+  if (result != expected)
+  {
+    fprintf(stderr, "%s failed: %d\n", what, result);
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  long megabytes = 64, size, offset;
+  int blockSize = 65536, smallWrites = 100000, smallSize = 64, opt;
+  unsigned int seed = 1;
+  tfs_session_t *session;
+  char *data, *read;
+  double start;
+
+  while ((opt = getopt(argc, argv, "m:b:n:w:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'm':
+      megabytes = atol(optarg);
+      break;
+    case 'b':
+      blockSize = atoi(optarg);
+      break;
+    case 'n':
+      smallWrites = atoi(optarg);
+      break;
+    case 'w':
+      smallSize = atoi(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  size = megabytes << 20;
+  if (argc - optind != 1 || megabytes <= 0 || blockSize <= 0 || smallWrites < 0 ||
+      smallSize <= 0 || smallSize > size)
+  {
+    fprintf(stderr, "Usage: %s [-m megabytes] [-b blocksize] [-n smallwrites] "
+                    "[-w smallsize] server_socket\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ((session = tfsSessionMount(argv[optind])) == NULL)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if ((data = malloc(blockSize)) == NULL || (read = malloc(blockSize)) == NULL)
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < blockSize; i++)
+    data[i] = rand_r(&seed);
+
+  tfsSessionDelete(session, FILE_PATH);
+  checkResult("create", tfsSessionCreate(session, FILE_PATH, 'f'), SUCCESS);
+
+  start = now_ns();
+  for (offset = 0; offset < size; offset += blockSize)
+  {
+    data[0] = offset / blockSize; /* every block different */
+    checkResult("write", tfsSessionWriteAt(session, FILE_PATH, data, blockSize, offset), blockSize);
+  }
+  printf("sequential write %8.1f MB/s\n", (double)offset / (1 << 20) / ((now_ns() - start) / 1e9));
+
+  start = now_ns();
+  for (offset = 0; offset < size; offset += blockSize)
+  {
+    data[0] = offset / blockSize;
+    checkResult("read", tfsSessionReadAt(session, FILE_PATH, read, blockSize, offset), blockSize);
+    checkResult("compare", memcmp(data, read, blockSize), 0);
+  }
+  printf("sequential read  %8.1f MB/s\n", (double)offset / (1 << 20) / ((now_ns() - start) / 1e9));
+
+  start = now_ns();
+  for (int i = 0; i < smallWrites; i++)
+  {
+    offset = ((long)rand_r(&seed) * (1 << 16) + rand_r(&seed) % (1 << 16)) % (size - smallSize + 1);
+    checkResult("small write", tfsSessionWriteAt(session, FILE_PATH, data, smallSize, offset), smallSize);
+  }
+  if (smallWrites > 0)
+    printf("random %d B writes %8.0f writes/s\n", smallSize, smallWrites / ((now_ns() - start) / 1e9));
+
+  tfsSessionDelete(session, FILE_PATH);
+  tfsSessionUnmount(session);
+  free(data);
+  free(read);
+  return 0;
+}
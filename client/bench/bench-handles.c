@@ -0,0 +1,112 @@
+/*
+ * bench-handles: small reads of a file deep in the tree, by path (each
+ * resolving it from the root) and through a handle of an open file (bound
+ * to its i-node); prints the rate and mean latency of each.
+ *
+ * Usage: bench-handles [-n reads] [-w size] [-d depth] server_socket
+ *        (default: 1000000 reads of 64 bytes, at depth 8)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Reads wrap around the file after this many */
+#define READS_PER_PASS 1024
+
+/*
+ * Exits if a request did not do all it should.
+ */
+void checkResult(char *what, int result, int expected)
+{
+  if (result != expected)
+  {
+    fprintf(stderr, "%s failed: %d\n", what, result);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Prints the rate and mean latency of n reads that took ns.
+ */
+void report(char *name, long n, double ns)
+{
+  printf("%-8s %10.0f reads/s  mean %7.2f us\n", name, n / (ns / 1e9), ns / n / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+  long n = 1000000;
+  int size = 64, depth = 8, fd, opt;
+  char path[MAX_PATH_LENGTH] = "", *data;
+  tfs_session_t *session;
+  double start;
+
+  while ((opt = getopt(argc, argv, "n:w:d:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      n = atol(optarg);
+      break;
+    case 'w':
+      size = atoi(optarg);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  if (argc - optind != 1 || n <= 0 || size <= 0 || depth < 0 || depth > 64)
+  {
+    fprintf(stderr, "Usage: %s [-n reads] [-w size] [-d depth] server_socket\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ((session = tfsSessionMount(argv[optind])) == NULL)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if ((data = calloc(READS_PER_PASS, size)) == NULL)
+    exit(EXIT_FAILURE);
+
+  for (int i = 0; i < depth; i++)
+  {
+    sprintf(path + strlen(path), "/handles%d", i);
+    tfsSessionCreate(session, path, 'd');
+  }
+  strcat(path, "/file");
+  tfsSessionCreate(session, path, 'f');
+  checkResult("write", tfsSessionWriteAt(session, path, data, READS_PER_PASS * size, 0), READS_PER_PASS * size);
+
+  start = now_ns();
+  for (long i = 0; i < n; i++)
+    checkResult("read by path", tfsSessionReadAt(session, path, data, size, i % READS_PER_PASS * size), size);
+  report("path", n, now_ns() - start);
+
+  checkResult("open", (fd = tfsSessionOpen(session, path, READ)) > 0, 1);
+  start = now_ns();
+  for (long i = 0; i < n; i++)
+  {
+    if (i % READS_PER_PASS == 0 && i > 0)
+      checkResult("seek", tfsSessionSeek(session, fd, 0), SUCCESS);
+    checkResult("read by handle", tfsSessionRead(session, fd, data, size), size);
+  }
+  report("handle", n, now_ns() - start);
+  tfsSessionClose(session, fd);
+
+  tfsSessionDelete(session, path);
+  for (int i = depth; i > 0; i--)
+  {
+    *strrchr(path, '/') = '\0';
+    tfsSessionDelete(session, path);
+  }
+  tfsSessionUnmount(session);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * bench-latency: round trip latency of a lookup, one at a time, through
+ * the socket and through the shared memory transport; prints the mean,
+ * median and 99th percentile of each.
+ *
+ * Usage: bench-latency [-n requests] server_socket   (default: 100000)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int compareLatencies(const void *a, const void *b)
+{
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Looks up a file n times in the session and prints the latencies.
+ */
+void run(char *name, tfs_session_t *session, long n, double *latencies)
+{
+  double start, total = 0;
+
+  /* warm up */
+  for (long i = 0; i < n / 10; i++)
+    tfsSessionLookup(session, "/latency/f");
+  for (long i = 0; i < n; i++)
+  {
+    start = now_ns();
+    if (tfsSessionLookup(session, "/latency/f") < 0)
+    {
+      fprintf(stderr, "%s: lookup failed\n", name);
+      exit(EXIT_FAILURE);
+    }
+    latencies[i] = now_ns() - start;
+    total += latencies[i];
+  }
+  qsort(latencies, n, sizeof(double), compareLatencies);
+  printf("%-14s mean %7.2f us  p50 %7.2f us  p99 %7.2f us\n", name, total / n / 1e3,
+         latencies[(n - 1) / 2] / 1e3, latencies[(n - 1) * 99 / 100] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+  long n = 100000;
+  tfs_session_t *session;
+  double *latencies;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      n = atol(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  if (argc - optind != 1 || n <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-n requests] server_socket\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ((session = tfsSessionMount(argv[optind])) == NULL ||
+      (latencies = malloc(n * sizeof(double))) == NULL)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  tfsSessionCreate(session, "/latency", 'd');
+  tfsSessionCreate(session, "/latency/f", 'f');
+  run("socket", session, n, latencies);
+  if (tfsSessionSharedMemory(session) != SUCCESS)
+  {
+    fprintf(stderr, "Shared memory transport refused\n");
+    exit(EXIT_FAILURE);
+  }
+  run("shared memory", session, n, latencies);
+  tfsSessionUnmount(session);
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,315 @@
+/*
+ * bench-load: load generator. Each thread opens its own session and, in a
+ * directory of its own, looks up random files or creates/deletes them for a
+ * fixed time; prints the throughput per thread count, and the median and
+ * 99th percentile latency of each operation. Optionally, other threads
+ * print the whole tree meanwhile (to /dev/null on the server) or, with -d,
+ * dump it back to the client (to /dev/null); the tree may first be filled
+ * with more files.
+ *
+ * Usage: bench-load [-s seconds] [-l lookup%] [-f files] [-p printers] [-d]
+ *                   [-t treefiles] server_socket [threads...]
+ *        (default: 2 seconds, 80% lookups, 256 files, no printers, no
+ *        extra files, 1 2 4 8 16 threads)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define OP_LOOKUP 0
+#define OP_CREATE 1
+#define OP_DELETE 2
+#define OP_PRINT 3
+#define OPS 4
+
+char *opNames[OPS] = {"lookup", "create", "delete", "print"};
+
+/*
+ * Latencies of one operation measured by one thread, in ns
+ */
+typedef struct samples {
+  unsigned int *ns;
+  long count, size;
+} Samples;
+
+char *serverName;
+double seconds = 2;
+int lookupPercent = 80;
+int files = 256;
+int printers = 0;
+int dumps = 0;
+int treeFiles = 0;
+volatile int running;
+pthread_barrier_t barrier;
+Samples (*samples)[OPS]; /* a row per thread */
+
+/*
+ * Records a latency.
+ */
+void addSample(Samples *s, double ns)
+{
+  if (s->count == s->size)
+  {
+    s->size = s->size ? s->size * 2 : 4096;
+    if ((s->ns = realloc(s->ns, s->size * sizeof(unsigned int))) == NULL)
+    {
+      fprintf(stderr, "Out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s->ns[s->count++] = ns;
+}
+
+/*
+ * Opens a session or exits.
+ */
+tfs_session_t *mountOrExit()
+{
+  tfs_session_t *session = tfsSessionMount(serverName);
+
+  if (session == NULL)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+    exit(EXIT_FAILURE);
+  }
+  return session;
+}
+
+/*
+ * Exits if the server could not be reached.
+ */
+void checkResult(int result)
+{
+  if (result == TECNICOFS_ERROR_CONNECTION_ERROR)
+  {
+    fprintf(stderr, "Connection error\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Issues requests in its own session until stopped.
+ * Input:
+ *  - arg: the thread's number, from 1
+ * Returns: number of requests done (cast to void*)
+ */
+void *worker(void *arg)
+{
+  long id = (long)arg, count = 0;
+  unsigned int seed = id;
+  char dir[MAX_INPUT_SIZE], path[MAX_PATH_LENGTH];
+  char *exists = calloc(files, 1);
+  tfs_session_t *session = mountOrExit();
+  Samples *mine = samples[id - 1];
+  int file, op;
+  double start;
+
+  if (exists == NULL)
+    exit(EXIT_FAILURE);
+  sprintf(dir, "/load%ld", id);
+  tfsSessionCreate(session, dir, 'd');
+
+  pthread_barrier_wait(&barrier);
+  while (running)
+  {
+    file = rand_r(&seed) % files;
+    sprintf(path, "%s/f%d", dir, file);
+    if (rand_r(&seed) % 100 < lookupPercent)
+      op = OP_LOOKUP;
+    else
+      op = exists[file] ? OP_DELETE : OP_CREATE;
+    start = now_ns();
+    if (op == OP_LOOKUP)
+      checkResult(tfsSessionLookup(session, path));
+    else if (op == OP_DELETE)
+      checkResult(tfsSessionDelete(session, path));
+    else
+      checkResult(tfsSessionCreate(session, path, 'f'));
+    addSample(&mine[op], now_ns() - start);
+    /* whether they succeed or fail, the file exists (or not) afterwards */
+    if (op != OP_LOOKUP)
+      exists[file] = op == OP_CREATE;
+    count++;
+  }
+
+  /* leave the directory empty for the next run */
+  for (file = 0; file < files; file++)
+  {
+    sprintf(path, "%s/f%d", dir, file);
+    if (exists[file])
+      tfsSessionDelete(session, path);
+  }
+  tfsSessionUnmount(session);
+  free(exists);
+  return (void *)count;
+}
+
+/*
+ * Prints the tree in its own session until stopped.
+ * Input:
+ *  - arg: the thread's number, after the workers'
+ * Returns: 0 requests, the printers are not counted in the throughput
+ */
+void *printer(void *arg)
+{
+  long id = (long)arg;
+  tfs_session_t *session = mountOrExit();
+  int null = open("/dev/null", O_WRONLY);
+  double start;
+
+  pthread_barrier_wait(&barrier);
+  while (running)
+  {
+    start = now_ns();
+    if (dumps)
+      checkResult(tfsSessionDump(session, null));
+    else
+      checkResult(tfsSessionPrint(session, "/dev/null"));
+    addSample(&samples[id - 1][OP_PRINT], now_ns() - start);
+  }
+  tfsSessionUnmount(session);
+  close(null);
+  return (void *)0;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+  unsigned int x = *(unsigned int *)a, y = *(unsigned int *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Prints the median and 99th percentile of each operation measured by the
+ * threads, and frees the samples.
+ */
+void printLatencies(int threads)
+{
+  unsigned int *all;
+  long count;
+
+  for (int op = 0; op < OPS; op++)
+  {
+    count = 0;
+    for (int i = 0; i < threads; i++)
+      count += samples[i][op].count;
+    if (count > 0 && (all = malloc(count * sizeof(unsigned int))) != NULL)
+    {
+      count = 0;
+      for (int i = 0; i < threads; i++)
+      {
+        for (long j = 0; j < samples[i][op].count; j++)
+          all[count++] = samples[i][op].ns[j];
+      }
+      qsort(all, count, sizeof(unsigned int), compareSamples);
+      printf("      %-7s p50 %9.1f us  p99 %9.1f us\n", opNames[op],
+             all[(count - 1) / 2] / 1e3, all[(count - 1) * 99 / 100] / 1e3);
+      free(all);
+    }
+    for (int i = 0; i < threads; i++)
+      free(samples[i][op].ns);
+  }
+}
+
+/*
+ * Runs n threads (and the printers) for the configured time and prints the
+ * throughput and the latencies.
+ */
+void run(int n)
+{
+  pthread_t tid[n + printers];
+  long total = 0;
+  void *count;
+
+  if ((samples = calloc(n + printers, sizeof(*samples))) == NULL)
+    exit(EXIT_FAILURE);
+  running = 1;
+  pthread_barrier_init(&barrier, NULL, n + printers + 1);
+  for (long i = 0; i < n + printers; i++)
+    if (pthread_create(&tid[i], NULL, i < n ? worker : printer, (void *)(i + 1)) != 0)
+      exit(EXIT_FAILURE);
+  pthread_barrier_wait(&barrier);
+  usleep(seconds * 1e6);
+  running = 0;
+  for (int i = 0; i < n + printers; i++)
+  {
+    pthread_join(tid[i], &count);
+    total += (long)count;
+  }
+  pthread_barrier_destroy(&barrier);
+  printf("%3d threads: %10.0f requests/s\n", n, total / seconds);
+  printLatencies(n + printers);
+  free(samples);
+}
+
+/*
+ * Creates the extra files, in /tree, for the printers to print.
+ */
+void fillTree()
+{
+  tfs_session_t *session = mountOrExit();
+  char path[MAX_INPUT_SIZE];
+
+  tfsSessionCreate(session, "/tree", 'd');
+  for (int i = 0; i < treeFiles; i++)
+  {
+    sprintf(path, "/tree/f%d", i);
+    tfsSessionCreate(session, path, 'f');
+  }
+  tfsSessionUnmount(session);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:l:f:p:dt:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 'l':
+      lookupPercent = atoi(optarg);
+      break;
+    case 'f':
+      files = atoi(optarg);
+      break;
+    case 'p':
+      printers = atoi(optarg);
+      break;
+    case 'd':
+      dumps = 1;
+      opNames[OP_PRINT] = "dump";
+      break;
+    case 't':
+      treeFiles = atoi(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  if (optind >= argc || seconds <= 0 || files <= 0 || printers < 0 || treeFiles < 0)
+  {
+    fprintf(stderr, "Usage: %s [-s seconds] [-l lookup%%] [-f files] [-p printers] "
+                    "[-d] [-t treefiles] server_socket [threads...]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  serverName = argv[optind];
+  if (treeFiles > 0)
+    fillTree();
+
+  if (optind + 1 < argc)
+    for (int i = optind + 1; i < argc; i++)
+      run(atoi(argv[i]));
+  else
+    for (int n = 1; n <= 16; n *= 2)
+      run(n);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,185 @@
+/*
+ * bench-replay: replays client input scripts against a running server, one
+ * request per round trip and then in batches, over the text and the binary
+ * protocols, and prints the throughput of each mode. Every round runs in a
+ * fresh directory, so each replays the same work. Print commands are
+ * skipped.
+ *
+ * Usage: bench-replay [-r rounds] [-b batchsize] server_socket inputfile...
+ *        (default: 20 rounds, batches of MAX_BATCH_SIZE)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_COMMANDS 100000
+
+typedef struct command {
+  char op;
+  char type;
+  char arg1[MAX_INPUT_SIZE];
+  char arg2[MAX_INPUT_SIZE];
+} Command;
+
+Command commands[MAX_COMMANDS];
+int commandsCount;
+
+/*
+ * Reads the create, delete, move and lookup commands of an input file.
+ */
+void loadCommands(char *filename)
+{
+  char line[MAX_INPUT_SIZE];
+  char arg2[MAX_INPUT_SIZE];
+  Command *command;
+  FILE *fp = fopen(filename, "r");
+
+  if (fp == NULL)
+  {
+    perror(filename);
+    exit(EXIT_FAILURE);
+  }
+  while (fgets(line, sizeof(line), fp) && commandsCount < MAX_COMMANDS)
+  {
+    command = &commands[commandsCount];
+    if (sscanf(line, "%c %s %s", &command->op, command->arg1, arg2) < 2 ||
+        strchr("cdml", command->op) == NULL)
+      continue;
+    if (command->op == 'c')
+      command->type = arg2[0];
+    else
+      strcpy(command->arg2, arg2);
+    commandsCount++;
+  }
+  fclose(fp);
+}
+
+/*
+ * Writes path, moved into the round's directory, to buffer.
+ */
+void roundPath(char *buffer, int round, char *path)
+{
+  snprintf(buffer, MAX_PATH_LENGTH, "/r%d%s%s", round, path[0] == '/' ? "" : "/", path);
+}
+
+/*
+ * Issues a command (queued, if a batch is open).
+ * Returns: the response (or the index in the batch)
+ */
+int issue(Command *command, int round)
+{
+  char path1[MAX_PATH_LENGTH], path2[MAX_PATH_LENGTH];
+
+  roundPath(path1, round, command->arg1);
+  switch (command->op)
+  {
+  case 'c':
+    return tfsCreate(path1, command->type);
+  case 'd':
+    return tfsDelete(path1);
+  case 'l':
+    return tfsLookup(path1);
+  default:
+    roundPath(path2, round, command->arg2);
+    return tfsMove(path1, path2);
+  }
+}
+
+/*
+ * Replays every command in the round's directory, batchSize at a time
+ * (0 for no batching).
+ * Returns: the number of datagrams sent
+ */
+long replay(int round, int batchSize)
+{
+  char path[MAX_PATH_LENGTH];
+  int results[MAX_BATCH_SIZE];
+  long datagrams = 1;
+  int i;
+
+  roundPath(path, round, "");
+  tfsCreate(path, 'd');
+  for (i = 0; i < commandsCount; i++)
+  {
+    if (batchSize > 0 && i % batchSize == 0)
+      tfsBatchBegin();
+    issue(&commands[i], round);
+    if (batchSize > 0 && (i % batchSize == batchSize - 1 || i == commandsCount - 1))
+    {
+      if (tfsBatchSubmit(results) < 0)
+      {
+        fprintf(stderr, "batch failed\n");
+        exit(EXIT_FAILURE);
+      }
+      datagrams++;
+    }
+    else if (batchSize == 0)
+      datagrams++;
+  }
+  return datagrams;
+}
+
+/*
+ * Runs the rounds in one mode and prints the results.
+ * Returns: the next free round number
+ */
+int bench(char *name, int firstRound, int rounds, int batchSize)
+{
+  long datagrams = 0, ops = (long)rounds * commandsCount;
+  double start = now_ns(), elapsed;
+
+  for (int round = firstRound; round < firstRound + rounds; round++)
+    datagrams += replay(round, batchSize);
+  elapsed = now_ns() - start;
+
+  printf("%-14s %8ld ops %8ld datagrams %10.0f ops/s %8.2f us/op\n", name, ops,
+         datagrams, ops / (elapsed / 1e9), elapsed / 1e3 / ops);
+  return firstRound + rounds;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, rounds = 20, batchSize = MAX_BATCH_SIZE, round = 0;
+
+  while ((opt = getopt(argc, argv, "r:b:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 'b':
+      batchSize = atoi(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  if (argc - optind < 2 || rounds <= 0 || batchSize <= 0 || batchSize > MAX_BATCH_SIZE)
+  {
+    fprintf(stderr, "Usage: %s [-r rounds] [-b batchsize] server_socket inputfile...\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = optind + 1; i < argc; i++)
+    loadCommands(argv[i]);
+  if (tfsMount(argv[optind]) != SUCCESS)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%d commands per round, %d rounds, batches of %d\n", commandsCount, rounds, batchSize);
+  tfsTextProtocol(1);
+  round = bench("text single", round, rounds, 0);
+  round = bench("text batch", round, rounds, batchSize);
+  tfsTextProtocol(0);
+  round = bench("binary single", round, rounds, 0);
+  round = bench("binary batch", round, rounds, batchSize);
+  tfsUnmount();
+  return 0;
+}
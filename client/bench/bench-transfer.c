@@ -0,0 +1,112 @@
+/*
+ * bench-transfer: bandwidth of single reads and writes of a file, from 4KB
+ * to 64MB, with the data sent in datagrams and through a memfd shared with
+ * the server; prints MB/s of each.
+ *
+ * Usage: bench-transfer [-t megabytes] server_socket
+ *        (default: 256 MB moved per size and direction, at least 4 times)
+ */
+#include "../tecnicofs-client-api.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_PATH "/bench-transfer"
+#define MIN_SIZE (4 << 10)
+#define MAX_SIZE (64 << 20)
+#define MIN_ROUNDS 4
+
+/*
+ * Exits if a request did not do all it should.
+ */
+void checkResult(char *what, int result, int expected)
+{
+  if (result != expected)
+  {
+    fprintf(stderr, "%s failed: %d\n", what, result);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Writes size bytes to the file, then reads them back, rounds times each.
+ * Input:
+ *  - threshold: see tfsMemfdThreshold
+ *  - bandwidth: where to store the write and read MB/s
+ */
+void run(tfs_session_t *session, char *data, char *read, int size, int rounds, int threshold,
+         double *bandwidth)
+{
+  double start;
+
+  tfsSessionMemfdThreshold(session, threshold);
+  start = now_ns();
+  for (int i = 0; i < rounds; i++)
+    checkResult("write", tfsSessionWriteAt(session, FILE_PATH, data, size, 0), size);
+  bandwidth[0] = (double)size * rounds / (1 << 20) / ((now_ns() - start) / 1e9);
+
+  start = now_ns();
+  for (int i = 0; i < rounds; i++)
+    checkResult("read", tfsSessionReadAt(session, FILE_PATH, read, size, 0), size);
+  bandwidth[1] = (double)size * rounds / (1 << 20) / ((now_ns() - start) / 1e9);
+  checkResult("compare", memcmp(data, read, size), 0);
+}
+
+int main(int argc, char *argv[])
+{
+  long total = 256;
+  int opt, rounds;
+  unsigned int seed = 1;
+  tfs_session_t *session;
+  char *data, *read;
+  double datagrams[2], memfd[2];
+
+  while ((opt = getopt(argc, argv, "t:")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      total = atol(optarg);
+      break;
+    default:
+      optind = argc; /* print usage */
+    }
+  }
+  if (argc - optind != 1 || total <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-t megabytes] server_socket\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if ((session = tfsSessionMount(argv[optind])) == NULL)
+  {
+    fprintf(stderr, "Unable to mount socket: %s\n", argv[optind]);
+    exit(EXIT_FAILURE);
+  }
+  if ((data = malloc(MAX_SIZE)) == NULL || (read = malloc(MAX_SIZE)) == NULL)
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < MAX_SIZE; i++)
+    data[i] = rand_r(&seed);
+  memset(read, 0, MAX_SIZE);
+
+  tfsSessionDelete(session, FILE_PATH);
+  checkResult("create", tfsSessionCreate(session, FILE_PATH, 'f'), SUCCESS);
+  printf("%10s %21s %21s\n", "", "datagrams MB/s", "memfd MB/s");
+  printf("%10s %10s %10s %10s %10s\n", "size", "write", "read", "write", "read");
+  for (int size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+  {
+    rounds = (total << 20) / size > MIN_ROUNDS ? (total << 20) / size : MIN_ROUNDS;
+    run(session, data, read, size, rounds, 0, datagrams);
+    run(session, data, read, size, rounds, 1, memfd);
+    printf("%8d K %10.1f %10.1f %10.1f %10.1f\n", size >> 10, datagrams[0], datagrams[1], memfd[0],
+           memfd[1]);
+  }
+
+  tfsSessionDelete(session, FILE_PATH);
+  tfsSessionUnmount(session);
+  free(data);
+  free(read);
+  return 0;
+}
@@ -0,0 +1,17 @@
+/* bench.h - helpers shared by the tecnicofs client benchmarks */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <time.h>
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static inline double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif /* BENCH_H */
@@ -2,8 +2,12 @@
 #ifndef TECNICOFS_API_CONSTANTS_H
 #define TECNICOFS_API_CONSTANTS_H
 
-#define MAX_FILE_NAME 100
+#define MAX_FILE_NAME 100 /* of each path component */
 #define MAX_INPUT_SIZE 100
+#define MAX_PATH_LENGTH 1024
+
+/* Maximum number of commands in a batch, see tfsBatchBegin */
+#define MAX_BATCH_SIZE 64
 
 typedef enum permission
 {
@@ -52,4 +56,22 @@ typedef enum type
 /* Print Specific */
 #define TECNICOFS_ERROR_FILE_NOT_OPEN -16
 
+/* Batch Specific */
+#define TECNICOFS_ERROR_BATCH_FULL -17
+
+/* Protocol Specific */
+#define TECNICOFS_ERROR_PATH_TOO_LONG -18
+
+/* Async Specific */
+#define TECNICOFS_ERROR_TOO_MANY_PENDING -19
+
+/* File Specific */
+#define TECNICOFS_ERROR_NOT_A_FILE -20
+#define TECNICOFS_ERROR_FILE_TOO_BIG -21
+
+/* Open File Specific */
+#define TECNICOFS_ERROR_BAD_HANDLE -22
+#define TECNICOFS_ERROR_PERMISSION_DENIED -23
+#define TECNICOFS_ERROR_TOO_MANY_OPEN_FILES -24
+
 #endif /* TECNICOFS_API_CONSTANTS_H */
\ No newline at end of file
@@ -1,18 +1,96 @@
+#define _GNU_SOURCE /* memfd_create */
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-protocol.h"
+#include "tecnicofs-ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-int sockfd;
-socklen_t servlen, clilen;
-struct sockaddr_un serv_addr, client_addr;
-char client_socket_name[MAX_INPUT_SIZE];
-char send_buffer[MAX_INPUT_SIZE];
-int send_size;
-int receive_buffer; /* We always get a code from the server (defined in the API) */
+/* State of a pending request slot */
+#define PENDING_FREE 0
+#define PENDING_WAITING 1 /* sent, no response yet */
+#define PENDING_DONE 2    /* response received, not yet claimed */
+
+/* Room for the largest datagram the server sends: a reply or a chunk */
+#define MAX_REPLY_SIZE (sizeof(TfsChunk) + TFS_MAX_CHUNK)
+
+/* Most data a single request moves through the data memfd */
+#define MAX_MEMFD_TRANSFER (64 << 20)
+
+/* Request ids (tickets) go from 1 to this, then wrap around */
+#define MAX_REQUEST_ID 0x7fffffff
+
+/*
+ * A request sent with the binary protocol, whose response has not been
+ * claimed. Request i uses slot i % TFS_MAX_PENDING.
+ */
+typedef struct pendingRequest
+{
+  unsigned int id;
+  int state;
+  int result;
+} PendingRequest;
+
+/*
+ * A session: a socket of its own and the state of its requests
+ */
+struct tfsSession
+{
+  int sockfd;
+  socklen_t servlen, clilen;
+  struct sockaddr_un serv_addr, client_addr;
+
+  /* Speak the old text protocol instead of the binary one (tfsTextProtocol) */
+  int text_protocol;
+
+  /* Requests queued for the next datagram, without its header: a single
+   * one, or those made between tfsBatchBegin and tfsBatchSubmit */
+  char request_buffer[TFS_MAX_DATAGRAM] __attribute__((aligned(TFS_ALIGN)));
+  int request_size;
+  int request_count;
+  unsigned int request_first_id; /* id of the first queued request */
+  unsigned int request_next_id;
+  int batch_open;
+
+  PendingRequest pending[TFS_MAX_PENDING];
+  int pending_count;
+
+  /* The shared memory transport (tfsSharedMemory), rings is NULL if it is
+   * not in use */
+  TfsSharedRings *rings;
+  int memfd, requestsfd, repliesfd;
+  int hangupfd; /* write end of the pipe the server watches */
+  int ring_spin;
+
+  /* Where the chunks of the request in progress go: a file (tfsDump), or
+   * a buffer of stream_size bytes (tfsReadAt); -1 and NULL if none */
+  int stream_fd;
+  char *stream_buffer;
+  int stream_size, stream_received;
+  unsigned int stream_id;
+  int stream_status;
+
+  /* A memfd the data of large reads and writes goes through, mapped, of
+   * data_size bytes (data_fd is -1 until first used), and the size from
+   * which transfers use it (tfsMemfdThreshold) */
+  int data_fd;
+  char *data_map;
+  size_t data_size;
+  int memfd_threshold;
+};
+
+/* The session of the functions without one (tfsMount, tfsCreate, ...) */
+tfs_session_t *default_session = NULL;
 
 /*
  * Initializes the socked address struct
@@ -32,140 +110,1283 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr)
 
   return SUN_LEN(addr);
 }
+
 /*
- * Sends through the socket the message added to the buffer
- * Returns: SUCCESS or TECNICOFS_ERROR_CONNECTION_ERROR
+ * Writes a chunk datagram of the dump in progress to its file, or copies
+ * that of the read in progress to its buffer. Chunks of other requests are
+ * dropped.
+ * Input:
+ *  - chunk: the datagram
+ *  - size: its size
  */
-int sendCommand()
+void storeChunk(tfs_session_t *session, char *chunk, size_t size)
 {
-  if (sendto(sockfd, send_buffer, send_size + 1, 0, (struct sockaddr *)&serv_addr, servlen) < 0)
+  TfsChunk *header = (TfsChunk *)chunk;
+  char *data = chunk + sizeof(TfsChunk);
+  size_t left;
+  ssize_t written;
+
+  if (size < sizeof(TfsChunk) || size - sizeof(TfsChunk) < header->size ||
+      header->id != session->stream_id)
+    return;
+
+  if (session->stream_buffer != NULL)
+  {
+    if (header->size > session->stream_size - session->stream_received)
+      session->stream_status = TECNICOFS_ERROR_OTHER;
+    else
+    {
+      memcpy(session->stream_buffer + session->stream_received, data, header->size);
+      session->stream_received += header->size;
+    }
+    return;
+  }
+  if (session->stream_fd < 0)
+    return;
+
+  /* the rest of the dump is still received, to get to the reply */
+  for (left = header->size; left > 0 && session->stream_status == SUCCESS; left -= written, data += written)
+  {
+    if ((written = write(session->stream_fd, data, left)) < 0)
+    {
+      if (errno != EINTR)
+        session->stream_status = TECNICOFS_ERROR_OTHER;
+      written = 0;
+    }
+  }
+}
+
+/*
+ * Stores the results of a reply datagram of the binary protocol in their
+ * pending slots. Results nobody waits for are dropped.
+ * Input:
+ *  - reply: the datagram
+ *  - size: its size
+ */
+void storeResults(tfs_session_t *session, char *reply, size_t size)
+{
+  TfsHeader *header = (TfsHeader *)reply;
+  TfsResult *results = (TfsResult *)(reply + sizeof(TfsHeader));
+  PendingRequest *slot;
+
+  if (size >= sizeof(TfsHeader) && header->magic == TFS_MAGIC_CHUNK)
+  {
+    storeChunk(session, reply, size);
+    return;
+  }
+  if (size < sizeof(TfsHeader) || header->magic != TFS_MAGIC ||
+      size < sizeof(TfsHeader) + header->count * sizeof(TfsResult))
+    return;
+
+  for (int i = 0; i < header->count; i++)
+  {
+    slot = &session->pending[results[i].id % TFS_MAX_PENDING];
+    if (slot->id == results[i].id && slot->state == PENDING_WAITING)
+    {
+      slot->result = results[i].result;
+      slot->state = PENDING_DONE;
+    }
+  }
+}
+
+/*
+ * Receives one reply datagram of the binary protocol, from the socket or
+ * the replies ring, and stores its results.
+ * Input:
+ *  - flags: MSG_DONTWAIT not to block, or 0
+ * Returns: 1 if a datagram was received, 0 if there was nothing to receive
+ *  (MSG_DONTWAIT) or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int receiveReply(tfs_session_t *session, int flags)
+{
+  char reply[MAX_REPLY_SIZE] __attribute__((aligned(TFS_ALIGN)));
+  TfsRingReply *ringReply;
+  ssize_t received;
+  int slot;
+
+  if (session->rings != NULL)
+  {
+    if (flags & MSG_DONTWAIT)
+      slot = tfsRingNext(&session->rings->replies);
+    else if ((slot = tfsRingWait(&session->rings->replies, session->repliesfd, session->sockfd, session->ring_spin)) < 0)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    if (slot < 0)
+      return 0;
+    ringReply = &session->rings->replySlots[slot];
+    storeResults(session, ringReply->datagram, ringReply->size < TFS_RING_REPLY ? ringReply->size : TFS_RING_REPLY);
+    tfsRingConsume(&session->rings->replies);
+    return 1;
+  }
+
+  if ((received = recv(session->sockfd, reply, sizeof(reply), flags)) < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : TECNICOFS_ERROR_CONNECTION_ERROR;
+  if (received == 0) /* a stream server closed the connection */
     return TECNICOFS_ERROR_CONNECTION_ERROR;
+  storeResults(session, reply, received);
+  return 1;
+}
+
+/*
+ * Waits for the response to a pending request, and frees its slot.
+ * Input:
+ *  - id: the request id
+ * Returns: the server response or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int waitResult(tfs_session_t *session, unsigned int id)
+{
+  PendingRequest *slot = &session->pending[id % TFS_MAX_PENDING];
+  int status;
+
+  while (slot->state == PENDING_WAITING)
+  {
+    if ((status = receiveReply(session, 0)) < 0)
+      return status;
+  }
+  slot->state = PENDING_FREE;
+  session->pending_count--;
+  return slot->result;
+}
+
+/*
+ * Queues a request of the binary protocol for the next datagram, checked
+ * by queueRequest or queueFileRequest.
+ * Input:
+ *  - opcode, arg, path1: see queueRequest
+ *  - length1: length of path1
+ *  - path2: its second path, or the TfsFileArgs of a file request
+ *  - length2: length of path2
+ *  - data: the data of a write, after path2, or NULL
+ *  - size: its size
+ * Returns: see queueRequest
+ */
+int queueBinaryRequest(tfs_session_t *session, char opcode, char arg, char *path1, int length1,
+                       char *path2, int length2, const char *data, int size)
+{
+  TfsRequest *request = (TfsRequest *)(session->request_buffer + session->request_size);
+  char *paths = session->request_buffer + session->request_size + sizeof(TfsRequest);
+  int total = TFS_REQUEST_SIZE(length1, length2 + size);
+
+  if (session->request_size + total >
+      (session->rings != NULL ? TFS_RING_DATAGRAM : TFS_MAX_DATAGRAM) - sizeof(TfsHeader))
+    return TECNICOFS_ERROR_BATCH_FULL;
+  if (session->pending[session->request_next_id % TFS_MAX_PENDING].state != PENDING_FREE)
+    return TECNICOFS_ERROR_TOO_MANY_PENDING;
+  if (session->request_count == 0)
+    session->request_first_id = session->request_next_id;
+  session->pending[session->request_next_id % TFS_MAX_PENDING].id = session->request_next_id;
+  session->pending[session->request_next_id % TFS_MAX_PENDING].state = PENDING_WAITING;
+  session->pending_count++;
+
+  request->id = session->request_next_id;
+  session->request_next_id = session->request_next_id == MAX_REQUEST_ID ? 1 : session->request_next_id + 1;
+  request->opcode = opcode;
+  request->arg = arg;
+  request->length1 = length1;
+  request->length2 = length2 + size;
+  request->unused = 0;
+  memcpy(paths, path1, length1 + 1);
+  memcpy(paths + length1 + 1, path2, length2);
+  if (size > 0)
+    memcpy(paths + length1 + 1 + length2, data, size);
+  memset(paths + length1 + 1 + length2 + size, 0, total - sizeof(TfsRequest) - length1 - 1 - length2 - size);
+  session->request_size += total;
+  return session->request_count++;
+}
+
+/*
+ * Queues a request for the next datagram.
+ * Input:
+ *  - opcode: the operation (a TfsOpcode)
+ *  - arg: node type of a create
+ *  - path1: its path
+ *  - path2: second path of a move, "" for other operations
+ * Returns: index of the request in the datagram, TECNICOFS_ERROR_PATH_TOO_LONG,
+ *  TECNICOFS_ERROR_BATCH_FULL or TECNICOFS_ERROR_TOO_MANY_PENDING
+ */
+int queueRequest(tfs_session_t *session, char opcode, char arg, char *path1, char *path2)
+{
+  int length1 = strlen(path1), length2 = strlen(path2), size;
+
+  if (length1 >= MAX_PATH_LENGTH || length2 >= MAX_PATH_LENGTH)
+    return TECNICOFS_ERROR_PATH_TOO_LONG;
+  if (session->request_count == MAX_BATCH_SIZE)
+    return TECNICOFS_ERROR_BATCH_FULL;
+
+  if (session->text_protocol)
+  {
+    /* "c path f\n", "d path r\n", "m path path\n" or "l path\n"; the header
+     * is a line too */
+    size = length1 + length2 + 6;
+    if (session->request_size + size > TFS_MAX_DATAGRAM - MAX_INPUT_SIZE)
+      return TECNICOFS_ERROR_BATCH_FULL;
+    if (opcode == TFS_OP_CREATE || (opcode == TFS_OP_DELETE && arg != 0))
+      session->request_size += sprintf(session->request_buffer + session->request_size, "%c %s %c\n", opcode, path1, arg);
+    else if (opcode == TFS_OP_MOVE)
+      session->request_size += sprintf(session->request_buffer + session->request_size, "%c %s %s\n", opcode, path1, path2);
+    else
+      session->request_size += sprintf(session->request_buffer + session->request_size, "%c %s\n", opcode, path1);
+    return session->request_count++;
+  }
+
+  return queueBinaryRequest(session, opcode, arg, path1, length1, path2, length2, NULL, 0);
+}
+
+/*
+ * Queues a file request (binary protocol only) for the next datagram.
+ * Input:
+ *  - opcode: TFS_OP_READ, TFS_OP_WRITE, TFS_OP_APPEND, TFS_OP_TRUNCATE,
+ *    TFS_OP_SEEK or TFS_OP_CLOSE
+ *  - path: path of the file, "" for an open one
+ *  - handle: the open file, or 0 for the path's
+ *  - data: the data of a write, or NULL
+ *  - size: its size, the bytes to read, or the size to truncate to
+ *  - offset: where to read, write or seek to
+ * Returns: see queueRequest, or TECNICOFS_ERROR_OTHER with the text protocol
+ */
+int queueFileRequest(tfs_session_t *session, char opcode, char *path, int handle, const char *data, int size,
+                     long offset)
+{
+  TfsFileArgs args = {offset, size, handle};
+  int length = strlen(path);
+
+  if (session->text_protocol)
+    return TECNICOFS_ERROR_OTHER;
+  if (length >= MAX_PATH_LENGTH)
+    return TECNICOFS_ERROR_PATH_TOO_LONG;
+  if (session->request_count == MAX_BATCH_SIZE)
+    return TECNICOFS_ERROR_BATCH_FULL;
+  return queueBinaryRequest(session, opcode, 0, path, length, (char *)&args, sizeof(args),
+                            data, data != NULL ? size : 0);
+}
+
+/*
+ * Gives up on the queued requests, freeing their pending slots.
+ */
+void dropRequests(tfs_session_t *session)
+{
+  if (!session->text_protocol)
+  {
+    for (int i = 0; i < session->request_count; i++)
+      session->pending[(session->request_first_id + i) % TFS_MAX_PENDING].state = PENDING_FREE;
+    session->pending_count -= session->request_count;
+  }
+  session->request_count = 0;
+  session->request_size = 0;
+}
+
+/*
+ * Sends the queued requests in one datagram through the socket, emptying
+ * the queue. While the server has no room for it, replies are received
+ * meanwhile (the server may be waiting for room to send them).
+ * Input:
+ *  - fds: file descriptors to send along (SCM_RIGHTS)
+ *  - fdsCount: how many, up to 4
+ * Returns: SUCCESS or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int sendDatagram(tfs_session_t *session, int *fds, int fdsCount)
+{
+  char header[16] __attribute__((aligned(TFS_ALIGN)));
+  char control[CMSG_SPACE(4 * sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct pollfd pfd = {session->sockfd, POLLIN | POLLOUT, 0};
+
+  /* the header and the queued requests, gathered into one datagram */
+  iov[0].iov_base = header;
+  iov[0].iov_len = 0;
+  if (!session->text_protocol)
+  {
+    ((TfsHeader *)header)->magic = TFS_MAGIC;
+    ((TfsHeader *)header)->version = TFS_VERSION;
+    ((TfsHeader *)header)->count = session->request_count;
+    iov[0].iov_len = sizeof(TfsHeader);
+  }
+  else if (session->batch_open || session->request_count > 1)
+    iov[0].iov_len = sprintf(header, "b %d\n", session->request_count);
+  iov[1].iov_base = session->request_buffer;
+  iov[1].iov_len = session->request_size;
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (fdsCount > 0)
+  {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(fdsCount * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fdsCount * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, fdsCount * sizeof(int));
+  }
+
+  /* with the text protocol no replies are session->pending, so just block */
+  while (sendmsg(session->sockfd, &msg, session->text_protocol ? 0 : MSG_DONTWAIT) < 0)
+  {
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || poll(&pfd, 1, -1) < 0 ||
+        ((pfd.revents & POLLIN) && receiveReply(session, MSG_DONTWAIT) < 0))
+    {
+      dropRequests(session);
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+  }
+  session->request_count = 0;
+  session->request_size = 0;
+  return SUCCESS;
+}
+
+/*
+ * Writes a request datagram of size bytes (the queued requests, after a
+ * header, or none for size 0) to the requests ring. While the ring is
+ * full, replies are taken meanwhile (the server may be waiting for room in
+ * the replies ring).
+ */
+void produceRequest(tfs_session_t *session, int size)
+{
+  TfsSharedRings *rings = session->rings;
+  TfsHeader header = {TFS_MAGIC, TFS_VERSION, session->request_count};
+  int slot;
+
+  while ((slot = tfsRingFree(&rings->requests)) < 0)
+  {
+    if (receiveReply(session, MSG_DONTWAIT) == 0)
+      sched_yield();
+  }
+  if (size > 0)
+  {
+    memcpy(rings->requestSlots[slot].datagram, &header, sizeof(TfsHeader));
+    memcpy(rings->requestSlots[slot].datagram + sizeof(TfsHeader), session->request_buffer, session->request_size);
+  }
+  rings->requestSlots[slot].size = size;
+  tfsRingProduce(&rings->requests, session->requestsfd);
+}
+
+/*
+ * Sends the queued requests in one datagram, through the requests ring if
+ * the shared memory transport is in use, or else the socket.
+ * Returns: SUCCESS or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int sendRequests(tfs_session_t *session)
+{
+  if (session->rings == NULL)
+    return sendDatagram(session, NULL, 0);
 
+  produceRequest(session, sizeof(TfsHeader) + session->request_size);
+  session->request_count = 0;
+  session->request_size = 0;
   return SUCCESS;
 }
 
 /*
- * Reads response from the server to client request
- * Returns: An integer server response or TECNICOFS_ERROR_CONNECTION_ERROR
+ * Sends the queued requests and waits for their responses.
+ * Input:
+ *  - results: where to store the response to each request
+ * Returns: number of responses, TECNICOFS_ERROR_OTHER if the server
+ *  rejected the datagram, or TECNICOFS_ERROR_CONNECTION_ERROR
  */
-int receiveResponse()
+int submitRequests(tfs_session_t *session, int *results)
 {
-  if (recvfrom(sockfd, &receive_buffer, sizeof(receive_buffer), 0, 0, 0) < 0)
+  int count = session->request_count;
+  unsigned int first_id = session->request_first_id;
+  ssize_t received;
+
+  if (sendRequests(session) != SUCCESS)
     return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receive_buffer;
+
+  if (session->text_protocol)
+  {
+    received = recv(session->sockfd, results, count * sizeof(int), 0);
+    if (received <= 0)
+      return TECNICOFS_ERROR_CONNECTION_ERROR;
+    return received == count * sizeof(int) ? count : TECNICOFS_ERROR_OTHER;
+  }
+
+  for (int i = 0; i < count; i++)
+    results[i] = waitResult(session, first_id + i);
+  return count;
+}
+
+/*
+ * Sends a request and waits for its response, or queues it if a batch is
+ * open.
+ * Returns: An integer server response, the index of the request in the
+ *  batch, or an error (see queueRequest and submitRequests)
+ */
+int executeRequest(tfs_session_t *session, char opcode, char arg, char *path1, char *path2)
+{
+  int index = queueRequest(session, opcode, arg, path1, path2), result;
+
+  if (session->batch_open || index < 0)
+    return index;
+  if ((index = submitRequests(session, &result)) < 0)
+    return index;
+  return result;
+}
+
+/*
+ * Sends a request without waiting for its response.
+ * Returns: the request's ticket (> 0), TECNICOFS_ERROR_OTHER if a batch is
+ *  open or the text protocol in use, or an error (see queueRequest)
+ */
+int executeRequestAsync(tfs_session_t *session, char opcode, char arg, char *path1, char *path2)
+{
+  int index;
+  unsigned int id = session->request_next_id;
+
+  if (session->batch_open || session->text_protocol)
+    return TECNICOFS_ERROR_OTHER;
+  if ((index = queueRequest(session, opcode, arg, path1, path2)) < 0)
+    return index;
+  if (sendRequests(session) != SUCCESS)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  return id;
+}
+
+/*
+ * Opens a session: creates a socket for the client and connects it to the
+ * server. A server in stream mode (tecnicofs -s) takes a SOCK_SEQPACKET
+ * connection; otherwise the socket is a datagram one, bound to a file in
+ * /tmp for the replies. Each session may be used by one thread at a time; a
+ * multi-threaded application gives each thread a session of its own.
+ * Input:
+ *  - sockPath: path of the server's socket
+ * Returns: the session, or NULL if it could not be opened
+ */
+tfs_session_t *tfsSessionMount(char *sockPath)
+{
+  tfs_session_t *session = malloc(sizeof(tfs_session_t));
+  int tmpfd;
+
+  if (session == NULL)
+    return NULL;
+  session->text_protocol = 0;
+  session->stream_fd = -1;
+  session->stream_buffer = NULL;
+  session->data_fd = -1;
+  session->data_map = NULL;
+  session->data_size = 0;
+  session->memfd_threshold = TFS_MEMFD_THRESHOLD;
+  session->request_size = 0;
+  session->request_count = 0;
+  session->request_next_id = 1;
+  session->batch_open = 0;
+  session->pending_count = 0;
+  bzero(session->pending, sizeof(session->pending));
+  session->rings = NULL;
+  bzero((char *)&session->client_addr, sizeof(struct sockaddr_un));
+  session->servlen = setSockAddrUn(sockPath, &session->serv_addr);
+
+  /* A stream server; connecting to a datagram socket fails with EPROTOTYPE */
+  if ((session->sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+  {
+    free(session);
+    return NULL;
+  }
+  if (connect(session->sockfd, (struct sockaddr *)&session->serv_addr, session->servlen) == 0)
+    return session;
+  close(session->sockfd);
+  if (errno != EPROTOTYPE)
+  {
+    free(session);
+    return NULL;
+  }
+
+  /* Creating socket for the client */
+  if ((session->sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  {
+    free(session);
+    return NULL;
+  }
+
+  /* Binding the new socket to a file in /tmp with random name */
+  session->client_addr.sun_family = AF_UNIX;
+  strcpy(session->client_addr.sun_path, "/tmp/client-socket-XXXXXX");
+  session->clilen = SUN_LEN(&session->client_addr);
+  if ((tmpfd = mkstemp(session->client_addr.sun_path)) == -1 ||
+      close(tmpfd) != 0 || unlink(session->client_addr.sun_path) != 0 ||
+      bind(session->sockfd, (struct sockaddr *)&session->client_addr, session->clilen) < 0)
+  {
+    close(session->sockfd);
+    free(session);
+    return NULL;
+  }
+
+  /* Connecting to the server, so that poll tells when it has room for
+   * another request */
+  if (connect(session->sockfd, (struct sockaddr *)&session->serv_addr, session->servlen) < 0)
+  {
+    tfsSessionUnmount(session);
+    return NULL;
+  }
+  return session;
+}
+
+/*
+ * Closes a session: closes (and unlinks) its socket, dropping any pending
+ * requests.
+ * Input:
+ *  - session: the session, not to be used again
+ */
+int tfsSessionUnmount(tfs_session_t *session)
+{
+  if (session->rings != NULL)
+  {
+    session->request_count = 0;
+    produceRequest(session, 0); /* detach */
+    munmap(session->rings, sizeof(TfsSharedRings));
+    close(session->memfd);
+    close(session->requestsfd);
+    close(session->repliesfd);
+    close(session->hangupfd);
+  }
+  if (session->data_fd >= 0)
+  {
+    munmap(session->data_map, session->data_size);
+    close(session->data_fd);
+  }
+  close(session->sockfd);
+  if (session->client_addr.sun_path[0] != '\0')
+    unlink(session->client_addr.sun_path);
+  free(session);
+  return SUCCESS;
+}
+
+/*
+ * Selects the protocol spoken to the server: the old text protocol, for
+ * servers that do not know the binary one, or the binary protocol (default).
+ * Input:
+ *  - session: the session
+ *  - enabled: 1 for the text protocol, 0 for the binary one
+ * Return: SUCCESS or TECNICOFS_ERROR_OTHER if a batch is open or there are
+ *  pending requests
+ */
+int tfsSessionTextProtocol(tfs_session_t *session, int enabled)
+{
+  if (session->batch_open || session->pending_count > 0 ||
+      (enabled && session->rings != NULL))
+    return TECNICOFS_ERROR_OTHER;
+  session->text_protocol = enabled;
+  return SUCCESS;
+}
+
+/*
+ * Switches the session to the shared memory transport: creates the rings
+ * in a memfd, the eventfds to wait on them and a pipe the server sees hang
+ * up if the process exits without unmounting, and sends them to the
+ * server, which then serves the session through them with a thread of its
+ * own (see tecnicofs-ring.h). Requests no longer make system calls, while
+ * the server keeps up; batches are limited to TFS_RING_DATAGRAM bytes.
+ * Input:
+ *  - session: the session
+ * Return: SUCCESS, TECNICOFS_ERROR_OTHER if a batch is open, there are
+ *  pending requests, the text protocol is in use or the server refused,
+ *  or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionSharedMemory(tfs_session_t *session)
+{
+  TfsSharedRings *rings = MAP_FAILED;
+  /* the memfd, the eventfds, and the pipe's read and write ends */
+  int fds[5] = {-1, -1, -1, -1, -1}, result = TECNICOFS_ERROR_OTHER;
+  unsigned int id = session->request_next_id;
+
+  if (session->rings != NULL)
+    return SUCCESS;
+  if (session->batch_open || session->pending_count > 0 || session->text_protocol)
+    return TECNICOFS_ERROR_OTHER;
+
+  /* sealed against shrinking, which the server requires */
+  if ((fds[0] = memfd_create("tecnicofs-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING)) >= 0 &&
+      ftruncate(fds[0], sizeof(TfsSharedRings)) == 0 && fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK) == 0 &&
+      (rings = mmap(NULL, sizeof(TfsSharedRings), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) != MAP_FAILED &&
+      (fds[1] = eventfd(0, EFD_CLOEXEC)) >= 0 && (fds[2] = eventfd(0, EFD_CLOEXEC)) >= 0 &&
+      pipe2(fds + 3, O_CLOEXEC) == 0 && queueRequest(session, TFS_OP_SHARED_MEMORY, '\0', "", "") == 0)
+  {
+    if (sendDatagram(session, fds, 4) == SUCCESS)
+      result = waitResult(session, id);
+    else
+      result = TECNICOFS_ERROR_CONNECTION_ERROR;
+  }
+  if (result != SUCCESS)
+  {
+    if (rings != MAP_FAILED)
+      munmap(rings, sizeof(TfsSharedRings));
+    for (int i = 0; i < 5; i++)
+    {
+      if (fds[i] >= 0)
+        close(fds[i]);
+    }
+    return result;
+  }
+  close(fds[3]); /* the server's */
+
+  session->rings = rings;
+  session->memfd = fds[0];
+  session->requestsfd = fds[1];
+  session->repliesfd = fds[2];
+  session->hangupfd = fds[4];
+  session->ring_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_RING_SPIN : 0;
+  return SUCCESS;
+}
+
+/*
+ * Sets the size from which reads and writes go through a memfd the session
+ * shares with the server (SCM_RIGHTS) instead of datagrams: the server
+ * copies the data straight between the file and the memfd's pages, in a
+ * single request of up to 64MB. Not over shared memory, whose rings cannot
+ * carry descriptors.
+ * Input:
+ *  - session: the session
+ *  - threshold: the size, in bytes, or 0 to always use datagrams (default
+ *    TFS_MEMFD_THRESHOLD)
+ * Return: SUCCESS
+ */
+int tfsSessionMemfdThreshold(tfs_session_t *session, int threshold)
+{
+  session->memfd_threshold = threshold;
+  return SUCCESS;
+}
+
+/*
+ * Starts a batch: until tfsBatchSubmit, the requests (tfsCreate, tfsDelete,
+ * tfsMove, tfsLookup, tfsPrint) are queued instead of sent, and return the
+ * index their result will have in the batch. Up to MAX_BATCH_SIZE requests
+ * are sent in a single datagram and executed by the server in order.
+ * Input:
+ *  - session: the session
+ * Return: SUCCESS or TECNICOFS_ERROR_OTHER if a batch is already open
+ */
+int tfsSessionBatchBegin(tfs_session_t *session)
+{
+  if (session->batch_open)
+    return TECNICOFS_ERROR_OTHER;
+  session->batch_open = 1;
+  return SUCCESS;
+}
+
+/*
+ * Sends the open batch to the server and closes it.
+ * Input:
+ *  - session: the session
+ *  - results: where to store the server response to each request, in the
+ *    order they were made (room for MAX_BATCH_SIZE)
+ * Return: the number of results, or TECNICOFS_ERROR_OTHER (no batch open, or
+ *  rejected by the server) or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionBatchSubmit(tfs_session_t *session, int *results)
+{
+  int count;
+
+  if (!session->batch_open)
+    return TECNICOFS_ERROR_OTHER;
+  if (session->request_count == 0)
+  {
+    session->batch_open = 0;
+    return 0;
+  }
+  count = submitRequests(session, results);
+  session->batch_open = 0;
+  return count;
+}
+
+/*
+ * Waits for the response to an asynchronous request.
+ * Input:
+ *  - session: the session the request was made in
+ *  - ticket: returned by the request (tfsCreateAsync, ...)
+ * Return: An integer server response, TECNICOFS_ERROR_OTHER if the ticket
+ *  is not pending, or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionWait(tfs_session_t *session, int ticket)
+{
+  PendingRequest *slot = &session->pending[(unsigned int)ticket % TFS_MAX_PENDING];
+
+  if (ticket <= 0 || slot->id != ticket || slot->state == PENDING_FREE)
+    return TECNICOFS_ERROR_OTHER;
+  return waitResult(session, ticket);
+}
+
+/*
+ * Checks, without blocking, whether an asynchronous request has completed.
+ * Input:
+ *  - session: the session the request was made in
+ *  - ticket: returned by the request (tfsCreateAsync, ...)
+ *  - result: where to store the server response, once completed (the
+ *    ticket may then no longer be used)
+ * Return: 1 if completed, 0 if not yet, TECNICOFS_ERROR_OTHER if the ticket
+ *  is not pending, or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionPoll(tfs_session_t *session, int ticket, int *result)
+{
+  PendingRequest *slot = &session->pending[(unsigned int)ticket % TFS_MAX_PENDING];
+  int status;
+
+  if (ticket <= 0 || slot->id != ticket || slot->state == PENDING_FREE)
+    return TECNICOFS_ERROR_OTHER;
+  while (slot->state == PENDING_WAITING)
+  {
+    if ((status = receiveReply(session, MSG_DONTWAIT)) <= 0)
+      return status;
+  }
+  *result = waitResult(session, ticket);
+  return 1;
 }
 
 /*
  * Sends to server a create command request
  * Input:
+ *  - session: the session
  *  - filename: filename of node to be created
  *  - nodeType: type of node to be added, either directory or file
  * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR
  */
-int tfsCreate(char *filename, char nodeType)
+int tfsSessionCreate(tfs_session_t *session, char *filename, char nodeType)
 {
-  send_size = sprintf(send_buffer, "c %s %c", filename, nodeType);
-  if (sendCommand() != SUCCESS)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receiveResponse();
+  return executeRequest(session, TFS_OP_CREATE, nodeType, filename, "");
 }
 
 /*
  * Sends to server a delete command request
  * Input:
+ *  - session: the session
  *  - path: path to file to be deleted
  * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR;
  */
-int tfsDelete(char *path)
+int tfsSessionDelete(tfs_session_t *session, char *path)
 {
-  send_size = sprintf(send_buffer, "d %s", path);
-  if (sendCommand() != SUCCESS)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receiveResponse();
+  return executeRequest(session, TFS_OP_DELETE, 0, path, "");
+}
+
+/*
+ * Sends to server a delete command request for a directory along with
+ * everything under it. The server detaches it at once and reclaims its
+ * contents in the background.
+ * Input:
+ *  - session: the session
+ *  - path: path to the directory (or file) to be deleted
+ * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR;
+ */
+int tfsSessionDeleteTree(tfs_session_t *session, char *path)
+{
+  return executeRequest(session, TFS_OP_DELETE, TFS_ARG_RECURSIVE, path, "");
 }
 
 /*
  * Sends to server a move command request
  * Input:
+ *  - session: the session
  *  - from: path to file to be moved
  *  - to: new path for the file
  * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR;
  */
-int tfsMove(char *from, char *to)
+int tfsSessionMove(tfs_session_t *session, char *from, char *to)
 {
-  send_size = sprintf(send_buffer, "m %s %s", from, to);
-  if (sendCommand() != SUCCESS)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receiveResponse();
+  return executeRequest(session, TFS_OP_MOVE, 0, from, to);
 }
 
 /*
  * Sends to server a lookup command request
  * Input:
+ *  - session: the session
  *  - path: path to file to be moved
  * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR;
  */
-int tfsLookup(char *path)
+int tfsSessionLookup(tfs_session_t *session, char *path)
 {
-  send_size = sprintf(send_buffer, "l %s", path);
-  if (sendCommand() != SUCCESS)
-    return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receiveResponse();
+  return executeRequest(session, TFS_OP_LOOKUP, 0, path, "");
 }
 
 /*
  * Sends to server a print command request
  * Input:
+ *  - session: the session
  *  - filename: filename of where to print the tecnicofs tree
  * Return: An integer server response or TECNICO_ERROR_CONNECTION_ERROR;
  */
-int tfsPrint(char *filename)
+int tfsSessionPrint(tfs_session_t *session, char *filename)
+{
+  return executeRequest(session, TFS_OP_PRINT, 0, filename, "");
+}
+
+/*
+ * Sends a request the server answers by streaming the tree back, and
+ * writes the tree to a file as it arrives.
+ * Input:
+ *  - opcode: TFS_OP_DUMP or TFS_OP_SNAPSHOT
+ *  - fd: where to write the tree
+ * Return: An integer server response, TECNICOFS_ERROR_OTHER if the tree
+ *  could not be written or the request is not allowed, or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int streamTree(tfs_session_t *session, char opcode, int fd)
+{
+  int result;
+
+  if (session->batch_open || session->text_protocol || session->rings != NULL)
+    return TECNICOFS_ERROR_OTHER;
+  session->stream_fd = fd;
+  session->stream_id = session->request_next_id;
+  session->stream_status = SUCCESS;
+  result = executeRequest(session, opcode, 0, "/", "");
+  session->stream_fd = -1;
+  return result == SUCCESS ? session->stream_status : result;
+}
+
+/*
+ * Dumps the tecnicofs tree, a path per line, to a file of the client: the
+ * server streams it back over the socket as it walks the tree. Only with
+ * the binary protocol over the socket, and not inside a batch.
+ * Input:
+ *  - session: the session
+ *  - fd: where to write the tree
+ * Return: see streamTree
+ */
+int tfsSessionDump(tfs_session_t *session, int fd)
+{
+  return streamTree(session, TFS_OP_DUMP, fd);
+}
+
+/*
+ * Backs up the tecnicofs tree to a file of the client, like tfsDump, as
+ * the create commands that rebuild it ("c /a d", one per line): an input
+ * file for tecnicofs-client. The server takes a snapshot, so the backup is
+ * the tree at a single point in time, although it keeps changing while it
+ * is sent.
+ * Input:
+ *  - session: the session
+ *  - fd: where to write the commands
+ * Return: see streamTree
+ */
+int tfsSessionSnapshot(tfs_session_t *session, int fd)
+{
+  return streamTree(session, TFS_OP_SNAPSHOT, fd);
+}
+
+/*
+ * Sends a file request and waits for its response. Not inside a batch.
+ * Returns: An integer server response or an error (see queueFileRequest
+ *  and submitRequests)
+ */
+int executeFileRequest(tfs_session_t *session, char opcode, char *path, int handle, const char *data, int size,
+                       long offset)
 {
-  send_size = sprintf(send_buffer, "p %s", filename);
-  if (sendCommand() != SUCCESS)
+  int index, result;
+
+  if (session->batch_open)
+    return TECNICOFS_ERROR_OTHER;
+  if ((index = queueFileRequest(session, opcode, path, handle, data, size, offset)) < 0)
+    return index;
+  if ((index = submitRequests(session, &result)) < 0)
+    return index;
+  return result;
+}
+
+/*
+ * Tells how much of a transfer to move through the data memfd in the next
+ * request, growing the memfd as needed. It is created sealed against
+ * shrinking, so the server may map it safely, and only grows; its pages
+ * are kept for the next transfers.
+ * Input:
+ *  - left: bytes of the transfer left
+ * Returns: the bytes, or 0 to use datagrams (the transfer is small, the
+ *  transport cannot carry descriptors or the memfd cannot be made)
+ */
+int memfdPiece(tfs_session_t *session, int left)
+{
+  size_t size = left < MAX_MEMFD_TRANSFER ? left : MAX_MEMFD_TRANSFER;
+  char *map;
+
+  if (session->memfd_threshold <= 0 || left < session->memfd_threshold ||
+      session->rings != NULL || session->text_protocol || session->batch_open)
+    return 0;
+  if (session->data_fd < 0)
+  {
+    if ((session->data_fd = memfd_create("tecnicofs-data", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+      return 0;
+    if (fcntl(session->data_fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+    {
+      close(session->data_fd);
+      session->data_fd = -1;
+      return 0;
+    }
+  }
+  if (size > session->data_size)
+  {
+    if (ftruncate(session->data_fd, size) < 0 ||
+        (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, session->data_fd, 0)) == MAP_FAILED)
+      return 0;
+    if (session->data_map != NULL)
+      munmap(session->data_map, session->data_size);
+    session->data_map = map;
+    session->data_size = size;
+  }
+  return size;
+}
+
+/*
+ * Sends a read or write whose data is in the data memfd (see memfdPiece),
+ * along with the memfd, and waits for its response.
+ * Returns: see executeFileRequest
+ */
+int executeMemfdRequest(tfs_session_t *session, char opcode, char *path, int handle, int size, long offset)
+{
+  TfsFileArgs args = {offset, size, handle};
+  unsigned int id = session->request_next_id;
+  int length = strlen(path), index;
+
+  if (length >= MAX_PATH_LENGTH)
+    return TECNICOFS_ERROR_PATH_TOO_LONG;
+  if ((index = queueBinaryRequest(session, opcode, TFS_ARG_MEMFD, path, length, (char *)&args, sizeof(args),
+                                  NULL, 0)) < 0)
+    return index;
+  if (sendDatagram(session, &session->data_fd, 1) != SUCCESS)
     return TECNICOFS_ERROR_CONNECTION_ERROR;
-  return receiveResponse();
+  return waitResult(session, id);
 }
 
 /*
- * Creates and binds the socket for the client and sets up server's socket address for communication
+ * Writes data to a file, in as many requests as its size takes: up to
+ * MAX_MEMFD_TRANSFER bytes each through the data memfd, for large writes,
+ * or else TFS_MAX_WRITE bytes each in datagrams, less over shared memory.
  * Input:
- *  - sockPath: path to file to be deleted
+ *  - opcode: TFS_OP_WRITE, or TFS_OP_APPEND to ignore offset
+ *  - path, handle: the file (see queueFileRequest)
+ *  - offset: where to write, ignored for an open file (which has its own)
+ * Returns: the bytes written, or an error if none were
  */
-int tfsMount(char *sockPath)
+int writeFile(tfs_session_t *session, char opcode, char *path, int handle, const void *data, int size, long offset)
 {
-  /* Creating socket for the client */
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
-    return TECNICOFS_ERROR_MOUNT_ERROR;
+  int done = 0, piece, result, room = TFS_MAX_WRITE;
 
-  bzero((char *)&client_addr, sizeof(struct sockaddr_un));
-  client_addr.sun_family = AF_UNIX;
+  if (session->rings != NULL)
+    room = TFS_RING_DATAGRAM - sizeof(TfsHeader) - sizeof(TfsRequest) - sizeof(TfsFileArgs) -
+           strlen(path) - 2 - TFS_ALIGN;
+  if (size < 0 || offset < 0)
+    return TECNICOFS_ERROR_OTHER;
+  do
+  {
+    if ((piece = memfdPiece(session, size - done)) > 0)
+    {
+      memcpy(session->data_map, (const char *)data + done, piece);
+      result = executeMemfdRequest(session, opcode, path, handle, piece, offset + done);
+    }
+    else
+    {
+      piece = size - done < room ? size - done : room;
+      result = executeFileRequest(session, opcode, path, handle, (const char *)data + done, piece, offset + done);
+    }
+    if (result < 0)
+      return done > 0 ? done : result;
+    done += result;
+  } while (result == piece && done < size);
+  return done;
+}
 
-  /* Binding the new socket to a file in /tmp with random name */
-  strcpy(client_addr.sun_path, "/tmp/client-socket-XXXXXX");
+/*
+ * Writes to a file, at an offset; writing past its end grows it, and a
+ * gap left before the data reads as zeros. Only with the binary protocol,
+ * and not inside a batch; writes of more than TFS_MAX_WRITE bytes are made
+ * of several requests, each atomic on its own.
+ * Input:
+ *  - session: the session
+ *  - path: path of the file
+ *  - data: the data
+ *  - size: its size
+ *  - offset: where to write it
+ * Return: the bytes written (all of them, unless the server ran out of
+ *  room), TECNICOFS_ERROR_FILE_NOT_FOUND, TECNICOFS_ERROR_NOT_A_FILE,
+ *  TECNICOFS_ERROR_FILE_TOO_BIG, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionWriteAt(tfs_session_t *session, char *path, const void *data, int size, long offset)
+{
+  return writeFile(session, TFS_OP_WRITE, path, 0, data, size, offset);
+}
 
-  if (mkstemp(client_addr.sun_path) == -1)
-    return TECNICOFS_ERROR_MOUNT_ERROR;
+/*
+ * Appends to a file, like tfsWriteAt at its end; a request of another
+ * client never lands in the middle of one of TFS_MAX_WRITE bytes or less.
+ * Return: see tfsSessionWriteAt
+ */
+int tfsSessionAppend(tfs_session_t *session, char *path, const void *data, int size)
+{
+  return writeFile(session, TFS_OP_APPEND, path, 0, data, size, 0);
+}
 
-  if (unlink(client_addr.sun_path) != 0)
-    return TECNICOFS_ERROR_MOUNT_ERROR;
+/*
+ * Reads from a file, in as many requests as size takes: through the data
+ * memfd, for large reads, or else TFS_MAX_READ bytes each, whose data the
+ * server streams back ahead of the reply.
+ * Input:
+ *  - path, handle: the file (see queueFileRequest)
+ *  - offset: where to read, ignored for an open file (which has its own)
+ * Returns: the bytes read, or an error if none were
+ */
+int readFile(tfs_session_t *session, char *path, int handle, void *data, int size, long offset)
+{
+  int done = 0, piece, result;
 
-  clilen = SUN_LEN(&client_addr);
+  if (session->rings != NULL || size < 0 || offset < 0)
+    return TECNICOFS_ERROR_OTHER;
+  do
+  {
+    if ((piece = memfdPiece(session, size - done)) > 0)
+    {
+      if ((result = executeMemfdRequest(session, TFS_OP_READ, path, handle, piece, offset + done)) > 0)
+        memcpy((char *)data + done, session->data_map, result);
+    }
+    else
+    {
+      piece = size - done < TFS_MAX_READ ? size - done : TFS_MAX_READ;
+      session->stream_buffer = (char *)data + done;
+      session->stream_size = piece;
+      session->stream_received = 0;
+      session->stream_id = session->request_next_id;
+      session->stream_status = SUCCESS;
+      result = executeFileRequest(session, TFS_OP_READ, path, handle, NULL, piece, offset + done);
+      session->stream_buffer = NULL;
+      if (result >= 0 && (session->stream_status != SUCCESS || session->stream_received != result))
+        result = TECNICOFS_ERROR_OTHER;
+    }
+    if (result < 0)
+      return done > 0 ? done : result;
+    done += result;
+  } while (result == piece && done < size);
+  return done;
+}
 
-  if (bind(sockfd, (struct sockaddr *)&client_addr, clilen) < 0)
-    return TECNICOFS_ERROR_MOUNT_ERROR;
+/*
+ * Reads from a file, at an offset: the server streams the data back over
+ * the socket, in TFS_MAX_READ bytes per request. Only with the binary
+ * protocol over the socket, and not inside a batch.
+ * Input:
+ *  - session: the session
+ *  - path: path of the file
+ *  - data: where to read to
+ *  - size: the most bytes to read
+ *  - offset: where to read from
+ * Return: the bytes read (fewer than size at the end of the file),
+ *  TECNICOFS_ERROR_FILE_NOT_FOUND, TECNICOFS_ERROR_NOT_A_FILE,
+ *  TECNICOFS_ERROR_OTHER or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionReadAt(tfs_session_t *session, char *path, void *data, int size, long offset)
+{
+  return readFile(session, path, 0, data, size, offset);
+}
 
-  /* Getting the server address */
-  servlen = setSockAddrUn(sockPath, &serv_addr);
-  return SUCCESS;
+/*
+ * Sets the size of a file, dropping its end or growing it with zeros.
+ * Only with the binary protocol, and not inside a batch.
+ * Input:
+ *  - session: the session
+ *  - path: path of the file
+ *  - size: its new size
+ * Return: SUCCESS, TECNICOFS_ERROR_FILE_NOT_FOUND, TECNICOFS_ERROR_NOT_A_FILE,
+ *  TECNICOFS_ERROR_FILE_TOO_BIG, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionTruncate(tfs_session_t *session, char *path, long size)
+{
+  if (size < 0 || size > 0x7fffffff)
+    return TECNICOFS_ERROR_FILE_TOO_BIG;
+  return executeFileRequest(session, TFS_OP_TRUNCATE, path, 0, NULL, size, 0);
+}
+
+/*
+ * Opens a file: the handle returned stands for the file in tfsRead,
+ * tfsWrite, tfsSeek and tfsClose, which the server then serves without
+ * resolving its path again, locking only the file. It keeps the offset
+ * they start at, from 0, and stays bound to the file if it is moved; once
+ * the file is deleted, they fail with TECNICOFS_ERROR_FILE_NOT_FOUND. A
+ * handle is not tied to the session, and stays open until closed. Only
+ * with the binary protocol.
+ * Input:
+ *  - session: the session
+ *  - path: path of the file
+ *  - mode: READ, WRITE or RW, the requests the handle allows
+ * Return: the handle (> 0), TECNICOFS_ERROR_FILE_NOT_FOUND,
+ *  TECNICOFS_ERROR_NOT_A_FILE, TECNICOFS_ERROR_PERMISSION_DENIED,
+ *  TECNICOFS_ERROR_TOO_MANY_OPEN_FILES, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionOpen(tfs_session_t *session, char *path, permission mode)
+{
+  if (session->text_protocol)
+    return TECNICOFS_ERROR_OTHER;
+  return executeRequest(session, TFS_OP_OPEN, mode, path, "");
 }
 
 /*
- * Closes the client's socket file descriptor and unlinks the socket for the client.
+ * Reads from an open file, at its offset, and advances it. Like
+ * tfsReadAt, not over shared memory nor inside a batch.
+ * Return: the bytes read (fewer than size at the end of the file),
+ *  TECNICOFS_ERROR_BAD_HANDLE, TECNICOFS_ERROR_PERMISSION_DENIED,
+ *  TECNICOFS_ERROR_FILE_NOT_FOUND, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionRead(tfs_session_t *session, int fd, void *data, int size)
+{
+  return readFile(session, "", fd, data, size, 0);
+}
+
+/*
+ * Writes to an open file, at its offset, and advances it (see
+ * tfsWriteAt).
+ * Return: the bytes written, TECNICOFS_ERROR_BAD_HANDLE,
+ *  TECNICOFS_ERROR_PERMISSION_DENIED, TECNICOFS_ERROR_FILE_NOT_FOUND,
+ *  TECNICOFS_ERROR_FILE_TOO_BIG, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionWrite(tfs_session_t *session, int fd, const void *data, int size)
+{
+  return writeFile(session, TFS_OP_WRITE, "", fd, data, size, 0);
+}
+
+/*
+ * Sets the offset of an open file, where its next read or write starts.
+ * Return: SUCCESS, TECNICOFS_ERROR_BAD_HANDLE, TECNICOFS_ERROR_FILE_TOO_BIG,
+ *  TECNICOFS_ERROR_OTHER or TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionSeek(tfs_session_t *session, int fd, long offset)
+{
+  if (offset < 0)
+    return TECNICOFS_ERROR_FILE_TOO_BIG;
+  return executeFileRequest(session, TFS_OP_SEEK, "", fd, NULL, 0, offset);
+}
+
+/*
+ * Closes an open file.
+ * Return: SUCCESS, TECNICOFS_ERROR_BAD_HANDLE, TECNICOFS_ERROR_OTHER or
+ *  TECNICOFS_ERROR_CONNECTION_ERROR
+ */
+int tfsSessionClose(tfs_session_t *session, int fd)
+{
+  return executeFileRequest(session, TFS_OP_CLOSE, "", fd, NULL, 0, 0);
+}
+
+/*
+ * Asynchronous versions of the requests above: they return a ticket as soon
+ * as the request is sent, to be passed to tfsWait or tfsPoll for the
+ * response. Up to TFS_MAX_PENDING requests may be pending, and they may be
+ * executed by the server in any order. Only with the binary protocol, and
+ * not inside a batch.
+ * Return: a ticket (> 0), or an error (< 0)
+ */
+int tfsSessionCreateAsync(tfs_session_t *session, char *filename, char nodeType)
+{
+  return executeRequestAsync(session, TFS_OP_CREATE, nodeType, filename, "");
+}
+
+int tfsSessionDeleteAsync(tfs_session_t *session, char *path)
+{
+  return executeRequestAsync(session, TFS_OP_DELETE, 0, path, "");
+}
+
+int tfsSessionDeleteTreeAsync(tfs_session_t *session, char *path)
+{
+  return executeRequestAsync(session, TFS_OP_DELETE, TFS_ARG_RECURSIVE, path, "");
+}
+
+int tfsSessionMoveAsync(tfs_session_t *session, char *from, char *to)
+{
+  return executeRequestAsync(session, TFS_OP_MOVE, 0, from, to);
+}
+
+int tfsSessionLookupAsync(tfs_session_t *session, char *path)
+{
+  return executeRequestAsync(session, TFS_OP_LOOKUP, 0, path, "");
+}
+
+int tfsSessionPrintAsync(tfs_session_t *session, char *filename)
+{
+  return executeRequestAsync(session, TFS_OP_PRINT, 0, filename, "");
+}
+
+/*
+ * Opens the default session, used by the functions below.
+ * Input:
+ *  - sockPath: path of the server's socket
+ * Returns: SUCCESS or TECNICOFS_ERROR_MOUNT_ERROR
+ */
+int tfsMount(char *sockPath)
+{
+  if (default_session != NULL)
+    return TECNICOFS_ERROR_MOUNT_ERROR;
+  default_session = tfsSessionMount(sockPath);
+  return default_session != NULL ? SUCCESS : TECNICOFS_ERROR_MOUNT_ERROR;
+}
+
+/*
+ * Closes the default session.
  */
 int tfsUnmount()
 {
-  close(sockfd);
-  unlink(client_socket_name);
+  if (default_session == NULL)
+    return TECNICOFS_ERROR_OTHER;
+  tfsSessionUnmount(default_session);
+  default_session = NULL;
   return SUCCESS;
 }
+
+/*
+ * The requests in the default session (see the tfsSession functions above).
+ * Like it, they are not to be called by several threads at once.
+ */
+int tfsTextProtocol(int enabled) { return tfsSessionTextProtocol(default_session, enabled); }
+
+int tfsSharedMemory() { return tfsSessionSharedMemory(default_session); }
+
+int tfsMemfdThreshold(int threshold) { return tfsSessionMemfdThreshold(default_session, threshold); }
+
+int tfsBatchBegin() { return tfsSessionBatchBegin(default_session); }
+
+int tfsBatchSubmit(int *results) { return tfsSessionBatchSubmit(default_session, results); }
+
+int tfsWait(int ticket) { return tfsSessionWait(default_session, ticket); }
+
+int tfsPoll(int ticket, int *result) { return tfsSessionPoll(default_session, ticket, result); }
+
+int tfsCreate(char *filename, char nodeType) { return tfsSessionCreate(default_session, filename, nodeType); }
+
+int tfsDelete(char *path) { return tfsSessionDelete(default_session, path); }
+
+int tfsDeleteTree(char *path) { return tfsSessionDeleteTree(default_session, path); }
+
+int tfsMove(char *from, char *to) { return tfsSessionMove(default_session, from, to); }
+
+int tfsLookup(char *path) { return tfsSessionLookup(default_session, path); }
+
+int tfsPrint(char *filename) { return tfsSessionPrint(default_session, filename); }
+
+int tfsDump(int fd) { return tfsSessionDump(default_session, fd); }
+
+int tfsSnapshot(int fd) { return tfsSessionSnapshot(default_session, fd); }
+
+int tfsWriteAt(char *path, const void *data, int size, long offset) { return tfsSessionWriteAt(default_session, path, data, size, offset); }
+
+int tfsAppend(char *path, const void *data, int size) { return tfsSessionAppend(default_session, path, data, size); }
+
+int tfsReadAt(char *path, void *data, int size, long offset) { return tfsSessionReadAt(default_session, path, data, size, offset); }
+
+int tfsTruncate(char *path, long size) { return tfsSessionTruncate(default_session, path, size); }
+
+int tfsOpen(char *path, permission mode) { return tfsSessionOpen(default_session, path, mode); }
+
+int tfsRead(int fd, void *data, int size) { return tfsSessionRead(default_session, fd, data, size); }
+
+int tfsWrite(int fd, const void *data, int size) { return tfsSessionWrite(default_session, fd, data, size); }
+
+int tfsSeek(int fd, long offset) { return tfsSessionSeek(default_session, fd, offset); }
+
+int tfsClose(int fd) { return tfsSessionClose(default_session, fd); }
+
+int tfsCreateAsync(char *filename, char nodeType) { return tfsSessionCreateAsync(default_session, filename, nodeType); }
+
+int tfsDeleteAsync(char *path) { return tfsSessionDeleteAsync(default_session, path); }
+
+int tfsDeleteTreeAsync(char *path) { return tfsSessionDeleteTreeAsync(default_session, path); }
+
+int tfsMoveAsync(char *from, char *to) { return tfsSessionMoveAsync(default_session, from, to); }
+
+int tfsLookupAsync(char *path) { return tfsSessionLookupAsync(default_session, path); }
+
+int tfsPrintAsync(char *filename) { return tfsSessionPrintAsync(default_session, filename); }
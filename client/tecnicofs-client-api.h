@@ -3,12 +3,81 @@
 
 #include "tecnicofs-api-constants.h"
 
+/* Maximum number of requests sent and not yet claimed (tfsWait, tfsPoll) */
+#define TFS_MAX_PENDING 1024
+
+/* Reads and writes of at least this many bytes go through a memfd, see
+ * tfsMemfdThreshold */
+#define TFS_MEMFD_THRESHOLD 65536
+
+/* A connection to the server, see tfsSessionMount */
+typedef struct tfsSession tfs_session_t;
+
+tfs_session_t *tfsSessionMount(char *sockPath);
+int tfsSessionUnmount(tfs_session_t *session);
+int tfsSessionCreate(tfs_session_t *session, char *path, char nodeType);
+int tfsSessionDelete(tfs_session_t *session, char *path);
+int tfsSessionDeleteTree(tfs_session_t *session, char *path);
+int tfsSessionLookup(tfs_session_t *session, char *path);
+int tfsSessionMove(tfs_session_t *session, char *from, char *to);
+int tfsSessionPrint(tfs_session_t *session, char *filename);
+int tfsSessionDump(tfs_session_t *session, int fd);
+int tfsSessionSnapshot(tfs_session_t *session, int fd);
+int tfsSessionWriteAt(tfs_session_t *session, char *path, const void *data, int size, long offset);
+int tfsSessionAppend(tfs_session_t *session, char *path, const void *data, int size);
+int tfsSessionReadAt(tfs_session_t *session, char *path, void *data, int size, long offset);
+int tfsSessionTruncate(tfs_session_t *session, char *path, long size);
+int tfsSessionOpen(tfs_session_t *session, char *path, permission mode);
+int tfsSessionRead(tfs_session_t *session, int fd, void *data, int size);
+int tfsSessionWrite(tfs_session_t *session, int fd, const void *data, int size);
+int tfsSessionSeek(tfs_session_t *session, int fd, long offset);
+int tfsSessionClose(tfs_session_t *session, int fd);
+int tfsSessionBatchBegin(tfs_session_t *session);
+int tfsSessionBatchSubmit(tfs_session_t *session, int *results);
+int tfsSessionTextProtocol(tfs_session_t *session, int enabled);
+int tfsSessionSharedMemory(tfs_session_t *session);
+int tfsSessionMemfdThreshold(tfs_session_t *session, int threshold);
+int tfsSessionCreateAsync(tfs_session_t *session, char *path, char nodeType);
+int tfsSessionDeleteAsync(tfs_session_t *session, char *path);
+int tfsSessionDeleteTreeAsync(tfs_session_t *session, char *path);
+int tfsSessionLookupAsync(tfs_session_t *session, char *path);
+int tfsSessionMoveAsync(tfs_session_t *session, char *from, char *to);
+int tfsSessionPrintAsync(tfs_session_t *session, char *filename);
+int tfsSessionWait(tfs_session_t *session, int ticket);
+int tfsSessionPoll(tfs_session_t *session, int ticket, int *result);
+
+/* The same, in a default session opened by tfsMount */
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
+int tfsDeleteTree(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsMount(char *sockPath);
 int tfsPrint(char *filename);
+int tfsDump(int fd);
+int tfsSnapshot(int fd);
+int tfsWriteAt(char *path, const void *data, int size, long offset);
+int tfsAppend(char *path, const void *data, int size);
+int tfsReadAt(char *path, void *data, int size, long offset);
+int tfsTruncate(char *path, long size);
+int tfsOpen(char *path, permission mode);
+int tfsRead(int fd, void *data, int size);
+int tfsWrite(int fd, const void *data, int size);
+int tfsSeek(int fd, long offset);
+int tfsClose(int fd);
 int tfsUnmount();
+int tfsBatchBegin();
+int tfsBatchSubmit(int *results);
+int tfsTextProtocol(int enabled);
+int tfsSharedMemory();
+int tfsMemfdThreshold(int threshold);
+int tfsCreateAsync(char *path, char nodeType);
+int tfsDeleteAsync(char *path);
+int tfsDeleteTreeAsync(char *path);
+int tfsLookupAsync(char *path);
+int tfsMoveAsync(char *from, char *to);
+int tfsPrintAsync(char *filename);
+int tfsWait(int ticket);
+int tfsPoll(int ticket, int *result);
 
 #endif /* CLIENT_H */
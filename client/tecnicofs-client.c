@@ -43,12 +43,12 @@ void errorParse()
 
 void *processInput()
 {
-  char line[MAX_INPUT_SIZE];
+  char line[2 * MAX_PATH_LENGTH + MAX_INPUT_SIZE];
 
   while (fgets(line, sizeof(line) / sizeof(char), inputFile))
   {
     char op;
-    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+    char arg1[MAX_PATH_LENGTH], arg2[MAX_PATH_LENGTH];
     int res;
 
     int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
@@ -96,9 +96,14 @@ void *processInput()
         printf("Search: %s not found\n", arg1);
       break;
     case 'd':
-      if (numTokens != 2)
-        errorParse();
-      res = tfsDelete(arg1);
+      if (numTokens == 3 && arg2[0] == 'r')
+        res = tfsDeleteTree(arg1);
+      else
+      {
+        if (numTokens != 2)
+          errorParse();
+        res = tfsDelete(arg1);
+      }
       if (!res)
         printf("Deleted: %s\n", arg1);
       else
@@ -0,0 +1,126 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Binary wire protocol, version 1.
+ *
+ * A request datagram is a TfsHeader followed by count requests, each a
+ * TfsRequest followed by its two paths, NUL terminated, padded together to
+ * TFS_ALIGN bytes. The reply is a TfsHeader followed by one TfsResult per
+ * request, in the same order. Integers are in host byte order (the socket
+ * is local).
+ *
+ * A TFS_OP_DUMP request is answered with the tree, a path per line, in
+ * chunk datagrams (a TfsChunk followed by size bytes, TFS_MAGIC_CHUNK) sent
+ * before its reply; a TFS_OP_SNAPSHOT request likewise, with the create
+ * commands that rebuild the tree ("c /a d", one per line). Either is a
+ * consistent snapshot of the tree.
+ *
+ * The file requests (TFS_OP_READ, TFS_OP_WRITE, TFS_OP_APPEND,
+ * TFS_OP_TRUNCATE, TFS_OP_SEEK and TFS_OP_CLOSE) carry a TfsFileArgs
+ * instead of a second path, followed by the data of a write; length2 covers
+ * both and a NUL still follows. A write's result is the bytes written. A
+ * read's data is sent in chunk datagrams, like a dump's, ahead of the
+ * reply, whose result is the bytes read (0 at the end of the file). The
+ * file is the one of the path, or that of a handle returned by TFS_OP_OPEN
+ * (with a permission as arg), whose offset then replaces the one given.
+ * A read or write with TFS_ARG_MEMFD as arg carries no data: the datagram
+ * carries a memfd instead (SCM_RIGHTS, not over shared memory), sealed
+ * against shrinking, whose first size bytes the data is read to or written
+ * from.
+ *
+ * A datagram not starting with TFS_MAGIC is a command of the old text
+ * protocol ("c /a f"), or a batch of them ("b <count>" and one command per
+ * line), still accepted by the server.
+ */
+#define TFS_MAGIC 0xf5 /* not a text command letter */
+#define TFS_MAGIC_CHUNK 0xf6
+#define TFS_VERSION 1
+
+/* Largest request datagram, in either protocol */
+#define TFS_MAX_DATAGRAM 65536
+
+#define TFS_ALIGN 4
+
+/* Largest data of a chunk datagram */
+#define TFS_MAX_CHUNK 32768
+
+/* Most data read or written by a single file request */
+#define TFS_MAX_READ (1 << 20)
+#define TFS_MAX_WRITE 32768
+
+/* arg of a read or write whose data is in a memfd */
+#define TFS_ARG_MEMFD 'm'
+
+/* arg of a delete of a directory along with everything under it ("d /a r"
+ * in the text protocol) */
+#define TFS_ARG_RECURSIVE 'r'
+
+/* Size of a request with paths of length1 and length2 bytes */
+#define TFS_REQUEST_SIZE(length1, length2) \
+  (sizeof(TfsRequest) + (((length1) + (length2) + 2 + TFS_ALIGN - 1) & ~(TFS_ALIGN - 1)))
+
+/* Opcodes are the letters of the text protocol commands */
+typedef enum tfsOpcode
+{
+  TFS_OP_CREATE = 'c',
+  TFS_OP_DELETE = 'd',
+  TFS_OP_MOVE = 'm',
+  TFS_OP_LOOKUP = 'l',
+  TFS_OP_PRINT = 'p',
+  TFS_OP_SHARED_MEMORY = 's', /* binary only, see tecnicofs-ring.h */
+  TFS_OP_DUMP = 't',          /* binary only, not over shared memory */
+  TFS_OP_SNAPSHOT = 'k',      /* likewise */
+  TFS_OP_READ = 'r',          /* likewise */
+  TFS_OP_WRITE = 'w',         /* binary only */
+  TFS_OP_APPEND = 'a',        /* likewise, a write at the end of the file */
+  TFS_OP_TRUNCATE = 'u',      /* likewise */
+  TFS_OP_OPEN = 'o',          /* likewise */
+  TFS_OP_SEEK = 'e',          /* likewise, by handle only */
+  TFS_OP_CLOSE = 'x'          /* likewise */
+} TfsOpcode;
+
+typedef struct tfsHeader
+{
+  uint8_t magic;
+  uint8_t version;
+  uint16_t count; /* requests or results that follow */
+} TfsHeader;
+
+typedef struct tfsRequest
+{
+  uint32_t id;      /* echoed in the result */
+  uint8_t opcode;
+  uint8_t arg;      /* node type of a create, 'f' or 'd', or permission */
+  uint16_t length1; /* of the first path, without the NUL */
+  uint16_t length2; /* of the second path (move only, else 0) */
+  uint16_t unused;
+} TfsRequest;
+
+/* In place of the second path of a file request, not aligned */
+typedef struct tfsFileArgs
+{
+  uint64_t offset; /* where to read or write (not for an append), seek to */
+  uint32_t size;   /* bytes to read or write, or size to truncate to */
+  uint32_t handle; /* of an open file, or 0 for the path's */
+} TfsFileArgs;
+
+typedef struct tfsChunk
+{
+  uint8_t magic; /* TFS_MAGIC_CHUNK */
+  uint8_t version;
+  uint16_t unused;
+  uint32_t id;   /* of the request (dump, snapshot or read) */
+  uint32_t size; /* of the data that follows */
+} TfsChunk;
+
+typedef struct tfsResult
+{
+  uint32_t id;
+  int32_t result;
+} TfsResult;
+
+#endif /* TECNICOFS_PROTOCOL_H */
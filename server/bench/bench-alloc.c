@@ -0,0 +1,115 @@
+/*
+ * bench-alloc: i-node allocation throughput at different thread counts.
+ * Every run fills a table of `count` i-nodes from scratch (fresh phase), then
+ * frees all of them and allocates them again (reuse phase).
+ *
+ * Usage: bench-alloc [count] [threads...]   (default: 100000 1 4 16 64)
+ */
+#include "../fs/operations.h"
+#include "bench.h"
+
+#include <pthread.h>
+
+int count;
+int threads_count;
+int *inumbers;
+pthread_barrier_t barrier;
+
+/*
+ * Creates (and later re-creates) this thread's share of the i-nodes.
+ */
+void *worker(void *arg)
+{
+  int id = *(int *)arg;
+  int first = (long)count * id / threads_count;
+  int last = (long)count * (id + 1) / threads_count;
+
+  pthread_barrier_wait(&barrier);
+  for (int i = first; i < last; i++)
+    inumbers[i] = inode_create(T_FILE, FS_ROOT);
+  pthread_barrier_wait(&barrier);
+
+  /* freed by the main thread, so the reuse phase does not start from a
+   * thread-local cache */
+  pthread_barrier_wait(&barrier);
+  for (int i = first; i < last; i++)
+    inumbers[i] = inode_create(T_FILE, FS_ROOT);
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+/*
+ * Runs both phases with n threads and prints their throughput.
+ */
+void run(int n)
+{
+  pthread_t tid[n];
+  int ids[n];
+  double start, fresh, reuse;
+
+  /* The root takes one slot */
+  init_fs(count + 1);
+  threads_count = n;
+  pthread_barrier_init(&barrier, NULL, n + 1);
+  for (int i = 0; i < n; i++)
+  {
+    ids[i] = i;
+    if (pthread_create(&tid[i], NULL, worker, &ids[i]) != 0)
+      exit(EXIT_FAILURE);
+  }
+
+  pthread_barrier_wait(&barrier);
+  start = now_ns();
+  pthread_barrier_wait(&barrier);
+  fresh = now_ns() - start;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (inumbers[i] == FAIL || inode_delete(inumbers[i]) == FAIL)
+    {
+      fprintf(stderr, "allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_barrier_wait(&barrier);
+  start = now_ns();
+  pthread_barrier_wait(&barrier);
+  reuse = now_ns() - start;
+
+  for (int i = 0; i < n; i++)
+    pthread_join(tid[i], NULL);
+  for (int i = 0; i < count; i++)
+  {
+    if (inumbers[i] == FAIL)
+    {
+      fprintf(stderr, "allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  destroy_fs();
+
+  printf("%3d threads: fresh %10.0f creates/s, reuse %10.0f creates/s\n", n,
+         count / (fresh / 1e9), count / (reuse / 1e9));
+}
+
+int main(int argc, char *argv[])
+{
+  int defaults[] = {1, 4, 16, 64};
+
+  count = argc > 1 ? atoi(argv[1]) : 100000;
+  inumbers = malloc(sizeof(int) * count);
+  if (inumbers == NULL)
+    exit(EXIT_FAILURE);
+
+  if (argc > 2)
+    for (int i = 2; i < argc; i++)
+      run(atoi(argv[i]));
+  else
+    for (int i = 0; i < 4; i++)
+      run(defaults[i]);
+
+  free(inumbers);
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,159 @@
+/*
+ * bench-churn: allocator churn of a create/write/delete workload. In every
+ * round each thread builds a directory of files (short and long names,
+ * written with 100 bytes to 8KB each), and then deletes the one its
+ * neighbour built, so most memory is freed by a thread other than the one
+ * that allocated it. Prints the rate of both phases and the resident set
+ * size after them, every few rounds: with slabs it should level off
+ * instead of creeping up. Build with `make clean bench MALLOC=1` to compare
+ * with plain malloc.
+ *
+ * Usage: bench-churn [-r rounds] [-t threads] [-f files]
+ *        (default: 40 rounds, 4 threads, 2000 files per thread and round)
+ */
+#include "../fs/operations.h"
+#include "../fs/slab.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Rounds between reports */
+#define REPORT_EVERY 10
+
+int rounds, threads, files;
+pthread_barrier_t barrier;
+double build_time, delete_time;
+long build_ops, delete_ops;
+char data[8192];
+
+/*
+ * Builds the name of a file of a round.
+ */
+void file_path(char *path, int thread, int round, int file)
+{
+  if (file % 2 == 0)
+    snprintf(path, MAX_FILE_NAME, "/t%d/r%d/f%d", thread, round, file);
+  else
+    snprintf(path, MAX_FILE_NAME, "/t%d/r%d/a-rather-long-file-name-%d", thread, round, file);
+}
+
+/*
+ * Builds its directory of each round, then deletes its neighbour's.
+ */
+void *worker(void *arg)
+{
+  long id = (long)arg;
+  int neighbour = (id + 1) % threads;
+  unsigned int seed = id + 1;
+  char path[MAX_FILE_NAME];
+
+  for (int round = 0; round < rounds; round++)
+  {
+    pthread_barrier_wait(&barrier);
+    snprintf(path, sizeof(path), "/t%ld/r%d", id, round);
+    if (create(path, T_DIRECTORY) != SUCCESS)
+      exit(EXIT_FAILURE);
+    for (int f = 0; f < files; f++)
+    {
+      file_path(path, id, round, f);
+      if (create(path, T_FILE) != SUCCESS ||
+          write_file(path, data, 100 + rand_r(&seed) % (sizeof(data) - 100), 0) < 0)
+      {
+        fprintf(stderr, "building %s failed\n", path);
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (int f = 0; f < files; f++)
+    {
+      file_path(path, neighbour, round, f);
+      if (delete (path) != SUCCESS)
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, sizeof(path), "/t%d/r%d", neighbour, round);
+    if (delete (path) != SUCCESS)
+      exit(EXIT_FAILURE);
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t tid[256];
+  char path[MAX_FILE_NAME];
+  double start, middle;
+  long built = 0;
+  int opt;
+
+  rounds = 40;
+  threads = 4;
+  files = 2000;
+  while ((opt = getopt(argc, argv, "r:t:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'r':
+      rounds = atoi(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'f':
+      files = atoi(optarg);
+      break;
+    default:
+      rounds = 0; /* print usage */
+    }
+  }
+  if (rounds <= 0 || threads <= 0 || threads > 256 || files <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-r rounds] [-t threads] [-f files]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(data, 'x', sizeof(data));
+  init_fs(0);
+  for (int i = 0; i < threads; i++)
+  {
+    snprintf(path, sizeof(path), "/t%d", i);
+    create(path, T_DIRECTORY);
+  }
+
+  printf("%-8s %14s %14s %12s %12s %12s\n", "rounds", "build ops/s", "delete ops/s", "RSS built",
+         "RSS deleted", "slabs");
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for (long i = 0; i < threads; i++)
+    if (pthread_create(&tid[i], NULL, worker, (void *)i) != 0)
+      exit(EXIT_FAILURE);
+
+  for (int round = 0; round < rounds; round++)
+  {
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    pthread_barrier_wait(&barrier);
+    middle = now_ns();
+    /* a create and a write per file, and the directory */
+    build_time += middle - start;
+    build_ops += (2L * files + 1) * threads;
+    if ((round + 1) % REPORT_EVERY == 0 || round == rounds - 1)
+      built = resident_bytes();
+
+    pthread_barrier_wait(&barrier);
+    delete_time += now_ns() - middle;
+    delete_ops += (files + 1L) * threads;
+
+    if ((round + 1) % REPORT_EVERY == 0 || round == rounds - 1)
+      printf("%-8d %14.0f %14.0f %10.1fMB %10.1fMB %10.1fMB\n", round + 1, build_ops / build_time * 1e9,
+             delete_ops / delete_time * 1e9, built / 1e6, resident_bytes() / 1e6, slab_mapped() / 1e6);
+  }
+
+  for (int i = 0; i < threads; i++)
+    pthread_join(tid[i], NULL);
+  pthread_barrier_destroy(&barrier);
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,72 @@
+/*
+ * bench-dirs: directory lookup latency (ns and cycles) and memory per entry
+ * for directories of 10, 1K and 100K entries (or the sizes given), for names
+ * present and absent.
+ *
+ * Usage: bench-dirs [entries...]
+ */
+#include "../fs/dir.h"
+#include "../fs/state.h"
+#include "bench.h"
+
+#define LOOKUPS 1000000
+
+/*
+ * Builds a directory of n entries and times random lookups in it.
+ */
+void run(int n)
+{
+  Dir *dir = dir_new();
+  char(*names)[MAX_FILE_NAME] = malloc(sizeof(*names) * n);
+  char(*missing)[MAX_FILE_NAME] = malloc(sizeof(*missing) * n);
+  unsigned int seed = 42;
+  double start, start_cycles, hit, miss, hit_cycles, miss_cycles;
+  int found = 0;
+
+  if (dir == NULL || names == NULL || missing == NULL)
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < n; i++)
+  {
+    snprintf(names[i], MAX_FILE_NAME, "file-%d", i);
+    snprintf(missing[i], MAX_FILE_NAME, "absent-%d", i);
+    if (dir_insert(dir, names[i], i + 1) == FAIL)
+      exit(EXIT_FAILURE);
+  }
+
+  start = now_ns();
+  start_cycles = cycles();
+  for (int i = 0; i < LOOKUPS; i++)
+    found += dir_lookup(dir, names[rand_r(&seed) % n]) != FAIL;
+  hit_cycles = (cycles() - start_cycles) / LOOKUPS;
+  hit = (now_ns() - start) / LOOKUPS;
+
+  start = now_ns();
+  start_cycles = cycles();
+  for (int i = 0; i < LOOKUPS; i++)
+    found += dir_lookup(dir, missing[rand_r(&seed) % n]) != FAIL;
+  miss_cycles = (cycles() - start_cycles) / LOOKUPS;
+  miss = (now_ns() - start) / LOOKUPS;
+
+  if (found != LOOKUPS)
+    fprintf(stderr, "unexpected lookup results\n");
+  printf("%7d entries: %5.1f bytes/entry, hit %6.1f ns %6.0f cycles, "
+         "miss %6.1f ns %6.0f cycles\n",
+         n, (double)dir_bytes(dir) / n, hit, hit_cycles, miss, miss_cycles);
+
+  dir_free(dir);
+  free(names);
+  free(missing);
+}
+
+int main(int argc, char *argv[])
+{
+  int defaults[] = {10, 1000, 100000};
+
+  if (argc > 1)
+    for (int i = 1; i < argc; i++)
+      run(atoi(argv[i]));
+  else
+    for (int i = 0; i < 3; i++)
+      run(defaults[i]);
+  exit(EXIT_SUCCESS);
+}
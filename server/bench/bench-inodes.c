@@ -0,0 +1,38 @@
+/*
+ * bench-inodes: creates a large number of i-nodes and reports create
+ * throughput and resident memory.
+ *
+ * Usage: bench-inodes [count]
+ */
+#include "../fs/operations.h"
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+  int count = argc > 1 ? atoi(argv[1]) : 1000000;
+  long rss_before, rss_after;
+  double start, elapsed;
+
+  init_fs(count + 1);
+  rss_before = resident_bytes();
+
+  start = now_ns();
+  for (int i = 0; i < count; i++)
+  {
+    if (inode_create(T_FILE, FS_ROOT) == FAIL)
+    {
+      fprintf(stderr, "inode_create failed after %d i-nodes\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  elapsed = now_ns() - start;
+  rss_after = resident_bytes();
+
+  printf("created %d i-nodes in %.3f s: %.0f creates/s\n", count,
+         elapsed / 1e9, count / (elapsed / 1e9));
+  printf("resident memory: %.1f MiB (%.1f bytes/i-node)\n",
+         rss_after / 1048576.0, (double)(rss_after - rss_before) / count);
+
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,140 @@
+/*
+ * bench-lookup: lookup throughput of hot paths versus thread count. Builds a
+ * tree of fanout^depth files and has every thread look up random ones for a
+ * fixed time. -n disables the path cache, so every lookup walks the tree.
+ *
+ * Usage: bench-lookup [-n] [-s seconds] [threads...]
+ *        (default: 2 seconds, 1, 2, 4, ... up to the number of cores)
+ */
+#include "../fs/dcache.h"
+#include "../fs/operations.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
+
+#define FANOUT 8
+#define DEPTH 4
+#define PATHS (FANOUT * FANOUT * FANOUT * FANOUT)
+
+char paths[PATHS][MAX_FILE_NAME];
+double seconds;
+volatile int running;
+pthread_barrier_t barrier;
+
+/*
+ * Creates every directory and file of the tree, recording the file paths.
+ */
+void build_tree()
+{
+  char path[MAX_FILE_NAME];
+  int n = 0;
+
+  for (int a = 0; a < FANOUT; a++)
+  {
+    snprintf(path, sizeof(path), "/d%d", a);
+    create(path, T_DIRECTORY);
+    for (int b = 0; b < FANOUT; b++)
+    {
+      snprintf(path, sizeof(path), "/d%d/d%d", a, b);
+      create(path, T_DIRECTORY);
+      for (int c = 0; c < FANOUT; c++)
+      {
+        snprintf(path, sizeof(path), "/d%d/d%d/d%d", a, b, c);
+        create(path, T_DIRECTORY);
+        for (int d = 0; d < FANOUT; d++)
+        {
+          snprintf(paths[n], MAX_FILE_NAME, "/d%d/d%d/d%d/f%d", a, b, c, d);
+          create(paths[n++], T_FILE);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Looks up random paths until stopped.
+ * Returns: number of lookups done (cast to void*)
+ */
+void *worker(void *arg)
+{
+  unsigned int seed = (unsigned long)arg;
+  long count = 0;
+
+  pthread_barrier_wait(&barrier);
+  while (running)
+  {
+    if (lookup(paths[rand_r(&seed) % PATHS]) < 0)
+    {
+      fprintf(stderr, "lookup failed\n");
+      exit(EXIT_FAILURE);
+    }
+    count++;
+  }
+  return (void *)count;
+}
+
+/*
+ * Runs n threads for the configured time and prints the throughput.
+ */
+void run(int n)
+{
+  pthread_t tid[n];
+  long total = 0;
+  void *count;
+
+  running = 1;
+  pthread_barrier_init(&barrier, NULL, n + 1);
+  for (long i = 0; i < n; i++)
+    if (pthread_create(&tid[i], NULL, worker, (void *)(i + 1)) != 0)
+      exit(EXIT_FAILURE);
+  pthread_barrier_wait(&barrier);
+  usleep(seconds * 1e6);
+  running = 0;
+  for (int i = 0; i < n; i++)
+  {
+    pthread_join(tid[i], &count);
+    total += (long)count;
+  }
+  pthread_barrier_destroy(&barrier);
+  printf("%3d threads: %10.0f lookups/s\n", n, total / seconds);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+  seconds = 2;
+  while ((opt = getopt(argc, argv, "ns:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      dcache_enabled = 0;
+      break;
+    case 's':
+      seconds = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n] [-s seconds] [threads...]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  init_fs(0);
+  build_tree();
+
+  if (optind < argc)
+    for (int i = optind; i < argc; i++)
+      run(atoi(argv[i]));
+  else
+  {
+    for (int n = 1; n < cores; n *= 2)
+      run(n);
+    run(cores);
+  }
+
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,134 @@
+/*
+ * bench-protocol: cost of parsing a request, for the sscanf parser the
+ * server used to have, the text protocol and the binary protocol, with one
+ * request per datagram and with full batches. Every iteration first copies
+ * the datagram, as recvfrom would (parsing text modifies it).
+ *
+ * Usage: bench-protocol [iterations]   (default: 1000000 requests)
+ */
+#include "../protocol.h"
+#include "bench.h"
+
+#include <string.h>
+
+char *commands[] = {"c /r12/a/b3 f", "l /r12/a/b3", "m /r12/a/b3 /r12/c/b3",
+                    "d /r12/a/b3"};
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+char text[COMMANDS][TFS_MAX_DATAGRAM];
+char binary[COMMANDS][TFS_MAX_DATAGRAM] __attribute__((aligned(TFS_ALIGN)));
+char textBatch[TFS_MAX_DATAGRAM];
+char binaryBatch[TFS_MAX_DATAGRAM] __attribute__((aligned(TFS_ALIGN)));
+int textSize[COMMANDS], binarySize[COMMANDS], textBatchSize, binaryBatchSize;
+
+char datagram[TFS_MAX_DATAGRAM + 1] __attribute__((aligned(TFS_ALIGN)));
+Request requests[MAX_BATCH_SIZE];
+volatile int sink;
+
+/*
+ * Appends the binary encoding of a text command to buffer.
+ * Returns: the size of the encoding
+ */
+int encode(char *buffer, char *command, unsigned int id)
+{
+  TfsRequest *request = (TfsRequest *)buffer;
+  char path1[MAX_PATH_LENGTH], path2[MAX_PATH_LENGTH] = "";
+  char op;
+  int size;
+
+  sscanf(command, "%c %s %s", &op, path1, path2);
+  memset(request, 0, sizeof(TfsRequest));
+  request->id = id;
+  request->opcode = op;
+  if (op == TFS_OP_CREATE)
+  {
+    request->arg = path2[0];
+    path2[0] = '\0';
+  }
+  request->length1 = strlen(path1);
+  request->length2 = strlen(path2);
+  size = TFS_REQUEST_SIZE(request->length1, request->length2);
+  memset(buffer + sizeof(TfsRequest), 0, size - sizeof(TfsRequest));
+  strcpy(buffer + sizeof(TfsRequest), path1);
+  strcpy(buffer + sizeof(TfsRequest) + request->length1 + 1, path2);
+  return size;
+}
+
+/*
+ * Builds every datagram: each command alone and a batch of MAX_BATCH_SIZE.
+ */
+void build()
+{
+  TfsHeader header = {TFS_MAGIC, TFS_VERSION, 1};
+
+  for (int i = 0; i < COMMANDS; i++)
+  {
+    textSize[i] = sprintf(text[i], "%s", commands[i]);
+    memcpy(binary[i], &header, sizeof(header));
+    binarySize[i] = sizeof(header) + encode(binary[i] + sizeof(header), commands[i], i);
+  }
+
+  header.count = MAX_BATCH_SIZE;
+  memcpy(binaryBatch, &header, sizeof(header));
+  binaryBatchSize = sizeof(header);
+  textBatchSize = sprintf(textBatch, "b %d\n", MAX_BATCH_SIZE);
+  for (int i = 0; i < MAX_BATCH_SIZE; i++)
+  {
+    textBatchSize += sprintf(textBatch + textBatchSize, "%s\n", commands[i % COMMANDS]);
+    binaryBatchSize += encode(binaryBatch + binaryBatchSize, commands[i % COMMANDS], i);
+  }
+}
+
+/*
+ * The parser the server used before the binary protocol.
+ */
+int parse_sscanf(char *datagram, int size)
+{
+  char token, arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+
+  datagram[size] = '\0';
+  return sscanf(datagram, "%c %s %s", &token, arg1, arg2) + arg1[0];
+}
+
+/*
+ * Parses each datagram in turn, n requests in all, and prints ns/request.
+ */
+void run(char *name, char datagrams[][TFS_MAX_DATAGRAM], int *sizes, int count,
+         int perDatagram, long n, int useSscanf)
+{
+  ProtocolFormat format;
+  double start = now_ns(), elapsed;
+  int i = 0;
+
+  for (long done = 0; done < n; done += perDatagram)
+  {
+    memcpy(datagram, datagrams[i], sizes[i]);
+    if (useSscanf)
+      sink = parse_sscanf(datagram, sizes[i]);
+    else
+      sink = protocol_parse(datagram, sizes[i], requests, &format);
+    if (sink < 0)
+    {
+      fprintf(stderr, "%s: parse failed\n", name);
+      exit(EXIT_FAILURE);
+    }
+    i = (i + 1) % count;
+  }
+  elapsed = now_ns() - start;
+  printf("%-14s %8.1f ns/request\n", name, elapsed / n);
+}
+
+int main(int argc, char *argv[])
+{
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+  build();
+  run("sscanf", text, textSize, COMMANDS, 1, n, 1);
+  run("text", text, textSize, COMMANDS, 1, n, 0);
+  run("binary", binary, binarySize, COMMANDS, 1, n, 0);
+  run("text batch", (char(*)[TFS_MAX_DATAGRAM])textBatch, &textBatchSize, 1,
+      MAX_BATCH_SIZE, n, 0);
+  run("binary batch", (char(*)[TFS_MAX_DATAGRAM])binaryBatch, &binaryBatchSize,
+      1, MAX_BATCH_SIZE, n, 0);
+  return 0;
+}
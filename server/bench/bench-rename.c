@@ -0,0 +1,247 @@
+/*
+ * bench-rename: concurrent renames, each thread in a subtree of its own
+ * (disjoint) and all of them in the same one (shared). Every subtree has
+ * directories a, b and c; the phases swap the name of a file within a
+ * (f<k> and g<k>), a file between a and b (h<k>), and a directory, with a
+ * file inside, between a and b (d<k>); the last one has half the threads
+ * swap directories while the others create and delete files in c. In the
+ * shared subtree a rename may find its node already moved by another
+ * thread; it is then tried the other way, both counted. Prints the
+ * renames (and creates and deletes) per second of each phase, then checks
+ * every node is still there, once.
+ *
+ * Usage: bench-rename [-n ops] [-t threads] [-f files]
+ *        (default: 100000 operations per thread and phase, 4 threads,
+ *        1000 files of each kind per thread)
+ */
+#include "../fs/operations.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
+
+#define PHASES 4
+
+char *phase_names[PHASES] = {"file, same dir", "file, across dirs", "directory", "directory + creates"};
+
+int ops, threads, files;
+pthread_barrier_t barrier;
+long done[2][PHASES];
+
+/*
+ * Builds the path of a node of a subtree: /t<id> or /s (shared).
+ * Input:
+ *  - path: where to build it
+ *  - shared: whether in the shared subtree
+ *  - id: the thread, for a disjoint one
+ *  - dir: 'a', 'b' or 'c'
+ *  - kind, k: the node's name
+ */
+void node_path(char *path, int shared, long id, char dir, char kind, int k)
+{
+  if (shared)
+    snprintf(path, MAX_FILE_NAME, "/s/%c/%c%d", dir, kind, k);
+  else
+    snprintf(path, MAX_FILE_NAME, "/t%ld/%c/%c%d", id, dir, kind, k);
+}
+
+/*
+ * Renames a node to the other of two paths, whichever it is at.
+ * Returns: the renames tried
+ */
+int swap(char *path1, char *path2)
+{
+  if (move(path1, path2) == SUCCESS)
+    return 1;
+  move(path2, path1);
+  return 2;
+}
+
+/*
+ * Runs an operation of a phase.
+ * Returns: the operations it took
+ */
+int step(int phase, int shared, long id, unsigned int *seed, int i)
+{
+  char path1[MAX_FILE_NAME], path2[MAX_FILE_NAME];
+  int k = rand_r(seed) % (shared ? files * threads : files);
+
+  switch (phase)
+  {
+  case 0:
+    node_path(path1, shared, id, 'a', 'f', k);
+    node_path(path2, shared, id, 'a', 'g', k);
+    return swap(path1, path2);
+  case 1:
+    node_path(path1, shared, id, 'a', 'h', k);
+    node_path(path2, shared, id, 'b', 'h', k);
+    return swap(path1, path2);
+  default:
+    if (phase == 3 && id % 2 == 1)
+    {
+      /* names of their own, even when shared */
+      node_path(path1, shared, id, 'c', 'n', id * 64 + i % 64);
+      create(path1, T_FILE);
+      delete (path1);
+      return 2;
+    }
+    node_path(path1, shared, id, 'a', 'd', k);
+    node_path(path2, shared, id, 'b', 'd', k);
+    return swap(path1, path2);
+  }
+}
+
+/*
+ * Runs every phase, in its own subtree and then in the shared one.
+ */
+void *worker(void *arg)
+{
+  long id = (long)arg;
+  unsigned int seed = id + 1;
+  long count;
+
+  for (int shared = 0; shared < 2; shared++)
+    for (int phase = 0; phase < PHASES; phase++)
+    {
+      pthread_barrier_wait(&barrier);
+      count = 0;
+      for (int i = 0; i < ops; i++)
+        count += step(phase, shared, id, &seed, i);
+      __atomic_add_fetch(&done[shared][phase], count, __ATOMIC_RELAXED);
+      pthread_barrier_wait(&barrier);
+    }
+  return NULL;
+}
+
+/*
+ * Builds a subtree: its directories, f, h and d nodes in a, and a file in
+ * each d.
+ */
+void build(int shared, long id, int count)
+{
+  char path[MAX_FILE_NAME];
+
+  if (shared)
+    strcpy(path, "/s");
+  else
+    snprintf(path, sizeof(path), "/t%ld", id);
+  create(path, T_DIRECTORY);
+  for (char dir = 'a'; dir <= 'c'; dir++)
+  {
+    if (shared)
+      snprintf(path, sizeof(path), "/s/%c", dir);
+    else
+      snprintf(path, sizeof(path), "/t%ld/%c", id, dir);
+    create(path, T_DIRECTORY);
+  }
+  for (int k = 0; k < count; k++)
+  {
+    node_path(path, shared, id, 'a', 'f', k);
+    create(path, T_FILE);
+    node_path(path, shared, id, 'a', 'h', k);
+    create(path, T_FILE);
+    node_path(path, shared, id, 'a', 'd', k);
+    create(path, T_DIRECTORY);
+    strcat(path, "/inner");
+    create(path, T_FILE);
+  }
+}
+
+/*
+ * Counts the nodes of a subtree that are not where they should be: each
+ * one at exactly one of its two names.
+ */
+int check(int shared, long id, int count)
+{
+  char path1[MAX_FILE_NAME], path2[MAX_FILE_NAME];
+  char kinds[] = {'f', 'h', 'd'};
+  int wrong = 0;
+
+  for (int k = 0; k < count; k++)
+    for (int i = 0; i < 3; i++)
+    {
+      node_path(path1, shared, id, 'a', kinds[i], k);
+      node_path(path2, shared, id, kinds[i] == 'f' ? 'a' : 'b', kinds[i] == 'f' ? 'g' : kinds[i], k);
+      if (kinds[i] == 'd')
+      {
+        strcat(path1, "/inner");
+        strcat(path2, "/inner");
+      }
+      if ((lookup(path1) >= 0) + (lookup(path2) >= 0) != 1)
+        wrong++;
+    }
+  return wrong;
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t tid[256];
+  double start, elapsed[2][PHASES];
+  int opt, wrong = 0;
+
+  ops = 100000;
+  threads = 4;
+  files = 1000;
+  while ((opt = getopt(argc, argv, "n:t:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      ops = atoi(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'f':
+      files = atoi(optarg);
+      break;
+    default:
+      ops = 0; /* print usage */
+    }
+  }
+  if (ops <= 0 || threads <= 0 || threads > 256 || files <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-n ops] [-t threads] [-f files]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  init_fs(0);
+  for (long i = 0; i < threads; i++)
+    build(0, i, files);
+  build(1, 0, files * threads);
+
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for (long i = 0; i < threads; i++)
+    if (pthread_create(&tid[i], NULL, worker, (void *)i) != 0)
+      exit(EXIT_FAILURE);
+  for (int shared = 0; shared < 2; shared++)
+    for (int phase = 0; phase < PHASES; phase++)
+    {
+      pthread_barrier_wait(&barrier);
+      start = now_ns();
+      pthread_barrier_wait(&barrier);
+      elapsed[shared][phase] = (now_ns() - start) / 1e9;
+    }
+  for (int i = 0; i < threads; i++)
+    pthread_join(tid[i], NULL);
+  pthread_barrier_destroy(&barrier);
+
+  printf("%-20s %14s %14s\n", "ops/s", "disjoint", "shared");
+  for (int phase = 0; phase < PHASES; phase++)
+    printf("%-20s %14.0f %14.0f\n", phase_names[phase], done[0][phase] / elapsed[0][phase],
+           done[1][phase] / elapsed[1][phase]);
+
+  for (long i = 0; i < threads; i++)
+    wrong += check(0, i, files);
+  wrong += check(1, 0, files * threads);
+  if (wrong > 0)
+  {
+    fprintf(stderr, "%d nodes lost or duplicated\n", wrong);
+    exit(EXIT_FAILURE);
+  }
+  printf("all nodes in place\n");
+
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
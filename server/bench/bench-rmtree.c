@@ -0,0 +1,222 @@
+/*
+ * bench-rmtree: deleting a large job directory, /job/d<i>/f<k>, node by
+ * node bottom-up and with a single delete_tree. For delete_tree it prints
+ * how long the call took, while the subtree is detached, and how long the
+ * background reclaimer then took to delete every i-node. Meanwhile threads
+ * create, look up and delete files elsewhere; their rate and slowest
+ * operation are printed with the directory quiet, during the bottom-up
+ * delete and during the reclaim, which takes RECLAIM_DUTY percent of a CPU
+ * at most.
+ *
+ * Usage: bench-rmtree [-n files] [-f fanout] [-t threads] [-o ops]
+ *        (default: 1000000 files, 1000 per directory, 2 threads, 100000
+ *        create, lookup and delete rounds per thread and phase)
+ */
+#include "../fs/operations.h"
+#include "../fs/reclaim.h"
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <string.h>
+
+#define PHASES 3
+
+char *phase_names[PHASES] = {"quiet", "bottom-up delete", "delete_tree"};
+
+int files, fanout, threads, ops;
+pthread_barrier_t barrier;
+double rate[256][PHASES], slowest[256][PHASES];
+
+/*
+ * Builds the path of a file of the job directory.
+ */
+void job_path(char *path, int k) { snprintf(path, MAX_FILE_NAME, "/job/d%d/f%d", k / fanout, k); }
+
+/*
+ * Creates, looks up and deletes files of its own directory, in every phase.
+ */
+void *worker(void *arg)
+{
+  long id = (long)arg;
+  char path[MAX_FILE_NAME];
+  double begin, start, elapsed;
+
+  for (int phase = 0; phase < PHASES; phase++)
+  {
+    pthread_barrier_wait(&barrier);
+    begin = now_ns();
+    for (int i = 0; i < ops; i++)
+    {
+      snprintf(path, sizeof(path), "/w%ld/f%d", id, i % 64);
+      for (int op = 0; op < 3; op++)
+      {
+        start = now_ns();
+        if (op == 0)
+          create(path, T_FILE);
+        else if (op == 1)
+          lookup(path);
+        else
+          delete (path);
+        if ((elapsed = now_ns() - start) > slowest[id][phase])
+          slowest[id][phase] = elapsed;
+      }
+    }
+    rate[id][phase] = 3.0 * ops / (now_ns() - begin) * 1e9;
+    pthread_barrier_wait(&barrier);
+  }
+  return NULL;
+}
+
+/*
+ * Builds the job directory.
+ */
+void build()
+{
+  char path[MAX_FILE_NAME];
+
+  create("/job", T_DIRECTORY);
+  for (int k = 0; k < files; k++)
+  {
+    if (k % fanout == 0)
+    {
+      snprintf(path, sizeof(path), "/job/d%d", k / fanout);
+      create(path, T_DIRECTORY);
+    }
+    job_path(path, k);
+    if (create(path, T_FILE) != SUCCESS)
+    {
+      fprintf(stderr, "building %s failed\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/*
+ * Deletes the job directory one node at a time, as a client had to.
+ */
+void delete_bottom_up()
+{
+  char path[MAX_FILE_NAME];
+
+  for (int k = 0; k < files; k++)
+  {
+    job_path(path, k);
+    delete (path);
+    if (k % fanout == fanout - 1 || k == files - 1)
+    {
+      snprintf(path, sizeof(path), "/job/d%d", k / fanout);
+      delete (path);
+    }
+  }
+  delete ("/job");
+}
+
+/*
+ * Runs a phase of the workers, alongside a bottom-up delete in phase 1.
+ */
+void run_phase(int phase)
+{
+  pthread_barrier_wait(&barrier);
+  if (phase == 1)
+    delete_bottom_up();
+  pthread_barrier_wait(&barrier);
+}
+
+int main(int argc, char *argv[])
+{
+  pthread_t tid[256];
+  char path[MAX_FILE_NAME];
+  double start, detach, reclaim, total, worst;
+  long reclaimed;
+  int opt;
+
+  files = 1000000;
+  fanout = 1000;
+  threads = 2;
+  ops = 100000;
+  while ((opt = getopt(argc, argv, "n:f:t:o:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 'f':
+      fanout = atoi(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'o':
+      ops = atoi(optarg);
+      break;
+    default:
+      files = 0; /* print usage */
+    }
+  }
+  if (files <= 0 || fanout <= 0 || threads < 0 || threads > 256 || ops <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-n files] [-f fanout] [-t threads] [-o ops]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  init_fs(0);
+  for (int i = 0; i < threads; i++)
+  {
+    snprintf(path, sizeof(path), "/w%d", i);
+    create(path, T_DIRECTORY);
+  }
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for (long i = 0; i < threads; i++)
+    if (pthread_create(&tid[i], NULL, worker, (void *)i) != 0)
+      exit(EXIT_FAILURE);
+
+  run_phase(0);
+
+  build();
+  start = now_ns();
+  delete_bottom_up();
+  printf("bottom-up delete: %.3f s for %d files\n", (now_ns() - start) / 1e9, files);
+  /* again, alongside the workers */
+  build();
+  run_phase(1);
+
+  build();
+  reclaimed = reclaim_reclaimed();
+  start = now_ns();
+  if (delete_tree("/job") != SUCCESS || lookup("/job") >= 0)
+  {
+    fprintf(stderr, "delete_tree failed\n");
+    exit(EXIT_FAILURE);
+  }
+  detach = now_ns() - start;
+  run_phase(2);
+  reclaim_wait();
+  reclaim = (now_ns() - start) / 1e9;
+  printf("delete_tree: %.1f us, reclaimed %ld i-nodes in %.3f s\n", detach / 1e3,
+         reclaim_reclaimed() - reclaimed, reclaim);
+
+  for (int i = 0; i < threads; i++)
+    pthread_join(tid[i], NULL);
+  pthread_barrier_destroy(&barrier);
+
+  if (threads > 0)
+  {
+    printf("%-20s %14s %14s\n", "workers", "ops/s", "slowest us");
+    for (int phase = 0; phase < PHASES; phase++)
+    {
+      total = worst = 0;
+      for (int i = 0; i < threads; i++)
+      {
+        total += rate[i][phase];
+        if (slowest[i][phase] > worst)
+          worst = slowest[i][phase];
+      }
+      printf("%-20s %14.0f %14.1f\n", phase_names[phase], total, worst / 1e3);
+    }
+  }
+
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,155 @@
+/*
+ * bench-startup: restart time of a large namespace, rebuilt by replaying
+ * its whole write-ahead log and restored from a checkpoint (mapped, and
+ * built lazily as it is used). Builds files in directories of fanout
+ * each, durably logged; restarts from the log, takes a checkpoint, and
+ * restarts from it. Then prints the cost of the first lookups, which build
+ * the i-nodes they reach from the checkpoint.
+ *
+ * Usage: bench-startup [-n files] [-d fanout] [-f logdir]
+ *        (default: 1000000 files, 1000 per directory, /tmp/bench-startup)
+ */
+#include "../fs/checkpoint.h"
+#include "../fs/operations.h"
+#include "bench.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Random lookups timed after the restart */
+#define LOOKUPS 10000
+
+char *log_path = "/tmp/bench-startup";
+int files, fanout;
+
+/*
+ * Removes the log and checkpoint left by a run.
+ */
+void remove_log()
+{
+  DIR *dir = opendir(log_path);
+  struct dirent *entry;
+  char path[PATH_MAX];
+
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    snprintf(path, sizeof(path), "%s/%s", log_path, entry->d_name);
+    if (entry->d_name[0] != '.')
+      unlink(path);
+  }
+  closedir(dir);
+  rmdir(log_path);
+}
+
+/*
+ * Restarts: a new table, rebuilt from the log's directory.
+ * Returns: the time it took, in seconds
+ */
+double restart()
+{
+  double start;
+
+  destroy_fs();
+  init_fs(files + files / fanout + 1024);
+  start = now_ns();
+  if (recover_fs(log_path, 0, 0) == FAIL)
+  {
+    perror("bench-startup: can't recover");
+    exit(EXIT_FAILURE);
+  }
+  return (now_ns() - start) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  char path[MAX_FILE_NAME];
+  unsigned int seed = 1;
+  int opt, dirs;
+  double start, elapsed;
+  struct stat st;
+
+  files = 1000000;
+  fanout = 1000;
+  while ((opt = getopt(argc, argv, "n:d:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 'd':
+      fanout = atoi(optarg);
+      break;
+    case 'f':
+      log_path = optarg;
+      break;
+    default:
+      files = 0; /* print usage */
+    }
+  }
+  if (files <= 0 || fanout <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-n files] [-d fanout] [-f logdir]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  dirs = (files + fanout - 1) / fanout;
+
+  remove_log();
+  init_fs(files + dirs + 1024);
+  if (recover_fs(log_path, 0, 0) == FAIL)
+  {
+    perror("bench-startup: can't open log");
+    exit(EXIT_FAILURE);
+  }
+  start = now_ns();
+  for (int d = 0; d < dirs; d++)
+  {
+    snprintf(path, sizeof(path), "/d%d", d);
+    create(path, T_DIRECTORY);
+    for (int f = 0; f < fanout && d * fanout + f < files; f++)
+    {
+      snprintf(path, sizeof(path), "/d%d/f%d", d, f);
+      create(path, T_FILE);
+    }
+  }
+  elapsed = (now_ns() - start) / 1e9;
+  printf("built %d files in %d directories in %.2f s\n", files, dirs, elapsed);
+
+  printf("restart, replaying the log:   %10.3f ms\n", restart() * 1e3);
+
+  start = now_ns();
+  if (checkpoint_take() == FAIL)
+  {
+    perror("bench-startup: can't take a checkpoint");
+    exit(EXIT_FAILURE);
+  }
+  elapsed = (now_ns() - start) / 1e9;
+  snprintf(path, sizeof(path), "%s/%s", log_path, CHECKPOINT_NAME);
+  stat(path, &st);
+  printf("checkpoint: %.1f MiB in %.3f s\n", st.st_size / 1048576.0, elapsed);
+
+  printf("restart, from the checkpoint: %10.3f ms\n", restart() * 1e3);
+
+  start = now_ns();
+  for (int i = 0; i < LOOKUPS; i++)
+  {
+    int file = rand_r(&seed) % files;
+    snprintf(path, sizeof(path), "/d%d/f%d", file / fanout, file % fanout);
+    if (lookup(path) < 0)
+    {
+      fprintf(stderr, "lookup of %s failed after the restart\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  elapsed = now_ns() - start;
+  printf("first %d lookups: mean %.2f us\n", LOOKUPS, elapsed / LOOKUPS / 1e3);
+
+  destroy_fs();
+  remove_log();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,173 @@
+/*
+ * bench-wal: throughput of creates and deletes made durable by the
+ * write-ahead log, versus the group commit window. Every thread creates and
+ * deletes files in a directory of its own, waiting for each operation to
+ * be on disk (as a worker does before replying); prints the rate and mean
+ * latency without the log and with it, for each window.
+ *
+ * Usage: bench-wal [-s seconds] [-t threads] [-f logdir] [windows_us...]
+ *        (default: 2 seconds, 8 threads, /tmp/bench-wal,
+ *         windows 0 100 1000 10000)
+ */
+#include "../fs/operations.h"
+#include "../fs/wal.h"
+#include "bench.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+
+/* Files of a thread, created and then deleted in turn */
+#define FILES 64
+
+char *log_path = "/tmp/bench-wal";
+double seconds;
+int threads;
+volatile int running;
+pthread_barrier_t barrier;
+
+/*
+ * Removes the log left by a run.
+ */
+void remove_log()
+{
+  DIR *dir = opendir(log_path);
+  struct dirent *entry;
+  char path[PATH_MAX];
+
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    snprintf(path, sizeof(path), "%s/%s", log_path, entry->d_name);
+    if (entry->d_name[0] != '.')
+      unlink(path);
+  }
+  closedir(dir);
+  rmdir(log_path);
+}
+
+/*
+ * Creates and deletes files until stopped.
+ * Returns: number of operations done (cast to void*)
+ */
+void *worker(void *arg)
+{
+  long id = (long)arg, count = 0;
+  char path[MAX_FILE_NAME];
+
+  pthread_barrier_wait(&barrier);
+  while (running)
+  {
+    snprintf(path, sizeof(path), "/t%ld/f%ld", id, count / 2 % FILES);
+    if ((count % 2 == 0 ? create(path, T_FILE) : delete (path)) != SUCCESS)
+    {
+      fprintf(stderr, "operation on %s failed\n", path);
+      exit(EXIT_FAILURE);
+    }
+    wal_sync();
+    count++;
+  }
+  return (void *)count;
+}
+
+/*
+ * Runs the threads for the configured time, with a new log, and prints the
+ * throughput.
+ * Input:
+ *  - window: group commit window in microseconds, or -1 for no log
+ */
+void run(int window)
+{
+  pthread_t tid[threads];
+  long total = 0;
+  void *count;
+  char name[MAX_FILE_NAME];
+
+  remove_log();
+  if (window >= 0 && recover_fs(log_path, window, 0) == FAIL)
+  {
+    perror("bench-wal: can't open log");
+    exit(EXIT_FAILURE);
+  }
+
+  running = 1;
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for (long i = 0; i < threads; i++)
+    if (pthread_create(&tid[i], NULL, worker, (void *)i) != 0)
+      exit(EXIT_FAILURE);
+  pthread_barrier_wait(&barrier);
+  usleep(seconds * 1e6);
+  running = 0;
+  for (int i = 0; i < threads; i++)
+  {
+    pthread_join(tid[i], &count);
+    total += (long)count;
+    /* a thread stopped after a create leaves its file for the next run */
+    if ((long)count % 2 == 1)
+    {
+      snprintf(name, sizeof(name), "/t%d/f%ld", i, (long)count / 2 % FILES);
+      delete (name);
+    }
+  }
+  pthread_barrier_destroy(&barrier);
+  wal_close();
+  remove_log();
+
+  if (window < 0)
+    snprintf(name, sizeof(name), "no log");
+  else
+    snprintf(name, sizeof(name), "window %d us", window);
+  printf("%-16s %10.0f ops/s  mean %8.2f us\n", name, total / seconds, seconds * 1e6 * threads / total);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  char path[MAX_FILE_NAME];
+
+  seconds = 2;
+  threads = 8;
+  while ((opt = getopt(argc, argv, "s:t:f:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      seconds = atof(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'f':
+      log_path = optarg;
+      break;
+    default:
+      optind = argc + 1; /* print usage */
+    }
+  }
+  if (optind > argc || seconds <= 0 || threads <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-s seconds] [-t threads] [-f logdir] [windows_us...]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  init_fs(0);
+  for (int i = 0; i < threads; i++)
+  {
+    snprintf(path, sizeof(path), "/t%d", i);
+    create(path, T_DIRECTORY);
+  }
+
+  run(-1);
+  if (optind < argc)
+    for (int i = optind; i < argc; i++)
+      run(atoi(argv[i]));
+  else
+    for (int window = 0; window <= 10000; window = window ? window * 10 : 100)
+      run(window);
+
+  destroy_fs();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,48 @@
+/* bench.h - helpers shared by the tecnicofs benchmarks */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+static inline double now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Returns the CPU timestamp counter, or nanoseconds where there is none.
+ */
+static inline double cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+/*
+ * Returns the resident set size of the process in bytes (0 if unknown).
+ */
+static inline long resident_bytes()
+{
+  long pages = 0, resident = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+
+  if (fp == NULL)
+    return 0;
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(fp);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+#endif /* BENCH_H */
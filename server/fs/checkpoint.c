@@ -0,0 +1,282 @@
+#include "checkpoint.h"
+#include "reclaim.h"
+#include "state.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Checkpoints of the namespace, next to its write-ahead log (see wal.c):
+ * the i-node table written from a snapshot (see inode_table_checkpoint),
+ * while writers go on, so the log only has to be replayed from the segment
+ * started with the snapshot. A checkpoint is written aside and renamed
+ * over the previous one once on disk, so there is always a whole one.
+ * On restart it is mapped, not read: the table is built from it as it is
+ * used (see inode_table_restore).
+ */
+char checkpoint_dir[PATH_MAX - 32]; /* room for the files' names */
+int checkpoint_interval; /* seconds between checkpoints */
+
+/* The checkpoint restored from, mapped until the table is destroyed */
+char *checkpoint_map;
+size_t checkpoint_map_size;
+
+pthread_t checkpoint_thread;
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+int checkpoint_running, checkpoint_stopping;
+
+/*
+ * A checkpoint file being written, through a buffer
+ */
+typedef struct checkpointFile {
+  int fd;
+  int used;
+  char buffer[CHECKPOINT_BUFFER_SIZE];
+} CheckpointFile;
+
+/*
+ * Builds the path of a file of the log's directory.
+ */
+static void checkpoint_path(char *path, const char *name)
+{
+  snprintf(path, PATH_MAX, "%s/%s", checkpoint_dir, name);
+}
+
+/*
+ * Writes out a checkpoint file's buffer.
+ * Returns: SUCCESS or FAIL
+ */
+static int checkpoint_flush(CheckpointFile *file)
+{
+  ssize_t written;
+  int done = 0;
+
+  while (done < file->used)
+  {
+    if ((written = write(file->fd, file->buffer + done, file->used - done)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return FAIL;
+    }
+    done += written;
+  }
+  file->used = 0;
+  return SUCCESS;
+}
+
+/*
+ * Receives a chunk of the checkpoint (see inode_table_checkpoint).
+ */
+static int checkpoint_emit(const char *chunk, int size, void *arg)
+{
+  CheckpointFile *file = arg;
+
+  if (file->used + size > CHECKPOINT_BUFFER_SIZE && checkpoint_flush(file) == FAIL)
+    return FAIL;
+  memcpy(file->buffer + file->used, chunk, size);
+  file->used += size;
+  return SUCCESS;
+}
+
+/*
+ * The snapshot a checkpoint is written from, and the subtrees it has still
+ * to reclaim
+ */
+typedef struct checkpointSnapshot {
+  unsigned long snapshot;
+  uint32_t *detached;
+  uint32_t detached_count;
+} CheckpointSnapshot;
+
+/*
+ * Takes the checkpoint's snapshot, when its log segment starts (see
+ * wal_rotate).
+ */
+static void checkpoint_snapshot(void *arg)
+{
+  CheckpointSnapshot *snapshot = arg;
+
+  snapshot->snapshot = reclaim_snapshot(&snapshot->detached, &snapshot->detached_count);
+}
+
+/*
+ * Restores the namespace from the checkpoint in the log's directory, if
+ * there is one. Called after init_fs, before the log is replayed.
+ * Input:
+ *  - path: the log's directory
+ *  - segment: where to store the first log segment to replay after it, 0
+ *    if there is no checkpoint
+ * Returns: SUCCESS, or FAIL if the checkpoint could not be restored
+ */
+int checkpoint_restore(char *path, uint64_t *segment)
+{
+  char file_path[PATH_MAX];
+  struct stat st;
+  uint32_t *detached, detached_count;
+  int fd;
+
+  if (strlen(path) >= PATH_MAX - 32)
+    return FAIL;
+  strcpy(checkpoint_dir, path);
+  *segment = 0;
+  checkpoint_path(file_path, CHECKPOINT_NAME);
+  if ((fd = open(file_path, O_RDONLY | O_CLOEXEC)) < 0)
+    return errno == ENOENT ? SUCCESS : FAIL;
+  if (fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    close(fd);
+    return FAIL;
+  }
+  checkpoint_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (checkpoint_map == MAP_FAILED)
+  {
+    checkpoint_map = NULL;
+    return FAIL;
+  }
+  checkpoint_map_size = st.st_size;
+
+  if (inode_table_restore(checkpoint_map, checkpoint_map_size, segment, &detached, &detached_count) == FAIL)
+  {
+    checkpoint_unmap();
+    return FAIL;
+  }
+  /* their reclaiming starts over */
+  for (uint32_t i = 0; i < detached_count; i++)
+    reclaim_add(detached[i]);
+  return SUCCESS;
+}
+
+/*
+ * Takes a checkpoint now: starts a new log segment, with a snapshot, writes
+ * the table as it was for the snapshot, and removes the segments before.
+ * Returns: SUCCESS or FAIL (the previous checkpoint and the log are kept)
+ */
+int checkpoint_take()
+{
+  char temp_path[PATH_MAX], path[PATH_MAX];
+  CheckpointSnapshot snapshot;
+  uint64_t segment;
+  CheckpointFile *file;
+  int status = FAIL, dir_fd;
+
+  if ((file = malloc(sizeof(CheckpointFile))) == NULL)
+    return FAIL;
+  checkpoint_path(temp_path, CHECKPOINT_TEMP_NAME);
+  checkpoint_path(path, CHECKPOINT_NAME);
+  if ((file->fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+  {
+    free(file);
+    return FAIL;
+  }
+  file->used = 0;
+
+  if ((segment = wal_rotate(checkpoint_snapshot, &snapshot)) != 0)
+  {
+    status = inode_table_checkpoint(snapshot.snapshot, segment, snapshot.detached, snapshot.detached_count,
+                                    checkpoint_emit, file);
+    inode_snapshot_end(snapshot.snapshot);
+    free(snapshot.detached);
+    if (status == SUCCESS && (checkpoint_flush(file) == FAIL || fsync(file->fd) < 0))
+      status = FAIL;
+  }
+  close(file->fd);
+  free(file);
+
+  if (status == SUCCESS && rename(temp_path, path) == 0 &&
+      (dir_fd = open(checkpoint_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+  {
+    status = fsync(dir_fd) < 0 ? FAIL : SUCCESS;
+    close(dir_fd);
+    if (status == SUCCESS)
+      wal_remove_segments(segment);
+    return status;
+  }
+  unlink(temp_path);
+  return FAIL;
+}
+
+/*
+ * The checkpoint thread: takes one every interval, if anything was logged
+ * since the last, or sooner if much was.
+ */
+static void *checkpoint_loop(void *arg)
+{
+  struct timespec deadline;
+  time_t last = time(NULL);
+  unsigned long logged;
+
+  pthread_mutex_lock(&checkpoint_lock);
+  while (!checkpoint_stopping)
+  {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CHECKPOINT_POLL;
+    pthread_cond_timedwait(&checkpoint_cond, &checkpoint_lock, &deadline);
+    logged = wal_segment_size();
+    if (checkpoint_stopping || logged == 0 ||
+        (time(NULL) - last < checkpoint_interval && logged < CHECKPOINT_LOG_SIZE))
+      continue;
+
+    pthread_mutex_unlock(&checkpoint_lock);
+    if (checkpoint_take() == FAIL)
+      perror("checkpoint: write error");
+    last = time(NULL);
+    pthread_mutex_lock(&checkpoint_lock);
+  }
+  pthread_mutex_unlock(&checkpoint_lock);
+  return NULL;
+}
+
+/*
+ * Starts taking checkpoints in the background, once the log is open.
+ * Input:
+ *  - interval: seconds between checkpoints, 0 for none
+ */
+void checkpoint_start(int interval)
+{
+  if (interval <= 0 || checkpoint_running)
+    return;
+  checkpoint_interval = interval;
+  checkpoint_stopping = 0;
+  if (pthread_create(&checkpoint_thread, NULL, checkpoint_loop, NULL) != 0)
+    exit(EXIT_FAILURE);
+  checkpoint_running = 1;
+}
+
+/*
+ * Stops taking checkpoints, once the one being taken is done.
+ */
+void checkpoint_stop()
+{
+  if (!checkpoint_running)
+    return;
+  pthread_mutex_lock(&checkpoint_lock);
+  checkpoint_stopping = 1;
+  pthread_cond_signal(&checkpoint_cond);
+  pthread_mutex_unlock(&checkpoint_lock);
+  pthread_join(checkpoint_thread, NULL);
+  checkpoint_running = 0;
+}
+
+/*
+ * Unmaps the checkpoint restored from, once the table built from it is
+ * destroyed.
+ */
+void checkpoint_unmap()
+{
+  if (checkpoint_map == NULL)
+    return;
+  munmap(checkpoint_map, checkpoint_map_size);
+  checkpoint_map = NULL;
+  checkpoint_map_size = 0;
+}
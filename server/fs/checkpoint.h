@@ -0,0 +1,29 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+
+/* The checkpoint, in the log's directory, and where it is written first */
+#define CHECKPOINT_NAME "checkpoint"
+#define CHECKPOINT_TEMP_NAME "checkpoint.tmp"
+
+/* Seconds between checks for a checkpoint to take */
+#define CHECKPOINT_POLL 1
+
+/* A checkpoint is taken before its interval once this much was logged */
+#define CHECKPOINT_LOG_SIZE (64 << 20)
+
+/* Buffer checkpoints are written through */
+#define CHECKPOINT_BUFFER_SIZE (1 << 20)
+
+int checkpoint_restore(char *path, uint64_t *segment);
+
+int checkpoint_take();
+
+void checkpoint_start(int interval);
+
+void checkpoint_stop();
+
+void checkpoint_unmap();
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,99 @@
+#include "dcache.h"
+#include "dir.h"
+#include "state.h"
+
+#include <string.h>
+
+/*
+ * Path resolution cache.
+ * Maps full paths to i-numbers so hot paths are resolved with a single probe
+ * instead of a locked walk from the root. Slots are seqlocks: readers never
+ * write shared memory, and a writer that finds a slot busy just skips caching.
+ * Every move or delete bumps the global generation, which invalidates every
+ * entry at once; creates never invalidate, since only found paths are cached.
+ */
+DcacheEntry dcache[DCACHE_SIZE];
+unsigned long dcache_current_generation;
+
+/* When 0, every lookup misses (to measure path walks) */
+int dcache_enabled = 1;
+
+/*
+ * Empties the cache.
+ */
+void dcache_init()
+{
+  memset(dcache, 0, sizeof(dcache));
+  dcache_current_generation = 1;
+}
+
+/*
+ * Returns the current generation. Read it before resolving a path, and pass
+ * it to dcache_lookup/dcache_insert.
+ */
+unsigned long dcache_generation()
+{
+  return __atomic_load_n(&dcache_current_generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Looks for a path resolved during the given generation.
+ * Returns:
+ *  - inumber: the cached i-number
+ *  - FAIL: on a miss
+ */
+int dcache_lookup(char *path, unsigned long generation)
+{
+  unsigned int hash = dir_hash(path);
+  DcacheEntry *entry = &dcache[hash & (DCACHE_SIZE - 1)];
+  unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+  int inumber, match;
+
+  if ((seq & 1) || !dcache_enabled)
+    return FAIL;
+  match = entry->hash == hash && entry->generation == generation &&
+          strncmp(entry->path, path, MAX_FILE_NAME) == 0;
+  inumber = entry->inumber;
+
+  /* Discard what was read if a writer got in meanwhile */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (!match || __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+    return FAIL;
+  return inumber;
+}
+
+/*
+ * Caches a path resolved during the given generation. Does nothing if the
+ * generation is already stale or the slot is being written by another thread.
+ */
+void dcache_insert(char *path, int inumber, unsigned long generation)
+{
+  unsigned int hash = dir_hash(path);
+  DcacheEntry *entry = &dcache[hash & (DCACHE_SIZE - 1)];
+  unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+  if (!dcache_enabled || strlen(path) >= MAX_FILE_NAME ||
+      generation != dcache_generation())
+    return;
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  entry->hash = hash;
+  entry->generation = generation;
+  entry->inumber = inumber;
+  strcpy(entry->path, path);
+
+  __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Invalidates every cached path. Called by move and delete after changing
+ * the tree, while still holding the locks of the directories they changed.
+ */
+void dcache_invalidate()
+{
+  __atomic_fetch_add(&dcache_current_generation, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,33 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "../tecnicofs-api-constants.h"
+
+/* Number of cached paths (direct mapped), must be a power of two */
+#define DCACHE_SIZE 16384
+
+/*
+ * A cached path resolution. seq is odd while the slot is being written;
+ * the entry is only valid while generation matches dcache_generation().
+ */
+typedef struct dcacheEntry {
+  unsigned int seq;
+  unsigned int hash;
+  unsigned long generation;
+  int inumber;
+  char path[MAX_FILE_NAME]; /* longer paths are not cached */
+} DcacheEntry;
+
+extern int dcache_enabled;
+
+void dcache_init();
+
+unsigned long dcache_generation();
+
+int dcache_lookup(char *path, unsigned long generation);
+
+void dcache_insert(char *path, int inumber, unsigned long generation);
+
+void dcache_invalidate();
+
+#endif /* DCACHE_H */
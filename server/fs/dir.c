@@ -0,0 +1,601 @@
+#include "dir.h"
+#include "epoch.h"
+#include "slab.h"
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A name being searched for, hashed and padded once per operation
+ */
+typedef struct dirKey {
+  const char *name;
+  unsigned int hash;
+  int len;
+  DirName padded; /* inline form, valid if len <= DIR_INLINE_NAME */
+} DirKey;
+
+/* Memory directories restored from a checkpoint point into (see
+ * dir_map_images): never freed nor written to, a directory copies it the
+ * first time it is changed */
+const char *dir_images_start, *dir_images_end;
+
+/*
+ * Checks if a table or arena is in a checkpoint's images.
+ */
+static int dir_in_images(const void *ptr)
+{
+  return (const char *)ptr >= dir_images_start && (const char *)ptr < dir_images_end;
+}
+
+/* Bytes of a table and of an arena of the given capacity */
+#define DIR_TABLE_BYTES(capacity) (sizeof(DirTable) + sizeof(DirEntry) * (capacity))
+#define DIR_NAMES_BYTES(capacity) (sizeof(DirNames) + (capacity))
+
+/*
+ * Retires a table replaced or freed, unless it is in the images.
+ */
+static void dir_release_table(DirTable *table)
+{
+  if (!dir_in_images(table))
+    epoch_retire(table, DIR_TABLE_BYTES(table->capacity));
+}
+
+/*
+ * Retires an arena replaced or freed (or NULL), unless it is in the images.
+ */
+static void dir_release_names(DirNames *names)
+{
+  if (names != NULL && !dir_in_images(names))
+    epoch_retire(names, DIR_NAMES_BYTES(names->capacity));
+}
+
+/*
+ * Hashes an entry name (32 bit FNV-1a).
+ */
+unsigned int dir_hash(const char *name)
+{
+  unsigned int hash = 2166136261u;
+
+  for (; *name != '\0'; name++)
+  {
+    hash ^= (unsigned char)*name;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Prepares the key for name.
+ */
+static void dir_key(DirKey *key, const char *name)
+{
+  key->name = name;
+  key->hash = dir_hash(name);
+  key->len = strlen(name);
+  memset(&key->padded, 0, sizeof(DirName));
+  if (key->len <= DIR_INLINE_NAME)
+    memcpy(key->padded.inline_name, name, key->len);
+}
+
+/*
+ * Checks if an entry holds the key's name. Short names are compared as one
+ * 8 byte word; long names compare length first and only then the arena.
+ */
+static int dir_entry_matches(DirNames *names, DirEntry *entry, DirKey *key)
+{
+  unsigned int offset;
+
+  if (entry->hash != key->hash)
+    return 0;
+  if (key->len <= DIR_INLINE_NAME)
+    return memcmp(&entry->name, &key->padded, sizeof(DirName)) == 0;
+  offset = entry->name.arena.offset;
+  return entry->name.arena.zero == 0 && entry->name.arena.len == key->len &&
+         names != NULL && offset + key->len < names->capacity &&
+         memcmp(names->data + offset, key->name, key->len) == 0;
+}
+
+/*
+ * Copies an entry's name, NUL terminated, into name (MAX_FILE_NAME bytes).
+ */
+static void dir_entry_name(Dir *dir, DirEntry *entry, char *name)
+{
+  if (entry->name.arena.zero == 0)
+    strcpy(name, dir->names->data + entry->name.arena.offset);
+  else
+  {
+    memcpy(name, entry->name.inline_name, DIR_INLINE_NAME);
+    name[DIR_INLINE_NAME] = '\0';
+  }
+}
+
+/*
+ * Allocates an entries table with every slot free.
+ */
+static DirTable *dir_alloc_table(int capacity)
+{
+  DirTable *table = slab_alloc(DIR_TABLE_BYTES(capacity));
+
+  if (table == NULL)
+    return NULL;
+  table->capacity = capacity;
+  for (int i = 0; i < capacity; i++)
+    table->entries[i].inumber = FREE_INODE;
+  return table;
+}
+
+/*
+ * Finds the slot holding the key, or the free slot where it would be
+ * inserted. Gives up after a full turn, which only a reader racing with a
+ * writer can see.
+ * Returns: the slot or FAIL
+ */
+static int dir_find_slot(DirTable *table, DirNames *names, DirKey *key)
+{
+  int mask = table->capacity - 1;
+  int i = key->hash & mask;
+
+  for (int probes = 0; probes < table->capacity; probes++, i = (i + 1) & mask)
+  {
+    DirEntry *entry = &table->entries[i];
+    if (entry->inumber == FREE_INODE || dir_entry_matches(names, entry, key))
+      return i;
+  }
+  return FAIL;
+}
+
+/*
+ * Doubles the entries table, rehashing every entry from its stored hash.
+ * Returns: SUCCESS or FAIL
+ */
+static int dir_grow(Dir *dir)
+{
+  DirTable *old = dir->table;
+  DirTable *table = dir_alloc_table(old->capacity * 2);
+  int mask;
+
+  if (table == NULL)
+    return FAIL;
+  mask = table->capacity - 1;
+  for (int i = 0; i < old->capacity; i++)
+  {
+    if (old->entries[i].inumber != FREE_INODE)
+    {
+      int slot = old->entries[i].hash & mask;
+      while (table->entries[slot].inumber != FREE_INODE)
+        slot = (slot + 1) & mask;
+      table->entries[slot] = old->entries[i];
+    }
+  }
+  __atomic_store_n(&dir->table, table, __ATOMIC_RELEASE);
+  dir_release_table(old);
+  return SUCCESS;
+}
+
+/*
+ * Allocates an arena able to hold at least size bytes.
+ */
+static DirNames *dir_alloc_names(int size)
+{
+  int capacity = DIR_INITIAL_NAMES;
+  DirNames *names;
+
+  while (capacity < size)
+    capacity *= 2;
+  if ((names = slab_alloc(DIR_NAMES_BYTES(capacity))) == NULL)
+    return NULL;
+  names->capacity = capacity;
+  return names;
+}
+
+/*
+ * Rebuilds the names arena with only the names still in use.
+ * Returns: SUCCESS or FAIL
+ */
+static int dir_compact_names(Dir *dir)
+{
+  DirNames *old = dir->names;
+  DirNames *names = dir_alloc_names(dir->names_size - dir->names_garbage);
+  DirTable *table = dir->table;
+  int size = 0;
+
+  if (names == NULL)
+    return FAIL;
+  for (int i = 0; i < table->capacity; i++)
+  {
+    DirEntry *entry = &table->entries[i];
+    if (entry->inumber != FREE_INODE && entry->name.arena.zero == 0)
+    {
+      memcpy(names->data + size, old->data + entry->name.arena.offset,
+             entry->name.arena.len + 1);
+      entry->name.arena.offset = size;
+      size += entry->name.arena.len + 1;
+    }
+  }
+  __atomic_store_n(&dir->names, names, __ATOMIC_RELEASE);
+  dir_release_names(old);
+  dir->names_size = size;
+  dir->names_garbage = 0;
+  return SUCCESS;
+}
+
+/*
+ * Appends a long name to the arena.
+ * Returns: the name's offset or FAIL
+ */
+static int dir_add_name(Dir *dir, DirKey *key)
+{
+  int offset;
+
+  if (dir->names == NULL || dir->names_size + key->len + 1 > dir->names->capacity)
+  {
+    DirNames *names = dir_alloc_names(dir->names_size + key->len + 1);
+    DirNames *old = dir->names;
+
+    if (names == NULL)
+      return FAIL;
+    if (old != NULL)
+      memcpy(names->data, old->data, dir->names_size);
+    __atomic_store_n(&dir->names, names, __ATOMIC_RELEASE);
+    dir_release_names(old);
+  }
+  offset = dir->names_size;
+  memcpy(dir->names->data + offset, key->name, key->len + 1);
+  dir->names_size += key->len + 1;
+  return offset;
+}
+
+/*
+ * Copies the table and arena of a directory restored from a checkpoint out
+ * of the images, before it is first changed. Concurrent lookups go on
+ * with the images, which stay mapped.
+ * Returns: SUCCESS or FAIL
+ */
+static int dir_own(Dir *dir)
+{
+  size_t table_size = DIR_TABLE_BYTES(dir->table->capacity);
+  DirTable *table;
+  DirNames *names;
+
+  if (dir_in_images(dir->table))
+  {
+    if ((table = slab_alloc(table_size)) == NULL)
+      return FAIL;
+    memcpy(table, dir->table, table_size);
+    __atomic_store_n(&dir->table, table, __ATOMIC_RELEASE);
+  }
+  if (dir->names != NULL && dir_in_images(dir->names))
+  {
+    if ((names = slab_alloc(DIR_NAMES_BYTES(dir->names->capacity))) == NULL)
+      return FAIL;
+    memcpy(names, dir->names, DIR_NAMES_BYTES(dir->names->capacity));
+    __atomic_store_n(&dir->names, names, __ATOMIC_RELEASE);
+  }
+  return SUCCESS;
+}
+
+/*
+ * Creates an empty directory.
+ * Returns: the directory or NULL if out of memory
+ */
+Dir *dir_new()
+{
+  Dir *dir = slab_alloc(sizeof(Dir));
+
+  if (dir == NULL)
+    return NULL;
+  dir->table = dir_alloc_table(DIR_INITIAL_CAPACITY);
+  if (dir->table == NULL)
+  {
+    slab_free(dir, sizeof(Dir));
+    return NULL;
+  }
+  dir->count = 0;
+  /* The arena is only allocated for the first long name */
+  dir->names = NULL;
+  dir->names_size = 0;
+  dir->names_garbage = 0;
+  return dir;
+}
+
+/*
+ * Copies a directory, as it is: the copy is never changed by the original's
+ * modifications. The caller must keep the original from being modified
+ * meanwhile.
+ * Returns: the copy or NULL if out of memory
+ */
+Dir *dir_clone(Dir *dir)
+{
+  Dir *copy = slab_alloc(sizeof(Dir));
+  size_t table_size = DIR_TABLE_BYTES(dir->table->capacity);
+
+  if (copy == NULL)
+    return NULL;
+  *copy = *dir;
+  copy->names = NULL;
+  if ((copy->table = slab_alloc(table_size)) == NULL)
+  {
+    slab_free(copy, sizeof(Dir));
+    return NULL;
+  }
+  memcpy(copy->table, dir->table, table_size);
+  if (dir->names != NULL)
+  {
+    if ((copy->names = slab_alloc(DIR_NAMES_BYTES(dir->names->capacity))) == NULL)
+    {
+      slab_free(copy->table, table_size);
+      slab_free(copy, sizeof(Dir));
+      return NULL;
+    }
+    copy->names->capacity = dir->names->capacity;
+    memcpy(copy->names->data, dir->names->data, dir->names_size);
+  }
+  return copy;
+}
+
+/*
+ * Releases a directory, once no concurrent lookup can be using it.
+ */
+void dir_free(Dir *dir)
+{
+  if (dir == NULL)
+    return;
+  dir_release_table(dir->table);
+  dir_release_names(dir->names);
+  epoch_retire(dir, sizeof(Dir));
+}
+
+/*
+ * Looks for an entry by name.
+ * Returns:
+ *  - inumber: the entry's i-number
+ *  - FAIL: if there is no such entry
+ */
+int dir_lookup(Dir *dir, const char *name)
+{
+  DirKey key;
+  DirTable *table;
+  DirNames *names;
+  int slot;
+
+  if (dir == NULL)
+    return FAIL;
+  dir_key(&key, name);
+  table = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+  names = __atomic_load_n(&dir->names, __ATOMIC_ACQUIRE);
+  if ((slot = dir_find_slot(table, names, &key)) == FAIL)
+    return FAIL;
+  return table->entries[slot].inumber;
+}
+
+/*
+ * Adds an entry.
+ * Returns: SUCCESS or FAIL (name already present, too long or out of memory)
+ */
+int dir_insert(Dir *dir, const char *name, int inumber)
+{
+  DirKey key;
+  DirEntry *entry;
+  int offset;
+
+  dir_key(&key, name);
+  if (key.len == 0 || key.len >= MAX_FILE_NAME || dir_own(dir) == FAIL)
+    return FAIL;
+  if ((dir->count + 1) * 4 > dir->table->capacity * 3 && dir_grow(dir) == FAIL)
+    return FAIL;
+
+  entry = &dir->table->entries[dir_find_slot(dir->table, dir->names, &key)];
+  if (entry->inumber != FREE_INODE)
+    return FAIL;
+
+  if (key.len <= DIR_INLINE_NAME)
+    entry->name = key.padded;
+  else
+  {
+    if ((offset = dir_add_name(dir, &key)) == FAIL)
+      return FAIL;
+    entry->name.arena.zero = 0;
+    entry->name.arena.len = key.len;
+    entry->name.arena.unused = 0;
+    entry->name.arena.offset = offset;
+  }
+  entry->hash = key.hash;
+  entry->inumber = inumber;
+  dir->count++;
+  return SUCCESS;
+}
+
+/*
+ * Removes an entry. The following entries of the probe sequence are shifted
+ * back, so lookups never need tombstones.
+ * Returns:
+ *  - inumber: the removed entry's i-number
+ *  - FAIL: if there is no such entry
+ */
+int dir_remove(Dir *dir, const char *name)
+{
+  DirKey key;
+  DirEntry *entries;
+  int mask = dir->table->capacity - 1;
+  int hole, inumber;
+
+  dir_key(&key, name);
+  hole = dir_find_slot(dir->table, dir->names, &key);
+  if (dir->table->entries[hole].inumber == FREE_INODE || dir_own(dir) == FAIL)
+    return FAIL;
+  entries = dir->table->entries;
+  inumber = entries[hole].inumber;
+  if (key.len > DIR_INLINE_NAME)
+    dir->names_garbage += key.len + 1;
+
+  for (int i = (hole + 1) & mask; entries[i].inumber != FREE_INODE;
+       i = (i + 1) & mask)
+  {
+    /* An entry may fill the hole unless its home slot lies in (hole, i] */
+    int home = entries[i].hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask))
+    {
+      entries[hole] = entries[i];
+      hole = i;
+    }
+  }
+  entries[hole].inumber = FREE_INODE;
+  dir->count--;
+
+  /* A failed compaction only delays reclaiming the space */
+  if (dir->names_garbage > DIR_INITIAL_NAMES &&
+      dir->names_garbage * 2 > dir->names_size)
+    dir_compact_names(dir);
+  return inumber;
+}
+
+/*
+ * Returns the number of entries in the directory.
+ */
+int dir_count(Dir *dir) { return dir == NULL ? 0 : dir->count; }
+
+/*
+ * Iterates over the entries. Start with *pos = 0.
+ * Input:
+ *  - name: buffer of MAX_FILE_NAME bytes for the entry's name
+ * Returns: SUCCESS with name and inumber set, or FAIL when there are no more
+ */
+int dir_next(Dir *dir, int *pos, char *name, int *inumber)
+{
+  for (; *pos < dir->table->capacity; (*pos)++)
+  {
+    DirEntry *entry = &dir->table->entries[*pos];
+    if (entry->inumber != FREE_INODE)
+    {
+      dir_entry_name(dir, entry, name);
+      *inumber = entry->inumber;
+      (*pos)++;
+      return SUCCESS;
+    }
+  }
+  return FAIL;
+}
+
+/*
+ * Copies every entry: its name, NUL terminated, is appended to names and
+ * its i-number to inumbers. Like dir_lookup, it may run concurrently with
+ * modifications, inside an epoch critical section: it never reads out of
+ * bounds, but the copy is only meaningful if validated afterwards.
+ * Input:
+ *  - dir: the directory
+ *  - names: where to copy the names, size bytes
+ *  - inumbers: where to copy the i-numbers, max of them
+ * Returns: number of entries, or FAIL if they do not fit
+ */
+int dir_copy(Dir *dir, char *names, int size, int *inumbers, int max)
+{
+  DirTable *table = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+  DirNames *arena = __atomic_load_n(&dir->names, __ATOMIC_ACQUIRE);
+  DirEntry entry;
+  int count = 0, used = 0, len;
+
+  for (int i = 0; i < table->capacity; i++)
+  {
+    entry = table->entries[i];
+    if (entry.inumber == FREE_INODE)
+      continue;
+    if (count == max || used + MAX_FILE_NAME > size)
+      return FAIL;
+
+    if (entry.name.arena.zero != 0)
+    {
+      memcpy(names + used, entry.name.inline_name, DIR_INLINE_NAME);
+      names[used + DIR_INLINE_NAME] = '\0';
+      len = strlen(names + used);
+    }
+    else
+    {
+      len = entry.name.arena.len;
+      if (arena == NULL || len >= MAX_FILE_NAME || entry.name.arena.offset + len >= arena->capacity)
+        len = 0; /* changed meanwhile, the copy will not validate */
+      else
+        memcpy(names + used, arena->data + entry.name.arena.offset, len);
+      names[used + len] = '\0';
+    }
+    used += len + 1;
+    inumbers[count++] = entry.inumber;
+  }
+  return count;
+}
+
+/*
+ * Returns the memory used by the directory, in bytes.
+ */
+size_t dir_bytes(Dir *dir)
+{
+  return sizeof(Dir) + DIR_TABLE_BYTES(dir->table->capacity) +
+         (dir->names ? DIR_NAMES_BYTES(dir->names->capacity) : 0);
+}
+
+/*
+ * Copies a directory's image (see DirImage). Like dir_copy, it may run
+ * concurrently with modifications, inside an epoch critical section: the
+ * image is only meaningful if validated afterwards.
+ * Input:
+ *  - buffer: where to copy it, size bytes
+ *  - image: where to describe it
+ * Returns: size of the image, which was only copied if it fits
+ */
+long dir_image(Dir *dir, char *buffer, long size, DirImage *image)
+{
+  DirTable *table = __atomic_load_n(&dir->table, __ATOMIC_ACQUIRE);
+  DirNames *names = __atomic_load_n(&dir->names, __ATOMIC_ACQUIRE);
+  long table_size = DIR_TABLE_BYTES(table->capacity);
+  long names_size = names != NULL ? DIR_NAMES_BYTES(names->capacity) : 0;
+  long names_offset = (table_size + 15) & ~15L;
+
+  image->names = names != NULL ? names_offset : 0;
+  image->size = names_offset + names_size;
+  image->count = dir->count;
+  image->names_size = dir->names_size;
+  image->names_garbage = dir->names_garbage;
+  image->unused = 0;
+  if (image->size <= size)
+  {
+    memcpy(buffer, table, table_size);
+    memset(buffer + table_size, 0, names_offset - table_size);
+    if (names != NULL)
+      memcpy(buffer + names_offset, names, names_size);
+  }
+  return image->size;
+}
+
+/*
+ * Creates a directory from its image, without copying it: the image must
+ * be in the memory given to dir_map_images.
+ * Input:
+ *  - base: the image, 16 byte aligned
+ *  - image: its description
+ * Returns: the directory or NULL if out of memory
+ */
+Dir *dir_from_image(char *base, DirImage *image)
+{
+  Dir *dir = slab_alloc(sizeof(Dir));
+
+  if (dir == NULL)
+    return NULL;
+  dir->table = (DirTable *)base;
+  dir->count = image->count;
+  dir->names = image->names ? (DirNames *)(base + image->names) : NULL;
+  dir->names_size = image->names_size;
+  dir->names_garbage = image->names_garbage;
+  return dir;
+}
+
+/*
+ * Sets the memory holding the images of the directories restored from a
+ * checkpoint (its mapping), which they never free nor write to. Only one
+ * checkpoint is mapped at a time.
+ */
+void dir_map_images(const char *start, size_t size)
+{
+  dir_images_start = start;
+  dir_images_end = start + size;
+}
@@ -0,0 +1,120 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include "../tecnicofs-api-constants.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIR_INITIAL_CAPACITY 8
+#define DIR_INITIAL_NAMES 64
+
+/* Names up to this length are stored inside the entry itself */
+#define DIR_INLINE_NAME 8
+
+/*
+ * Where an entry's name lives: names up to DIR_INLINE_NAME bytes are stored
+ * inline, zero padded; longer ones are in the directory's name arena, marked
+ * by a zero first byte (names are never empty).
+ */
+typedef union dirName {
+  char inline_name[DIR_INLINE_NAME];
+  struct
+  {
+    unsigned char zero;
+    unsigned char len;
+    unsigned short unused;
+    unsigned int offset;
+  } arena;
+} DirName;
+
+/*
+ * Contains the hash of the entry's name, where the name is and respective
+ * i-number. 16 bytes, four entries per cache line.
+ */
+typedef struct dirEntry {
+  unsigned int hash;
+  int inumber; /* FREE_INODE if the slot is empty */
+  DirName name;
+} DirEntry;
+
+/*
+ * Hash table of entries. The capacity lives with the entries it describes,
+ * so a reader that loads the table pointer once always probes in bounds.
+ */
+typedef struct dirTable {
+  int capacity;
+  int unused[3]; /* keeps entries 16 byte aligned */
+  DirEntry entries[];
+} DirTable;
+
+/*
+ * Arena of long names, packed and NUL terminated
+ */
+typedef struct dirNames {
+  int capacity;
+  char data[];
+} DirNames;
+
+/*
+ * Directory contents: an open addressing (linear probing) hash table of
+ * entries, keyed by name. capacity is always a power of two and the table
+ * doubles whenever it gets more than 3/4 full. Long names are kept in the
+ * names arena; names_garbage counts the bytes of removed names, reclaimed
+ * when they reach half the arena.
+ * Modifications must be serialized by the caller. Lookups may run
+ * concurrently with them (inside an epoch critical section, see epoch.h):
+ * they always stay in bounds, but their result is only meaningful if
+ * validated afterwards (see inode_read_begin in state.h). Replaced tables
+ * and arenas are retired, never freed directly.
+ */
+typedef struct dir {
+  DirTable *table;
+  int count;
+  DirNames *names;
+  int names_size;
+  int names_garbage;
+} Dir;
+
+/*
+ * A directory's image, as stored in a checkpoint: its table followed by its
+ * names arena (16 byte aligned), copied as they are, since entries only
+ * hold offsets into the arena
+ */
+typedef struct dirImage {
+  uint32_t size;  /* of the image */
+  uint32_t names; /* offset of the arena in the image, 0 if none */
+  int32_t count;
+  int32_t names_size;
+  int32_t names_garbage;
+  int32_t unused;
+} DirImage;
+
+unsigned int dir_hash(const char *name);
+
+Dir *dir_new();
+
+Dir *dir_clone(Dir *dir);
+
+void dir_free(Dir *dir);
+
+int dir_lookup(Dir *dir, const char *name);
+
+int dir_insert(Dir *dir, const char *name, int inumber);
+
+int dir_remove(Dir *dir, const char *name);
+
+int dir_count(Dir *dir);
+
+int dir_next(Dir *dir, int *pos, char *name, int *inumber);
+
+int dir_copy(Dir *dir, char *names, int size, int *inumbers, int max);
+
+size_t dir_bytes(Dir *dir);
+
+long dir_image(Dir *dir, char *buffer, long size, DirImage *image);
+
+Dir *dir_from_image(char *base, DirImage *image);
+
+void dir_map_images(const char *start, size_t size);
+
+#endif /* DIR_H */
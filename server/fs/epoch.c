@@ -0,0 +1,238 @@
+#include "epoch.h"
+#include "slab.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/*
+ * A retired block, waiting for its epoch to become safe
+ */
+typedef struct epochGarbage {
+  struct epochGarbage *next;
+  void *ptr;
+  size_t size;
+  unsigned long epoch;
+} EpochGarbage;
+
+/*
+ * Per-thread state: the record readers publish their epoch in, and the
+ * blocks this thread retired (newest first)
+ */
+typedef struct epochThread {
+  EpochRecord *record;
+  EpochGarbage *garbage;
+  int garbage_count;
+  int collect_at; /* garbage_count that triggers the next collection */
+} EpochThread;
+
+unsigned long epoch_global = 1;
+
+/* Every thread's record, never freed (records of exited threads are reused) */
+EpochRecord *epoch_records;
+pthread_mutex_t epoch_records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Garbage left behind by exited threads */
+EpochGarbage *epoch_orphans;
+pthread_mutex_t epoch_orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_key_t epoch_key;
+pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+
+__thread EpochThread epoch_thread;
+
+/*
+ * Releases a thread's record and hands its garbage to the orphans list.
+ */
+static void epoch_thread_exit(void *arg)
+{
+  EpochThread *thread = arg;
+  EpochGarbage *last = thread->garbage;
+
+  if (last != NULL)
+  {
+    while (last->next != NULL)
+      last = last->next;
+    pthread_mutex_lock(&epoch_orphans_lock);
+    last->next = epoch_orphans;
+    epoch_orphans = thread->garbage;
+    pthread_mutex_unlock(&epoch_orphans_lock);
+  }
+  thread->garbage = NULL;
+  thread->garbage_count = 0;
+  thread->collect_at = 0;
+
+  /* nesting == -1 marks the record as free for the next thread */
+  __atomic_store_n(&thread->record->nesting, -1, __ATOMIC_RELEASE);
+  thread->record = NULL;
+}
+
+static void epoch_make_key() { pthread_key_create(&epoch_key, epoch_thread_exit); }
+
+/*
+ * Returns the calling thread's state, registering the thread on first use.
+ */
+static EpochThread *epoch_self()
+{
+  EpochRecord *record;
+  int expected = -1;
+
+  if (epoch_thread.record != NULL)
+    return &epoch_thread;
+
+  pthread_once(&epoch_key_once, epoch_make_key);
+  pthread_mutex_lock(&epoch_records_lock);
+  for (record = epoch_records; record != NULL; record = record->next)
+    if (__atomic_compare_exchange_n(&record->nesting, &expected, 0, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+    else
+      expected = -1;
+  if (record == NULL)
+  {
+    if ((record = malloc(sizeof(EpochRecord))) == NULL)
+      exit(EXIT_FAILURE);
+    record->epoch = 0;
+    record->nesting = 0;
+    record->next = epoch_records;
+    __atomic_store_n(&epoch_records, record, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&epoch_records_lock);
+
+  epoch_thread.record = record;
+  pthread_setspecific(epoch_key, &epoch_thread);
+  return &epoch_thread;
+}
+
+/*
+ * Enters a read-side critical section. Sections may be nested.
+ */
+void epoch_enter()
+{
+  EpochRecord *record = epoch_self()->record;
+
+  if (record->nesting++ == 0)
+  {
+    __atomic_store_n(&record->epoch, __atomic_load_n(&epoch_global, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    /* The epoch must be visible before any shared data is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+/*
+ * Leaves a read-side critical section.
+ */
+void epoch_exit()
+{
+  EpochRecord *record = epoch_thread.record;
+
+  if (--record->nesting == 0)
+    __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Advances the global epoch if every thread inside a critical section has
+ * already seen the current one.
+ * Returns: the global epoch
+ */
+static unsigned long epoch_try_advance()
+{
+  unsigned long global = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+  EpochRecord *record;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (record = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); record != NULL;
+       record = record->next)
+  {
+    unsigned long epoch = __atomic_load_n(&record->epoch, __ATOMIC_ACQUIRE);
+    if (epoch != 0 && epoch != global)
+      return global;
+  }
+  __atomic_compare_exchange_n(&epoch_global, &global, global + 1, 0,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Frees the blocks of a list retired at least two epochs before global.
+ * Returns: the remaining list
+ */
+static EpochGarbage *epoch_collect(EpochGarbage *list, unsigned long global,
+                                   int *count)
+{
+  EpochGarbage **link = &list;
+
+  while (*link != NULL)
+  {
+    EpochGarbage *garbage = *link;
+    if (garbage->epoch + 2 <= global)
+    {
+      *link = garbage->next;
+      slab_free(garbage->ptr, garbage->size);
+      slab_free(garbage, sizeof(EpochGarbage));
+      if (count != NULL)
+        (*count)--;
+    }
+    else
+      link = &garbage->next;
+  }
+  return list;
+}
+
+/*
+ * Frees ptr, from slab_alloc, once no lock-free reader can be using it
+ * anymore.
+ * Input:
+ *  - ptr: the block, or NULL
+ *  - size: the size it was allocated with
+ */
+void epoch_retire(void *ptr, size_t size)
+{
+  EpochThread *thread;
+  EpochGarbage *garbage;
+  unsigned long global;
+
+  if (ptr == NULL)
+    return;
+  thread = epoch_self();
+  if ((garbage = slab_alloc(sizeof(EpochGarbage))) == NULL)
+    exit(EXIT_FAILURE);
+  garbage->ptr = ptr;
+  garbage->size = size;
+  garbage->epoch = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE);
+  garbage->next = thread->garbage;
+  thread->garbage = garbage;
+
+  if (++thread->garbage_count < thread->collect_at)
+    return;
+
+  global = epoch_try_advance();
+  thread->garbage = epoch_collect(thread->garbage, global, &thread->garbage_count);
+  thread->collect_at = thread->garbage_count + EPOCH_RETIRE_THRESHOLD;
+
+  if (__atomic_load_n(&epoch_orphans, __ATOMIC_RELAXED) != NULL &&
+      pthread_mutex_trylock(&epoch_orphans_lock) == 0)
+  {
+    epoch_orphans = epoch_collect(epoch_orphans, global, NULL);
+    pthread_mutex_unlock(&epoch_orphans_lock);
+  }
+}
+
+/*
+ * Waits until every critical section in progress has ended; those entered
+ * meanwhile are not waited for. Must not be called inside a section.
+ */
+void epoch_synchronize()
+{
+  unsigned long global = __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE), now;
+  unsigned long target = global + 2;
+
+  /* a section in progress holds back the second advance until it ends */
+  while ((now = epoch_try_advance()) < target)
+  {
+    if (now == global)
+      sched_yield();
+    global = now;
+  }
+}
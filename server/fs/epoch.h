@@ -0,0 +1,31 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stddef.h>
+
+/* Retired blocks a thread accumulates before trying to free some */
+#define EPOCH_RETIRE_THRESHOLD 64
+
+/*
+ * Epoch based reclamation.
+ * Lock-free readers bracket their accesses with epoch_enter/epoch_exit;
+ * writers hand memory that readers may still be using to epoch_retire
+ * instead of freeing it, and it is freed (with slab_free, see slab.h) once
+ * every thread inside a critical section at the time has left it (two
+ * epoch advances later).
+ */
+typedef struct epochRecord {
+  struct epochRecord *next;
+  unsigned long epoch; /* global epoch seen on entry, 0 when outside */
+  int nesting;
+} EpochRecord;
+
+void epoch_enter();
+
+void epoch_exit();
+
+void epoch_retire(void *ptr, size_t size);
+
+void epoch_synchronize();
+
+#endif /* EPOCH_H */
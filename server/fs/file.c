@@ -0,0 +1,164 @@
+#include "file.h"
+#include "slab.h"
+#include "state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Creates an empty file. Its block table is only allocated when it is
+ * first written.
+ * Returns: the file or NULL if out of memory
+ */
+File *file_new()
+{
+  File *file = slab_alloc(sizeof(File));
+
+  if (file == NULL)
+    return NULL;
+  file->size = 0;
+  file->capacity = 0;
+  file->blocks = NULL;
+  return file;
+}
+
+/*
+ * Releases a file and its blocks.
+ */
+void file_free(File *file)
+{
+  if (file == NULL)
+    return;
+  for (int i = 0; i < file->capacity; i++)
+    slab_free(file->blocks[i], FILE_BLOCK_SIZE);
+  slab_free(file->blocks, file->capacity * sizeof(char *));
+  slab_free(file, sizeof(File));
+}
+
+/*
+ * Returns the size of the file, in bytes.
+ */
+long file_size(File *file) { return file == NULL ? 0 : file->size; }
+
+/*
+ * Makes room in the block table for count blocks, doubling it as needed.
+ * Returns: SUCCESS or FAIL
+ */
+static int file_reserve(File *file, int count)
+{
+  int capacity = file->capacity ? file->capacity : FILE_INITIAL_BLOCKS;
+  char **blocks;
+
+  if (count <= file->capacity)
+    return SUCCESS;
+  while (capacity < count)
+    capacity *= 2;
+  if ((blocks = slab_alloc(capacity * sizeof(char *))) == NULL)
+    return FAIL;
+  if (file->blocks != NULL)
+    memcpy(blocks, file->blocks, file->capacity * sizeof(char *));
+  memset(blocks + file->capacity, 0, (capacity - file->capacity) * sizeof(char *));
+  slab_free(file->blocks, file->capacity * sizeof(char *));
+  file->blocks = blocks;
+  file->capacity = capacity;
+  return SUCCESS;
+}
+
+/*
+ * Writes data at an offset, growing the file if it ends past its end. A
+ * block only partly written for the first time has the rest zeroed.
+ * Input:
+ *  - file: the file
+ *  - data: the data
+ *  - size: its size
+ *  - offset: where to write it, possibly past the end (leaving a hole)
+ * Returns: size, the bytes written before running out of memory, or FAIL
+ *  if the file would grow past FILE_MAX_SIZE (or nothing could be written)
+ */
+int file_write(File *file, const char *data, int size, long offset)
+{
+  long end = offset + size, position;
+  int done = 0, index, within, length;
+
+  if (offset < 0 || size < 0 || end > FILE_MAX_SIZE ||
+      file_reserve(file, (end + FILE_BLOCK_SIZE - 1) >> FILE_BLOCK_BITS) == FAIL)
+    return FAIL;
+
+  while (done < size)
+  {
+    position = offset + done;
+    index = position >> FILE_BLOCK_BITS;
+    within = position & (FILE_BLOCK_SIZE - 1);
+    length = FILE_BLOCK_SIZE - within < size - done ? FILE_BLOCK_SIZE - within : size - done;
+    if (file->blocks[index] == NULL)
+    {
+      if ((file->blocks[index] = slab_alloc(FILE_BLOCK_SIZE)) == NULL)
+        break;
+      if (length != FILE_BLOCK_SIZE)
+        memset(file->blocks[index], 0, FILE_BLOCK_SIZE);
+    }
+    memcpy(file->blocks[index] + within, data + done, length);
+    done += length;
+  }
+
+  if (offset + done > file->size)
+    file->size = offset + done;
+  return done > 0 || size == 0 ? done : FAIL;
+}
+
+/*
+ * Reads up to size bytes from an offset; holes read as zeros.
+ * Returns: the bytes read, 0 at or past the end of the file
+ */
+int file_read(File *file, char *data, int size, long offset)
+{
+  long position;
+  int done = 0, index, within, length;
+
+  if (file == NULL || offset < 0 || offset >= file->size || size <= 0)
+    return 0;
+  if (size > file->size - offset)
+    size = file->size - offset;
+
+  while (done < size)
+  {
+    position = offset + done;
+    index = position >> FILE_BLOCK_BITS;
+    within = position & (FILE_BLOCK_SIZE - 1);
+    length = FILE_BLOCK_SIZE - within < size - done ? FILE_BLOCK_SIZE - within : size - done;
+    if (index < file->capacity && file->blocks[index] != NULL)
+      memcpy(data + done, file->blocks[index] + within, length);
+    else
+      memset(data + done, 0, length);
+    done += length;
+  }
+  return done;
+}
+
+/*
+ * Sets the size of the file. Shrinking frees the blocks past the new end
+ * and zeroes the rest of the last one, so that growing it again reads
+ * zeros; growing leaves a hole.
+ * Returns: SUCCESS or FAIL
+ */
+int file_truncate(File *file, long size)
+{
+  int first, within;
+
+  if (size < 0 || size > FILE_MAX_SIZE)
+    return FAIL;
+  if (size < file->size)
+  {
+    first = (size + FILE_BLOCK_SIZE - 1) >> FILE_BLOCK_BITS;
+    for (int i = first; i < file->capacity; i++)
+    {
+      slab_free(file->blocks[i], FILE_BLOCK_SIZE);
+      file->blocks[i] = NULL;
+    }
+    within = size & (FILE_BLOCK_SIZE - 1);
+    if (within != 0 && first - 1 < file->capacity && file->blocks[first - 1] != NULL)
+      memset(file->blocks[first - 1] + within, 0, FILE_BLOCK_SIZE - within);
+  }
+  file->size = size;
+  return SUCCESS;
+}
@@ -0,0 +1,42 @@
+#ifndef FILE_H
+#define FILE_H
+
+/* Files are stored in blocks of this size */
+#define FILE_BLOCK_BITS 12
+#define FILE_BLOCK_SIZE (1 << FILE_BLOCK_BITS)
+
+/* Largest file size, so that sizes and offsets fit the protocol's results */
+#define FILE_MAX_SIZE (1L << 30)
+
+#define FILE_INITIAL_BLOCKS 4
+
+/* Offset of a write that appends, see write_file */
+#define FILE_APPEND -1
+
+/*
+ * File contents: a table of fixed size blocks. A block is allocated when
+ * it is first written; those never written (holes, left by writes past the
+ * end or by truncates that grow the file) read as zeros. Appending only
+ * allocates new blocks: the data never moves, and the table of block
+ * pointers doubles when it is full.
+ * Accesses must be serialized by the caller (the i-node's lock).
+ */
+typedef struct file {
+  long size;
+  int capacity; /* entries in blocks */
+  char **blocks;
+} File;
+
+File *file_new();
+
+void file_free(File *file);
+
+long file_size(File *file);
+
+int file_write(File *file, const char *data, int size, long offset);
+
+int file_read(File *file, char *data, int size, long offset);
+
+int file_truncate(File *file, long size);
+
+#endif /* FILE_H */
@@ -0,0 +1,156 @@
+#include "inject.h"
+#include "state.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *inject_names[INJECT_POINTS] = {
+    "inode_create",    "inode_delete",    "inode_get",
+    "dir_add_entry",   "dir_reset_entry", "dir_remove_entry"};
+
+InjectRule inject_rules[INJECT_POINTS];
+
+/* Per-thread random state, seeded lazily */
+static __thread unsigned int inject_seed;
+
+static double inject_random()
+{
+  if (inject_seed == 0)
+    inject_seed = (unsigned int)(unsigned long)&inject_seed ^ time(NULL);
+  return (rand_r(&inject_seed) + 1.0) / (RAND_MAX + 2.0); /* in (0, 1) */
+}
+
+static long inject_now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Parses a single rule, "dist[/fail=p]" without the point name.
+ * Returns: SUCCESS or FAIL
+ */
+static int inject_parse_rule(char *text, InjectRule *rule)
+{
+  char *fail = strstr(text, "/fail=");
+
+  memset(rule, 0, sizeof(*rule));
+  if (fail)
+  {
+    *fail = '\0';
+    rule->fail = atof(fail + strlen("/fail="));
+    if (rule->fail < 0 || rule->fail > 1)
+      return FAIL;
+  }
+
+  if (strcmp(text, "none") == 0 || text[0] == '\0')
+    rule->dist = INJECT_NONE;
+  else if (sscanf(text, "fixed:%lf", &rule->a) == 1)
+    rule->dist = INJECT_FIXED;
+  else if (sscanf(text, "uniform:%lf:%lf", &rule->a, &rule->b) == 2 &&
+           rule->a <= rule->b)
+    rule->dist = INJECT_UNIFORM;
+  else if (sscanf(text, "exp:%lf", &rule->a) == 1)
+    rule->dist = INJECT_EXP;
+  else
+    return FAIL;
+  return rule->a < 0 ? FAIL : SUCCESS;
+}
+
+/*
+ * Configures injection from a spec of semicolon separated rules
+ * "point=dist[/fail=p]", where point is an operation name (e.g.
+ * inode_create) or "all", and dist is one of
+ *  none | fixed:NS | uniform:MIN:MAX | exp:MEAN   (nanoseconds).
+ * The optional fail=p makes the operation fail with probability p; it is
+ * only honoured by inode_create and dir_reset_entry, the operations whose
+ * failure leaves the file system unchanged.
+ * e.g. "all=fixed:10000;inode_create=exp:50000/fail=0.01"
+ * Input:
+ *  - spec: the spec, or NULL to read it from INJECT_ENV
+ * Returns: SUCCESS or FAIL (malformed spec, nothing is injected)
+ */
+int inject_init(const char *spec)
+{
+  char *copy, *rule, *save, *value;
+  InjectRule parsed;
+  int point, matched;
+
+  memset(inject_rules, 0, sizeof(inject_rules));
+  if (spec == NULL && (spec = getenv(INJECT_ENV)) == NULL)
+    return SUCCESS;
+
+  copy = strdup(spec);
+  for (rule = strtok_r(copy, ";", &save); rule != NULL;
+       rule = strtok_r(NULL, ";", &save))
+  {
+    if ((value = strchr(rule, '=')) == NULL)
+      goto malformed;
+    *value++ = '\0';
+    if (inject_parse_rule(value, &parsed) == FAIL)
+      goto malformed;
+
+    matched = 0;
+    for (point = 0; point < INJECT_POINTS; point++)
+    {
+      if (strcmp(rule, "all") == 0 || strcmp(rule, inject_names[point]) == 0)
+      {
+        inject_rules[point] = parsed;
+        matched = 1;
+      }
+    }
+    if (!matched)
+      goto malformed;
+  }
+  free(copy);
+  return SUCCESS;
+
+malformed:
+  fprintf(stderr, "inject: malformed rule '%s'\n", rule);
+  free(copy);
+  memset(inject_rules, 0, sizeof(inject_rules));
+  return FAIL;
+}
+
+/*
+ * Injects the configured latency at a point, busy waiting (callers usually
+ * hold i-node locks, as a slow operation would).
+ * Input:
+ *  - point: the operation being injected
+ * Returns: 1 if the operation should fail, 0 otherwise
+ */
+int inject(InjectPoint point)
+{
+  InjectRule *rule = &inject_rules[point];
+  double delay = 0;
+  long until;
+
+  switch (rule->dist)
+  {
+  case INJECT_FIXED:
+    delay = rule->a;
+    break;
+  case INJECT_UNIFORM:
+    delay = rule->a + (rule->b - rule->a) * inject_random();
+    break;
+  case INJECT_EXP:
+    delay = -rule->a * log(inject_random());
+    break;
+  case INJECT_NONE:
+    break;
+  }
+
+  if (delay > 0)
+  {
+    until = inject_now_ns() + (long)delay;
+    while (inject_now_ns() < until)
+    {
+    }
+  }
+  return rule->fail > 0 && inject_random() < rule->fail;
+}
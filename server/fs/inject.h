@@ -0,0 +1,50 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+/* Environment variable holding the injection spec (see inject_init) */
+#define INJECT_ENV "TECNICOFS_INJECT"
+
+/*
+ * Points where latency or faults can be injected, one per i-node operation
+ */
+typedef enum injectPoint {
+  INJECT_INODE_CREATE,
+  INJECT_INODE_DELETE,
+  INJECT_INODE_GET,
+  INJECT_DIR_ADD_ENTRY,
+  INJECT_DIR_RESET_ENTRY,
+  INJECT_DIR_REMOVE_ENTRY,
+  INJECT_POINTS
+} InjectPoint;
+
+typedef enum injectDist {
+  INJECT_NONE,
+  INJECT_FIXED,   /* always a ns */
+  INJECT_UNIFORM, /* uniform in [a, b] ns */
+  INJECT_EXP      /* exponential with mean a ns */
+} InjectDist;
+
+typedef struct injectRule {
+  InjectDist dist;
+  double a, b;
+  double fail; /* probability of failing the operation */
+} InjectRule;
+
+/*
+ * Injection is only compiled in when building with INJECT=1 (which defines
+ * TECNICOFS_INJECT), for stress testing; otherwise INJECT is a constant 0
+ * and the hot paths carry no trace of it.
+ * INJECT(point) delays the caller according to the point's rule and
+ * evaluates to 1 when the operation should fail.
+ */
+#ifdef TECNICOFS_INJECT
+#define INJECT(point) inject(point)
+#else
+#define INJECT(point) 0
+#endif
+
+int inject_init(const char *spec);
+
+int inject(InjectPoint point);
+
+#endif /* INJECT_H */
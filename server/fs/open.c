@@ -0,0 +1,157 @@
+#include "open.h"
+#include "state.h"
+#include <string.h>
+
+/*
+ * Open file table.
+ * A handle names a slot of the table and how many times the slot had been
+ * taken when it was opened, so a handle closed (and its slot taken again)
+ * is never mistaken for the new one, and a handle is only good for the
+ * owner that opened it, so no client can guess another's. Each slot has a
+ * mutex of its own,
+ * held while the open file is used: requests through one handle are
+ * serialized, and its offset needs no other lock. Only opening and closing
+ * take the table's lock, for its free list.
+ */
+OpenFile open_table[OPEN_TABLE_SIZE];
+int open_table_free;
+pthread_mutex_t open_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Files open by the owners of each bucket (see open_owner_bucket), atomic */
+int open_owner_files[1 << OPEN_OWNER_BITS];
+
+/*
+ * Returns the bucket of an owner.
+ */
+static int open_owner_bucket(unsigned long owner)
+{
+  return (owner * 0x9e3779b97f4a7c15UL) >> (64 - OPEN_OWNER_BITS);
+}
+
+/*
+ * Empties the table.
+ */
+void open_table_init()
+{
+  for (int i = 0; i < OPEN_TABLE_SIZE; i++)
+  {
+    if (pthread_mutex_init(&open_table[i].lock, NULL) != 0)
+      exit(EXIT_FAILURE);
+    open_table[i].handle = 0;
+    open_table[i].reuse = 0;
+    open_table[i].next_free = i + 1 < OPEN_TABLE_SIZE ? i + 1 : FAIL;
+  }
+  open_table_free = 0;
+  memset(open_owner_files, 0, sizeof(open_owner_files));
+}
+
+/*
+ * Releases the table's locks; the files still open are dropped.
+ */
+void open_table_destroy()
+{
+  for (int i = 0; i < OPEN_TABLE_SIZE; i++)
+    pthread_mutex_destroy(&open_table[i].lock);
+}
+
+/*
+ * Opens a file.
+ * Input:
+ *  - inumber: the file's i-node
+ *  - generation: its generation, read under its lock
+ *  - mode: READ, WRITE or RW
+ *  - owner: the client opening it
+ * Returns: the handle (> 0), or FAIL if too many files are open
+ */
+int open_table_add(int inumber, unsigned int generation, permission mode, unsigned long owner)
+{
+  OpenFile *file;
+  int index, handle;
+
+  pthread_mutex_lock(&open_table_lock);
+  if ((index = open_table_free) == FAIL)
+  {
+    pthread_mutex_unlock(&open_table_lock);
+    return FAIL;
+  }
+  open_table_free = open_table[index].next_free;
+  pthread_mutex_unlock(&open_table_lock);
+
+  file = &open_table[index];
+  pthread_mutex_lock(&file->lock);
+  file->reuse = file->reuse == OPEN_REUSE_MAX ? 1 : file->reuse + 1;
+  file->handle = handle = file->reuse << OPEN_TABLE_BITS | index;
+  file->inumber = inumber;
+  file->generation = generation;
+  file->mode = mode;
+  file->offset = 0;
+  file->owner = owner;
+  pthread_mutex_unlock(&file->lock);
+  __atomic_add_fetch(&open_owner_files[open_owner_bucket(owner)], 1, __ATOMIC_RELAXED);
+  return handle;
+}
+
+/*
+ * Takes an open file, to be given back with open_table_put.
+ * Returns: the open file, locked, or NULL if the handle is not open (by
+ *  that owner)
+ */
+OpenFile *open_table_get(int handle, unsigned long owner)
+{
+  OpenFile *file = &open_table[handle & (OPEN_TABLE_SIZE - 1)];
+
+  if (handle <= 0)
+    return NULL;
+  pthread_mutex_lock(&file->lock);
+  if (file->handle != handle || file->owner != owner)
+  {
+    pthread_mutex_unlock(&file->lock);
+    return NULL;
+  }
+  return file;
+}
+
+/*
+ * Gives back an open file taken with open_table_get.
+ */
+void open_table_put(OpenFile *file) { pthread_mutex_unlock(&file->lock); }
+
+/*
+ * Closes a file, once no request is using it.
+ * Returns: SUCCESS, or FAIL if the handle is not open (by that owner)
+ */
+int open_table_remove(int handle, unsigned long owner)
+{
+  OpenFile *file = open_table_get(handle, owner);
+  int index = handle & (OPEN_TABLE_SIZE - 1);
+
+  if (file == NULL)
+    return FAIL;
+  file->handle = 0;
+  open_table_put(file);
+  __atomic_sub_fetch(&open_owner_files[open_owner_bucket(owner)], 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&open_table_lock);
+  file->next_free = open_table_free;
+  open_table_free = index;
+  pthread_mutex_unlock(&open_table_lock);
+  return SUCCESS;
+}
+
+/*
+ * Closes every file an owner left open, once it is gone: none, unless its
+ * bucket has some. The table's handles are only looked at without their
+ * lock, to skip the others' files: it opens no more files meanwhile.
+ */
+void open_table_remove_owner(unsigned long owner)
+{
+  int handle;
+
+  if (__atomic_load_n(&open_owner_files[open_owner_bucket(owner)], __ATOMIC_RELAXED) == 0)
+    return;
+
+  for (int i = 0; i < OPEN_TABLE_SIZE; i++)
+    if ((handle = __atomic_load_n(&open_table[i].handle, __ATOMIC_RELAXED)) != 0 &&
+        __atomic_load_n(&open_table[i].owner, __ATOMIC_RELAXED) == owner)
+      open_table_remove(handle, owner);
+}
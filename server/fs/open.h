@@ -0,0 +1,50 @@
+#ifndef OPEN_H
+#define OPEN_H
+
+#include "../tecnicofs-api-constants.h"
+#include <pthread.h>
+
+/* Most files open at once, over all clients */
+#define OPEN_TABLE_BITS 16
+#define OPEN_TABLE_SIZE (1 << OPEN_TABLE_BITS)
+
+/* Times a slot of the table is reused before its handles repeat */
+#define OPEN_REUSE_MAX 0x7fff
+
+/* Buckets owners are counted in, for the owners with no file open to be
+ * told apart without scanning the table */
+#define OPEN_OWNER_BITS 12
+
+/*
+ * An open file: a file i-node, bound when it was opened, and the offset
+ * its reads and writes start at. The i-node is only valid while it has
+ * the generation it had then (see inode_generation). Only the client that
+ * opened it, its owner, may use it.
+ */
+typedef struct openFile {
+  pthread_mutex_t lock; /* held while it is used (open_table_get) */
+  int handle;           /* 0 while the slot is free */
+  int inumber;
+  unsigned int generation;
+  permission mode;
+  long offset;
+  unsigned long owner;
+  unsigned int reuse; /* times the slot was taken, in its handles */
+  int next_free;
+} OpenFile;
+
+void open_table_init();
+
+void open_table_destroy();
+
+int open_table_add(int inumber, unsigned int generation, permission mode, unsigned long owner);
+
+OpenFile *open_table_get(int handle, unsigned long owner);
+
+void open_table_put(OpenFile *file);
+
+int open_table_remove(int handle, unsigned long owner);
+
+void open_table_remove_owner(unsigned long owner);
+
+#endif /* OPEN_H */
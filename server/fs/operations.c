@@ -1,9 +1,23 @@
 #include "operations.h"
+#include "checkpoint.h"
+#include "dcache.h"
+#include "epoch.h"
+#include "inject.h"
+#include "open.h"
+#include "reclaim.h"
+#include "wal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Directory moves, one at a time: rename_seq is odd while one is made, and
+ * bumped twice by each (see namespace_enter).
+ */
+pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int rename_seq;
+
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
  * Input:
@@ -47,10 +61,14 @@ int split_parent_child_from_path(char *path, char **parent, char **child)
 
 /*
  * Initializes tecnicofs and creates root node.
+ * Input:
+ *  - max_inodes: maximum number of i-nodes (DEFAULT_MAX_INODES if <= 0)
  */
-void init_fs()
+void init_fs(int max_inodes)
 {
-  inode_table_init();
+  inode_table_init(max_inodes);
+  dcache_init();
+  open_table_init();
 
   /* create root inode */
   int root = inode_create(T_DIRECTORY, -1);
@@ -60,61 +78,443 @@ void init_fs()
     printf("failed to create node for tecnicofs root\n");
     exit(EXIT_FAILURE);
   }
+  reclaim_start();
+
+#ifdef TECNICOFS_INJECT
+  /* only after the root exists, which must not be failed */
+  if (inject_init(NULL) == FAIL)
+    exit(EXIT_FAILURE);
+#endif
+}
+
+/*
+ * Applies an operation replayed from the write-ahead log.
+ */
+static void recover_operation(char op, char arg, char *path1, char *path2)
+{
+  switch (op)
+  {
+  case WAL_CREATE:
+    create(path1, arg == 'd' ? T_DIRECTORY : T_FILE);
+    break;
+  case WAL_DELETE:
+    if (arg == 'r')
+      delete_tree(path1);
+    else
+      delete (path1);
+    break;
+  case WAL_MOVE:
+    move(path1, path2);
+    break;
+  }
+}
+
+/*
+ * Rebuilds the namespace from the last checkpoint and the write-ahead log
+ * after it, logs the operations that follow, and takes checkpoints in the
+ * background; called after init_fs, before any request.
+ * Input:
+ *  - log_path: directory of the log and checkpoint, created if it does
+ *    not exist
+ *  - window: group commit window in microseconds, see wal_open
+ *  - interval: seconds between checkpoints, 0 for none
+ * Returns: SUCCESS or FAIL
+ */
+int recover_fs(char *log_path, int window, int interval)
+{
+  uint64_t segment;
+
+  if (checkpoint_restore(log_path, &segment) == FAIL ||
+      wal_open(log_path, segment, window, recover_operation) == FAIL)
+    return FAIL;
+  checkpoint_start(interval);
+  return SUCCESS;
 }
 
 /*
  * Destroy tecnicofs and inode table.
  */
-void destroy_fs() { inode_table_destroy(); }
+void destroy_fs()
+{
+  checkpoint_stop();
+  wal_close();
+  reclaim_stop();
+  open_table_destroy();
+  inode_table_destroy();
+  checkpoint_unmap();
+}
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns: SUCCESS or FAIL
  */
-int is_dir_empty(DirEntry *dirEntries)
+int is_dir_empty(Dir *dir)
 {
-  if (dirEntries == NULL)
+  if (dir == NULL)
   {
     return FAIL;
   }
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-  {
-    if (dirEntries[i].inumber != FREE_INODE)
-    {
-      return FAIL;
-    }
-  }
-  return SUCCESS;
+  return dir_count(dir) == 0 ? SUCCESS : FAIL;
 }
 
 /*
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries)
+int lookup_sub_node(char *name, Dir *dir)
 {
-  if (entries == NULL)
+  return dir_lookup(dir, name);
+}
+
+/*
+ * Lookup for a given path without taking any lock or writing shared memory.
+ * Every directory is read between inode_read_begin and inode_read_retry, and
+ * a child's sequence number is taken before validating its parent, so the
+ * whole chain is known to have been linked together.
+ * Input:
+ *  - name: path of node
+ *  - inumber: where to store the node's inumber, or FAIL if not found
+ * Returns: SUCCESS, or FAIL if a concurrent change forces a retry
+ */
+static int lookup_optimistic(char *name, int *inumber)
+{
+  char *saveptr;
+  char full_path[MAX_PATH_LENGTH];
+  char delim[] = "/";
+  int current_inumber = FS_ROOT, child_inumber, status = SUCCESS;
+  unsigned int seq, child_seq;
+  type nType;
+  union Data data;
+
+  strcpy(full_path, name);
+  epoch_enter();
+  seq = inode_read_begin(current_inumber);
+  char *path = strtok_r(full_path, delim, &saveptr);
+
+  while (path != NULL)
   {
-    return FAIL;
+    /* data may only be dereferenced once it is known to match nType */
+    if (inode_peek(current_inumber, &nType, &data) == FAIL ||
+        inode_read_retry(current_inumber, seq))
+    {
+      status = FAIL;
+      break;
+    }
+    child_inumber = nType == T_DIRECTORY ? lookup_sub_node(path, data.dir) : FAIL;
+    if (child_inumber != FAIL)
+      child_seq = inode_read_begin(child_inumber);
+    if (inode_read_retry(current_inumber, seq))
+    {
+      status = FAIL;
+      break;
+    }
+    current_inumber = child_inumber;
+    if (current_inumber == FAIL)
+      break;
+    seq = child_seq;
+    path = strtok_r(NULL, delim, &saveptr);
   }
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+  epoch_exit();
+
+  *inumber = current_inumber;
+  return status;
+}
+
+/*
+ * Lookup for a given path. Hot paths are answered by the path cache; on a
+ * miss the path is walked without locks (retrying if a create, delete or
+ * move changes a directory on the way), and only if that keeps failing with
+ * read locks. Found paths are cached.
+ * Input:
+ *  - name: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup(char *name)
+{
+  int locked[MAX_PATH_DEPTH] = {0};
+  int index = 0;
+  char *saveptr;
+  char full_path[MAX_PATH_LENGTH];
+  char delim[] = "/";
+  unsigned long generation = dcache_generation();
+
+  /* start at root node */
+  int current_inumber = dcache_lookup(name, generation);
+  if (current_inumber != FAIL)
+    return current_inumber;
+
+  for (int i = 0; i < LOOKUP_OPTIMISTIC_TRIES; i++)
   {
-    if (entries[i].inumber != FREE_INODE &&
-        strcmp(entries[i].name, name) == 0)
+    if (lookup_optimistic(name, &current_inumber) == SUCCESS)
     {
-      return entries[i].inumber;
+      if (current_inumber < 0)
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
+      dcache_insert(name, current_inumber, generation);
+      return current_inumber;
     }
   }
+
+  strcpy(full_path, name);
+  current_inumber = FS_ROOT;
+
+  /* use for copy */
+  type nType;
+  union Data data;
+
+  /* Critical Zone */
+  inodeLock('r', current_inumber); /* Locking the root folder */
+  locked[index++] = current_inumber;
+
+  /* get root inode data */
+  inode_get(current_inumber, &nType, &data);
+  char *path = strtok_r(full_path, delim, &saveptr);
+
+  /* search for all sub nodes */
+  while (path != NULL &&
+         (current_inumber = lookup_sub_node(path, nType == T_DIRECTORY ? data.dir : NULL)) != FAIL)
+  {
+    inodeLock('r', current_inumber); /*  Locking all the nodes along the lookup path */
+    locked[index++] = current_inumber;
+
+    inode_get(current_inumber, &nType, &data);
+    path = strtok_r(NULL, delim, &saveptr);
+  }
+  /* Unlocking in reverse order */
+  unlockAll(locked, index);
+
+  if (current_inumber < 0)
+    return TECNICOFS_ERROR_FILE_NOT_FOUND;
+
+  dcache_insert(name, current_inumber, generation);
+  return current_inumber;
+}
+
+/*
+ * Looks a path up again without locks, once its node is locked, to check
+ * it still leads there (see lock_path).
+ * Returns: SUCCESS, or FAIL if it leads elsewhere or concurrent changes
+ *  keep the walk from completing
+ */
+static int lookup_confirm(char *name, int inumber)
+{
+  int found;
+
+  for (int i = 0; i < LOOKUP_OPTIMISTIC_TRIES; i++)
+    if (lookup_optimistic(name, &found) == SUCCESS)
+      return found == inumber ? SUCCESS : FAIL;
+  return FAIL;
+}
+
+/*
+ * Looks up a node and locks it. Only the node is locked: once it is, it
+ * can no longer be deleted, so if the path still leads to it (no delete or
+ * move happened since the lookup, or a second walk says so) it is the one
+ * at that path for as long as the lock is held, unless a directory above
+ * it is moved (see namespace_enter).
+ * Input:
+ *  - name: path of the node
+ *  - mode: 'r' or 'w', the lock taken
+ * Returns: its inumber, or TECNICOFS_ERROR_FILE_NOT_FOUND with nothing
+ *  locked
+ */
+static int lock_path(char *name, char mode)
+{
+  unsigned long generation;
+  int inumber;
+
+  for (;;)
+  {
+    generation = dcache_generation();
+    if ((inumber = lookup(name)) < 0)
+      return inumber;
+    inodeLock(mode, inumber);
+    if (dcache_generation() == generation || lookup_confirm(name, inumber) == SUCCESS)
+      return inumber;
+    inodeUnlock(inumber);
+  }
+}
+
+/*
+ * Starts a namespace operation (create, delete, or a move that is not of a
+ * directory), before it looks up its paths: waits for the directory move in
+ * progress, if any.
+ * Returns: the rename_seq to give namespace_enter
+ */
+static unsigned int namespace_begin()
+{
+  unsigned int seq;
+
+  while ((seq = __atomic_load_n(&rename_seq, __ATOMIC_ACQUIRE)) & 1)
+  {
+    pthread_mutex_lock(&rename_lock);
+    pthread_mutex_unlock(&rename_lock);
+  }
+  return seq;
+}
+
+/*
+ * Enters a namespace operation, once the nodes it changes are locked.
+ * Moving a directory changes the path of everything under it, which such
+ * operations resolve before locking only those nodes: they go on only if
+ * no directory move ran since namespace_begin, and are then made and
+ * logged inside an epoch critical section, which a directory move waits
+ * for (see rename_begin). Waiting for locks stays outside of it.
+ * Returns: SUCCESS, or FAIL if a directory move ran, for the caller to
+ *  unlock the nodes and start again
+ */
+static int namespace_enter(unsigned int seq)
+{
+  /* epoch_enter orders the check below after the section is visible:
+   * either the move sees it, or the check sees the move */
+  epoch_enter();
+  if (__atomic_load_n(&rename_seq, __ATOMIC_ACQUIRE) == seq)
+    return SUCCESS;
+  epoch_exit();
   return FAIL;
 }
 
+/*
+ * Leaves a namespace operation.
+ */
+static void namespace_exit() { epoch_exit(); }
+
+/*
+ * Starts a directory move: waits for the move in progress, if any, and
+ * then for the namespace operations inside namespace_enter; those not
+ * there yet start again once it ends.
+ */
+static void rename_begin()
+{
+  pthread_mutex_lock(&rename_lock);
+  __atomic_add_fetch(&rename_seq, 1, __ATOMIC_SEQ_CST);
+  epoch_synchronize();
+}
+
+/*
+ * Ends a directory move.
+ */
+static void rename_end()
+{
+  __atomic_add_fetch(&rename_seq, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rename_lock);
+}
+
+/*
+ * Counts the components of a path, its depth in the tree ("" is the root).
+ */
+static int path_depth(const char *path)
+{
+  int depth = 0;
+
+  for (; *path != '\0'; path++)
+    if (*path != '/' && (path[1] == '/' || path[1] == '\0'))
+      depth++;
+  return depth;
+}
+
+/*
+ * Checks if a path is another one or under it, comparing their components.
+ */
+static int path_within(const char *path, const char *ancestor)
+{
+  for (;;)
+  {
+    while (*ancestor == '/')
+      ancestor++;
+    while (*path == '/')
+      path++;
+    if (*ancestor == '\0')
+      return 1;
+    for (; *ancestor != '\0' && *ancestor != '/'; ancestor++, path++)
+      if (*path != *ancestor)
+        return 0;
+    if (*path != '\0' && *path != '/')
+      return 0;
+  }
+}
+
+/*
+ * Looks up and write locks up to three nodes, in the global order: by
+ * depth and then inumber, that of a walk down the tree, which locks a
+ * parent before its children. Depths come from the paths, which only a
+ * directory move changes: a namespace operation only blocks on a lock with
+ * none held, and starts again if a directory move ran. A stale lookup may
+ * point at an i-node somewhere else by now, which must not be waited for
+ * while holding the others: all but the first are only tried, and if one
+ * is held everything is released to wait for it alone.
+ * Input:
+ *  - names: paths of the nodes
+ *  - count: how many
+ *  - inumbers: where to store their inumbers (negative if not found, and
+ *    then not locked)
+ *  - locked: where to store those locked, in order, for unlockAll
+ * Returns: how many were locked
+ */
+static int lock_nodes(char **names, int count, int *inumbers, int *locked)
+{
+  int depths[3], order[3], found, locked_count, busy, i, j;
+  unsigned long generation;
+
+  for (;;)
+  {
+    generation = dcache_generation();
+    found = 0;
+    for (i = 0; i < count; i++)
+    {
+      if ((inumbers[i] = lookup(names[i])) < 0)
+        continue;
+      depths[i] = path_depth(names[i]);
+      for (j = found++; j > 0 && (depths[order[j - 1]] > depths[i] ||
+                                  (depths[order[j - 1]] == depths[i] && inumbers[order[j - 1]] > inumbers[i]));
+           j--)
+        order[j] = order[j - 1];
+      order[j] = i;
+    }
+
+    locked_count = 0;
+    busy = FAIL;
+    for (i = 0; i < found && busy == FAIL; i++)
+    {
+      for (j = 0; j < locked_count && locked[j] != inumbers[order[i]]; j++)
+        ;
+      if (j < locked_count)
+        continue;
+      if (locked_count == 0)
+        inodeLock('w', inumbers[order[i]]);
+      else if (inodeTryLock('w', inumbers[order[i]]) == FAIL)
+      {
+        busy = inumbers[order[i]];
+        break;
+      }
+      locked[locked_count++] = inumbers[order[i]];
+    }
+    if (busy != FAIL)
+    {
+      unlockAll(locked, locked_count);
+      inodeLock('w', busy);
+      inodeUnlock(busy);
+      continue;
+    }
+
+    if (dcache_generation() == generation)
+      return locked_count;
+    for (i = 0; i < count && (inumbers[i] < 0 || lookup_confirm(names[i], inumbers[i]) == SUCCESS); i++)
+      ;
+    if (i == count)
+      return locked_count;
+    unlockAll(locked, locked_count);
+  }
+}
+
 /*
  * Creates a new node given a path.
  * Input:
@@ -129,9 +529,9 @@ int lookup_sub_node(char *name, DirEntry *entries)
  */
 int create(char *name, type nodeType)
 {
-  int parent_inumber, child_inumber;
-  int locked[INODE_TABLE_SIZE] = {0}, locked_index;
-  char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+  int parent_inumber, child_inumber, result = SUCCESS;
+  unsigned int seq;
+  char *parent_name, *child_name, name_copy[MAX_PATH_LENGTH];
   /* use for copy */
   type pType;
   union Data pdata;
@@ -139,12 +539,20 @@ int create(char *name, type nodeType)
   strcpy(name_copy, name);
   split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-  parent_inumber = aux_lookup(parent_name, locked, &locked_index, NULL, 0);
+  for (;;)
+  {
+    seq = namespace_begin();
+    parent_inumber = lock_path(parent_name, 'w');
+    if (namespace_enter(seq) == SUCCESS)
+      break;
+    if (parent_inumber >= 0)
+      inodeUnlock(parent_inumber);
+  }
 
-  if (parent_inumber == FAIL)
+  if (parent_inumber < 0)
   {
     printf("failed to create %s, invalid parent dir %s\n", name, parent_name);
-    unlockAll(locked, locked_index);
+    namespace_exit();
     return TECNICOFS_ERROR_INVALID_PARENT_DIR;
   }
 
@@ -153,56 +561,49 @@ int create(char *name, type nodeType)
   if (pType != T_DIRECTORY)
   {
     printf("failed to create %s, parent %s is not a dir\n", name, parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_PARENT_NOT_DIR;
+    result = TECNICOFS_ERROR_PARENT_NOT_DIR;
   }
-
-  if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL)
+  else if (lookup_sub_node(child_name, pdata.dir) != FAIL)
   {
     printf("failed to create %s, already exists in dir %s\n", child_name,
            parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+    result = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
   }
-
   /* create node and add entry to folder that contains new node */
-  child_inumber = inode_create(nodeType, parent_inumber);
-
-  if (child_inumber == FAIL)
+  else if ((child_inumber = inode_create(nodeType, parent_inumber)) == FAIL)
   {
     printf("failed to create %s in  %s, couldn't allocate inode\n", child_name,
            parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_COULDNT_ALLOCATE_INODE;
+    result = TECNICOFS_ERROR_COULDNT_ALLOCATE_INODE;
   }
-
-  if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL)
+  else if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL)
   {
     printf("could not add entry %s in dir %s\n", child_name, parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_COULDNT_ADD_ENTRY;
+    result = TECNICOFS_ERROR_COULDNT_ADD_ENTRY;
+    /* never reachable: nobody else can have it */
+    inodeLock('w', child_inumber);
+    inode_delete(child_inumber);
+    inodeUnlock(child_inumber);
   }
-  unlockAll(locked, locked_index);
-  return SUCCESS;
+  else
+    wal_log(WAL_CREATE, nodeType == T_DIRECTORY ? 'd' : 'f', name, "");
+
+  inodeUnlock(parent_inumber);
+  namespace_exit();
+  return result;
 }
 
 /*
- * Deletes a node given a path.
+ * Deletes a node given a path (see delete and delete_tree).
  * Input:
  *  - name: path of node
- * Returns: SUCCESS or 
- * TECNICOFS_ERROR_INVALID_PARENT_DIR 
- * TECNICOFS_ERROR_PARENT_NOT_DIR
- * TECNICOFS_ERROR_DOESNT_EXIST_IN_DIR 
- * TECNICOFS_ERROR_DIR_NOT_EMPTY
- * TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR
- * TECNICOFS_ERROR_FAILED_DELETE_INODE
+ *  - recursive: whether a directory is deleted along with its contents
  */
-int delete (char *name)
+static int remove_node(char *name, int recursive)
 {
-  int parent_inumber, child_inumber;
-  int locked[INODE_TABLE_SIZE] = {0}, locked_index;
-  char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+  int parent_inumber, child_inumber, result, writer = 0;
+  unsigned int seq;
+  char *parent_name, *child_name, name_copy[MAX_PATH_LENGTH];
   /* use for copy */
   type pType, cType;
   union Data pdata, cdata;
@@ -210,305 +611,525 @@ int delete (char *name)
   strcpy(name_copy, name);
   split_parent_child_from_path(name_copy, &parent_name, &child_name);
 
-  parent_inumber = aux_lookup(parent_name, locked, &locked_index, NULL, 0);
-
-  if (parent_inumber == FAIL)
+  /* Detaching a subtree is made alone, like a directory move: nothing
+   * runs inside it meanwhile, so whatever was logged before it was done
+   * to the subtree first. Found out once it is locked, and then again. */
+  do
   {
-    printf("failed to delete %s, invalid parent dir %s\n", child_name,
-           parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_INVALID_PARENT_DIR;
-  }
+    result = SUCCESS;
+    for (;;)
+    {
+      if (writer)
+        rename_begin();
+      else
+        seq = namespace_begin();
+      child_inumber = FAIL;
+      if ((parent_inumber = lock_path(parent_name, 'w')) >= 0)
+      {
+        inode_get(parent_inumber, &pType, &pdata);
+        /* the child is deeper than its parent: locked after it */
+        if (pType == T_DIRECTORY && (child_inumber = lookup_sub_node(child_name, pdata.dir)) != FAIL)
+          inodeLock('w', child_inumber);
+      }
+      if (writer || namespace_enter(seq) == SUCCESS)
+        break;
+      if (child_inumber != FAIL)
+        inodeUnlock(child_inumber);
+      if (parent_inumber >= 0)
+        inodeUnlock(parent_inumber);
+    }
 
-  inode_get(parent_inumber, &pType, &pdata);
+    if (parent_inumber < 0)
+    {
+      printf("failed to delete %s, invalid parent dir %s\n", child_name,
+             parent_name);
+      result = TECNICOFS_ERROR_INVALID_PARENT_DIR;
+      break;
+    }
 
-  if (pType != T_DIRECTORY)
-  {
-    printf("failed to delete %s, parent %s is not a dir\n", child_name,
-           parent_name);
+    if (pType != T_DIRECTORY)
+    {
+      printf("failed to delete %s, parent %s is not a dir\n", child_name,
+             parent_name);
+      inodeUnlock(parent_inumber);
+      result = TECNICOFS_ERROR_PARENT_NOT_DIR;
+      break;
+    }
 
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_PARENT_NOT_DIR;
-  }
+    if (child_inumber == FAIL)
+    {
+      printf("could not delete %s, does not exist in dir %s\n", name,
+             parent_name);
+      inodeUnlock(parent_inumber);
+      result = TECNICOFS_ERROR_DOESNT_EXIST_IN_DIR;
+      break;
+    }
 
-  child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+    inode_get(child_inumber, &cType, &cdata);
 
-  if (child_inumber == FAIL)
-  {
-    printf("could not delete %s, does not exist in dir %s\n", name,
-           parent_name);
-    unlockAll(locked, locked_index);
-    return TECNICOFS_ERROR_DOESNT_EXIST_IN_DIR;
-  }
+    if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL)
+    {
+      if (!recursive)
+      {
+        printf("could not delete %s: is a directory and not empty\n", name);
+        result = TECNICOFS_ERROR_DIR_NOT_EMPTY;
+      }
+      else if (!writer)
+      {
+        writer = 1;
+        result = FAIL;
+      }
+      /* detached now, its contents deleted in the background */
+      else if (reclaim_detach(parent_inumber, child_inumber, child_name) == FAIL)
+      {
+        printf("failed to delete %s from dir %s\n", child_name, parent_name);
+        result = TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR;
+      }
+    }
+    /* remove entry from folder that contained deleted node */
+    else if (dir_reset_entry(parent_inumber, child_inumber, child_name) == FAIL)
+    {
+      printf("failed to delete %s from dir %s\n", child_name, parent_name);
+      result = TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR;
+    }
+    else if (inode_delete(child_inumber) == FAIL)
+    {
+      printf("could not delete inode number %d from dir %s\n", child_inumber,
+             parent_name);
+      result = TECNICOFS_ERROR_FAILED_DELETE_INODE;
+    }
 
-  inodeLock('w', child_inumber);
-  inode_get(child_inumber, &cType, &cdata);
+    if (result == SUCCESS)
+    {
+      dcache_invalidate();
+      wal_log(WAL_DELETE, recursive ? 'r' : 0, name, "");
+    }
 
-  if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL)
-  {
-    printf("could not delete %s: is a directory and not empty\n", name);
-    unlockAll(locked, locked_index);
     inodeUnlock(child_inumber);
-    return TECNICOFS_ERROR_DIR_NOT_EMPTY;
-  }
+    inodeUnlock(parent_inumber);
+    if (result == FAIL)
+      namespace_exit();
+  } while (result == FAIL);
 
-  /* remove entry from folder that contained deleted node */
-  if (dir_reset_entry(parent_inumber, child_inumber) == FAIL)
-  {
-    printf("failed to delete %s from dir %s\n", child_name, parent_name);
-    unlockAll(locked, locked_index);
-    inodeUnlock(child_inumber);
-    return TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR;
-  }
+  if (writer)
+    rename_end();
+  else
+    namespace_exit();
+  return result;
+}
 
-  if (inode_delete(child_inumber) == FAIL)
-  {
-    printf("could not delete inode number %d from dir %s\n", child_inumber,
-           parent_name);
-    unlockAll(locked, locked_index);
-    inodeUnlock(child_inumber);
-    return TECNICOFS_ERROR_FAILED_DELETE_INODE;
-  }
+/*
+ * Deletes a node given a path.
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or 
+ * TECNICOFS_ERROR_INVALID_PARENT_DIR 
+ * TECNICOFS_ERROR_PARENT_NOT_DIR
+ * TECNICOFS_ERROR_DOESNT_EXIST_IN_DIR 
+ * TECNICOFS_ERROR_DIR_NOT_EMPTY
+ * TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR
+ * TECNICOFS_ERROR_FAILED_DELETE_INODE
+ */
+int delete (char *name) { return remove_node(name, 0); }
 
-  unlockAll(locked, locked_index);
-  inodeUnlock(child_inumber);
-  return SUCCESS;
-}
+/*
+ * Deletes a node given a path and, if it is a directory, everything under
+ * it, in constant time: the directory is detached from its parent, and its
+ * contents are deleted in the background (see reclaim.c).
+ * Input:
+ *  - name: path of node
+ * Returns: SUCCESS or 
+ * TECNICOFS_ERROR_INVALID_PARENT_DIR 
+ * TECNICOFS_ERROR_PARENT_NOT_DIR
+ * TECNICOFS_ERROR_DOESNT_EXIST_IN_DIR 
+ * TECNICOFS_ERROR_FAILED_REMOVE_FROM_DIR
+ * TECNICOFS_ERROR_FAILED_DELETE_INODE
+ */
+int delete_tree(char *name) { return remove_node(name, 1); }
 
 /*
- * Moves a node from a given to another one.
+ * Moves a node from a given to another one. Only the source and
+ * destination directories and the node are locked; moving a directory
+ * changes the path of everything under it, so it is made alone (see
+ * namespace_enter), while files are moved like any namespace operation.
  * Input:
  *  - src: path of the node
  *  - dest: destination of the node
- * Returns: SUCCESS or FAIL
+ * Returns: SUCCESS,
+ * TECNICOFS_ERROR_MOVE_TO_ITSELF (dest under src)
+ * TECNICOFS_ERROR_INVALID_PARENT_DIR
+ * TECNICOFS_ERROR_FILE_ALREADY_EXISTS
+ * TECNICOFS_ERROR_FILE_NOT_FOUND
+ * TECNICOFS_ERROR_COULDNT_ADD_ENTRY (nothing moved)
  */
 int move(char *src, char *dest)
 {
-  int sparent_inumber, dparent_inumber, moved_inumber;
-  int slocked[INODE_TABLE_SIZE] = {0};
-  int dlocked[INODE_TABLE_SIZE] = {0};
-  int sindex, dindex;
-  char *sparent_name, *schild_name, *dparent_name, *dchild_name;
-  type sType, dType;
-  union Data sdata, ddata;
-  int ddepth = split_parent_child_from_path(dest, &dparent_name, &dchild_name);
-  int sdepth = split_parent_child_from_path(src, &sparent_name, &schild_name);
-
-  /* Checking for loop cases m /a /a/a */
-  if (dparent_name[0] == '/')
-  {
-    /* m /a /a/a */
-    if (strcmp(schild_name, dparent_name + 1) == 0 && *sparent_name == '\0')
-      return TECNICOFS_ERROR_MOVE_TO_ITSELF;
-  }
-  else
-  {
-    /* m /a a/a */
-    if (strcmp(schild_name, dparent_name) == 0 && *sparent_name == '\0')
-      return TECNICOFS_ERROR_MOVE_TO_ITSELF;
-  }
+  int inumbers[3], locked[3], locked_count, moved_inumber, exclusive, writer, result;
+  unsigned int seq;
+  char *sparent_name, *schild_name, *dparent_name, *dchild_name, *names[3];
+  char src_copy[MAX_PATH_LENGTH], dest_copy[MAX_PATH_LENGTH];
+  type sType, dType, mType;
+  union Data sdata, ddata, mdata;
 
-  /* Establishing an order for locking, the shallowest inode first */
-  if (sdepth < ddepth)
-  {
-    sparent_inumber = aux_lookup(sparent_name, slocked, &sindex, NULL, 0);
-    dparent_inumber =
-        aux_lookup(dparent_name, dlocked, &dindex, slocked, sindex);
-  }
-  else if (sdepth > ddepth)
-  {
-    dparent_inumber = aux_lookup(dparent_name, dlocked, &dindex, NULL, 0);
-    sparent_inumber =
-        aux_lookup(sparent_name, slocked, &sindex, dlocked, dindex);
-  }
-  else
-  {
-    /* If both paths have the same depth, use supposed inumbers */
-    sparent_inumber = lookup(sparent_name);
-    dparent_inumber = lookup(dparent_name);
+  split_parent_child_from_path(strcpy(dest_copy, dest), &dparent_name, &dchild_name);
+  split_parent_child_from_path(strcpy(src_copy, src), &sparent_name, &schild_name);
+
+  /* Checking for loop cases m /a /a/b/c, whatever the depth */
+  if (path_within(dparent_name, src))
+    return TECNICOFS_ERROR_MOVE_TO_ITSELF;
 
-    /* First case, also handles moving within the same directory (when the
-     * inumbers are the same) */
-    if (sparent_inumber >= dparent_inumber)
+  names[0] = sparent_name;
+  names[1] = dparent_name;
+  names[2] = src;
+
+  /* A guess, checked once the node is locked */
+  moved_inumber = lookup(src);
+  exclusive = moved_inumber >= 0 && inode_peek(moved_inumber, &mType, &mdata) == SUCCESS &&
+              mType == T_DIRECTORY;
+
+  do
+  {
+    if ((writer = exclusive))
+      rename_begin();
+    else
+      seq = namespace_begin();
+    locked_count = lock_nodes(names, 3, inumbers, locked);
+    if (!writer && namespace_enter(seq) == FAIL)
     {
-      sparent_inumber = aux_lookup(sparent_name, slocked, &sindex, NULL, 0);
-      dparent_inumber =
-          aux_lookup(dparent_name, dlocked, &dindex, slocked, sindex);
+      unlockAll(locked, locked_count);
+      result = FAIL;
+      continue;
     }
+
+    // With everything locked verify src and dest parent actually exist
+    if (inumbers[0] < 0 || inumbers[1] < 0)
+      result = TECNICOFS_ERROR_INVALID_PARENT_DIR;
     else
     {
-      dparent_inumber = aux_lookup(dparent_name, dlocked, &dindex, NULL, 0);
-      sparent_inumber =
-          aux_lookup(sparent_name, slocked, &sindex, dlocked, dindex);
+      inode_get(inumbers[0], &sType, &sdata);
+      inode_get(inumbers[1], &dType, &ddata);
+
+      // Veryfying the destination is a folder and doesnt contain another file with the same name
+      if (dType != T_DIRECTORY || lookup_sub_node(dchild_name, ddata.dir) != FAIL)
+        result = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+      // Veryfying the inode we want to move exists
+      else if (sType != T_DIRECTORY || (moved_inumber = lookup_sub_node(schild_name, sdata.dir)) == FAIL)
+        result = TECNICOFS_ERROR_FILE_NOT_FOUND;
+      /* Replaced since it was looked up, or a directory: again */
+      else if (moved_inumber != inumbers[2])
+        result = FAIL;
+      else if (!writer && inode_get(moved_inumber, &mType, &mdata) == SUCCESS && mType == T_DIRECTORY)
+      {
+        exclusive = 1;
+        result = FAIL;
+      }
+      /* Actual move operation happens here */
+      else if (dir_move_entry(inumbers[0], inumbers[1], moved_inumber, schild_name, dchild_name) == FAIL)
+        result = TECNICOFS_ERROR_COULDNT_ADD_ENTRY;
+      else
+      {
+        dcache_invalidate();
+        wal_log(WAL_MOVE, 0, src, dest);
+        result = SUCCESS;
+      }
     }
-  }
 
-  // With everything locked verify src and dest parent actually exist
-  if (sparent_inumber < 0 || dparent_inumber < 0)
-  {
-    unlockAll(slocked, sindex);
-    unlockAll(dlocked, dindex);
-    return TECNICOFS_ERROR_INVALID_PARENT_DIR;
-  }
+    unlockAll(locked, locked_count);
+    if (writer)
+      rename_end();
+    else
+      namespace_exit();
+  } while (result == FAIL);
+  return result;
+}
 
-  // Veryfying the destination is a folder and doesnt contain another file with the same name
-  inode_get(dparent_inumber, &dType, &ddata);
-  if (dType != T_DIRECTORY || lookup_sub_node(dchild_name, ddata.dirEntries) != FAIL)
-  {
-    unlockAll(slocked, sindex);
-    unlockAll(dlocked, dindex);
-    return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
-  }
+/*
+ * Looks up a file and leaves it locked, and only it (see lock_path).
+ * Input:
+ *  - name: path of the file
+ *  - mode: 'r' or 'w', the lock taken
+ * Returns: the file's inumber, or TECNICOFS_ERROR_FILE_NOT_FOUND or
+ *  TECNICOFS_ERROR_NOT_A_FILE, with nothing left locked
+ */
+static int lock_file(char *name, char mode)
+{
+  int inumber = lock_path(name, mode);
+  type nType;
+  union Data data;
 
-  // Veryfying the inode we want to move exists
-  inode_get(sparent_inumber, &sType, &sdata);
-  moved_inumber = lookup_sub_node(schild_name, sdata.dirEntries);
-  if (sType != T_DIRECTORY || moved_inumber == FAIL)
-  {
-    unlockAll(slocked, sindex);
-    unlockAll(dlocked, dindex);
+  if (inumber < 0)
     return TECNICOFS_ERROR_FILE_NOT_FOUND;
+  inode_get(inumber, &nType, &data);
+  if (nType != T_FILE)
+  {
+    inodeUnlock(inumber);
+    return TECNICOFS_ERROR_NOT_A_FILE;
   }
-
-  /* Actual move operation happens here */
-  dir_remove_entry(sparent_inumber, moved_inumber);
-  dir_add_entry(dparent_inumber, moved_inumber, dchild_name);
-
-  unlockAll(slocked, sindex);
-  unlockAll(dlocked, dindex);
-  return SUCCESS;
+  return inumber;
 }
 
 /*
- * Lookup for a given path.
+ * Writes to a file given a path.
  * Input:
- *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *  - name: path of the file
+ *  - data: the data
+ *  - size: its size
+ *  - offset: where to write it, or FILE_APPEND for the end of the file
+ * Returns: the bytes written,
+ * TECNICOFS_ERROR_FILE_NOT_FOUND
+ * TECNICOFS_ERROR_NOT_A_FILE
+ * TECNICOFS_ERROR_FILE_TOO_BIG (past FILE_MAX_SIZE, or out of memory)
  */
-int lookup(char *name)
+int write_file(char *name, const char *data, int size, long offset)
 {
-  int locked[INODE_TABLE_SIZE] = {0};
-  int index = 0;
-  char *saveptr;
-  char full_path[MAX_FILE_NAME];
-  char delim[] = "/";
-  strcpy(full_path, name);
+  int inumber = lock_file(name, 'w'), written;
 
-  /* start at root node */
-  int current_inumber = FS_ROOT;
+  if (inumber < 0)
+    return inumber;
+  if ((written = inode_file_write(inumber, data, size, offset)) == FAIL)
+    written = TECNICOFS_ERROR_FILE_TOO_BIG;
+  inodeUnlock(inumber);
+  return written;
+}
 
-  /* use for copy */
-  type nType;
-  union Data data;
+/*
+ * Reads from a file given a path.
+ * Input:
+ *  - name: path of the file
+ *  - data: where to read to
+ *  - size: the most bytes to read
+ *  - offset: where to read from
+ * Returns: the bytes read (0 at the end of the file),
+ * TECNICOFS_ERROR_FILE_NOT_FOUND
+ * TECNICOFS_ERROR_NOT_A_FILE
+ */
+int read_file(char *name, char *data, int size, long offset)
+{
+  int inumber = lock_file(name, 'r'), count;
 
-  /* Critical Zone */
-  inodeLock('r', current_inumber); /* Locking the root folder */
-  locked[index++] = current_inumber;
+  if (inumber < 0)
+    return inumber;
+  count = inode_file_read(inumber, data, size, offset);
+  inodeUnlock(inumber);
+  return count;
+}
 
-  /* get root inode data */
-  inode_get(current_inumber, &nType, &data);
-  char *path = strtok_r(full_path, delim, &saveptr);
+/*
+ * Sets the size of a file given a path, dropping its end or leaving a hole
+ * (read as zeros) after it.
+ * Returns: SUCCESS,
+ * TECNICOFS_ERROR_FILE_NOT_FOUND
+ * TECNICOFS_ERROR_NOT_A_FILE
+ * TECNICOFS_ERROR_FILE_TOO_BIG (negative or past FILE_MAX_SIZE)
+ */
+int truncate_file(char *name, long size)
+{
+  int inumber = lock_file(name, 'w'), result;
 
-  /* search for all sub nodes */
-  while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL)
-  {
-    inodeLock('r', current_inumber); /*  Locking all the nodes along the lookup path */
-    locked[index++] = current_inumber;
+  if (inumber < 0)
+    return inumber;
+  result = inode_file_truncate(inumber, size) == SUCCESS ? SUCCESS : TECNICOFS_ERROR_FILE_TOO_BIG;
+  inodeUnlock(inumber);
+  return result;
+}
 
-    inode_get(current_inumber, &nType, &data);
-    path = strtok_r(NULL, delim, &saveptr);
-  }
-  /* Unlocking in reverse order */
-  unlockAll(locked, index);
+/*
+ * Opens a file given a path: the handle returned is bound to its i-node,
+ * so requests through it neither resolve the path again nor lock anything
+ * but the file, and they still reach it once moved. Only its owner can
+ * use the handle (see open_table_get).
+ * Input:
+ *  - name: path of the file
+ *  - mode: READ, WRITE or RW, what the handle allows
+ *  - owner: the client opening it
+ * Returns: the handle (> 0),
+ * TECNICOFS_ERROR_FILE_NOT_FOUND
+ * TECNICOFS_ERROR_NOT_A_FILE
+ * TECNICOFS_ERROR_PERMISSION_DENIED (not a mode)
+ * TECNICOFS_ERROR_TOO_MANY_OPEN_FILES
+ */
+int open_file(char *name, permission mode, unsigned long owner)
+{
+  int inumber, handle;
 
-  if (current_inumber < 0)
-    return TECNICOFS_ERROR_FILE_NOT_FOUND;
+  if (mode != READ && mode != WRITE && mode != RW)
+    return TECNICOFS_ERROR_PERMISSION_DENIED;
+  if ((inumber = lock_file(name, 'r')) < 0)
+    return inumber;
+  handle = open_table_add(inumber, inode_generation(inumber), mode, owner);
+  inodeUnlock(inumber);
+  return handle != FAIL ? handle : TECNICOFS_ERROR_TOO_MANY_OPEN_FILES;
+}
 
-  return current_inumber;
+/*
+ * Closes a file opened with open_file.
+ * Returns: SUCCESS or TECNICOFS_ERROR_BAD_HANDLE
+ */
+int close_file(int handle, unsigned long owner)
+{
+  return open_table_remove(handle, owner) == SUCCESS ? SUCCESS : TECNICOFS_ERROR_BAD_HANDLE;
 }
 
 /*
- * Searches for a number in a array
+ * Closes every file a client left open, once it is gone.
+ */
+void close_files(unsigned long owner) { open_table_remove_owner(owner); }
+
+/*
+ * Takes an open file and locks its i-node, if the handle allows the
+ * access and the file was not deleted meanwhile.
  * Input:
- *  - array: array of numbers
- *  - length: max index to look for
- *  - el: number to look for
- * Returns:
- *  SUCESS : found the number in the array
- *  FAIL: otherwise
+ *  - handle, owner: the handle and the client using it
+ *  - access: READ or WRITE, also the lock taken
+ *  - file: where to store the open file, to give back with release_handle
+ * Returns: SUCCESS,
+ * TECNICOFS_ERROR_BAD_HANDLE
+ * TECNICOFS_ERROR_PERMISSION_DENIED
+ * TECNICOFS_ERROR_FILE_NOT_FOUND (deleted)
  */
-int linear_search(int *array, int length, int el)
+static int acquire_handle(int handle, unsigned long owner, permission access, OpenFile **file)
 {
-  for (int i = 0; i < length; i++)
+  if ((*file = open_table_get(handle, owner)) == NULL)
+    return TECNICOFS_ERROR_BAD_HANDLE;
+  if (((*file)->mode & access) == 0)
   {
-    if (array[i] == el)
-      return SUCCESS;
+    open_table_put(*file);
+    return TECNICOFS_ERROR_PERMISSION_DENIED;
   }
-  return FAIL;
+  inodeLock(access == READ ? 'r' : 'w', (*file)->inumber);
+  if (inode_generation((*file)->inumber) != (*file)->generation)
+  {
+    inodeUnlock((*file)->inumber);
+    open_table_put(*file);
+    return TECNICOFS_ERROR_FILE_NOT_FOUND;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Gives back an open file taken with acquire_handle.
+ */
+static void release_handle(OpenFile *file)
+{
+  inodeUnlock(file->inumber);
+  open_table_put(file);
+}
+
+/*
+ * Reads from an open file, at its offset, which it advances.
+ * Returns: the bytes read (0 at the end of the file), or an error (see
+ * acquire_handle)
+ */
+int read_handle(int handle, unsigned long owner, char *data, int size)
+{
+  OpenFile *file;
+  int count = acquire_handle(handle, owner, READ, &file);
+
+  if (count != SUCCESS)
+    return count;
+  if ((count = inode_file_read(file->inumber, data, size, file->offset)) > 0)
+    file->offset += count;
+  release_handle(file);
+  return count;
 }
 
 /*
- * Lookup for a given path.
+ * Writes to an open file, at its offset or at the end of the file, and
+ * leaves the offset after the data.
  * Input:
- *  - name: path of node
- * Returns:
- *  inumber: identifier of the i-node, if found
- *     FAIL: otherwise
+ *  - handle, owner: the handle and the client using it
+ *  - data: the data
+ *  - size: its size
+ *  - append: whether to write at the end of the file
+ * Returns: the bytes written, TECNICOFS_ERROR_FILE_TOO_BIG or an error
+ *  (see acquire_handle)
  */
-int aux_lookup(char *name, int *locked, int *index, int *already_locked, int already_locked_index)
+int write_handle(int handle, unsigned long owner, const char *data, int size, int append)
 {
-  int locked_index = 0;
-  char *saveptr;
-  char full_path[MAX_FILE_NAME];
-  char delim[] = "/";
-  strcpy(full_path, name);
+  OpenFile *file;
+  int written = acquire_handle(handle, owner, WRITE, &file);
 
-  /* start at root node */
-  int current_inumber = FS_ROOT;
+  if (written != SUCCESS)
+    return written;
+  if (append)
+    file->offset = inode_file_size(file->inumber);
+  if ((written = inode_file_write(file->inumber, data, size, file->offset)) == FAIL)
+    written = TECNICOFS_ERROR_FILE_TOO_BIG;
+  else
+    file->offset += written;
+  release_handle(file);
+  return written;
+}
 
-  /* use for copy */
-  type nType;
-  union Data data;
+/*
+ * Sets the size of an open file (see truncate_file); its offset is kept.
+ * Returns: SUCCESS, TECNICOFS_ERROR_FILE_TOO_BIG or an error (see
+ *  acquire_handle)
+ */
+int truncate_handle(int handle, unsigned long owner, long size)
+{
+  OpenFile *file;
+  int result = acquire_handle(handle, owner, WRITE, &file);
 
-  /* First iteration outside the loop, for the root folder */
-  char *path = strtok_r(full_path, delim, &saveptr);
-  if (already_locked_index == 0 || linear_search(already_locked, already_locked_index, current_inumber) == FAIL)
-  {
-    if (path == NULL)
-      inodeLock('w', current_inumber); /* Locking the root folder */
-    else
-      inodeLock('r', current_inumber); /* Locking the root folder */
-    locked[locked_index++] = current_inumber;
-  }
-  inode_get(current_inumber, &nType, &data);
+  if (result != SUCCESS)
+    return result;
+  result = inode_file_truncate(file->inumber, size) == SUCCESS ? SUCCESS : TECNICOFS_ERROR_FILE_TOO_BIG;
+  release_handle(file);
+  return result;
+}
 
-  /* search for all sub nodes */
-  while (path != NULL &&
-         (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL)
+/*
+ * Sets the offset of an open file, where its next read or write starts.
+ * Returns: SUCCESS, TECNICOFS_ERROR_BAD_HANDLE or
+ *  TECNICOFS_ERROR_FILE_TOO_BIG (negative or past FILE_MAX_SIZE)
+ */
+int seek_handle(int handle, unsigned long owner, long offset)
+{
+  OpenFile *file = open_table_get(handle, owner);
+
+  if (file == NULL)
+    return TECNICOFS_ERROR_BAD_HANDLE;
+  if (offset < 0 || offset > FILE_MAX_SIZE)
   {
-    path = strtok_r(NULL, delim, &saveptr);
-    /* Check if the node has been locked previously */
-    if (already_locked_index == 0 || linear_search(already_locked, already_locked_index, current_inumber) == 0)
-    {
-      if (path == NULL)
-        inodeLock('w', current_inumber);
-      else
-        inodeLock(
-            'r',
-            current_inumber); /*  Locking all the nodes along the lookup path */
-      locked[locked_index++] = current_inumber;
-    }
-    inode_get(current_inumber, &nType, &data);
+    open_table_put(file);
+    return TECNICOFS_ERROR_FILE_TOO_BIG;
   }
-  *index = locked_index;
-  return current_inumber;
+  file->offset = offset;
+  open_table_put(file);
+  return SUCCESS;
+}
+
+/*
+ * Exports tecnicofs tree from a snapshot (see inode_snapshot_begin): the
+ * tree as it was when the export started, even if it changes meanwhile.
+ * Input:
+ *  - format: TREE_PATHS, a path per line, or TREE_COMMANDS, the create
+ *    commands that rebuild the tree
+ *  - emit: called with each chunk of the output
+ *  - arg: passed to emit
+ * Returns: SUCCESS or the first error of emit
+ */
+int export_tecnicofs_tree(int format, tree_emit_t emit, void *arg)
+{
+  unsigned long snapshot = inode_snapshot_begin();
+  int status = inode_export_tree(FS_ROOT, snapshot, format, emit, arg);
+
+  inode_snapshot_end(snapshot);
+  return status;
+}
+
+/*
+ * Writes a chunk of the tree to a file.
+ */
+static int print_chunk(const char *chunk, int size, void *arg)
+{
+  return fwrite(chunk, 1, size, (FILE *)arg) == (size_t)size ? SUCCESS : FAIL;
 }
 
 /*
  * Prints tecnicofs tree.
  * Input:
  *  - fp: pointer to output file
+ * Returns: SUCCESS or FAIL
  */
-void print_tecnicofs_tree(FILE *fp) { inode_print_tree(fp, FS_ROOT, ""); }
+int print_tecnicofs_tree(FILE *fp) { return export_tecnicofs_tree(TREE_PATHS, print_chunk, fp); }
@@ -3,23 +3,53 @@
 
 #include "state.h"
 
-void init_fs();
+/* Upper bound on the i-nodes locked along a single path: every component
+ * takes at least two characters ("a/") plus the root */
+#define MAX_PATH_DEPTH (MAX_PATH_LENGTH / 2 + 1)
+
+/* Lock-free walks lookup() tries before falling back to read locks */
+#define LOOKUP_OPTIMISTIC_TRIES 3
+
+void init_fs(int max_inodes);
+
+int recover_fs(char *log_path, int window, int interval);
 
 void destroy_fs();
 
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Dir *dir);
 
 int create(char *name, type nodeType);
 
 int delete (char *name);
 
+int delete_tree(char *name);
+
 int move(char *src, char *dest);
 
 int lookup(char *name);
 
-int aux_lookup(char *name, int *locked, int *index, int *already_locked,
-               int already_locked_amount);
+int write_file(char *name, const char *data, int size, long offset);
+
+int read_file(char *name, char *data, int size, long offset);
+
+int truncate_file(char *name, long size);
+
+int open_file(char *name, permission mode, unsigned long owner);
+
+int close_file(int handle, unsigned long owner);
+
+void close_files(unsigned long owner);
+
+int read_handle(int handle, unsigned long owner, char *data, int size);
+
+int write_handle(int handle, unsigned long owner, const char *data, int size, int append);
+
+int truncate_handle(int handle, unsigned long owner, long size);
+
+int seek_handle(int handle, unsigned long owner, long offset);
+
+int export_tecnicofs_tree(int format, tree_emit_t emit, void *arg);
 
-void print_tecnicofs_tree(FILE *fp);
+int print_tecnicofs_tree(FILE *fp);
 
 #endif /* FS_H */
@@ -0,0 +1,302 @@
+#include "reclaim.h"
+#include "epoch.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Subtrees deleted with delete_tree: each is detached from its parent at
+ * once, and its i-nodes are deleted here, in the background, by a thread
+ * that takes RECLAIM_DUTY percent of a CPU at most. It runs at the
+ * workers' priority: the locks it takes are taken by requests too, which
+ * would wait for it if it could be kept off the CPU. Every node is removed
+ * from its directory and deleted under reclaim_lock, so a snapshot sees
+ * each subtree whole but for what was already reclaimed; checkpoints list
+ * the subtrees still to reclaim (see reclaim_snapshot), which are queued
+ * again on restore. reclaim_lock is taken after any i-node lock.
+ */
+int *reclaim_roots; /* detached, not yet deleted; the first is being reclaimed */
+int reclaim_count, reclaim_size;
+pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t reclaim_idle_cond = PTHREAD_COND_INITIALIZER;
+
+pthread_t reclaim_thread;
+int reclaim_running, reclaim_stopping;
+
+/* i-nodes deleted so far, for the benchmarks */
+long reclaim_total;
+
+/* Work done since the reclaimer last slept, in nanoseconds */
+long reclaim_busy;
+
+/*
+ * A directory being emptied, and where its entries are read from
+ */
+typedef struct reclaimFrame {
+  int inumber;
+  int pos;
+} ReclaimFrame;
+
+/*
+ * Queues a detached subtree. The caller holds reclaim_lock.
+ */
+static void reclaim_push(int inumber)
+{
+  int size;
+
+  if (reclaim_count == reclaim_size)
+  {
+    size = reclaim_size ? reclaim_size * 2 : 16;
+    if ((reclaim_roots = realloc(reclaim_roots, size * sizeof(int))) == NULL)
+      exit(EXIT_FAILURE);
+    reclaim_size = size;
+  }
+  reclaim_roots[reclaim_count++] = inumber;
+  pthread_cond_signal(&reclaim_cond);
+}
+
+static long reclaim_now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Counts the work done since start, with no lock held, and sleeps once a
+ * slice of it is done, for as long as RECLAIM_DUTY says.
+ */
+static void reclaim_throttle(long start)
+{
+  long sleep;
+  struct timespec ts;
+
+  if ((reclaim_busy += reclaim_now_ns() - start) < RECLAIM_SLICE)
+    return;
+  sleep = reclaim_busy * (100 - RECLAIM_DUTY) / RECLAIM_DUTY;
+  ts.tv_sec = sleep / 1000000000L;
+  ts.tv_nsec = sleep % 1000000000L;
+  nanosleep(&ts, NULL);
+  reclaim_busy = 0;
+}
+
+/*
+ * Deletes everything under a detached directory, leaving it empty. Goes
+ * down into each non-empty directory found, and deletes the rest, up to
+ * RECLAIM_BATCH entries at a time with its directory locked, so a
+ * directory is only locked for short whiles, and throttled between them.
+ * Returns: SUCCESS, or FAIL if stopped first
+ */
+static int reclaim_tree(int root)
+{
+  ReclaimFrame *stack, *frame;
+  int depth = 1, max = 16, child, descend, done, empty;
+  long start;
+  char name[MAX_FILE_NAME];
+  type nType, cType;
+  union Data data, cdata;
+
+  if ((stack = malloc(max * sizeof(ReclaimFrame))) == NULL)
+    exit(EXIT_FAILURE);
+  stack[0].inumber = root;
+  stack[0].pos = 0;
+
+  while (depth > 0 && !__atomic_load_n(&reclaim_stopping, __ATOMIC_RELAXED))
+  {
+    frame = &stack[depth - 1];
+    descend = FAIL;
+    start = reclaim_now_ns();
+    inodeLock('w', frame->inumber);
+    inode_get(frame->inumber, &nType, &data);
+    for (done = 0; nType == T_DIRECTORY && done < RECLAIM_BATCH &&
+                   dir_next(data.dir, &frame->pos, name, &child) == SUCCESS;
+         done++)
+    {
+      /* back to the entry's slot: once emptied, or to what is shifted
+       * into it when it is removed (see dir_remove) */
+      frame->pos--;
+      inodeLock('w', child);
+      inode_get(child, &cType, &cdata);
+      if (cType == T_DIRECTORY && dir_count(cdata.dir) > 0)
+      {
+        inodeUnlock(child);
+        descend = child;
+        break;
+      }
+      pthread_mutex_lock(&reclaim_lock);
+      dir_reset_entry(frame->inumber, child, name);
+      inode_delete(child);
+      pthread_mutex_unlock(&reclaim_lock);
+      inodeUnlock(child);
+      __atomic_add_fetch(&reclaim_total, 1, __ATOMIC_RELAXED);
+    }
+    empty = nType != T_DIRECTORY || dir_count(data.dir) == 0;
+    inodeUnlock(frame->inumber);
+    reclaim_throttle(start);
+
+    if (descend != FAIL)
+    {
+      if (depth == max && (stack = realloc(stack, (max *= 2) * sizeof(ReclaimFrame))) == NULL)
+        exit(EXIT_FAILURE);
+      stack[depth].inumber = descend;
+      stack[depth++].pos = 0;
+    }
+    else if (empty)
+      depth--; /* deleted from its parent's frame, the root by the caller */
+    else if (done < RECLAIM_BATCH)
+      frame->pos = 0; /* entries shifted back past the end: again */
+  }
+  free(stack);
+  return depth == 0 ? SUCCESS : FAIL;
+}
+
+/*
+ * The reclaimer: empties the detached subtrees one at a time, and then
+ * deletes their roots.
+ */
+static void *reclaim_loop(void *arg)
+{
+  int root;
+
+  pthread_mutex_lock(&reclaim_lock);
+  for (;;)
+  {
+    while (!reclaim_stopping && reclaim_count == 0)
+      pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+    if (reclaim_stopping)
+      break;
+    root = reclaim_roots[0];
+    pthread_mutex_unlock(&reclaim_lock);
+
+    /* the operations that reached the subtree before it was detached */
+    epoch_synchronize();
+    if (reclaim_tree(root) == FAIL)
+    {
+      pthread_mutex_lock(&reclaim_lock);
+      break;
+    }
+
+    /* along with its removal from the list, for snapshots (reclaim_snapshot) */
+    inodeLock('w', root);
+    pthread_mutex_lock(&reclaim_lock);
+    inode_delete(root);
+    inodeUnlock(root);
+    __atomic_add_fetch(&reclaim_total, 1, __ATOMIC_RELAXED);
+    memmove(reclaim_roots, reclaim_roots + 1, --reclaim_count * sizeof(int));
+    if (reclaim_count == 0)
+      pthread_cond_broadcast(&reclaim_idle_cond);
+  }
+  pthread_mutex_unlock(&reclaim_lock);
+  return NULL;
+}
+
+/*
+ * Starts the reclaimer, along with the file system.
+ */
+void reclaim_start()
+{
+  if (reclaim_running)
+    return;
+  reclaim_stopping = 0;
+  if (pthread_create(&reclaim_thread, NULL, reclaim_loop, NULL) != 0)
+    exit(EXIT_FAILURE);
+  reclaim_running = 1;
+}
+
+/*
+ * Stops the reclaimer, before the table is destroyed: the subtrees left
+ * are dropped along with it.
+ */
+void reclaim_stop()
+{
+  if (!reclaim_running)
+    return;
+  pthread_mutex_lock(&reclaim_lock);
+  __atomic_store_n(&reclaim_stopping, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&reclaim_cond);
+  pthread_mutex_unlock(&reclaim_lock);
+  pthread_join(reclaim_thread, NULL);
+
+  pthread_mutex_lock(&reclaim_lock);
+  reclaim_running = 0;
+  free(reclaim_roots);
+  reclaim_roots = NULL;
+  reclaim_count = reclaim_size = 0;
+  pthread_cond_broadcast(&reclaim_idle_cond);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * Detaches a directory from its parent, to be reclaimed. The caller holds
+ * the write locks of both.
+ * Input:
+ *  - parent_inumber: the parent
+ *  - inumber: the directory
+ *  - name: its name in the parent
+ * Returns: SUCCESS or FAIL (see dir_reset_entry)
+ */
+int reclaim_detach(int parent_inumber, int inumber, char *name)
+{
+  int status;
+
+  /* along with its queuing, for snapshots (reclaim_snapshot) */
+  pthread_mutex_lock(&reclaim_lock);
+  if ((status = dir_reset_entry(parent_inumber, inumber, name)) == SUCCESS)
+    reclaim_push(inumber);
+  pthread_mutex_unlock(&reclaim_lock);
+  return status;
+}
+
+/*
+ * Queues a subtree already detached, from a checkpoint being restored.
+ */
+void reclaim_add(int inumber)
+{
+  pthread_mutex_lock(&reclaim_lock);
+  reclaim_push(inumber);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * Takes a snapshot (see inode_snapshot_begin) for a checkpoint, along with
+ * the subtrees it sees detached and not yet deleted: neither detaching one
+ * nor deleting its root happens in between.
+ * Input:
+ *  - roots: where to store the list of their roots, to be freed
+ *  - count: where to store its length
+ * Returns: the snapshot
+ */
+unsigned long reclaim_snapshot(uint32_t **roots, uint32_t *count)
+{
+  unsigned long snapshot;
+
+  pthread_mutex_lock(&reclaim_lock);
+  snapshot = inode_snapshot_begin();
+  if ((*roots = malloc((reclaim_count + 1) * sizeof(uint32_t))) == NULL)
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < reclaim_count; i++)
+    (*roots)[i] = reclaim_roots[i];
+  *count = reclaim_count;
+  pthread_mutex_unlock(&reclaim_lock);
+  return snapshot;
+}
+
+/*
+ * Waits until every detached subtree is reclaimed.
+ */
+void reclaim_wait()
+{
+  pthread_mutex_lock(&reclaim_lock);
+  while (reclaim_count > 0 && reclaim_running)
+    pthread_cond_wait(&reclaim_idle_cond, &reclaim_lock);
+  pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * Returns the i-nodes reclaimed so far.
+ */
+long reclaim_reclaimed() { return __atomic_load_n(&reclaim_total, __ATOMIC_RELAXED); }
@@ -0,0 +1,28 @@
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+#include <stdint.h>
+
+/* Entries of a directory the reclaimer deletes before letting go of it */
+#define RECLAIM_BATCH 64
+
+/* Share of a CPU the reclaimer takes, in percent, and how long it works
+ * (in nanoseconds) before sleeping off the rest */
+#define RECLAIM_DUTY 25
+#define RECLAIM_SLICE 1000000L
+
+void reclaim_start();
+
+void reclaim_stop();
+
+int reclaim_detach(int parent_inumber, int inumber, char *name);
+
+void reclaim_add(int inumber);
+
+unsigned long reclaim_snapshot(uint32_t **roots, uint32_t *count);
+
+void reclaim_wait();
+
+long reclaim_reclaimed();
+
+#endif /* RECLAIM_H */
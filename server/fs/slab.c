@@ -0,0 +1,372 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Bytes of slabs mapped, for the benchmarks */
+size_t slab_mapped_bytes;
+
+#ifndef TECNICOFS_MALLOC
+
+/* Objects start past the slab's header, 16 byte aligned */
+#define SLAB_HEADER 64
+
+/*
+ * A slab: a SLAB_SIZE block of objects of one class, owned by one heap.
+ * Objects are carved from the end of the used part as needed, so a new
+ * slab is only touched as far as it is used; freed ones go on its free
+ * list. Only the owner changes a slab; it goes back to the pool once empty.
+ */
+typedef struct slab {
+  struct slabHeap *heap;
+  struct slab *next, *prev; /* in its class' partial list */
+  void *free;               /* freed objects, linked through their first word */
+  char *carve;              /* next object never handed out */
+  int size_class;
+  int size;
+  int capacity;
+  int used;
+} Slab;
+
+/*
+ * A heap's slabs of a size class. partial holds the slabs with free
+ * objects (full ones are on no list), allocated from first to last.
+ * remote is the stack other threads push the objects they free on; it is
+ * on a cache line of its own, away from what the owner touches.
+ */
+typedef struct slabClass {
+  Slab *partial;
+  Slab *empty;
+  int empty_count;
+  char pad[64 - 2 * sizeof(Slab *) - sizeof(int)];
+  void *remote;
+  char remote_pad[64 - sizeof(void *)];
+} SlabClass;
+
+/*
+ * A thread's slabs. Heaps are never freed: the heap of an exited thread is
+ * adopted by the next thread to start, along with whatever was freed to it
+ * meanwhile.
+ */
+typedef struct slabHeap {
+  struct slabHeap *next; /* in the orphans list */
+  SlabClass classes[SLAB_CLASSES];
+} SlabHeap;
+
+/* Empty slabs any heap can take */
+Slab *slab_pool;
+int slab_pool_count;
+pthread_mutex_t slab_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Heaps of exited threads */
+SlabHeap *slab_orphans;
+pthread_mutex_t slab_orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_key_t slab_key;
+pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+
+__thread SlabHeap *slab_heap;
+
+/*
+ * Hands the heap of an exiting thread to the orphans list.
+ */
+static void slab_thread_exit(void *arg)
+{
+  SlabHeap *heap = arg;
+
+  pthread_mutex_lock(&slab_orphans_lock);
+  heap->next = slab_orphans;
+  slab_orphans = heap;
+  pthread_mutex_unlock(&slab_orphans_lock);
+  slab_heap = NULL;
+}
+
+static void slab_make_key() { pthread_key_create(&slab_key, slab_thread_exit); }
+
+/*
+ * Returns the calling thread's heap, adopting an orphan or creating one on
+ * first use.
+ */
+static SlabHeap *slab_self()
+{
+  SlabHeap *heap;
+
+  if (slab_heap != NULL)
+    return slab_heap;
+
+  pthread_once(&slab_key_once, slab_make_key);
+  pthread_mutex_lock(&slab_orphans_lock);
+  heap = slab_orphans;
+  if (heap != NULL)
+    slab_orphans = heap->next;
+  pthread_mutex_unlock(&slab_orphans_lock);
+
+  if (heap == NULL)
+  {
+    /* cache line aligned, for the remote stacks to be on lines of their own */
+    if (posix_memalign((void **)&heap, 64, sizeof(SlabHeap)) != 0)
+      exit(EXIT_FAILURE);
+    memset(heap, 0, sizeof(SlabHeap));
+  }
+  slab_heap = heap;
+  pthread_setspecific(slab_key, heap);
+  return heap;
+}
+
+/*
+ * Returns the class of an object size (at most SLAB_MAX_OBJECT).
+ */
+static int slab_class(size_t size)
+{
+  int bits;
+
+  if (size <= 128)
+    return size == 0 ? 0 : (size - 1) >> 4;
+  bits = 63 - __builtin_clzl(size - 1); /* 7 to 11 */
+  return 8 + (bits - 7) * 4 + ((size - 1) >> (bits - 2)) - 4;
+}
+
+/*
+ * Returns the object size of a class.
+ */
+static int slab_class_size(int size_class)
+{
+  int shift;
+
+  if (size_class < 8)
+    return 16 * (size_class + 1);
+  shift = (size_class - 8) / 4;
+  return (128 << shift) + ((size_class - 8) % 4 + 1) * (32 << shift);
+}
+
+/*
+ * Maps a new slab, aligned to its size.
+ * Returns: the slab or NULL if out of memory
+ */
+static Slab *slab_map()
+{
+  char *area = mmap(NULL, 2 * SLAB_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  char *start;
+
+  if (area == MAP_FAILED)
+    return NULL;
+  start = (char *)(((uintptr_t)area + SLAB_SIZE - 1) & ~((uintptr_t)SLAB_SIZE - 1));
+  if (start > area)
+    munmap(area, start - area);
+  munmap(start + SLAB_SIZE, area + SLAB_SIZE - start);
+  __atomic_fetch_add(&slab_mapped_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+  return (Slab *)start;
+}
+
+/*
+ * Links a slab first in its class' partial list.
+ */
+static void slab_link(SlabClass *class, Slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = class->partial;
+  if (class->partial != NULL)
+    class->partial->prev = slab;
+  class->partial = slab;
+}
+
+/*
+ * Unlinks a slab from its class' partial list.
+ */
+static void slab_unlink(SlabClass *class, Slab *slab)
+{
+  if (slab->prev != NULL)
+    slab->prev->next = slab->next;
+  else
+    class->partial = slab->next;
+  if (slab->next != NULL)
+    slab->next->prev = slab->prev;
+}
+
+/*
+ * Gives a slab to a heap's class: one of its empty ones, one from the pool
+ * or a new one.
+ * Returns: the slab, linked in the partial list, or NULL if out of memory
+ */
+static Slab *slab_new(SlabHeap *heap, int size_class)
+{
+  SlabClass *class = &heap->classes[size_class];
+  Slab *slab = class->empty;
+
+  if (slab != NULL)
+  {
+    class->empty = slab->next;
+    class->empty_count--;
+  }
+  else
+  {
+    pthread_mutex_lock(&slab_pool_lock);
+    if ((slab = slab_pool) != NULL)
+    {
+      slab_pool = slab->next;
+      slab_pool_count--;
+    }
+    pthread_mutex_unlock(&slab_pool_lock);
+    if (slab == NULL && (slab = slab_map()) == NULL)
+      return NULL;
+  }
+
+  slab->heap = heap;
+  slab->free = NULL;
+  slab->carve = (char *)slab + SLAB_HEADER;
+  slab->size_class = size_class;
+  slab->size = slab_class_size(size_class);
+  slab->capacity = (SLAB_SIZE - SLAB_HEADER) / slab->size;
+  slab->used = 0;
+  slab_link(class, slab);
+  return slab;
+}
+
+/*
+ * Releases a slab that became empty: the class keeps a few, the pool some
+ * more, and the rest are unmapped.
+ */
+static void slab_release(SlabClass *class, Slab *slab)
+{
+  slab_unlink(class, slab);
+  if (class->empty_count < SLAB_KEEP_EMPTY)
+  {
+    slab->next = class->empty;
+    class->empty = slab;
+    class->empty_count++;
+    return;
+  }
+
+  pthread_mutex_lock(&slab_pool_lock);
+  if (slab_pool_count < SLAB_POOL_MAX)
+  {
+    slab->next = slab_pool;
+    slab_pool = slab;
+    slab_pool_count++;
+    slab = NULL;
+  }
+  pthread_mutex_unlock(&slab_pool_lock);
+  if (slab != NULL)
+  {
+    munmap(slab, SLAB_SIZE);
+    __atomic_fetch_sub(&slab_mapped_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Returns an object to its slab, owned by the calling thread's heap.
+ */
+static void slab_free_local(SlabHeap *heap, Slab *slab, void *ptr)
+{
+  SlabClass *class = &heap->classes[slab->size_class];
+
+  *(void **)ptr = slab->free;
+  slab->free = ptr;
+  if (slab->used-- == slab->capacity)
+    slab_link(class, slab);
+  if (slab->used == 0)
+    slab_release(class, slab);
+}
+
+/*
+ * Takes back the objects other threads freed to a class.
+ * Returns: whether there were any
+ */
+static int slab_drain(SlabHeap *heap, SlabClass *class)
+{
+  void *ptr, *next;
+
+  if (__atomic_load_n(&class->remote, __ATOMIC_RELAXED) == NULL)
+    return 0;
+  /* The whole stack is taken at once, so pushes never race with pops */
+  ptr = __atomic_exchange_n(&class->remote, NULL, __ATOMIC_ACQUIRE);
+  for (; ptr != NULL; ptr = next)
+  {
+    next = *(void **)ptr;
+    slab_free_local(heap, (Slab *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1)), ptr);
+  }
+  return 1;
+}
+
+/*
+ * Allocates an object: from the calling thread's slabs of its class if it
+ * is at most SLAB_MAX_OBJECT bytes, else from malloc.
+ * Returns: the object, 16 byte aligned, or NULL if out of memory
+ */
+void *slab_alloc(size_t size)
+{
+  SlabHeap *heap;
+  SlabClass *class;
+  Slab *slab;
+  void *ptr;
+  int size_class;
+
+  if (size > SLAB_MAX_OBJECT)
+    return malloc(size);
+  heap = slab_self();
+  size_class = slab_class(size);
+  class = &heap->classes[size_class];
+
+  if ((slab = class->partial) == NULL && (!slab_drain(heap, class) || (slab = class->partial) == NULL) &&
+      (slab = slab_new(heap, size_class)) == NULL)
+    return NULL;
+
+  if (slab->free != NULL)
+  {
+    ptr = slab->free;
+    slab->free = *(void **)ptr;
+  }
+  else
+  {
+    ptr = slab->carve;
+    slab->carve += slab->size;
+  }
+  if (++slab->used == slab->capacity)
+    slab_unlink(class, slab);
+  return ptr;
+}
+
+/*
+ * Frees an object from slab_alloc, from any thread.
+ * Input:
+ *  - ptr: the object, or NULL
+ *  - size: the size it was allocated with
+ */
+void slab_free(void *ptr, size_t size)
+{
+  Slab *slab;
+  SlabClass *class;
+  void *top;
+
+  if (ptr == NULL)
+    return;
+  if (size > SLAB_MAX_OBJECT)
+  {
+    free(ptr);
+    return;
+  }
+
+  slab = (Slab *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+  if (slab->heap == slab_heap)
+  {
+    slab_free_local(slab_heap, slab, ptr);
+    return;
+  }
+
+  class = &slab->heap->classes[slab->size_class];
+  top = __atomic_load_n(&class->remote, __ATOMIC_RELAXED);
+  do
+    *(void **)ptr = top;
+  while (!__atomic_compare_exchange_n(&class->remote, &top, ptr, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#endif /* TECNICOFS_MALLOC */
+
+/*
+ * Returns the bytes of slabs currently mapped (0 when built with MALLOC=1).
+ */
+size_t slab_mapped() { return __atomic_load_n(&slab_mapped_bytes, __ATOMIC_RELAXED); }
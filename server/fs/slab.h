@@ -0,0 +1,48 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/* Slabs are aligned to their size, so an object's slab is found by masking
+ * its address */
+#define SLAB_BITS 18
+#define SLAB_SIZE (1 << SLAB_BITS)
+
+/* Largest object served from slabs (a file block); larger ones come from
+ * malloc */
+#define SLAB_MAX_OBJECT 4096
+
+/* Size classes: multiples of 16 bytes up to 128, then four per doubling up
+ * to SLAB_MAX_OBJECT */
+#define SLAB_CLASSES 28
+
+/* Empty slabs a thread keeps per class, and that are shared between
+ * threads, before they are returned to the system */
+#define SLAB_KEEP_EMPTY 1
+#define SLAB_POOL_MAX 256
+
+/*
+ * Per-thread slab allocator for the file system's small, identically sized
+ * objects: directories, their tables and arenas, files, their blocks and
+ * block tables, i-node versions and epoch garbage records. Every thread
+ * allocates from slabs of its own without locking; an object freed by
+ * another thread (the epoch reclaimer, a delete from another worker) is
+ * pushed on a lock-free stack of the owner, which takes it back the next
+ * time it runs out of free objects in that class. Objects are freed with
+ * the size they were allocated with.
+ * Building with MALLOC=1 (which defines TECNICOFS_MALLOC) makes both plain
+ * malloc and free, for comparison.
+ */
+#ifdef TECNICOFS_MALLOC
+#define slab_alloc(size) malloc(size)
+#define slab_free(ptr, size) free(ptr)
+#else
+void *slab_alloc(size_t size);
+
+void slab_free(void *ptr, size_t size);
+#endif
+
+size_t slab_mapped();
+
+#endif /* SLAB_H */
@@ -1,5 +1,9 @@
 #include "state.h"
+#include "epoch.h"
+#include "inject.h"
+#include "slab.h"
 #include "../tecnicofs-api-constants.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,7 +11,530 @@
 
 #include <pthread.h>
 
-inode_t inode_table[INODE_TABLE_SIZE];
+/* Segment directory: inode_segments[i] holds i-nodes
+ * [i * INODE_SEGMENT_SIZE, (i + 1) * INODE_SEGMENT_SIZE) or NULL */
+inode_t **inode_segments;
+int inode_segments_count;
+int inode_max;
+
+/* Number of i-numbers handed out so far (high-water mark) */
+int inode_next;
+
+/* Bumped by every inode_table_init, so caches left over from a previous
+ * table are ignored */
+int inode_table_id;
+
+/*
+ * A batch of free i-numbers in the shared pool
+ */
+typedef struct inodeBatch
+{
+  struct inodeBatch *next;
+  int count;
+  int inumbers[INODE_BATCH_SIZE];
+} InodeBatch;
+
+/*
+ * Per-thread stack of free i-numbers, allocated from and freed to without
+ * any locking
+ */
+typedef struct inodeCache
+{
+  int table_id;
+  int drain_seq;
+  int count;
+  int inumbers[INODE_CACHE_SIZE];
+} InodeCache;
+
+__thread InodeCache inode_cache;
+
+/* Shared pool of freed i-numbers */
+InodeBatch *inode_free_batches;
+pthread_mutex_t inode_free_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped by a thread that finds the table full: every thread then hands its
+ * cached i-numbers back to the shared pool, on its next allocation or free */
+int inode_drain_seq;
+
+pthread_key_t inode_cache_key;
+pthread_once_t inode_cache_key_once = PTHREAD_ONCE_INIT;
+
+/* Snapshot clock: changes are stamped with it, and the snapshot that moved
+ * it to S sees exactly the changes stamped below S */
+unsigned long snapshot_clock = 1;
+
+/* Snapshots in use, oldest first, and their number and oldest (atomic,
+ * ULONG_MAX if none) for writers to check without the lock */
+unsigned long *snapshot_ids;
+int snapshot_ids_count, snapshot_ids_size;
+int snapshot_active = 0;
+unsigned long snapshot_oldest = ULONG_MAX;
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* I-numbers of the i-nodes with kept versions, pruned as snapshots end */
+int *snapshot_versioned;
+int snapshot_versioned_count, snapshot_versioned_size;
+pthread_mutex_t snapshot_versioned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The checkpoint the table was restored from (see inode_table_restore):
+ * its segments are only built from it when first used */
+char *restored_image;
+int restored_inodes; /* i-numbers below this are in it, 0 if none */
+int restored_end;    /* end of its last segment */
+unsigned char *restored_types;
+uint32_t *restored_segment_dirs;
+CheckpointDir *restored_dirs;
+
+static int inode_segment_alloc(int inumber);
+
+/*
+ * Returns the i-node with the given inumber, or NULL if it is out of range or
+ * its segment was never allocated.
+ */
+inode_t *inode_at(int inumber)
+{
+  inode_t *segment;
+
+  if (inumber < 0 || inumber >= inode_max)
+    return NULL;
+  segment = __atomic_load_n(&inode_segments[inumber >> INODE_SEGMENT_BITS],
+                            __ATOMIC_ACQUIRE);
+  if (segment == NULL)
+  {
+    /* restored, but not used since */
+    if (inumber >= restored_end)
+      return NULL;
+    if (inode_segment_alloc(inumber) == FAIL)
+      exit(EXIT_FAILURE);
+    segment = __atomic_load_n(&inode_segments[inumber >> INODE_SEGMENT_BITS], __ATOMIC_ACQUIRE);
+  }
+  return &segment[inumber & (INODE_SEGMENT_SIZE - 1)];
+}
+
+/*
+ * Fills a segment with its i-nodes in the checkpoint the table was restored
+ * from: their types and, for directories, their entries, which stay in the
+ * checkpoint's image until changed (see dir_from_image).
+ * Returns: SUCCESS or FAIL
+ */
+static int inode_segment_restore(inode_t *segment, int index)
+{
+  int first = index << INODE_SEGMENT_BITS;
+  CheckpointDir *dir;
+
+  for (int i = 0; i < INODE_SEGMENT_SIZE && first + i < restored_inodes; i++)
+    segment[i].nodeType = restored_types[first + i];
+  for (uint32_t d = restored_segment_dirs[index]; d < restored_segment_dirs[index + 1]; d++)
+  {
+    dir = &restored_dirs[d];
+    segment[dir->inumber - first].data.dir = dir_from_image(restored_image + dir->offset, &dir->image);
+    if (segment[dir->inumber - first].data.dir == NULL)
+      return FAIL;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Releases a segment never published: only the directories restored into
+ * it are its own, their images are not.
+ */
+static void inode_segment_discard(inode_t *segment)
+{
+  for (int i = 0; i < INODE_SEGMENT_SIZE; i++)
+  {
+    pthread_rwlock_destroy(&segment[i].lock);
+    if (segment[i].nodeType == T_DIRECTORY)
+      slab_free(segment[i].data.dir, sizeof(Dir));
+  }
+  free(segment);
+}
+
+/*
+ * Makes sure the segment holding inumber exists, restored from the
+ * checkpoint if it is in it. Threads racing to allocate the same segment
+ * all build one, only the first to publish it wins.
+ * Returns: SUCCESS or FAIL
+ */
+static int inode_segment_alloc(int inumber)
+{
+  int index = inumber >> INODE_SEGMENT_BITS;
+  inode_t *segment, *expected = NULL;
+
+  if (__atomic_load_n(&inode_segments[index], __ATOMIC_ACQUIRE) != NULL)
+    return SUCCESS;
+
+  segment = malloc(sizeof(inode_t) * INODE_SEGMENT_SIZE);
+  if (segment == NULL)
+    return FAIL;
+  for (int i = 0; i < INODE_SEGMENT_SIZE; i++)
+  {
+    if (pthread_rwlock_init(&segment[i].lock, NULL) != 0)
+      exit(EXIT_FAILURE);
+    segment[i].seq = 0;
+    segment[i].nodeType = T_NONE;
+    segment[i].data.dir = NULL;
+    segment[i].version = 0;
+    segment[i].versions = NULL;
+    segment[i].generation = 0;
+  }
+  if (inumber < restored_end && inode_segment_restore(segment, index) == FAIL)
+  {
+    inode_segment_discard(segment);
+    return FAIL;
+  }
+
+  if (!__atomic_compare_exchange_n(&inode_segments[index], &expected, segment,
+                                   0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+  {
+    /* Someone else published it first */
+    inode_segment_discard(segment);
+  }
+  return SUCCESS;
+}
+
+/*
+ * Hands every i-number of a cache back to the shared pool.
+ */
+static void inode_cache_drain(InodeCache *cache)
+{
+  InodeBatch *batch;
+
+  while (cache->count > 0)
+  {
+    if ((batch = malloc(sizeof(InodeBatch))) == NULL)
+      exit(EXIT_FAILURE);
+    batch->count = cache->count < INODE_BATCH_SIZE ? cache->count : INODE_BATCH_SIZE;
+    cache->count -= batch->count;
+    memcpy(batch->inumbers, cache->inumbers + cache->count, sizeof(int) * batch->count);
+
+    pthread_mutex_lock(&inode_free_lock);
+    batch->next = inode_free_batches;
+    inode_free_batches = batch;
+    pthread_mutex_unlock(&inode_free_lock);
+  }
+}
+
+/*
+ * Hands the cache of an exiting thread back to the shared pool.
+ */
+static void inode_cache_exit(void *arg)
+{
+  InodeCache *cache = arg;
+
+  if (cache->table_id == inode_table_id)
+    inode_cache_drain(cache);
+}
+
+static void inode_cache_make_key() { pthread_key_create(&inode_cache_key, inode_cache_exit); }
+
+/*
+ * Returns the calling thread's cache, emptied if it belongs to an older table
+ * and drained if a thread found the table full since it was last used.
+ */
+static InodeCache *inode_cache_get()
+{
+  int drain_seq = __atomic_load_n(&inode_drain_seq, __ATOMIC_RELAXED);
+
+  if (inode_cache.table_id != inode_table_id)
+  {
+    pthread_once(&inode_cache_key_once, inode_cache_make_key);
+    pthread_setspecific(inode_cache_key, &inode_cache);
+    inode_cache.table_id = inode_table_id;
+    inode_cache.drain_seq = drain_seq;
+    inode_cache.count = 0;
+  }
+  else if (inode_cache.drain_seq != drain_seq)
+  {
+    inode_cache.drain_seq = drain_seq;
+    inode_cache_drain(&inode_cache);
+  }
+  return &inode_cache;
+}
+
+/*
+ * Refills an empty cache with one batch, taken from the shared pool of freed
+ * i-numbers or, if there is none, from never used ones.
+ * Returns: SUCCESS or FAIL (table full)
+ */
+static int inode_cache_refill(InodeCache *cache)
+{
+  InodeBatch *batch;
+  int first, last;
+
+  pthread_mutex_lock(&inode_free_lock);
+  batch = inode_free_batches;
+  if (batch != NULL)
+    inode_free_batches = batch->next;
+  pthread_mutex_unlock(&inode_free_lock);
+
+  if (batch != NULL)
+  {
+    memcpy(cache->inumbers, batch->inumbers, sizeof(int) * batch->count);
+    cache->count = batch->count;
+    free(batch);
+    return SUCCESS;
+  }
+
+  if (__atomic_load_n(&inode_next, __ATOMIC_RELAXED) >= inode_max)
+    return FAIL;
+  first = __atomic_fetch_add(&inode_next, INODE_BATCH_SIZE, __ATOMIC_RELAXED);
+  if (first >= inode_max)
+    return FAIL;
+  last = first + INODE_BATCH_SIZE < inode_max ? first + INODE_BATCH_SIZE
+                                              : inode_max;
+
+  /* A batch never crosses a segment boundary */
+  if (inode_segment_alloc(first) == FAIL)
+    return FAIL;
+
+  /* Pushed in reverse, so they are handed out in increasing order */
+  for (int inumber = last - 1; inumber >= first; inumber--)
+    cache->inumbers[cache->count++] = inumber;
+  return SUCCESS;
+}
+
+/*
+ * Moves the oldest batch of a full cache to the shared pool.
+ */
+static void inode_cache_spill(InodeCache *cache)
+{
+  InodeBatch *batch = malloc(sizeof(InodeBatch));
+
+  if (batch == NULL)
+    exit(EXIT_FAILURE);
+  batch->count = INODE_BATCH_SIZE;
+  memcpy(batch->inumbers, cache->inumbers, sizeof(batch->inumbers));
+  cache->count -= INODE_BATCH_SIZE;
+  memmove(cache->inumbers, cache->inumbers + INODE_BATCH_SIZE,
+          sizeof(int) * cache->count);
+
+  pthread_mutex_lock(&inode_free_lock);
+  batch->next = inode_free_batches;
+  inode_free_batches = batch;
+  pthread_mutex_unlock(&inode_free_lock);
+}
+
+/*
+ * Checks if inumber refers to an allocated i-node.
+ */
+static int inode_valid(int inumber)
+{
+  inode_t *inode = inode_at(inumber);
+  return inode != NULL && inode->nodeType != T_NONE;
+}
+
+/*
+ * Marks the start of a change to an i-node's type or data, so concurrent
+ * lock-free readers (see inode_read_begin) retry. The caller must hold the
+ * i-node's write lock.
+ */
+static void inode_write_begin(inode_t *inode)
+{
+  __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Marks the end of a change started with inode_write_begin.
+ */
+static void inode_write_end(inode_t *inode)
+{
+  __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Adds an i-node to the list of those with kept versions.
+ */
+static void inode_list_versioned(int inumber)
+{
+  int size;
+
+  pthread_mutex_lock(&snapshot_versioned_lock);
+  if (snapshot_versioned_count == snapshot_versioned_size)
+  {
+    size = snapshot_versioned_size ? snapshot_versioned_size * 2 : 64;
+    if ((snapshot_versioned = realloc(snapshot_versioned, size * sizeof(int))) == NULL)
+      exit(EXIT_FAILURE);
+    snapshot_versioned_size = size;
+  }
+  snapshot_versioned[snapshot_versioned_count++] = inumber;
+  pthread_mutex_unlock(&snapshot_versioned_lock);
+}
+
+/*
+ * Reads the snapshot clock, to stamp a change with. Read once per operation,
+ * after inode_write_begin of every i-node it changes: a snapshot then either
+ * sees all of the operation or none of it.
+ */
+static unsigned long inode_clock()
+{
+  return __atomic_load_n(&snapshot_clock, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stamps a change to an i-node with the snapshot clock. If a snapshot was
+ * taken since its last change, its current state is kept first, for the
+ * snapshots that must not see this change: a copy of its directory or, if
+ * it is being deleted, the directory itself, which it then no longer owns.
+ * The caller must hold its write lock, past inode_write_begin.
+ * Input:
+ *  - inumber: the i-node
+ *  - clock: from inode_clock
+ *  - deleting: whether the change deletes the i-node
+ */
+static void inode_stamp(int inumber, unsigned long clock, int deleting)
+{
+  inode_t *inode = inode_at(inumber);
+  InodeVersion *version;
+
+  if (inode->version < clock && inode->nodeType != T_NONE &&
+      __atomic_load_n(&snapshot_active, __ATOMIC_SEQ_CST) > 0)
+  {
+    if ((version = slab_alloc(sizeof(InodeVersion))) == NULL)
+      exit(EXIT_FAILURE);
+    version->from = inode->version;
+    version->to = clock;
+    version->nodeType = inode->nodeType;
+    version->dir = NULL;
+    if (inode->nodeType == T_DIRECTORY)
+    {
+      if (deleting)
+      {
+        version->dir = inode->data.dir;
+        inode->data.dir = NULL;
+      }
+      else if ((version->dir = dir_clone(inode->data.dir)) == NULL)
+        exit(EXIT_FAILURE);
+    }
+    version->next = inode->versions;
+    if (inode->versions == NULL)
+      inode_list_versioned(inumber);
+    __atomic_store_n(&inode->versions, version, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&inode->version, clock, __ATOMIC_RELAXED);
+}
+
+/*
+ * The state an i-node had for a snapshot: its current one if it has not
+ * changed since the snapshot was taken, else the kept version for it. Lock
+ * free readers call it between inode_read_begin and inode_read_retry.
+ * Input:
+ *  - inode: the i-node
+ *  - snapshot: the snapshot
+ *  - dir: where to store its directory, if it was one
+ * Returns: its type then, T_NONE if it did not exist
+ */
+static type inode_state_at(inode_t *inode, unsigned long snapshot, Dir **dir)
+{
+  InodeVersion *version;
+
+  if (__atomic_load_n(&inode->version, __ATOMIC_RELAXED) < snapshot)
+  {
+    *dir = __atomic_load_n(&inode->data.dir, __ATOMIC_RELAXED);
+    return __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+  }
+  for (version = __atomic_load_n(&inode->versions, __ATOMIC_ACQUIRE); version != NULL;
+       version = version->next)
+  {
+    if (snapshot > version->to)
+      break;
+    if (snapshot > version->from)
+    {
+      *dir = version->dir;
+      return version->nodeType;
+    }
+  }
+  return T_NONE;
+}
+
+/*
+ * Takes a snapshot: until inode_snapshot_end, readers may see the tree as it
+ * was at this point, while writers go on. Each i-node changed meanwhile
+ * keeps its previous state, once per snapshot (see inode_stamp).
+ * Returns: the snapshot
+ */
+unsigned long inode_snapshot_begin()
+{
+  unsigned long snapshot;
+  int size;
+
+  pthread_mutex_lock(&snapshot_lock);
+  if (snapshot_ids_count == snapshot_ids_size)
+  {
+    size = snapshot_ids_size ? snapshot_ids_size * 2 : 8;
+    if ((snapshot_ids = realloc(snapshot_ids, size * sizeof(unsigned long))) == NULL)
+      exit(EXIT_FAILURE);
+    snapshot_ids_size = size;
+  }
+  /* raised before the clock moves: a writer that sees the new clock sees
+   * the snapshot in use */
+  __atomic_add_fetch(&snapshot_active, 1, __ATOMIC_SEQ_CST);
+  snapshot = __atomic_add_fetch(&snapshot_clock, 1, __ATOMIC_SEQ_CST);
+  snapshot_ids[snapshot_ids_count++] = snapshot;
+  __atomic_store_n(&snapshot_oldest, snapshot_ids[0], __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&snapshot_lock);
+  return snapshot;
+}
+
+/*
+ * Ends a snapshot, and discards the kept versions no snapshot in use needs
+ * anymore. They are retired (see epoch.h), since lock-free readers may
+ * still be looking at them.
+ * Input:
+ *  - snapshot: from inode_snapshot_begin
+ */
+void inode_snapshot_end(unsigned long snapshot)
+{
+  InodeVersion **link, *version;
+  inode_t *inode;
+  int *versioned, count, i;
+
+  pthread_mutex_lock(&snapshot_lock);
+  for (i = 0; i < snapshot_ids_count && snapshot_ids[i] != snapshot; i++)
+    ;
+  if (i == snapshot_ids_count)
+  {
+    pthread_mutex_unlock(&snapshot_lock);
+    return;
+  }
+  memmove(snapshot_ids + i, snapshot_ids + i + 1, (snapshot_ids_count - i - 1) * sizeof(unsigned long));
+  snapshot_ids_count--;
+  __atomic_store_n(&snapshot_oldest, snapshot_ids_count ? snapshot_ids[0] : ULONG_MAX, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&snapshot_active, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&snapshot_lock);
+
+  pthread_mutex_lock(&snapshot_versioned_lock);
+  versioned = snapshot_versioned;
+  count = snapshot_versioned_count;
+  snapshot_versioned = NULL;
+  snapshot_versioned_count = snapshot_versioned_size = 0;
+  pthread_mutex_unlock(&snapshot_versioned_lock);
+
+  for (i = 0; i < count; i++)
+  {
+    inode = inode_at(versioned[i]);
+    pthread_rwlock_wrlock(&inode->lock);
+    inode_write_begin(inode);
+    /* versions are newest first: only those for older snapshots go */
+    link = &inode->versions;
+    while (*link != NULL && (*link)->to >= __atomic_load_n(&snapshot_oldest, __ATOMIC_SEQ_CST))
+      link = &(*link)->next;
+    version = *link;
+    __atomic_store_n(link, NULL, __ATOMIC_RELEASE);
+    inode_write_end(inode);
+    if (inode->versions != NULL)
+      inode_list_versioned(versioned[i]);
+    pthread_rwlock_unlock(&inode->lock);
+
+    for (InodeVersion *next; version != NULL; version = next)
+    {
+      next = version->next;
+      dir_free(version->dir);
+      epoch_retire(version, sizeof(InodeVersion));
+    }
+  }
+  free(versioned);
+}
 
 /*
  * Unlocks an inode
@@ -17,14 +544,14 @@ void inodeLock(char lockmethod, int inumber)
   switch (lockmethod)
   {
   case 'r':
-    if (pthread_rwlock_rdlock(&inode_table[inumber].lock) != 0)
+    if (pthread_rwlock_rdlock(&inode_at(inumber)->lock) != 0)
     {
       exit(EXIT_FAILURE);
     }
     break;
 
   case 'w':
-    if (pthread_rwlock_wrlock(&inode_table[inumber].lock) != 0)
+    if (pthread_rwlock_wrlock(&inode_at(inumber)->lock) != 0)
     {
       exit(EXIT_FAILURE);
     }
@@ -36,12 +563,25 @@ void inodeLock(char lockmethod, int inumber)
   }
 }
 
+/*
+ * Locks an inode if no other thread holds it, without waiting.
+ * Returns: SUCCESS, or FAIL if it is held
+ */
+int inodeTryLock(char lockmethod, int inumber)
+{
+  pthread_rwlock_t *lock = &inode_at(inumber)->lock;
+
+  return (lockmethod == 'r' ? pthread_rwlock_tryrdlock(lock) : pthread_rwlock_trywrlock(lock)) == 0
+             ? SUCCESS
+             : FAIL;
+}
+
 /*
  * Locks an inode
  */
 void inodeUnlock(int inumber)
 {
-  if (pthread_rwlock_unlock(&inode_table[inumber].lock) != 0)
+  if (pthread_rwlock_unlock(&inode_at(inumber)->lock) != 0)
   {
     exit(EXIT_FAILURE);
   }
@@ -60,28 +600,34 @@ void unlockAll(int *locked, int index)
 }
 
 /*
- * Sleeps for synchronization testing.
+ * Releases the contents of an i-node, according to its type.
  */
-void insert_delay(int cycles)
+static void inode_free_data(inode_t *inode)
 {
-  for (int i = 0; i < cycles; i++)
-  {
-  }
+  if (inode->nodeType == T_DIRECTORY)
+    dir_free(inode->data.dir);
+  else
+    file_free(inode->data.file);
+  inode->data.dir = NULL;
 }
 
 /*
  * Initializes the i-nodes table.
+ * Input:
+ *  - max_inodes: maximum number of i-nodes the table may grow to
  */
-void inode_table_init()
+void inode_table_init(int max_inodes)
 {
-  for (int i = 0; i < INODE_TABLE_SIZE; i++)
-  {
-    if (pthread_rwlock_init(&inode_table[i].lock, NULL) != 0)
-      exit(EXIT_FAILURE);
-    inode_table[i].nodeType = T_NONE;
-    inode_table[i].data.dirEntries = NULL;
-    inode_table[i].data.fileContents = NULL;
-  }
+  if (max_inodes <= 0)
+    max_inodes = DEFAULT_MAX_INODES;
+  inode_segments_count =
+      (max_inodes + INODE_SEGMENT_SIZE - 1) >> INODE_SEGMENT_BITS;
+  inode_max = max_inodes;
+  inode_next = 0;
+  inode_table_id++;
+  inode_segments = calloc(inode_segments_count, sizeof(inode_t *));
+  if (inode_segments == NULL)
+    exit(EXIT_FAILURE);
 }
 
 /*
@@ -89,24 +635,74 @@ void inode_table_init()
  */
 void inode_table_destroy()
 {
-
-  for (int i = 0; i < INODE_TABLE_SIZE; i++)
+  for (int s = 0; s < inode_segments_count; s++)
   {
-    if (pthread_rwlock_destroy(&inode_table[i].lock) != 0)
-      exit(EXIT_FAILURE);
-    if (inode_table[i].nodeType != T_NONE)
+    inode_t *segment = inode_segments[s];
+    if (segment == NULL)
+      continue;
+    for (int i = 0; i < INODE_SEGMENT_SIZE; i++)
     {
-      /* as data is an union, the same pointer is used for both dirEntries and
-       * fileContents */
-      /* just release one of them */
-      if (inode_table[i].data.dirEntries)
-        free(inode_table[i].data.dirEntries);
+      if (pthread_rwlock_destroy(&segment[i].lock) != 0)
+        exit(EXIT_FAILURE);
+      if (segment[i].nodeType != T_NONE)
+        inode_free_data(&segment[i]);
+      for (InodeVersion *version = segment[i].versions, *next; version != NULL; version = next)
+      {
+        next = version->next;
+        dir_free(version->dir);
+        slab_free(version, sizeof(InodeVersion));
+      }
     }
+    free(segment);
+  }
+  free(inode_segments);
+  inode_segments = NULL;
+  free(snapshot_versioned);
+  snapshot_versioned = NULL;
+  snapshot_versioned_count = snapshot_versioned_size = 0;
+
+  while (inode_free_batches != NULL)
+  {
+    InodeBatch *batch = inode_free_batches;
+    inode_free_batches = batch->next;
+    free(batch);
+  }
+
+  /* the checkpoint may be unmapped now */
+  restored_image = NULL;
+  restored_inodes = restored_end = 0;
+  dir_map_images(NULL, 0);
+}
+
+/*
+ * Fills a freshly claimed i-node. The caller must hold its write lock.
+ */
+static void inode_fill(inode_t *inode, type nType)
+{
+  inode_write_begin(inode);
+  /* nothing to keep: no snapshot sees a free i-node */
+  __atomic_store_n(&inode->version, inode_clock(), __ATOMIC_RELAXED);
+  inode->nodeType = nType;
+  if (nType == T_DIRECTORY)
+  {
+    /* Initializes entry table */
+    inode->data.dir = dir_new();
+    if (inode->data.dir == NULL)
+      exit(EXIT_FAILURE);
   }
+  else
+    inode->data.file = NULL;
+  inode_write_end(inode);
 }
 
 /*
  * Creates a new i-node in the table with the given information.
+ * The i-number comes from the calling thread's cache of free i-numbers, so
+ * this is constant time and threads allocate from disjoint i-node ranges.
+ * Cached i-numbers are only hints, checked to be free under their lock
+ * before being used. Once the table is full, the i-numbers still sitting in
+ * other threads' caches are not scanned for: this fails and asks every
+ * thread to hand its cache back to the shared pool, for later creates.
  * Input:
  *  - nType: the type of the node (file or directory)
  * Returns:
@@ -115,33 +711,29 @@ void inode_table_destroy()
  */
 int inode_create(type nType, int parent_inumber)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  int inumber;
+  inode_t *inode;
+  InodeCache *cache = inode_cache_get();
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  if (INJECT(INJECT_INODE_CREATE))
+    return FAIL;
 
-  for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++)
+  while (cache->count > 0 || inode_cache_refill(cache) == SUCCESS)
   {
-    /* If the inode is being used by other thread, we skip it */
-    if (pthread_rwlock_trywrlock(&inode_table[inumber].lock) != 0)
-      continue;
-    if (inode_table[inumber].nodeType == T_NONE)
+    inumber = cache->inumbers[--cache->count];
+    inode = inode_at(inumber);
+    pthread_rwlock_wrlock(&inode->lock);
+    if (inode->nodeType == T_NONE)
     {
-      inode_table[inumber].nodeType = nType;
-      if (nType == T_DIRECTORY)
-      {
-        /* Initializes entry table */
-        inode_table[inumber].data.dirEntries =
-            malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-          inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-      }
-      else
-        inode_table[inumber].data.fileContents = NULL;
+      inode_fill(inode, nType);
       inodeUnlock(inumber);
       return inumber;
     }
     inodeUnlock(inumber);
   }
+
+  __atomic_fetch_add(&inode_drain_seq, 1, __ATOMIC_RELAXED);
   return FAIL;
 }
 
@@ -153,21 +745,29 @@ int inode_create(type nType, int parent_inumber)
  */
 int inode_delete(int inumber)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  InodeCache *cache;
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  (void)INJECT(INJECT_INODE_DELETE);
 
   /*Critical Zone Beggining*/
-  if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) ||
-      (inode_table[inumber].nodeType == T_NONE))
+  if (!inode_valid(inumber))
   {
     printf("inode_delete: invalid inumber\n");
     return FAIL;
   }
 
-  inode_table[inumber].nodeType = T_NONE;
-  /* see inode_table_destroy function */
-  if (inode_table[inumber].data.dirEntries)
-    free(inode_table[inumber].data.dirEntries);
+  inode_write_begin(inode_at(inumber));
+  inode_stamp(inumber, inode_clock(), 1);
+  inode_free_data(inode_at(inumber));
+  inode_at(inumber)->nodeType = T_NONE;
+  inode_at(inumber)->generation++;
+  inode_write_end(inode_at(inumber));
+
+  cache = inode_cache_get();
+  if (cache->count == INODE_CACHE_SIZE)
+    inode_cache_spill(cache);
+  cache->inumbers[cache->count++] = inumber;
   return SUCCESS;
 }
 
@@ -182,67 +782,108 @@ int inode_delete(int inumber)
  */
 int inode_get(int inumber, type *nType, union Data *data)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  (void)INJECT(INJECT_INODE_GET);
   /*Critical Zone Beggining*/
-  if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) ||
-      (inode_table[inumber].nodeType == T_NONE))
+  if (!inode_valid(inumber))
   {
     printf("inode_get: invalid inumber %d\n", inumber);
     return FAIL;
   }
   if (nType)
-    *nType = inode_table[inumber].nodeType;
+    *nType = inode_at(inumber)->nodeType;
 
   if (data)
-    *data = inode_table[inumber].data;
+    *data = inode_at(inumber)->data;
 
   return SUCCESS;
 }
 
+/*
+ * Starts a lock-free read of an i-node's type and data (see inode_peek).
+ * Returns: the sequence number to pass to inode_read_retry
+ */
+unsigned int inode_read_begin(int inumber)
+{
+  inode_t *inode = inode_at(inumber);
+
+  if (inode == NULL)
+    return 1; /* odd: inode_read_retry always fails */
+  return __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Checks whether what was read since inode_read_begin may be inconsistent,
+ * because the i-node was changed meanwhile.
+ * Returns: 0 if the reads are valid, 1 if they must be retried
+ */
+int inode_read_retry(int inumber, unsigned int seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (seq & 1) || __atomic_load_n(&inode_at(inumber)->seq,
+                                      __ATOMIC_RELAXED) != seq;
+}
+
+/*
+ * Like inode_get, for lock-free readers: no injection and no complaints about
+ * invalid i-numbers. The result must be checked with inode_read_retry before
+ * being used, and data only dereferenced inside an epoch critical section.
+ * Returns: SUCCESS or FAIL
+ */
+int inode_peek(int inumber, type *nType, union Data *data)
+{
+  inode_t *inode = inode_at(inumber);
+
+  if (inode == NULL)
+    return FAIL;
+  *nType = __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+  data->dir = __atomic_load_n(&inode->data.dir, __ATOMIC_RELAXED);
+  return *nType == T_NONE ? FAIL : SUCCESS;
+}
+
 /*
  * Resets an entry for a directory.
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber)
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  Dir *dir;
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  if (INJECT(INJECT_DIR_RESET_ENTRY))
+    return FAIL;
 
   /*Critical Zone Beggining*/
-  if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) ||
-      (inode_table[inumber].nodeType == T_NONE))
+  if (!inode_valid(inumber))
   {
     printf("inode_reset_entry: invalid inumber\n");
     return FAIL;
   }
 
-  if (inode_table[inumber].nodeType != T_DIRECTORY)
+  if (inode_at(inumber)->nodeType != T_DIRECTORY)
   {
     printf("inode_reset_entry: can only reset entry to directories\n");
     return FAIL;
   }
 
-  if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) ||
-      (inode_table[sub_inumber].nodeType == T_NONE))
+  if (!inode_valid(sub_inumber))
   {
     printf("inode_reset_entry: invalid entry inumber\n");
     return FAIL;
   }
 
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-  {
-    if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber)
-    {
-      inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-      inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-      return SUCCESS;
-    }
-  }
-  return FAIL;
+  dir = inode_at(inumber)->data.dir;
+  if (dir_lookup(dir, sub_name) != sub_inumber)
+    return FAIL;
+  inode_write_begin(inode_at(inumber));
+  inode_stamp(inumber, inode_clock(), 0);
+  dir_remove(dir, sub_name);
+  inode_write_end(inode_at(inumber));
+  return SUCCESS;
 }
 
 /*
@@ -255,25 +896,25 @@ int dir_reset_entry(int inumber, int sub_inumber)
  */
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  int result;
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  (void)INJECT(INJECT_DIR_ADD_ENTRY);
 
   /*Critical Zone Beggining*/
-  if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) ||
-      (inode_table[inumber].nodeType == T_NONE))
+  if (!inode_valid(inumber))
   {
     printf("inode_add_entry: invalid inumber\n");
     return FAIL;
   }
 
-  if (inode_table[inumber].nodeType != T_DIRECTORY)
+  if (inode_at(inumber)->nodeType != T_DIRECTORY)
   {
     printf("inode_add_entry: can only add entry to directories\n");
     return FAIL;
   }
 
-  if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) ||
-      (inode_table[sub_inumber].nodeType == T_NONE))
+  if (!inode_valid(sub_inumber))
   {
     printf("inode_add_entry: invalid entry inumber\n");
     return FAIL;
@@ -286,16 +927,11 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name)
     return FAIL;
   }
 
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-  {
-    if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE)
-    {
-      inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-      strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-      return SUCCESS;
-    }
-  }
-  return FAIL;
+  inode_write_begin(inode_at(inumber));
+  inode_stamp(inumber, inode_clock(), 0);
+  result = dir_insert(inode_at(inumber)->data.dir, sub_name, sub_inumber);
+  inode_write_end(inode_at(inumber));
+  return result;
 }
 
 /*
@@ -306,74 +942,702 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name)
  *  - sub_name: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_remove_entry(int inumber, int sub_inumber)
+int dir_remove_entry(int inumber, int sub_inumber, char *sub_name)
 {
-  /* Used for testing synchronization speedup */
-  insert_delay(DELAY);
+  Dir *dir;
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  (void)INJECT(INJECT_DIR_REMOVE_ENTRY);
 
   /*Critical Zone Beggining*/
-  if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) ||
-      (inode_table[inumber].nodeType == T_NONE))
+  if (!inode_valid(inumber))
   {
     printf("inode_remove_entry: invalid inumber\n");
     return FAIL;
   }
 
-  if (inode_table[inumber].nodeType != T_DIRECTORY)
+  if (inode_at(inumber)->nodeType != T_DIRECTORY)
   {
     printf("inode_remove_entry: can only remove entry to directories\n");
     return FAIL;
   }
 
-  if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) ||
-      (inode_table[sub_inumber].nodeType == T_NONE))
+  if (!inode_valid(sub_inumber))
   {
     printf("inode_remove_entry: invalid entry inumber\n");
     return FAIL;
   }
 
-  for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+  dir = inode_at(inumber)->data.dir;
+  if (dir_lookup(dir, sub_name) != sub_inumber)
+    return FAIL;
+  inode_write_begin(inode_at(inumber));
+  inode_stamp(inumber, inode_clock(), 0);
+  dir_remove(dir, sub_name);
+  inode_write_end(inode_at(inumber));
+  return SUCCESS;
+}
+
+/*
+ * Moves an entry from a directory to another (or within one), as a single
+ * change for snapshots. The caller must hold both write locks.
+ * Input:
+ *  - from_inumber: identifier of the directory it is in
+ *  - to_inumber: identifier of the directory it goes to
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - from_name: its name in from_inumber
+ *  - to_name: its name in to_inumber
+ * Returns: SUCCESS or FAIL (nothing moved)
+ */
+int dir_move_entry(int from_inumber, int to_inumber, int sub_inumber,
+                   char *from_name, char *to_name)
+{
+  unsigned long clock;
+  int result;
+
+  /* Latency/fault injection, compiled out unless built with INJECT=1 */
+  (void)INJECT(INJECT_DIR_REMOVE_ENTRY);
+  (void)INJECT(INJECT_DIR_ADD_ENTRY);
+
+  if (!inode_valid(from_inumber) || !inode_valid(to_inumber) ||
+      inode_at(from_inumber)->nodeType != T_DIRECTORY ||
+      inode_at(to_inumber)->nodeType != T_DIRECTORY)
   {
-    if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber)
-    {
-      inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-      inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-      return SUCCESS;
-    }
+    printf("dir_move_entry: can only move entries between directories\n");
+    return FAIL;
   }
-  return FAIL;
+
+  if (!inode_valid(sub_inumber) ||
+      dir_lookup(inode_at(from_inumber)->data.dir, from_name) != sub_inumber)
+  {
+    printf("dir_move_entry: invalid entry inumber\n");
+    return FAIL;
+  }
+
+  inode_write_begin(inode_at(from_inumber));
+  if (to_inumber != from_inumber)
+    inode_write_begin(inode_at(to_inumber));
+  clock = inode_clock();
+  inode_stamp(from_inumber, clock, 0);
+  if (to_inumber != from_inumber)
+    inode_stamp(to_inumber, clock, 0);
+
+  /* added first: if it cannot be, the entry stays where it was */
+  if ((result = dir_insert(inode_at(to_inumber)->data.dir, to_name, sub_inumber)) == SUCCESS &&
+      dir_remove(inode_at(from_inumber)->data.dir, from_name) == FAIL)
+  {
+    dir_remove(inode_at(to_inumber)->data.dir, to_name);
+    result = FAIL;
+  }
+
+  if (to_inumber != from_inumber)
+    inode_write_end(inode_at(to_inumber));
+  inode_write_end(inode_at(from_inumber));
+  return result;
 }
 
 /*
- * Prints the i-nodes table.
+ * Returns the generation of an i-node, which changes when it is deleted: a
+ * reference kept to it without holding its lock (an open file) is still
+ * to the same node while the generation is the one it first saw. The
+ * caller must hold its lock.
+ */
+unsigned int inode_generation(int inumber)
+{
+  return inode_at(inumber)->generation;
+}
+
+/*
+ * Returns the size of a file i-node, in bytes. The caller must hold its
+ * lock.
+ */
+long inode_file_size(int inumber)
+{
+  if (!inode_valid(inumber) || inode_at(inumber)->nodeType != T_FILE)
+    return 0;
+  return file_size(inode_at(inumber)->data.file);
+}
+
+/*
+ * Returns the contents of a file i-node, creating them on first use. The
+ * caller must hold its write lock.
+ * Returns: the contents or NULL (not a file, or out of memory)
+ */
+static File *inode_file(int inumber)
+{
+  inode_t *inode = inode_at(inumber);
+  File *file;
+
+  if (!inode_valid(inumber) || inode->nodeType != T_FILE)
+    return NULL;
+  if (inode->data.file == NULL)
+  {
+    if ((file = file_new()) == NULL)
+      return NULL;
+    inode_write_begin(inode);
+    inode->data.file = file;
+    inode_write_end(inode);
+  }
+  return inode->data.file;
+}
+
+/*
+ * Writes to a file i-node. The caller must hold its write lock.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - data: the data
+ *  - size: its size
+ *  - offset: where to write it, or FILE_APPEND for the end of the file
+ * Returns: bytes written or FAIL
+ */
+int inode_file_write(int inumber, const char *data, int size, long offset)
+{
+  File *file = inode_file(inumber);
+
+  if (file == NULL)
+    return FAIL;
+  return file_write(file, data, size, offset == FILE_APPEND ? file->size : offset);
+}
+
+/*
+ * Reads from a file i-node. The caller must hold its lock.
  * Input:
  *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - data: where to read to
+ *  - size: the most bytes to read
+ *  - offset: where to read from
+ * Returns: bytes read (0 at the end of the file) or FAIL
+ */
+int inode_file_read(int inumber, char *data, int size, long offset)
+{
+  if (!inode_valid(inumber) || inode_at(inumber)->nodeType != T_FILE)
+    return FAIL;
+  return file_read(inode_at(inumber)->data.file, data, size, offset);
+}
+
+/*
+ * Sets the size of a file i-node. The caller must hold its write lock.
+ * Returns: SUCCESS or FAIL
+ */
+int inode_file_truncate(int inumber, long size)
+{
+  File *file = inode_file(inumber);
+
+  if (file == NULL)
+    return FAIL;
+  return file_truncate(file, size);
+}
+
+/* Times a directory is copied without its lock before taking it */
+#define TREE_OPTIMISTIC_TRIES 3
+
+/* Initial room for a directory's copy, doubled as needed */
+#define TREE_INITIAL_ENTRIES 64
+
+/*
+ * A directory's entries, copied (see dir_copy)
+ */
+typedef struct treeDir {
+  char *names;
+  int *inumbers;
+  int max, count;
+} TreeDir;
+
+/*
+ * A tree export in progress: its output buffered so far, and the path of
+ * the node being visited
+ */
+typedef struct treeExport {
+  unsigned long snapshot;
+  int format;
+  tree_emit_t emit;
+  void *arg;
+  int status;
+  int used;
+  char chunk[TREE_CHUNK_SIZE];
+  char path[MAX_PATH_LENGTH];
+} TreeExport;
+
+/*
+ * Doubles the room of a directory's copy.
+ * Returns: SUCCESS or FAIL
+ */
+static int tree_dir_grow(TreeDir *copy)
+{
+  int max = copy->max ? copy->max * 2 : TREE_INITIAL_ENTRIES;
+  char *names = realloc(copy->names, max * MAX_FILE_NAME);
+  int *inumbers;
+
+  if (names == NULL)
+    return FAIL;
+  copy->names = names;
+  if ((inumbers = realloc(copy->inumbers, max * sizeof(int))) == NULL)
+    return FAIL;
+  copy->inumbers = inumbers;
+  copy->max = max;
+  return SUCCESS;
+}
+
+/*
+ * Copies a directory's entries as they were for a snapshot, without its
+ * lock and validated by its sequence number or, if it keeps changing
+ * meanwhile, under its read lock; the lock is never held for longer than
+ * the copy.
+ * Input:
+ *  - inumber: the i-node
+ *  - snapshot: the snapshot
+ *  - copy: where to copy the entries, if it was a directory
+ * Returns: its type, T_NONE if it did not exist (or out of memory)
  */
-void inode_print_tree(FILE *fp, int inumber, char *name)
+static type tree_copy_dir(int inumber, unsigned long snapshot, TreeDir *copy)
 {
+  inode_t *inode = inode_at(inumber);
+  unsigned int seq;
+  Dir *dir;
+  type nType;
+  int valid;
+
+  if (inode == NULL)
+    return T_NONE;
+  for (int tries = 0; tries < TREE_OPTIMISTIC_TRIES;)
+  {
+    epoch_enter();
+    seq = inode_read_begin(inumber);
+    nType = inode_state_at(inode, snapshot, &dir);
+    copy->count = 0;
+    if (nType == T_DIRECTORY)
+      copy->count = dir_copy(dir, copy->names, copy->max * MAX_FILE_NAME, copy->inumbers, copy->max);
+    valid = !inode_read_retry(inumber, seq);
+    epoch_exit();
+
+    if (!valid)
+      tries++;
+    else if (copy->count != FAIL)
+      return nType;
+    else if (tree_dir_grow(copy) == FAIL)
+      return T_NONE;
+  }
+
   inodeLock('r', inumber);
-  if (inode_table[inumber].nodeType == T_FILE)
+  nType = inode_state_at(inode, snapshot, &dir);
+  copy->count = 0;
+  while (nType == T_DIRECTORY &&
+         (copy->count = dir_copy(dir, copy->names, copy->max * MAX_FILE_NAME, copy->inumbers, copy->max)) == FAIL)
   {
-    fprintf(fp, "%s\n", name);
-    inodeUnlock(inumber);
+    if (tree_dir_grow(copy) == FAIL)
+      nType = T_NONE;
+  }
+  inodeUnlock(inumber);
+  return nType;
+}
+
+/*
+ * Appends a line to the export's output, emitting the chunk first if the
+ * line does not fit.
+ */
+static void tree_write(TreeExport *export, const char *line, int length)
+{
+  if (export->used + length > TREE_CHUNK_SIZE)
+  {
+    if (export->status == SUCCESS)
+      export->status = export->emit(export->chunk, export->used, export->arg);
+    export->used = 0;
+  }
+  memcpy(export->chunk + export->used, line, length);
+  export->used += length;
+}
+
+/*
+ * Exports a node and, if it is a directory, the nodes under it.
+ * Input:
+ *  - export: the export, whose path holds the node's path
+ *  - inumber: the node's i-node
+ *  - length: the length of its path
+ */
+static void tree_export(TreeExport *export, int inumber, int length)
+{
+  TreeDir copy = {NULL, NULL, 0, 0};
+  char *name;
+  int name_length;
+  type nType = tree_copy_dir(inumber, export->snapshot, &copy);
+
+  if (nType == T_NONE)
+  {
+    free(copy.names);
+    free(copy.inumbers);
     return;
   }
-  if (inode_table[inumber].nodeType == T_DIRECTORY)
+
+  if (export->format == TREE_PATHS)
+  {
+    export->path[length] = '\n';
+    tree_write(export, export->path, length + 1);
+  }
+  else if (length > 0) /* the root always exists */
+  {
+    tree_write(export, "c ", 2);
+    tree_write(export, export->path, length);
+    tree_write(export, nType == T_DIRECTORY ? " d\n" : " f\n", 3);
+  }
+
+  name = copy.names;
+  for (int i = 0; i < copy.count && export->status == SUCCESS; i++)
+  {
+    name_length = strlen(name);
+    if (length + 1 + name_length >= MAX_PATH_LENGTH)
+      fprintf(stderr, "truncation when building full path\n");
+    else
+    {
+      export->path[length] = '/';
+      memcpy(export->path + length + 1, name, name_length);
+      tree_export(export, copy.inumbers[i], length + 1 + name_length);
+    }
+    name += name_length + 1;
+  }
+  free(copy.names);
+  free(copy.inumbers);
+}
+
+/*
+ * Exports the tree under an i-node as it was for a snapshot, to emit in
+ * chunks of up to TREE_CHUNK_SIZE bytes. Each directory is copied on its
+ * own (see tree_copy_dir), so no lock is held while the tree is walked or
+ * the output written, and writers are never blocked for long.
+ * Input:
+ *  - inumber: the i-node at the top, exported as ""
+ *  - snapshot: from inode_snapshot_begin, in use until this returns
+ *  - format: TREE_PATHS or TREE_COMMANDS
+ *  - emit: called with each chunk
+ *  - arg: passed to emit
+ * Returns: SUCCESS, or the first error of emit (which stops the export)
+ */
+int inode_export_tree(int inumber, unsigned long snapshot, int format,
+                      tree_emit_t emit, void *arg)
+{
+  TreeExport *export = malloc(sizeof(TreeExport));
+  int status;
+
+  if (export == NULL)
+    return FAIL;
+  export->snapshot = snapshot;
+  export->format = format;
+  export->emit = emit;
+  export->arg = arg;
+  export->status = SUCCESS;
+  export->used = 0;
+  tree_export(export, inumber, 0);
+  if (export->status == SUCCESS && export->used > 0)
+    export->status = emit(export->chunk, export->used, arg);
+  status = export->status;
+  free(export);
+  return status;
+}
+
+/* Initial room for a directory's image, doubled as needed */
+#define CHECKPOINT_INITIAL_IMAGE 4096
+
+/*
+ * A checkpoint being written: where its output goes, and the lists that
+ * follow the directories' images, built meanwhile
+ */
+typedef struct checkpointWriter {
+  tree_emit_t emit;
+  void *arg;
+  int status;
+  uint64_t offset;
+  char *image; /* a directory's image, copied */
+  long image_size;
+  CheckpointDir *dirs;
+  uint32_t dirs_count, dirs_max;
+  uint32_t *free;
+  uint32_t free_count, free_max;
+} CheckpointWriter;
+
+/*
+ * Appends to the checkpoint, in chunks of up to TREE_CHUNK_SIZE bytes.
+ */
+static void checkpoint_write(CheckpointWriter *writer, const void *data, uint64_t size)
+{
+  int chunk;
+
+  writer->offset += size;
+  for (; size > 0 && writer->status == SUCCESS; data = (const char *)data + chunk, size -= chunk)
+  {
+    chunk = size < TREE_CHUNK_SIZE ? size : TREE_CHUNK_SIZE;
+    writer->status = writer->emit(data, chunk, writer->arg);
+  }
+}
+
+/*
+ * Pads the checkpoint with zeros to a multiple of align bytes (up to 16).
+ */
+static void checkpoint_align(CheckpointWriter *writer, int align)
+{
+  static const char zeros[16];
+
+  checkpoint_write(writer, zeros, -writer->offset & (align - 1));
+}
+
+/*
+ * Makes room for one more item in a list, doubling it as needed.
+ */
+static void *checkpoint_list_grow(void *list, uint32_t count, uint32_t *max, size_t item)
+{
+  if (count < *max)
+    return list;
+  *max = *max ? *max * 2 : 1024;
+  if ((list = realloc(list, *max * item)) == NULL)
+    exit(EXIT_FAILURE);
+  return list;
+}
+
+/*
+ * Appends a directory's image, and lists it.
+ */
+static void checkpoint_add_dir(CheckpointWriter *writer, int inumber, const char *image, DirImage *info)
+{
+  CheckpointDir *dir;
+
+  checkpoint_align(writer, 16);
+  writer->dirs = checkpoint_list_grow(writer->dirs, writer->dirs_count, &writer->dirs_max, sizeof(CheckpointDir));
+  dir = &writer->dirs[writer->dirs_count++];
+  dir->inumber = inumber;
+  dir->unused = 0;
+  dir->offset = writer->offset;
+  dir->image = *info;
+  checkpoint_write(writer, image, info->size);
+}
+
+/*
+ * Copies the state an i-node had for a snapshot and, if it was a directory,
+ * its image, into the writer's buffer; like tree_copy_dir, first without
+ * its lock, validated by its sequence number.
+ * Returns: its type, T_NONE if it did not exist
+ */
+static type checkpoint_copy_inode(CheckpointWriter *writer, int inumber, unsigned long snapshot, DirImage *info)
+{
+  inode_t *inode = inode_at(inumber);
+  unsigned int seq;
+  long size = 0;
+  Dir *dir;
+  type nType;
+  int valid;
+
+  for (int tries = 0; tries < TREE_OPTIMISTIC_TRIES;)
+  {
+    epoch_enter();
+    seq = inode_read_begin(inumber);
+    nType = inode_state_at(inode, snapshot, &dir);
+    if (nType == T_DIRECTORY)
+      size = dir_image(dir, writer->image, writer->image_size, info);
+    valid = !inode_read_retry(inumber, seq);
+    epoch_exit();
+
+    if (!valid)
+      tries++;
+    else if (nType != T_DIRECTORY || size <= writer->image_size)
+      return nType;
+    else
+    {
+      while (writer->image_size < size)
+        writer->image_size *= 2;
+      if ((writer->image = realloc(writer->image, writer->image_size)) == NULL)
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  inodeLock('r', inumber);
+  nType = inode_state_at(inode, snapshot, &dir);
+  while (nType == T_DIRECTORY && (size = dir_image(dir, writer->image, writer->image_size, info)) > writer->image_size)
+  {
+    while (writer->image_size < size)
+      writer->image_size *= 2;
+    if ((writer->image = realloc(writer->image, writer->image_size)) == NULL)
+      exit(EXIT_FAILURE);
+  }
+  inodeUnlock(inumber);
+  return nType;
+}
+
+/*
+ * Writes a checkpoint of the i-node table as it was for a snapshot: the
+ * directories' images (see DirImage), then the type of every i-node, the
+ * directories, the free i-numbers and the roots of the subtrees detached
+ * but not reclaimed, and a footer (CheckpointFooter).
+ * Like a tree export, it holds no lock but for the moment each directory
+ * is copied, and writers go on. A segment restored from a checkpoint and
+ * not used since is copied straight from it.
+ * Input:
+ *  - snapshot: from inode_snapshot_begin, in use until this returns
+ *  - segment: stored in the footer
+ *  - detached, detached_count: the subtrees still to reclaim for the
+ *    snapshot (see reclaim_snapshot)
+ *  - emit: called with each chunk
+ *  - arg: passed to emit
+ * Returns: SUCCESS, or the first error of emit (which stops the checkpoint)
+ */
+int inode_table_checkpoint(unsigned long snapshot, uint64_t segment, uint32_t *detached,
+                           uint32_t detached_count, tree_emit_t emit, void *arg)
+{
+  CheckpointWriter writer = {emit, arg, SUCCESS, 0, NULL, CHECKPOINT_INITIAL_IMAGE};
+  CheckpointFooter footer = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, segment};
+  int next = __atomic_load_n(&inode_next, __ATOMIC_ACQUIRE);
+  int segments, inumber, first;
+  unsigned char *types;
+  uint32_t *segment_dirs;
+  inode_t *inodes;
+  CheckpointDir *restored;
+  DirImage info;
+  type nType;
+
+  if (next > inode_max)
+    next = inode_max;
+  segments = (next + INODE_SEGMENT_SIZE - 1) >> INODE_SEGMENT_BITS;
+  if ((types = malloc(next + 1)) == NULL || (segment_dirs = malloc((segments + 1) * sizeof(uint32_t))) == NULL ||
+      (writer.image = malloc(writer.image_size)) == NULL)
+    exit(EXIT_FAILURE);
+
+  for (int s = 0; s < segments && writer.status == SUCCESS; s++)
   {
-    fprintf(fp, "%s\n", name);
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
+    first = s << INODE_SEGMENT_BITS;
+    segment_dirs[s] = writer.dirs_count;
+    inodes = __atomic_load_n(&inode_segments[s], __ATOMIC_ACQUIRE);
+    if (inodes == NULL && first < restored_inodes)
+    {
+      /* restored and not even built since: unchanged, copied as it was */
+      for (int i = 0; i < INODE_SEGMENT_SIZE && (inumber = first + i) < next; i++)
+        types[inumber] = inumber < restored_inodes ? restored_types[inumber] : T_NONE;
+      for (uint32_t d = restored_segment_dirs[s]; d < restored_segment_dirs[s + 1]; d++)
+      {
+        restored = &restored_dirs[d];
+        checkpoint_add_dir(&writer, restored->inumber, restored_image + restored->offset, &restored->image);
+      }
+    }
+    else
     {
-      if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE)
+      for (int i = 0; i < INODE_SEGMENT_SIZE && (inumber = first + i) < next; i++)
       {
-        char path[MAX_FILE_NAME];
-        if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path))
-        {
-          fprintf(stderr, "truncation when building full path\n");
-        }
-        inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
+        if (inodes == NULL)
+          nType = T_NONE; /* its segment is being allocated */
+        else if ((nType = checkpoint_copy_inode(&writer, inumber, snapshot, &info)) == T_DIRECTORY)
+          checkpoint_add_dir(&writer, inumber, writer.image, &info);
+        types[inumber] = nType;
+      }
+    }
+    for (int i = 0; i < INODE_SEGMENT_SIZE && (inumber = first + i) < next; i++)
+    {
+      if (types[inumber] == T_NONE)
+      {
+        writer.free = checkpoint_list_grow(writer.free, writer.free_count, &writer.free_max, sizeof(uint32_t));
+        writer.free[writer.free_count++] = inumber;
       }
     }
   }
-  inodeUnlock(inumber);
+  segment_dirs[segments] = writer.dirs_count;
+
+  footer.inodes = next;
+  footer.dirs = writer.dirs_count;
+  footer.free = writer.free_count;
+  footer.detached = detached_count;
+  footer.types = writer.offset;
+  checkpoint_write(&writer, types, next);
+  checkpoint_align(&writer, 8);
+  footer.segment_dirs = writer.offset;
+  checkpoint_write(&writer, segment_dirs, (segments + 1) * sizeof(uint32_t));
+  checkpoint_align(&writer, 8);
+  footer.dir_list = writer.offset;
+  checkpoint_write(&writer, writer.dirs, (uint64_t)writer.dirs_count * sizeof(CheckpointDir));
+  footer.free_list = writer.offset;
+  checkpoint_write(&writer, writer.free, (uint64_t)writer.free_count * sizeof(uint32_t));
+  footer.detached_list = writer.offset;
+  checkpoint_write(&writer, detached, (uint64_t)detached_count * sizeof(uint32_t));
+  checkpoint_align(&writer, 8);
+  checkpoint_write(&writer, &footer, sizeof(footer));
+
+  free(types);
+  free(segment_dirs);
+  free(writer.image);
+  free(writer.dirs);
+  free(writer.free);
+  return writer.status;
+}
+
+/*
+ * Replaces the i-node table with a checkpoint's (see
+ * inode_table_checkpoint), in constant time but for its free i-numbers:
+ * each segment is only built from it when first used, and directories keep
+ * their entries in it until changed. It must stay mapped, and unchanged,
+ * until inode_table_destroy.
+ * Input:
+ *  - image: the checkpoint, 16 byte aligned
+ *  - size: its size
+ *  - segment: where to store the segment in its footer
+ *  - detached, detached_count: where to store its list of subtrees still
+ *    to reclaim, in the image
+ * Returns: SUCCESS, or FAIL if it is not a valid checkpoint or does not
+ * fit in the table
+ */
+int inode_table_restore(char *image, size_t size, uint64_t *segment, uint32_t **detached,
+                        uint32_t *detached_count)
+{
+  CheckpointFooter *footer = (CheckpointFooter *)(image + size - sizeof(CheckpointFooter));
+  int max = inode_max, segments, next;
+  InodeCache *cache;
+  InodeBatch *batch;
+  uint32_t *free_list;
+
+  if (size < sizeof(CheckpointFooter) || footer->magic != CHECKPOINT_MAGIC ||
+      footer->version != CHECKPOINT_VERSION || footer->inodes == 0 || footer->inodes > max)
+    return FAIL;
+  segments = (footer->inodes + INODE_SEGMENT_SIZE - 1) >> INODE_SEGMENT_BITS;
+  if (footer->types + footer->inodes > size ||
+      footer->segment_dirs + (segments + 1) * sizeof(uint32_t) > size ||
+      footer->dir_list + (uint64_t)footer->dirs * sizeof(CheckpointDir) > size ||
+      footer->free_list + (uint64_t)footer->free * sizeof(uint32_t) > size ||
+      footer->detached_list + (uint64_t)footer->detached * sizeof(uint32_t) > size)
+    return FAIL;
+  for (uint32_t i = 0; i < footer->detached; i++)
+    if (((uint32_t *)(image + footer->detached_list))[i] >= footer->inodes)
+      return FAIL;
+
+  inode_table_destroy();
+  inode_table_init(max);
+  restored_image = image;
+  restored_types = (unsigned char *)image + footer->types;
+  restored_segment_dirs = (uint32_t *)(image + footer->segment_dirs);
+  restored_dirs = (CheckpointDir *)(image + footer->dir_list);
+  restored_inodes = footer->inodes;
+  restored_end = segments << INODE_SEGMENT_BITS;
+  dir_map_images(image, size);
+
+  /* batches of fresh i-numbers start where the checkpoint's end, aligned */
+  next = (footer->inodes + INODE_BATCH_SIZE - 1) & ~(INODE_BATCH_SIZE - 1);
+  inode_next = next;
+  if (next > max)
+    next = max;
+  free_list = (uint32_t *)(image + footer->free_list);
+  cache = inode_cache_get();
+  for (uint32_t i = 0; i < footer->free + (next - footer->inodes);)
+  {
+    if ((batch = malloc(sizeof(InodeBatch))) == NULL)
+      exit(EXIT_FAILURE);
+    for (int b = 0; b < INODE_BATCH_SIZE && i < footer->free + (next - footer->inodes); b++, i++)
+      batch->inumbers[b] = i < footer->free ? free_list[i] : footer->inodes + (i - footer->free);
+    batch->count = INODE_BATCH_SIZE;
+    if (i % INODE_BATCH_SIZE != 0)
+    {
+      /* the last, partial, batch goes to this thread's cache */
+      for (int b = 0; b < i % INODE_BATCH_SIZE; b++)
+        cache->inumbers[cache->count++] = batch->inumbers[b];
+      free(batch);
+      break;
+    }
+    batch->next = inode_free_batches;
+    inode_free_batches = batch;
+  }
+
+  *segment = footer->segment;
+  *detached = (uint32_t *)(image + footer->detached_list);
+  *detached_count = footer->detached;
+  return SUCCESS;
 }
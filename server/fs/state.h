@@ -2,6 +2,10 @@
 #define INODES_H
 
 #include "../tecnicofs-api-constants.h"
+#include "dir.h"
+#include "file.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -9,49 +13,117 @@
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+
+/*
+ * The i-node table is split in fixed size segments, allocated on demand, so
+ * i-nodes never move once created and the table can grow up to max_inodes
+ * (chosen at init) without ever reallocating.
+ */
+#define INODE_SEGMENT_BITS 10
+#define INODE_SEGMENT_SIZE (1 << INODE_SEGMENT_BITS)
+#define DEFAULT_MAX_INODES (1 << 24)
+
+/*
+ * Free i-numbers are kept in per-thread caches of INODE_CACHE_SIZE, refilled
+ * from (and spilled to) a shared pool INODE_BATCH_SIZE i-numbers at a time.
+ * INODE_SEGMENT_SIZE must be a multiple of INODE_BATCH_SIZE.
+ */
+#define INODE_CACHE_SIZE 64
+#define INODE_BATCH_SIZE 32
 
 #define SUCCESS 0
 #define FAIL -1
 
-#define DELAY 5000
+/* Largest chunk a tree export emits at a time */
+#define TREE_CHUNK_SIZE 32768
+
+/* Formats of a tree export: a path per line, or the create commands
+ * ("c /a d") that rebuild the tree */
+#define TREE_PATHS 0
+#define TREE_COMMANDS 1
+
+/*
+ * Receives a chunk of a tree export (see inode_export_tree).
+ * Returns: SUCCESS, or an error that stops the export
+ */
+typedef int (*tree_emit_t)(const char *chunk, int size, void *arg);
+
+/* Checkpoint format, see inode_table_checkpoint */
+#define CHECKPOINT_MAGIC 0x43534654 /* "TFSC" */
+#define CHECKPOINT_VERSION 2
+
+/*
+ * A directory in a checkpoint, listed by i-number
+ */
+typedef struct checkpointDir {
+  uint32_t inumber;
+  uint32_t unused;
+  uint64_t offset; /* of its image, 16 byte aligned */
+  DirImage image;
+} CheckpointDir;
 
 /*
- * Contains the name of the entry and respective i-number
+ * Ends a checkpoint, which is read from its end; offsets are from its start
  */
-typedef struct dirEntry {
-  char name[MAX_FILE_NAME];
-  int inumber;
-} DirEntry;
+typedef struct checkpointFooter {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t segment;  /* first log segment not in it, set by the caller */
+  uint32_t inodes;   /* it holds the i-numbers below this */
+  uint32_t dirs;     /* directories listed */
+  uint32_t free;     /* free i-numbers listed */
+  uint32_t detached; /* subtrees still to reclaim listed (see reclaim.c) */
+  uint64_t types;    /* a byte per i-node, its type */
+  uint64_t segment_dirs; /* per i-node segment, its first directory listed */
+  uint64_t dir_list; /* CheckpointDir, in i-number order */
+  uint64_t free_list; /* uint32_t i-numbers */
+  uint64_t detached_list; /* uint32_t i-numbers of their roots */
+} CheckpointFooter;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either contents (File, NULL until first written) or entries (Dir)
  */
 union Data {
-  char *fileContents;   /* for files */
-  DirEntry *dirEntries; /* for directories */
+  File *file; /* for files */
+  Dir *dir;   /* for directories */
 };
 
+/*
+ * A state an i-node had before a change, kept for the snapshots that must
+ * not see the change: those from + 1 to to (see inode_snapshot_begin)
+ */
+typedef struct inodeVersion {
+  struct inodeVersion *next; /* older */
+  unsigned long from, to;
+  type nodeType;
+  Dir *dir; /* of a directory, never changed again */
+} InodeVersion;
+
 /*
  * I-node definition
  */
 typedef struct inode_t {
   pthread_rwlock_t lock;
+  unsigned int seq; /* odd while nodeType or data are being changed */
   type nodeType;
   union Data data;
+  unsigned long version;  /* snapshot clock at its last change */
+  InodeVersion *versions; /* newest first */
+  unsigned int generation; /* times deleted, see inode_generation */
   /* more i-node attributes will be added in future exercises */
 } inode_t;
 
 void inodeLock(char lockmethod, int inumber);
 
+int inodeTryLock(char lockmethod, int inumber);
+
 void inodeUnlock(int inumber);
 
 void unlockAll(int *locked, int index);
 
-void insert_delay(int cycles);
+inode_t *inode_at(int inumber);
 
-void inode_table_init();
+void inode_table_init(int max_inodes);
 
 void inode_table_destroy();
 
@@ -61,14 +133,42 @@ int inode_delete(int inumber);
 
 int inode_get(int inumber, type *nType, union Data *data);
 
-int inode_set_file(int inumber, char *fileContents, int len);
+unsigned int inode_read_begin(int inumber);
+
+int inode_read_retry(int inumber, unsigned int seq);
+
+int inode_peek(int inumber, type *nType, union Data *data);
+
+unsigned int inode_generation(int inumber);
+
+long inode_file_size(int inumber);
+
+int inode_file_write(int inumber, const char *data, int size, long offset);
 
-int dir_reset_entry(int inumber, int sub_inumber);
+int inode_file_read(int inumber, char *data, int size, long offset);
+
+int inode_file_truncate(int inumber, long size);
+
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name);
 
 int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
 
-int dir_remove_entry(int inumber, int sub_inumber);
+int dir_remove_entry(int inumber, int sub_inumber, char *sub_name);
+
+int dir_move_entry(int from_inumber, int to_inumber, int sub_inumber,
+                   char *from_name, char *to_name);
+
+unsigned long inode_snapshot_begin();
+
+void inode_snapshot_end(unsigned long snapshot);
+
+int inode_export_tree(int inumber, unsigned long snapshot, int format,
+                      tree_emit_t emit, void *arg);
+
+int inode_table_checkpoint(unsigned long snapshot, uint64_t segment, uint32_t *detached,
+                           uint32_t detached_count, tree_emit_t emit, void *arg);
 
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int inode_table_restore(char *image, size_t size, uint64_t *segment, uint32_t **detached,
+                        uint32_t *detached_count);
 
 #endif /* INODES_H */
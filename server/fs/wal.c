@@ -0,0 +1,495 @@
+#include "wal.h"
+#include "state.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Write-ahead log of the namespace: every create, delete and move is
+ * appended to the log, while the operation still holds its locks (so the
+ * log has conflicting operations in the order they were applied), and the
+ * request is only answered once its record is on disk (wal_sync).
+ * Group commit: records are appended to a buffer in memory, and a single
+ * thread writes out everything buffered and syncs it, with one fdatasync
+ * for all the records that arrived meanwhile, or within a window it waits
+ * for more to arrive. Records are numbered (LSNs) in the order appended;
+ * wal_durable is the last one on disk.
+ * The log is a sequence of segments, files of a directory numbered in
+ * order (WAL_SEGMENT_NAME). A checkpoint (see wal_rotate) starts a new
+ * one, and holds everything logged in those before it, which are then
+ * removed.
+ */
+int wal_fd = -1; /* of the segment being written */
+int wal_window; /* microseconds the writer waits for more records */
+pthread_t wal_writer;
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wal_appended_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t wal_durable_cond = PTHREAD_COND_INITIALIZER;
+int wal_closing;
+
+/* The buffer records are appended to, and the one being written out */
+char *wal_buffer, *wal_spare;
+size_t wal_used, wal_size, wal_spare_size;
+
+unsigned long wal_appended; /* LSN of the last record appended */
+unsigned long wal_durable;  /* LSN of the last record synced, atomic */
+
+char wal_dir[PATH_MAX - 32]; /* room for the segments' names */
+uint64_t wal_segment; /* the last one, appended to */
+unsigned long wal_segment_bytes; /* appended to it so far */
+
+/* A pending rotation (see wal_rotate): the next segment, and how much of
+ * what was appended goes to the current one */
+int wal_next_fd = -1;
+size_t wal_rotate_at;
+
+/* LSN of the last record the calling thread appended */
+__thread unsigned long wal_thread_lsn;
+
+/*
+ * FNV-1a of the bytes of a record after its checksum: a torn or garbage
+ * record at the end of the log does not match it.
+ */
+static uint32_t wal_checksum(const char *record, size_t size)
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 2 * sizeof(uint32_t); i < size; i++)
+    hash = (hash ^ (unsigned char)record[i]) * 16777619u;
+  return hash;
+}
+
+/*
+ * Writes all of a buffer to a segment.
+ * Returns: SUCCESS or FAIL
+ */
+static int wal_write_all(int fd, const char *data, size_t size)
+{
+  ssize_t written;
+
+  while (size > 0)
+  {
+    if ((written = write(fd, data, size)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return FAIL;
+    }
+    data += written;
+    size -= written;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Writes out and syncs part of the records, to a segment.
+ */
+static void wal_write_segment(int fd, const char *data, size_t size)
+{
+  if (wal_write_all(fd, data, size) == FAIL || fdatasync(fd) < 0)
+  {
+    perror("wal: write error");
+    exit(EXIT_FAILURE); /* answering without durability would be a lie */
+  }
+}
+
+/*
+ * The writer: writes out the records appended and syncs them, until the
+ * log is closed (and everything appended is on disk). On a rotation, the
+ * current segment gets its records, synced, before the next one gets any.
+ */
+static void *wal_write_records(void *arg)
+{
+  unsigned long last;
+  char *buffer;
+  size_t used, size, rotate_at;
+  int next_fd;
+
+  pthread_mutex_lock(&wal_lock);
+  while (1)
+  {
+    while (wal_used == 0 && wal_next_fd < 0 && !wal_closing)
+      pthread_cond_wait(&wal_appended_cond, &wal_lock);
+    if (wal_used == 0 && wal_next_fd < 0)
+      break;
+    if (wal_window > 0 && !wal_closing)
+    {
+      /* let the records of the other workers join this sync */
+      pthread_mutex_unlock(&wal_lock);
+      usleep(wal_window);
+      pthread_mutex_lock(&wal_lock);
+    }
+
+    /* swap the buffers, so appending goes on while these are written */
+    buffer = wal_buffer;
+    used = wal_used;
+    size = wal_size;
+    last = wal_appended;
+    next_fd = wal_next_fd;
+    rotate_at = next_fd >= 0 ? wal_rotate_at : used;
+    wal_buffer = wal_spare;
+    wal_size = wal_spare_size;
+    wal_used = 0;
+    wal_next_fd = -1;
+    pthread_mutex_unlock(&wal_lock);
+
+    wal_write_segment(wal_fd, buffer, rotate_at);
+    if (next_fd >= 0)
+    {
+      close(wal_fd);
+      __atomic_store_n(&wal_fd, next_fd, __ATOMIC_RELAXED);
+      wal_write_segment(wal_fd, buffer + rotate_at, used - rotate_at);
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    wal_spare = buffer;
+    wal_spare_size = size;
+    __atomic_store_n(&wal_durable, last, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&wal_durable_cond);
+  }
+  pthread_mutex_unlock(&wal_lock);
+  return NULL;
+}
+
+/*
+ * Replays the records of a segment, up to the first one torn or corrupt (a
+ * crash while it was written), and cuts the segment there.
+ * Input:
+ *  - replayed: where to count the records replayed
+ * Returns: SUCCESS or FAIL if the segment could not be read
+ */
+static int wal_replay(int fd, wal_apply_t apply, long *replayed)
+{
+  struct stat st;
+  char *log, *path1, *path2;
+  WalRecord *record;
+  size_t offset = 0;
+
+  if (fstat(fd, &st) < 0)
+    return FAIL;
+  if (st.st_size == 0)
+    return SUCCESS;
+  if ((log = malloc(st.st_size)) == NULL)
+    return FAIL;
+  if (pread(fd, log, st.st_size, 0) != st.st_size)
+  {
+    free(log);
+    return FAIL;
+  }
+
+  while (st.st_size - offset >= sizeof(WalRecord))
+  {
+    record = (WalRecord *)(log + offset);
+    if (record->size < sizeof(WalRecord) + record->length1 + record->length2 + 2 ||
+        record->size > st.st_size - offset || record->checksum != wal_checksum(log + offset, record->size))
+      break;
+    path1 = log + offset + sizeof(WalRecord);
+    path2 = path1 + record->length1 + 1;
+    if (path1[record->length1] != '\0' || path2[record->length2] != '\0')
+      break;
+    apply(record->op, record->arg, path1, path2);
+    offset += record->size;
+    (*replayed)++;
+  }
+  free(log);
+
+  if (offset < st.st_size)
+  {
+    printf("wal: dropping %ld bytes of a torn record\n", (long)(st.st_size - offset));
+    if (ftruncate(fd, offset) < 0 || fdatasync(fd) < 0)
+      return FAIL;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Builds the path of a segment.
+ */
+static void wal_segment_path(char *path, uint64_t segment)
+{
+  snprintf(path, PATH_MAX, "%s/" WAL_SEGMENT_NAME, wal_dir, (unsigned long)segment);
+}
+
+/*
+ * Creates a segment, empty, and makes sure it survives a crash.
+ * Returns: its file descriptor or FAIL
+ */
+static int wal_create_segment(uint64_t segment)
+{
+  char path[PATH_MAX];
+  int fd, dir_fd;
+
+  wal_segment_path(path, segment);
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    return FAIL;
+  if ((dir_fd = open(wal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fsync(dir_fd) < 0)
+  {
+    if (dir_fd >= 0)
+      close(dir_fd);
+    close(fd);
+    return FAIL;
+  }
+  close(dir_fd);
+  return fd;
+}
+
+/*
+ * Lists the segments in the log's directory.
+ * Input:
+ *  - segments: where to store them, in order, to be freed
+ * Returns: their number or FAIL
+ */
+static int wal_list_segments(uint64_t **segments)
+{
+  DIR *dir = opendir(wal_dir);
+  struct dirent *entry;
+  unsigned long segment;
+  uint64_t *list = NULL, *grown;
+  int count = 0, max = 0, i;
+  char end;
+
+  if (dir == NULL)
+    return FAIL;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    /* WAL_SEGMENT_NAME, and nothing after it */
+    if (sscanf(entry->d_name, "wal.%16lx%c", &segment, &end) != 1)
+      continue;
+    if (count == max)
+    {
+      max = max ? max * 2 : 16;
+      if ((grown = realloc(list, max * sizeof(uint64_t))) == NULL)
+        exit(EXIT_FAILURE);
+      list = grown;
+    }
+    /* insertion sort: there are only a few */
+    for (i = count++; i > 0 && list[i - 1] > segment; i--)
+      list[i] = list[i - 1];
+    list[i] = segment;
+  }
+  closedir(dir);
+  *segments = list;
+  return count;
+}
+
+/*
+ * Opens the log: replays its segments from first on, to rebuild the
+ * namespace they record after the checkpoint that holds the ones before,
+ * and then appends to a new segment.
+ * Input:
+ *  - path: the log's directory, created if it does not exist
+ *  - first: the first segment to replay, see CheckpointFooter
+ *  - window: microseconds to wait for more records before each sync, or 0
+ *    to sync as soon as the previous sync is done
+ *  - apply: applies each record replayed, without logging it again
+ * Returns: SUCCESS or FAIL
+ */
+int wal_open(char *path, uint64_t first, int window, wal_apply_t apply)
+{
+  char segment_path[PATH_MAX];
+  uint64_t *segments, last = first;
+  long replayed = 0;
+  int count, fd;
+
+  if ((mkdir(path, 0755) < 0 && errno != EEXIST) || strlen(path) >= PATH_MAX - 32)
+    return FAIL;
+  strcpy(wal_dir, path);
+  if ((count = wal_list_segments(&segments)) == FAIL)
+    return FAIL;
+  for (int i = 0; i < count; i++)
+  {
+    wal_segment_path(segment_path, segments[i]);
+    if (segments[i] < first)
+    {
+      unlink(segment_path); /* in the checkpoint */
+      continue;
+    }
+    /* the log is only open (wal_fd) after the replay, which is not logged */
+    if ((fd = open(segment_path, O_RDWR | O_CLOEXEC)) < 0 || wal_replay(fd, apply, &replayed) == FAIL)
+    {
+      free(segments);
+      return FAIL;
+    }
+    close(fd);
+    last = segments[i] + 1;
+  }
+  free(segments);
+  printf("wal: replayed %ld operations\n", replayed);
+
+  if ((wal_buffer = malloc(WAL_BUFFER_SIZE)) == NULL || (wal_spare = malloc(WAL_BUFFER_SIZE)) == NULL ||
+      (fd = wal_create_segment(last > 0 ? last : 1)) == FAIL)
+    return FAIL;
+  wal_segment = last > 0 ? last : 1;
+  wal_segment_bytes = 0;
+  wal_size = wal_spare_size = WAL_BUFFER_SIZE;
+  wal_used = 0;
+  wal_next_fd = -1;
+  wal_window = window;
+  wal_closing = 0;
+  wal_fd = fd;
+  if (pthread_create(&wal_writer, NULL, wal_write_records, NULL) != 0)
+    exit(EXIT_FAILURE);
+  return SUCCESS;
+}
+
+/*
+ * Starts a new segment, for a checkpoint: what is logged from then on goes
+ * to it, and at the moment it starts, with nothing being logged, at is
+ * called (to take the snapshot the checkpoint is written from). Called by
+ * one thread at a time.
+ * Input:
+ *  - at: called at the start of the new segment
+ *  - arg: passed to at
+ * Returns: the new segment, or 0 if the log is not open or on error
+ */
+uint64_t wal_rotate(void (*at)(void *arg), void *arg)
+{
+  uint64_t segment;
+  int fd;
+
+  pthread_mutex_lock(&wal_lock);
+  while (wal_next_fd >= 0)
+    pthread_cond_wait(&wal_durable_cond, &wal_lock);
+  segment = wal_segment + 1;
+  pthread_mutex_unlock(&wal_lock);
+  if (wal_fd < 0 || (fd = wal_create_segment(segment)) == FAIL)
+    return 0;
+
+  pthread_mutex_lock(&wal_lock);
+  if (wal_closing)
+  {
+    pthread_mutex_unlock(&wal_lock);
+    close(fd);
+    return 0;
+  }
+  at(arg);
+  wal_next_fd = fd;
+  wal_rotate_at = wal_used;
+  wal_segment = segment;
+  __atomic_store_n(&wal_segment_bytes, 0, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wal_appended_cond);
+  pthread_mutex_unlock(&wal_lock);
+  return segment;
+}
+
+/*
+ * Removes the segments before one, held by a checkpoint now on disk.
+ */
+void wal_remove_segments(uint64_t before)
+{
+  char path[PATH_MAX];
+  uint64_t *segments;
+  int count;
+
+  if ((count = wal_list_segments(&segments)) == FAIL)
+    return;
+  for (int i = 0; i < count && segments[i] < before; i++)
+  {
+    wal_segment_path(path, segments[i]);
+    unlink(path);
+  }
+  free(segments);
+}
+
+/*
+ * Returns the bytes logged since the current segment started.
+ */
+unsigned long wal_segment_size()
+{
+  return __atomic_load_n(&wal_segment_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Closes the log, once everything appended is on disk. Operations logged
+ * afterwards are dropped, and their requests never answered.
+ */
+void wal_close()
+{
+  int fd;
+
+  if (wal_fd < 0 || wal_closing)
+    return;
+  pthread_mutex_lock(&wal_lock);
+  wal_closing = 1;
+  pthread_cond_signal(&wal_appended_cond);
+  pthread_mutex_unlock(&wal_lock);
+  pthread_join(wal_writer, NULL);
+
+  /* the writer may have moved to another segment meanwhile */
+  pthread_mutex_lock(&wal_lock);
+  fd = wal_fd;
+  wal_fd = -1;
+  pthread_mutex_unlock(&wal_lock);
+  close(fd);
+  free(wal_buffer);
+  free(wal_spare);
+  wal_buffer = wal_spare = NULL;
+}
+
+/*
+ * Appends an operation to the log, if it is open. Called with the locks
+ * the operation took still held.
+ * Input:
+ *  - op: WAL_CREATE, WAL_DELETE or WAL_MOVE
+ *  - arg: node type of a create
+ *  - path1: its path
+ *  - path2: second path of a move, "" for the others
+ */
+void wal_log(char op, char arg, char *path1, char *path2)
+{
+  int length1 = strlen(path1), length2 = strlen(path2);
+  size_t size = (sizeof(WalRecord) + length1 + length2 + 2 + 3) & ~(size_t)3;
+  WalRecord record = {size, 0, op, arg, length1, length2, 0};
+  char *buffer;
+
+  if (__atomic_load_n(&wal_fd, __ATOMIC_RELAXED) < 0 && !__atomic_load_n(&wal_closing, __ATOMIC_RELAXED))
+    return; /* not logging */
+  pthread_mutex_lock(&wal_lock);
+  if (wal_fd < 0 || wal_closing)
+  {
+    /* closed: never durable, wal_sync blocks until the server exits */
+    if (wal_closing)
+      wal_thread_lsn = ULONG_MAX;
+    pthread_mutex_unlock(&wal_lock);
+    return;
+  }
+  if (wal_used + size > wal_size)
+  {
+    if ((buffer = realloc(wal_buffer, wal_size * 2 + size)) == NULL)
+      exit(EXIT_FAILURE);
+    wal_buffer = buffer;
+    wal_size = wal_size * 2 + size;
+  }
+  buffer = wal_buffer + wal_used;
+  memcpy(buffer, &record, sizeof(WalRecord));
+  memcpy(buffer + sizeof(WalRecord), path1, length1 + 1);
+  memcpy(buffer + sizeof(WalRecord) + length1 + 1, path2, length2 + 1);
+  memset(buffer + sizeof(WalRecord) + length1 + length2 + 2, 0, size - sizeof(WalRecord) - length1 - length2 - 2);
+  ((WalRecord *)buffer)->checksum = wal_checksum(buffer, size);
+  wal_used += size;
+  __atomic_store_n(&wal_segment_bytes, wal_segment_bytes + size, __ATOMIC_RELAXED);
+  wal_thread_lsn = ++wal_appended;
+  pthread_cond_signal(&wal_appended_cond);
+  pthread_mutex_unlock(&wal_lock);
+}
+
+/*
+ * Waits until the records the calling thread appended are on disk: called
+ * before answering the requests that appended them, with no lock held.
+ */
+void wal_sync()
+{
+  if (wal_thread_lsn <= __atomic_load_n(&wal_durable, __ATOMIC_ACQUIRE))
+    return;
+  pthread_mutex_lock(&wal_lock);
+  while (wal_durable < wal_thread_lsn)
+    pthread_cond_wait(&wal_durable_cond, &wal_lock);
+  pthread_mutex_unlock(&wal_lock);
+}
@@ -0,0 +1,50 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+
+/* Operations logged, the letters of the protocol's opcodes */
+#define WAL_CREATE 'c'
+#define WAL_DELETE 'd'
+#define WAL_MOVE 'm'
+
+/* Names of the log's segments, in its directory, by number */
+#define WAL_SEGMENT_NAME "wal.%016lx"
+
+/* Initial size of the log buffer, which grows as needed */
+#define WAL_BUFFER_SIZE (1 << 20)
+
+/*
+ * A log record, followed by its two paths, NUL terminated, padded
+ * together to 4 bytes
+ */
+typedef struct walRecord {
+  uint32_t size;     /* of the record, with the paths */
+  uint32_t checksum; /* of what follows, see wal_checksum */
+  uint8_t op;
+  uint8_t arg; /* node type of a create */
+  uint16_t length1;
+  uint16_t length2;
+  uint16_t unused;
+} WalRecord;
+
+/*
+ * Applies a record replayed from the log.
+ */
+typedef void (*wal_apply_t)(char op, char arg, char *path1, char *path2);
+
+int wal_open(char *path, uint64_t first, int window, wal_apply_t apply);
+
+void wal_close();
+
+uint64_t wal_rotate(void (*at)(void *arg), void *arg);
+
+void wal_remove_segments(uint64_t before);
+
+unsigned long wal_segment_size();
+
+void wal_log(char op, char arg, char *path1, char *path2);
+
+void wal_sync();
+
+#endif /* WAL_H */
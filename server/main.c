@@ -1,9 +1,17 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -11,23 +19,172 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include "fs/operations.h"
+#include "fs/wal.h"
+#include "pool.h"
+#include "protocol.h"
+#include "tecnicofs-ring.h"
 
 #define MAX_INPUT_SIZE 100
 
+/* Seconds between checkpoints, unless set with -c */
+#define DEFAULT_CHECKPOINT_INTERVAL 60
+
+/* Datagram mode: most datagrams received (and replied to) at once */
+#define MAX_RECV_BATCH 64
+
+/* Most file descriptors a datagram may carry: those of the shared memory
+ * transport, a memfd and two eventfds */
+#define MAX_TASK_FDS 4
+
+/* Stream mode: most clients connected at once */
+#define MAX_CLIENTS 4096
+/* Stream mode: most events taken by one epoll_wait */
+#define MAX_EVENTS 64
+/* Stream mode: most requests of a client queued; its connection is not
+ * read from until the workers catch up */
+#define MAX_CLIENT_REQUESTS 16
+
+/* Maximum number of i-nodes, set with -i */
+int maxInodes = DEFAULT_MAX_INODES;
+
+/* Serve SOCK_SEQPACKET connections instead of datagrams, set with -s */
+int streamMode = 0;
+
+/* Directory of the write-ahead log and checkpoints of the namespace, set
+ * with -l; none by default */
+char *logPath = NULL;
+
+/* Group commit window of the log, in microseconds, set with -w */
+int logWindow = 0;
+
+/* Seconds between checkpoints, set with -c (0 for none) */
+int checkpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+
+/*
+ * Stream mode: a client's connection. Its requests are executed in order:
+ * one task at a time is in the pool, the others wait in the connection.
+ */
+typedef struct connection {
+  int fd;
+  pthread_mutex_t lock;
+  struct serverTask *first, *last; /* waiting for the one in the pool */
+  int queued;                      /* tasks not yet finished */
+  int scheduled;                   /* a task is in the pool */
+  int paused;                      /* out of epoll, too many queued */
+  int closed;                      /* hung up */
+  unsigned long owner;             /* of the files it opens (see taskOwner) */
+} Connection;
+
+/*
+ * A received datagram (or message) and its decoded requests, to be
+ * executed by a worker of the pool
+ */
+typedef struct serverTask {
+  PoolTask task;
+  struct serverTask *next; /* in its connection, or in its chain */
+  Connection *connection;  /* stream mode, NULL for a datagram */
+  struct sockaddr_un clientAddr;
+  socklen_t addrlen;
+  ProtocolFormat format;
+  int count;
+  Request requests[MAX_BATCH_SIZE];
+  int fds[MAX_TASK_FDS]; /* received with the datagram, closed when freed */
+  int fdsCount;
+  char datagram[] __attribute__((aligned(TFS_ALIGN)));
+} ServerTask;
+
+/*
+ * Where the chunks of a dump (or read) go: the client of a task, tagged
+ * with the id of its request
+ */
+typedef struct chunkTarget {
+  ServerTask *task;
+  unsigned int id;
+} ChunkTarget;
+
+/*
+ * Shared memory mode: a client's rings and eventfds (see tecnicofs-ring.h)
+ */
+typedef struct ringClient {
+  TfsSharedRings *rings;
+  int requestsfd, repliesfd, memfd;
+  int hangupfd;
+  unsigned long owner; /* of the client that attached it */
+} RingClient;
+
+int serverSocket;
+int threadsCount;
+int epollfd;
+int clientsCount = 0; /* connections open, atomic */
+
+/* Owners of open files: connections get the next id; datagram clients,
+ * the hash of their address, keyed so no client can pick another's */
+unsigned long ownersCount = 0; /* atomic */
+unsigned long ownerKey;
+
+/* Times a ring's consumer checks it before sleeping; spinning is pointless
+ * on a single core */
+int ringSpin;
+
+/*
+ * Prints the usage message and exits.
+ */
+void displayUsage()
+{
+  fprintf(stderr, "Usage: [-i maxinodes] [-s] [-l logdir [-w window_us] [-c seconds]] [numthreads] [nomesocket].\n");
+  exit(EXIT_FAILURE);
+}
+
 /*
- * Validates the initial arguments for the program.
+ * Validates the initial arguments for the program. On return, optind points
+ * to the first positional argument.
  * Input:
  *  - argc: number of arguments in argv
  *  - argv: array passed arguments
  */
 void validateInitArgs(int argc, char *argv[])
 {
-  if (argc != 3)
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:sl:w:c:")) != -1)
   {
-    fprintf(stderr, "Usage: [numthreads] [nomesocket].\n");
-    exit(EXIT_FAILURE);
+    switch (opt)
+    {
+    case 'i':
+      if ((maxInodes = atoi(optarg)) <= 0)
+      {
+        fprintf(stderr, "Invalid maxinodes.\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      streamMode = 1;
+      break;
+    case 'l':
+      logPath = optarg;
+      break;
+    case 'w':
+      if ((logWindow = atoi(optarg)) < 0)
+      {
+        fprintf(stderr, "Invalid window.\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      if ((checkpointInterval = atoi(optarg)) < 0)
+      {
+        fprintf(stderr, "Invalid checkpoint interval.\n");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      displayUsage();
+    }
   }
-  else if (atoi(argv[1]) <= 0)
+
+  if (argc - optind != 2)
+    displayUsage();
+  else if (atoi(argv[optind]) <= 0)
   {
     fprintf(stderr, "Invalid numthreads.\n");
     exit(EXIT_FAILURE);
@@ -44,114 +201,795 @@ void errorParse()
 }
 
 /*
- * Sends response to the client according to the result of the operation asked by the client.
- * Input:
- *  - sockfd: sock file descriptor for the client
- *  - response_code: response code that should be sent to the client
- *  - client_addr: client address
- *  - addrelen: client address length
+ * Returns the owner of the files a task's client opens: its connection's,
+ * in stream mode, or its address's (see ownerKey), with the top bit set,
+ * which no connection's has.
  */
-void sendResponse(int sockfd, int response_code, struct sockaddr_un *client_addr, socklen_t addrlen)
+unsigned long taskOwner(ServerTask *task)
 {
-  if (sendto(sockfd, &response_code, sizeof(int), 0, (struct sockaddr *)client_addr, addrlen) < 0)
-    perror("server: sendto error");
+  unsigned long hash = ownerKey;
+  int length = task->addrlen - offsetof(struct sockaddr_un, sun_path);
+
+  if (task->connection != NULL)
+    return task->connection->owner;
+  /* FNV-1a from the key, then mixed (splitmix64's finalizer) */
+  for (int i = 0; i < length && i < sizeof(task->clientAddr.sun_path); i++)
+    hash = (hash ^ (unsigned char)task->clientAddr.sun_path[i]) * 0x100000001b3UL;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9UL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebUL;
+  return (hash ^ (hash >> 31)) | 1UL << 63;
 }
 
 /*
- * Waits for a any command, that should be sent by a mounted client
+ * Executes a request.
  * Input:
- *  - arg: socket file descriptor for the server 
+ *  - request: the request
+ *  - owner: the client's, for the files it opens (see taskOwner)
+ * Returns: the response code for the client
  */
-void *consumerThread(void *arg)
+int executeRequest(Request *request, unsigned long owner)
 {
-  int sockfd = *(int *)arg;
-  int numArgs;
-  char token;
-  char command[MAX_INPUT_SIZE];
-  char arg1[MAX_INPUT_SIZE];
-  char arg2[MAX_INPUT_SIZE];
-
-  struct sockaddr_un client_addr;
-  socklen_t addrlen;
-  int c;
   int searchResult;
   FILE *fp;
-  addrlen = sizeof(struct sockaddr_un);
 
-  while (1)
+  if (request->error != SUCCESS)
+    return request->error;
+
+  switch (request->opcode)
   {
-    c = recvfrom(sockfd, command, sizeof(command) - 1, 0, (struct sockaddr *)&client_addr, &addrlen);
-    if (c <= 0)
-      continue;
-    command[c] = '\0';
-    numArgs = sscanf(command, "%c %s %s", &token, arg1, arg2);
-    if (numArgs < 2)
+  case TFS_OP_CREATE:
+    switch (request->arg)
+    {
+    case 'f':
+      printf("Create file: %s\n", request->path1);
+      return create(request->path1, T_FILE);
+    case 'd':
+      printf("Create directory: %s\n", request->path1);
+      return create(request->path1, T_DIRECTORY);
+    default:
+      fprintf(stderr, "Error: invalid node type\n");
+      return TECNICOFS_ERROR_INVALID_NODE_TYPE;
+    }
+  case TFS_OP_MOVE:
+    printf("Move file: %s to %s\n", request->path1, request->path2);
+    return move(request->path1, request->path2);
+  case TFS_OP_LOOKUP:
+    searchResult = lookup(request->path1);
+    if (searchResult >= 0)
+      printf("Search: %s found\n", request->path1);
+    else
+      printf("Search: %s not found\n", request->path1);
+    return searchResult;
+  case TFS_OP_DELETE:
+    if (request->arg == TFS_ARG_RECURSIVE)
     {
-      sendResponse(sockfd, TECNICOFS_ERROR_OTHER, &client_addr, addrlen);
+      printf("Delete tree: %s\n", request->path1);
+      return delete_tree(request->path1);
+    }
+    printf("Delete: %s\n", request->path1);
+    return delete (request->path1);
+  case TFS_OP_PRINT:
+    printf("Print: %s\n", request->path1);
+    fp = fopen(request->path1, "w");
+    if (fp == NULL)
+      return TECNICOFS_ERROR_FILE_NOT_OPEN;
+    print_tecnicofs_tree(fp);
+    fclose(fp); /* If function fails, server must continue */
+    return SUCCESS;
+  case TFS_OP_WRITE:
+  case TFS_OP_APPEND:
+    if (request->data == NULL || request->arg == TFS_ARG_MEMFD) /* see transferFile */
+      return TECNICOFS_ERROR_OTHER;
+    if (request->handle != 0)
+      return write_handle(request->handle, owner, request->data, request->size, request->opcode == TFS_OP_APPEND);
+    printf("Write: %s, %d bytes\n", request->path1, request->size);
+    return write_file(request->path1, request->data, request->size,
+                      request->opcode == TFS_OP_APPEND ? FILE_APPEND : request->offset);
+  case TFS_OP_TRUNCATE:
+    if (request->data == NULL)
+      return TECNICOFS_ERROR_OTHER;
+    if (request->handle != 0)
+      return truncate_handle(request->handle, owner, request->size);
+    printf("Truncate: %s to %d bytes\n", request->path1, request->size);
+    return truncate_file(request->path1, request->size);
+  case TFS_OP_OPEN:
+    printf("Open: %s\n", request->path1);
+    return open_file(request->path1, request->arg, owner);
+  case TFS_OP_SEEK:
+    if (request->data == NULL)
+      return TECNICOFS_ERROR_OTHER;
+    return seek_handle(request->handle, owner, request->offset);
+  case TFS_OP_CLOSE:
+    if (request->data == NULL)
+      return TECNICOFS_ERROR_OTHER;
+    return close_file(request->handle, owner);
+  default:
+    fprintf(stderr, "Error: command to apply\n");
+    return TECNICOFS_ERROR_OTHER;
+  }
+}
+
+/*
+ * Closes a connection, and the files it left open, and frees it.
+ */
+void destroyConnection(Connection *connection)
+{
+  close_files(connection->owner);
+  close(connection->fd);
+  pthread_mutex_destroy(&connection->lock);
+  free(connection);
+  __atomic_sub_fetch(&clientsCount, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Stream mode: done with a task of a connection. Submits its next one, if
+ * any, and lets the connection be read from again once the queue is short.
+ */
+void finishConnectionTask(Connection *connection)
+{
+  ServerTask *next;
+  struct epoll_event event;
+  int destroy;
+
+  pthread_mutex_lock(&connection->lock);
+  connection->queued--;
+  if ((next = connection->first) != NULL)
+  {
+    if ((connection->first = next->next) == NULL)
+      connection->last = NULL;
+  }
+  else
+    connection->scheduled = 0;
+  if (connection->paused && connection->queued <= MAX_CLIENT_REQUESTS / 2)
+  {
+    connection->paused = 0;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, connection->fd, &event) < 0)
+      perror("server: epoll_ctl error");
+  }
+  destroy = connection->closed && !connection->scheduled;
+  pthread_mutex_unlock(&connection->lock);
+
+  if (next != NULL)
+    pool_submit(&next->task);
+  else if (destroy)
+    destroyConnection(connection);
+}
+
+/*
+ * Shared memory mode: serves a client through its rings until it detaches,
+ * or is gone (see tfsRingHungUp), and closes the files it left open.
+ * Input:
+ *  - arg: the RingClient, freed on return
+ */
+void *ringThread(void *arg)
+{
+  RingClient *client = arg;
+  TfsSharedRings *rings = client->rings;
+  /* the request is copied out of the ring first: the client may reuse the
+   * slot, or write to it meanwhile; +1 for the NUL protocol_parse may add */
+  char datagram[TFS_RING_DATAGRAM + 1] __attribute__((aligned(TFS_ALIGN)));
+  Request requests[MAX_BATCH_SIZE];
+  int results[MAX_BATCH_SIZE];
+  ProtocolFormat format;
+  unsigned int size;
+  int slot, count, i;
+
+  while ((slot = tfsRingWait(&rings->requests, client->requestsfd, client->hangupfd, ringSpin)) >= 0)
+  {
+    if ((size = rings->requestSlots[slot].size) == 0)
+      break; /* detached */
+    if (size > TFS_RING_DATAGRAM)
+      size = TFS_RING_DATAGRAM;
+    memcpy(datagram, rings->requestSlots[slot].datagram, size);
+    tfsRingConsume(&rings->requests);
+
+    if ((count = protocol_parse(datagram, size, requests, &format)) == FAIL)
+      count = 0;
+    for (i = 0; i < count; i++)
+      results[i] = executeRequest(&requests[i], client->owner);
+    wal_sync();
+
+    /* a client slow to take its replies makes this one wait */
+    while ((slot = tfsRingFree(&rings->replies)) < 0 && !tfsRingHungUp(client->hangupfd))
+      usleep(100);
+    if (slot < 0)
+      break; /* gone */
+    rings->replySlots[slot].size = protocol_reply(format, requests, results, count, rings->replySlots[slot].datagram);
+    tfsRingProduce(&rings->replies, client->repliesfd);
+  }
+
+  close_files(client->owner);
+  munmap(rings, sizeof(TfsSharedRings));
+  close(client->requestsfd);
+  close(client->repliesfd);
+  close(client->memfd);
+  close(client->hangupfd);
+  free(client);
+  return NULL;
+}
+
+/*
+ * Shared memory mode: attaches a client, with a thread of its own serving
+ * its rings. The task's file descriptors are the memfd holding the rings,
+ * the eventfds of its requests ring and its replies ring, and the read end
+ * of a pipe that hangs up when the client is gone, in that order; it keeps
+ * them, on success. The memfd must be sealed against shrinking, or the
+ * client could fault the ring thread by truncating it.
+ * Input:
+ *  - task: the task with the TFS_OP_SHARED_MEMORY request
+ * Returns: SUCCESS or TECNICOFS_ERROR_OTHER
+ */
+int attachSharedMemory(ServerTask *task)
+{
+  RingClient *client;
+  struct stat st;
+  pthread_t tid;
+  pthread_attr_t attr;
+  int seals;
+
+  if (task->fdsCount != 4 || fstat(task->fds[0], &st) < 0 || st.st_size < sizeof(TfsSharedRings) ||
+      (seals = fcntl(task->fds[0], F_GET_SEALS)) < 0 || !(seals & F_SEAL_SHRINK) || (client = malloc(sizeof(RingClient))) == NULL)
+    return TECNICOFS_ERROR_OTHER;
+  client->rings = mmap(NULL, sizeof(TfsSharedRings), PROT_READ | PROT_WRITE, MAP_SHARED, task->fds[0], 0);
+  if (client->rings == MAP_FAILED)
+  {
+    free(client);
+    return TECNICOFS_ERROR_OTHER;
+  }
+  client->memfd = task->fds[0];
+  client->requestsfd = task->fds[1];
+  client->repliesfd = task->fds[2];
+  client->hangupfd = task->fds[3];
+  client->owner = taskOwner(task);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&tid, &attr, ringThread, client) != 0)
+  {
+    pthread_attr_destroy(&attr);
+    munmap(client->rings, sizeof(TfsSharedRings));
+    free(client);
+    return TECNICOFS_ERROR_OTHER;
+  }
+  pthread_attr_destroy(&attr);
+  printf("Shared memory: client attached\n");
+  task->fdsCount = 0;
+  return SUCCESS;
+}
+
+/*
+ * Takes the file descriptors received with a message (SCM_RIGHTS), up to
+ * MAX_TASK_FDS; any others are closed.
+ * Input:
+ *  - msg: the message
+ *  - fds: where to store them
+ * Returns: how many were stored
+ */
+int receiveFds(struct msghdr *msg, int *fds)
+{
+  struct cmsghdr *cmsg;
+  int count = 0, n, fd;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
       continue;
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < n; i++)
+    {
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      if (count < MAX_TASK_FDS)
+        fds[count++] = fd;
+      else
+        close(fd);
     }
-    switch (token)
+  }
+  return count;
+}
+
+/*
+ * Sends a chunk of the tree to the client of a dump (see dumpTree), or of
+ * a file to the client of a read.
+ * Returns: SUCCESS, or FAIL if the client is gone
+ */
+int sendChunk(const char *chunk, int size, void *arg)
+{
+  ChunkTarget *target = arg;
+  ServerTask *task = target->task;
+  TfsChunk header = {TFS_MAGIC_CHUNK, TFS_VERSION, 0, target->id, size};
+  struct iovec iov[2] = {{&header, sizeof(header)}, {(char *)chunk, size}};
+  struct msghdr msg;
+
+  bzero(&msg, sizeof(msg));
+  if (task->connection == NULL)
+  {
+    msg.msg_name = &task->clientAddr;
+    msg.msg_namelen = task->addrlen;
+  }
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(task->connection ? task->connection->fd : serverSocket, &msg, MSG_NOSIGNAL) < 0)
+  {
+    perror("server: dump error");
+    return FAIL;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Streams the tree to the client of a task, in chunk datagrams (see
+ * tecnicofs-protocol.h) sent as the tree is walked, ahead of the reply.
+ * Input:
+ *  - task: the task, binary, with the request
+ *  - request: the TFS_OP_DUMP or TFS_OP_SNAPSHOT request; a snapshot is
+ *    sent as the create commands that rebuild the tree
+ * Returns: SUCCESS or TECNICOFS_ERROR_OTHER
+ */
+int dumpTree(ServerTask *task, Request *request)
+{
+  ChunkTarget target = {task, request->id};
+  int format = request->opcode == TFS_OP_SNAPSHOT ? TREE_COMMANDS : TREE_PATHS;
+
+  printf(format == TREE_COMMANDS ? "Snapshot\n" : "Dump\n");
+  return export_tecnicofs_tree(format, sendChunk, &target) == SUCCESS ? SUCCESS : TECNICOFS_ERROR_OTHER;
+}
+
+/*
+ * Reads from a file for the client of a task, and sends it the data in
+ * chunk datagrams, ahead of the reply.
+ * Input:
+ *  - task: the task, binary, with the request
+ *  - request: the TFS_OP_READ request, of up to TFS_MAX_READ bytes
+ * Returns: the bytes read, or an error (see read_file and read_handle)
+ */
+int readFile(ServerTask *task, Request *request)
+{
+  ChunkTarget target = {task, request->id};
+  int size = request->size < TFS_MAX_READ ? request->size : TFS_MAX_READ, count;
+  char *data = malloc(size > 0 ? size : 1);
+
+  if (data == NULL)
+    return TECNICOFS_ERROR_OTHER;
+  if (request->handle != 0)
+    count = read_handle(request->handle, taskOwner(task), data, size);
+  else
+  {
+    printf("Read: %s, %d bytes\n", request->path1, size);
+    count = read_file(request->path1, data, size, request->offset);
+  }
+  for (int sent = 0; sent < count; sent += TFS_MAX_CHUNK)
+  {
+    if (sendChunk(data + sent, count - sent < TFS_MAX_CHUNK ? count - sent : TFS_MAX_CHUNK, &target) != SUCCESS)
     {
-    case 'c':
-      switch (arg2[0])
-      {
-      case 'f':
-        printf("Create file: %s\n", arg1);
-        sendResponse(sockfd, create(arg1, T_FILE), &client_addr, addrlen);
-        break;
-      case 'd':
-        printf("Create directory: %s\n", arg1);
-        sendResponse(sockfd, create(arg1, T_DIRECTORY), &client_addr, addrlen);
-        break;
-      default:
-        fprintf(stderr, "Error: invalid node type\n");
-        sendResponse(sockfd, TECNICOFS_ERROR_INVALID_NODE_TYPE, &client_addr, addrlen);
-      }
-      break;
-    case 'm':
-      printf("Move file: %s to %s\n", arg1, arg2);
-      sendResponse(sockfd, move(arg1, arg2), &client_addr, addrlen);
+      count = TECNICOFS_ERROR_OTHER;
       break;
-    case 'l':
-      searchResult = lookup(arg1);
-      if (searchResult >= 0)
-      {
-        printf("Search: %s found\n", arg1);
-        sendResponse(sockfd, searchResult, &client_addr, addrlen);
-      }
+    }
+  }
+  free(data);
+  return count;
+}
+
+/*
+ * Reads or writes a file through the memfd sent along with the request
+ * (TFS_ARG_MEMFD) rather than through datagrams: the data is copied once,
+ * between the file's blocks and the client's pages, however large.
+ * Input:
+ *  - task: the task, binary, with the memfd
+ *  - request: the TFS_OP_READ, TFS_OP_WRITE or TFS_OP_APPEND request
+ * Returns: the bytes read or written, TECNICOFS_ERROR_OTHER if the memfd
+ *  is missing, too small or not sealed against shrinking (which would
+ *  fault the server while it copies), or an error of the operation
+ */
+int transferFile(ServerTask *task, Request *request)
+{
+  int reading = request->opcode == TFS_OP_READ, seals, result;
+  struct stat st;
+  char *data;
+
+  if (task->fdsCount != 1 || request->size <= 0 || fstat(task->fds[0], &st) < 0 ||
+      st.st_size < request->size || (seals = fcntl(task->fds[0], F_GET_SEALS)) < 0 ||
+      !(seals & F_SEAL_SHRINK))
+    return TECNICOFS_ERROR_OTHER;
+  data = mmap(NULL, request->size, reading ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED | MAP_POPULATE,
+              task->fds[0], 0);
+  if (data == MAP_FAILED)
+    return TECNICOFS_ERROR_OTHER;
+
+  if (reading && request->handle != 0)
+    result = read_handle(request->handle, taskOwner(task), data, request->size);
+  else if (reading)
+  {
+    printf("Read: %s, %d bytes\n", request->path1, request->size);
+    result = read_file(request->path1, data, request->size, request->offset);
+  }
+  else if (request->handle != 0)
+    result = write_handle(request->handle, taskOwner(task), data, request->size, request->opcode == TFS_OP_APPEND);
+  else
+  {
+    printf("Write: %s, %d bytes\n", request->path1, request->size);
+    result = write_file(request->path1, data, request->size,
+                        request->opcode == TFS_OP_APPEND ? FILE_APPEND : request->offset);
+  }
+  munmap(data, request->size);
+  return result;
+}
+
+/*
+ * Executes the requests of a task, in order, and builds its reply.
+ * Input:
+ *  - task: the task
+ *  - reply: where to build the reply (PROTOCOL_MAX_REPLY bytes)
+ * Returns: size of the reply
+ */
+int executeTask(ServerTask *task, char *reply)
+{
+  int results[MAX_BATCH_SIZE];
+
+  for (int i = 0; i < task->count; i++)
+  {
+    if (task->requests[i].opcode == TFS_OP_SHARED_MEMORY && task->requests[i].error == SUCCESS)
+      results[i] = attachSharedMemory(task);
+    else if ((task->requests[i].opcode == TFS_OP_DUMP || task->requests[i].opcode == TFS_OP_SNAPSHOT) &&
+             task->requests[i].error == SUCCESS && task->format == PROTOCOL_BINARY)
+      results[i] = dumpTree(task, &task->requests[i]);
+    else if (task->requests[i].arg == TFS_ARG_MEMFD && task->requests[i].data != NULL &&
+             task->requests[i].error == SUCCESS &&
+             (task->requests[i].opcode == TFS_OP_READ || task->requests[i].opcode == TFS_OP_WRITE ||
+              task->requests[i].opcode == TFS_OP_APPEND))
+      results[i] = transferFile(task, &task->requests[i]);
+    else if (task->requests[i].opcode == TFS_OP_READ && task->requests[i].data != NULL &&
+             task->requests[i].error == SUCCESS)
+      results[i] = readFile(task, &task->requests[i]);
+    else
+      results[i] = executeRequest(&task->requests[i], taskOwner(task));
+  }
+  /* no reply before what was done is on disk */
+  wal_sync();
+  return protocol_reply(task->format, task->requests, results, task->count, reply);
+}
+
+/*
+ * Closes the file descriptors a task still holds, and frees it.
+ */
+void freeTask(ServerTask *task)
+{
+  for (int i = 0; i < task->fdsCount; i++)
+    close(task->fds[i]);
+  free(task);
+}
+
+/*
+ * Datagram mode: executes a chain of tasks, in order, and sends all their
+ * replies with a single sendmmsg.
+ * Input:
+ *  - poolTask: the first task (a ServerTask) of the chain, all freed on
+ *    return
+ */
+void runDatagramTasks(PoolTask *poolTask)
+{
+  static __thread char replies[MAX_RECV_BATCH][PROTOCOL_MAX_REPLY] __attribute__((aligned(TFS_ALIGN)));
+  struct mmsghdr messages[MAX_RECV_BATCH];
+  struct iovec iovs[MAX_RECV_BATCH];
+  ServerTask *task, *chain[MAX_RECV_BATCH];
+  int count = 0, sent;
+
+  bzero(messages, sizeof(messages));
+  for (task = (ServerTask *)poolTask; task != NULL; task = task->next)
+  {
+    iovs[count].iov_base = replies[count];
+    iovs[count].iov_len = executeTask(task, replies[count]);
+    messages[count].msg_hdr.msg_name = &task->clientAddr;
+    messages[count].msg_hdr.msg_namelen = task->addrlen;
+    messages[count].msg_hdr.msg_iov = &iovs[count];
+    messages[count].msg_hdr.msg_iovlen = 1;
+    chain[count++] = task;
+  }
+
+  /* a reply that fails is skipped, the rest are still sent */
+  for (int i = 0; i < count; i += sent > 0 ? sent : 1)
+  {
+    if ((sent = sendmmsg(serverSocket, messages + i, count - i, 0)) < 0)
+      perror("server: sendmmsg error");
+  }
+  for (int i = 0; i < count; i++)
+    freeTask(chain[i]);
+}
+
+/*
+ * Stream mode: executes a task of a connection and sends its reply.
+ * Input:
+ *  - poolTask: the task (a ServerTask), freed on return
+ */
+void runConnectionTask(PoolTask *poolTask)
+{
+  ServerTask *task = (ServerTask *)poolTask;
+  char reply[PROTOCOL_MAX_REPLY] __attribute__((aligned(TFS_ALIGN)));
+  int size = executeTask(task, reply);
+
+  /* if the client hung up, the event loop finds out */
+  send(task->connection->fd, reply, size, MSG_NOSIGNAL);
+  finishConnectionTask(task->connection);
+  freeTask(task);
+}
+
+/*
+ * Decodes a datagram (or message) into a task. Tasks with nothing but
+ * lookups have high priority, so that they do not wait behind long prints
+ * or moves.
+ * Input:
+ *  - datagram: the datagram
+ *  - size: its size
+ * Returns: the task
+ */
+ServerTask *decodeTask(char *datagram, int size)
+{
+  ServerTask *task = malloc(sizeof(ServerTask) + size + 1);
+  int i;
+
+  if (task == NULL)
+  {
+    fprintf(stderr, "Error: unable to allocate a task\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(task->datagram, datagram, size);
+  if ((task->count = protocol_parse(task->datagram, size, task->requests, &task->format)) == FAIL)
+    task->count = 0;
+  task->task.priority = POOL_HIGH;
+  for (i = 0; i < task->count; i++)
+  {
+    if (task->requests[i].opcode != TFS_OP_LOOKUP)
+      task->task.priority = POOL_NORMAL;
+  }
+  task->connection = NULL;
+  task->next = NULL;
+  task->fdsCount = 0;
+  return task;
+}
+
+/*
+ * Datagram mode: receives the datagrams, up to a batch at a time with
+ * recvmmsg, and hands them to the pool. The batch grows while the calls
+ * fill it and shrinks while they return less than half of it. The
+ * datagrams received together are split into chains, by priority, of a
+ * worker's share each, so that every worker gets some.
+ * Input:
+ *  - sockfd: socket file descriptor for the server
+ */
+void dispatchDatagrams(int sockfd)
+{
+  /* +1 for the NUL protocol_parse may add */
+  static char datagrams[MAX_RECV_BATCH][TFS_MAX_DATAGRAM + 1] __attribute__((aligned(TFS_ALIGN)));
+  static struct sockaddr_un addrs[MAX_RECV_BATCH];
+  static char controls[MAX_RECV_BATCH][CMSG_SPACE(MAX_TASK_FDS * sizeof(int))];
+  struct mmsghdr messages[MAX_RECV_BATCH];
+  struct iovec iovs[MAX_RECV_BATCH];
+  ServerTask *task, *first[POOL_PRIORITIES] = {NULL}, *last[POOL_PRIORITIES];
+  int length[POOL_PRIORITIES] = {0};
+  int batch = 1, count, share, p, i;
+
+  bzero(messages, sizeof(messages));
+  for (i = 0; i < MAX_RECV_BATCH; i++)
+  {
+    iovs[i].iov_base = datagrams[i];
+    iovs[i].iov_len = TFS_MAX_DATAGRAM;
+    messages[i].msg_hdr.msg_name = &addrs[i];
+    messages[i].msg_hdr.msg_iov = &iovs[i];
+    messages[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (1)
+  {
+    for (i = 0; i < batch; i++)
+    {
+      messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+      messages[i].msg_hdr.msg_control = controls[i];
+      messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+    }
+    /* waits for the first datagram only */
+    if ((count = recvmmsg(sockfd, messages, batch, MSG_WAITFORONE, NULL)) <= 0)
+      continue;
+
+    share = (count + threadsCount - 1) / threadsCount;
+    for (i = 0; i < count; i++)
+    {
+      if (messages[i].msg_len == 0)
+        continue;
+      task = decodeTask(datagrams[i], messages[i].msg_len);
+      task->fdsCount = receiveFds(&messages[i].msg_hdr, task->fds);
+      task->task.run = runDatagramTasks;
+      task->clientAddr = addrs[i];
+      task->addrlen = messages[i].msg_hdr.msg_namelen;
+
+      p = task->task.priority;
+      if (first[p] == NULL)
+        first[p] = task;
       else
+        last[p]->next = task;
+      last[p] = task;
+      if (++length[p] == share)
       {
-        printf("Search: %s not found\n", arg1);
-        sendResponse(sockfd, searchResult, &client_addr, addrlen);
+        pool_submit(&first[p]->task);
+        first[p] = NULL;
+        length[p] = 0;
       }
-      break;
-    case 'd':
-      printf("Delete: %s\n", arg1);
-      sendResponse(sockfd, delete (arg1), &client_addr, addrlen);
-      break;
-    case 'p':
-      printf("Print: %s\n", arg1);
-      fp = fopen(arg1, "w");
-      if (fp == NULL)
-      {
-        sendResponse(sockfd, TECNICOFS_ERROR_FILE_NOT_OPEN, &client_addr, addrlen);
-        break;
-      }
-      print_tecnicofs_tree(fp);
-      fclose(fp); /* If function fails, server must continue */
-      sendResponse(sockfd, SUCCESS, &client_addr, addrlen);
-      break;
-    default:
+    }
+    for (p = 0; p < POOL_PRIORITIES; p++)
+    {
+      if (first[p] != NULL)
+        pool_submit(&first[p]->task);
+      first[p] = NULL;
+      length[p] = 0;
+    }
+
+    if (count == batch && batch < MAX_RECV_BATCH)
+      batch *= 2;
+    else if (count < batch / 2)
+      batch /= 2;
+  }
+}
+
+/*
+ * Stream mode: queues a task of a connection, submitting it if none of the
+ * connection's is in the pool.
+ * Returns: 1 if the connection has too many requests queued, and was taken
+ *  out of epoll, or 0
+ */
+int queueConnectionTask(Connection *connection, ServerTask *task)
+{
+  int submit = 0, paused;
+
+  task->connection = connection;
+  task->next = NULL;
+  pthread_mutex_lock(&connection->lock);
+  connection->queued++;
+  if (!connection->scheduled)
+    connection->scheduled = submit = 1;
+  else if (connection->last != NULL)
+    connection->last = connection->last->next = task;
+  else
+    connection->first = connection->last = task;
+  if (connection->queued >= MAX_CLIENT_REQUESTS)
+  {
+    /* out of epoll rather than with no events, or a hang up would still
+     * be reported, over and over */
+    connection->paused = 1;
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->fd, NULL);
+  }
+  paused = connection->paused;
+  pthread_mutex_unlock(&connection->lock);
+
+  if (submit)
+    pool_submit(&task->task);
+  return paused;
+}
+
+/*
+ * Stream mode: reads the requests a client has sent and queues them, or
+ * closes the connection if the client hung up.
+ * Input:
+ *  - connection: the connection
+ *  - datagram: buffer for a message, TFS_MAX_DATAGRAM + 1 bytes
+ */
+void readConnection(Connection *connection, char *datagram)
+{
+  char control[CMSG_SPACE(MAX_TASK_FDS * sizeof(int))];
+  struct iovec iov = {datagram, TFS_MAX_DATAGRAM};
+  struct msghdr msg;
+  ServerTask *task;
+  int c, destroy;
+
+  bzero(&msg, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  while ((c = recvmsg(connection->fd, &msg, MSG_DONTWAIT)) > 0)
+  {
+    task = decodeTask(datagram, c);
+    task->fdsCount = receiveFds(&msg, task->fds);
+    task->task.run = runConnectionTask;
+    msg.msg_controllen = sizeof(control);
+    if (queueConnectionTask(connection, task))
+      return;
+  }
+  if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return;
+
+  /* hung up: closed now, or by the worker of its last task */
+  epoll_ctl(epollfd, EPOLL_CTL_DEL, connection->fd, NULL);
+  pthread_mutex_lock(&connection->lock);
+  connection->closed = 1;
+  destroy = !connection->scheduled;
+  pthread_mutex_unlock(&connection->lock);
+  if (destroy)
+    destroyConnection(connection);
+}
+
+/*
+ * Stream mode: accepts the pending connections, up to MAX_CLIENTS open.
+ * Input:
+ *  - sockfd: the listening socket, non-blocking
+ */
+void acceptClients(int sockfd)
+{
+  struct epoll_event event;
+  Connection *connection;
+  int clientfd;
+
+  while ((clientfd = accept(sockfd, NULL, NULL)) >= 0)
+  {
+    if (__atomic_load_n(&clientsCount, __ATOMIC_RELAXED) >= MAX_CLIENTS || (connection = malloc(sizeof(Connection))) == NULL)
     {
-      fprintf(stderr, "Error: command to apply\n");
-      sendResponse(sockfd, TECNICOFS_ERROR_OTHER, &client_addr, addrlen);
+      close(clientfd);
+      continue;
     }
+    connection->fd = clientfd;
+    pthread_mutex_init(&connection->lock, NULL);
+    connection->first = connection->last = NULL;
+    connection->queued = connection->scheduled = 0;
+    connection->paused = connection->closed = 0;
+    connection->owner = __atomic_add_fetch(&ownersCount, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&clientsCount, 1, __ATOMIC_RELAXED);
+
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &event) < 0)
+    {
+      perror("server: epoll_ctl error");
+      destroyConnection(connection);
     }
   }
 }
 
 /*
- * Creates all the threads.
+ * Stream mode: the event loop. Accepts connections, reads their requests
+ * and hands them to the pool.
+ * Input:
+ *  - sockfd: the listening socket, non-blocking
+ */
+void eventLoop(int sockfd)
+{
+  /* +1 for the NUL protocol_parse may add */
+  static char datagram[TFS_MAX_DATAGRAM + 1] __attribute__((aligned(TFS_ALIGN)));
+  struct epoll_event events[MAX_EVENTS], event;
+  int count, i;
+
+  if ((epollfd = epoll_create1(0)) < 0)
+  {
+    perror("server: epoll_create1 error");
+    exit(EXIT_FAILURE);
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL; /* the listening socket */
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &event) < 0)
+  {
+    perror("server: epoll_ctl error");
+    exit(EXIT_FAILURE);
+  }
+
+  while (1)
+  {
+    if ((count = epoll_wait(epollfd, events, MAX_EVENTS, -1)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("server: epoll_wait error");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < count; i++)
+    {
+      if (events[i].data.ptr == NULL)
+        acceptClients(sockfd);
+      else
+        readConnection(events[i].data.ptr, datagram);
+    }
+  }
+}
+
+/*
+ * Creates the pool's threads, and dispatches the requests to them.
  * Input:
  *  - threads_count_char: number of threads to be created
  *  - sockfd: socket file descriptor for the server
@@ -161,15 +999,26 @@ void executeThreads(char *threads_count_char, int sockfd)
   int i, *result;
   int threads_count = atoi(threads_count_char);
   pthread_t tid[threads_count];
+
+  pool_init(threads_count);
   for (i = 0; i < threads_count; i++)
   {
-    if (pthread_create(&tid[i], NULL, consumerThread, (void *)&sockfd) != 0)
+    if (pthread_create(&tid[i], NULL, pool_worker, (void *)(long)i) != 0)
     {
       fprintf(stderr, "Failed to create a thread %d.\n", i);
       exit(EXIT_FAILURE);
     }
   }
 
+  /* this thread is the dispatcher, which does not return */
+  serverSocket = sockfd;
+  threadsCount = threads_count;
+  ringSpin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? TFS_RING_SPIN : 0;
+  if (streamMode)
+    eventLoop(sockfd);
+  else
+    dispatchDatagrams(sockfd);
+
   for (i = 0; i < threads_count; i++)
   {
     if (pthread_join(tid[i], (void **)&result) != 0)
@@ -194,7 +1043,8 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr)
 }
 
 /*
- * Mounts the socket for the server
+ * Mounts the socket for the server: a datagram socket or, in stream mode,
+ * a listening SOCK_SEQPACKET one, which keeps the requests' boundaries
  * Input:
  *  - path: path for the file associated with the socket
  *  - addr: socket struct for the server
@@ -205,7 +1055,7 @@ int socketMount(char *socket_name)
   int sockfd;
   struct sockaddr_un server_addr;
 
-  if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  if ((sockfd = socket(AF_UNIX, streamMode ? SOCK_SEQPACKET : SOCK_DGRAM, 0)) < 0)
   {
     perror("server: can't open socket");
     exit(EXIT_FAILURE);
@@ -216,19 +1066,69 @@ int socketMount(char *socket_name)
     perror("server: bind error");
     exit(EXIT_FAILURE);
   }
+  if (streamMode &&
+      (listen(sockfd, SOMAXCONN) < 0 || fcntl(sockfd, F_SETFL, O_NONBLOCK) < 0))
+  {
+    perror("server: listen error");
+    exit(EXIT_FAILURE);
+  }
   return sockfd;
 }
 
+/*
+ * Waits for SIGINT or SIGTERM, blocked in every other thread, and shuts the
+ * server down: the write-ahead log is closed once what was logged is on
+ * disk, so every operation answered survives.
+ * Input:
+ *  - arg: path of the socket, unlinked
+ */
+void *signalThread(void *arg)
+{
+  sigset_t signals;
+  int received;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigwait(&signals, &received);
+
+  wal_close();
+  unlink((char *)arg);
+  exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char *argv[])
 {
   int sockfd;
+  sigset_t signals;
+  pthread_t tid;
+
   validateInitArgs(argc, argv);
-  init_fs();
-  sockfd = socketMount(argv[2]);
-  executeThreads(argv[1], sockfd);
+  /* before any thread exists, so all inherit the mask */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  if (getrandom(&ownerKey, sizeof(ownerKey), 0) != sizeof(ownerKey))
+  {
+    perror("server: getrandom error");
+    exit(EXIT_FAILURE);
+  }
+
+  init_fs(maxInodes);
+  if (logPath != NULL && recover_fs(logPath, logWindow, checkpointInterval) == FAIL)
+  {
+    perror("server: can't open log");
+    exit(EXIT_FAILURE);
+  }
+  sockfd = socketMount(argv[optind + 1]);
+  if (pthread_create(&tid, NULL, signalThread, argv[optind + 1]) != 0)
+  {
+    fprintf(stderr, "Failed to create the signal thread.\n");
+    exit(EXIT_FAILURE);
+  }
+  executeThreads(argv[optind], sockfd);
   close(sockfd);
-  unlink(argv[2]);
-  exit(EXIT_SUCCESS);
-  destroy_fs();
+  unlink(argv[optind + 1]);
   exit(EXIT_SUCCESS);
 }
\ No newline at end of file
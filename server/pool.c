@@ -0,0 +1,184 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * A deque of tasks: the owner takes from the head, thieves from the tail
+ */
+typedef struct poolDeque {
+  pthread_mutex_t lock;
+  PoolTask *head, *tail;
+} PoolDeque;
+
+/*
+ * A worker's deques, on cache lines of their own
+ */
+typedef struct poolWorker {
+  PoolDeque deques[POOL_PRIORITIES];
+} __attribute__((aligned(64))) PoolWorker;
+
+PoolWorker *pool_workers;
+int pool_workers_count;
+
+/* Tasks submitted and not yet taken, and workers sleeping (atomic) */
+int pool_pending = 0;
+int pool_idle = 0;
+pthread_mutex_t pool_sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_sleep_cond = PTHREAD_COND_INITIALIZER;
+
+/* Worker that gets the next task submitted from outside the pool */
+unsigned int pool_next_worker = 0;
+
+/* Index of the calling thread in the pool, -1 outside */
+__thread int pool_self = -1;
+
+/*
+ * Allocates the workers' deques; the workers are then started by running
+ * pool_worker in a thread each.
+ * Input:
+ *  - workers: number of workers
+ */
+void pool_init(int workers)
+{
+  if (posix_memalign((void **)&pool_workers, 64, workers * sizeof(PoolWorker)) != 0)
+  {
+    fprintf(stderr, "Error: unable to allocate the worker pool\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < workers; i++)
+  {
+    for (int p = 0; p < POOL_PRIORITIES; p++)
+    {
+      pthread_mutex_init(&pool_workers[i].deques[p].lock, NULL);
+      pool_workers[i].deques[p].head = NULL;
+      pool_workers[i].deques[p].tail = NULL;
+    }
+  }
+  pool_workers_count = workers;
+}
+
+/*
+ * Appends a task to a deque.
+ */
+static void pool_push(PoolDeque *deque, PoolTask *task)
+{
+  pthread_mutex_lock(&deque->lock);
+  task->next = NULL;
+  task->prev = deque->tail;
+  if (deque->tail != NULL)
+    deque->tail->next = task;
+  else
+    deque->head = task;
+  deque->tail = task;
+  pthread_mutex_unlock(&deque->lock);
+}
+
+/*
+ * Takes a task from a deque: the oldest for its owner, the newest for a
+ * thief.
+ * Returns: the task, or NULL if the deque is empty
+ */
+static PoolTask *pool_take(PoolDeque *deque, int steal)
+{
+  PoolTask *task;
+
+  /* an unlocked peek, so that idle thieves do not contend for the lock */
+  if (__atomic_load_n(&deque->head, __ATOMIC_RELAXED) == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  task = steal ? deque->tail : deque->head;
+  if (task != NULL)
+  {
+    if (task->prev != NULL)
+      task->prev->next = task->next;
+    else
+      deque->head = task->next;
+    if (task->next != NULL)
+      task->next->prev = task->prev;
+    else
+      deque->tail = task->prev;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return task;
+}
+
+/*
+ * Finds a task for a worker: its own, or else another worker's, high
+ * priority tasks first.
+ * Returns: the task, or NULL if there is none
+ */
+static PoolTask *pool_find(int self)
+{
+  PoolTask *task;
+
+  for (int p = 0; p < POOL_PRIORITIES; p++)
+  {
+    if ((task = pool_take(&pool_workers[self].deques[p], 0)) != NULL)
+      return task;
+    for (int i = 1; i < pool_workers_count; i++)
+    {
+      task = pool_take(&pool_workers[(self + i) % pool_workers_count].deques[p], 1);
+      if (task != NULL)
+        return task;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Runs tasks forever.
+ * Input:
+ *  - arg: the worker's index, from 0 to the number of workers - 1 (cast
+ *    to void*)
+ */
+void *pool_worker(void *arg)
+{
+  PoolTask *task;
+
+  pool_self = (long)arg;
+  while (1)
+  {
+    if ((task = pool_find(pool_self)) != NULL)
+    {
+      __atomic_sub_fetch(&pool_pending, 1, __ATOMIC_SEQ_CST);
+      task->run(task);
+      continue;
+    }
+
+    /* pool_idle is raised before pool_pending is checked, and pool_submit
+     * raises pool_pending before checking pool_idle: one of them sees the
+     * other, so no wake up is lost */
+    pthread_mutex_lock(&pool_sleep_lock);
+    __atomic_add_fetch(&pool_idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool_pending, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_wait(&pool_sleep_cond, &pool_sleep_lock);
+    __atomic_sub_fetch(&pool_idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool_sleep_lock);
+  }
+  return NULL;
+}
+
+/*
+ * Submits a task, to be run by some worker.
+ * Input:
+ *  - task: the task, with its priority and run set
+ */
+void pool_submit(PoolTask *task)
+{
+  int worker = pool_self;
+
+  if (worker < 0)
+    worker = __atomic_fetch_add(&pool_next_worker, 1, __ATOMIC_RELAXED) % pool_workers_count;
+  pool_push(&pool_workers[worker].deques[task->priority], task);
+
+  __atomic_add_fetch(&pool_pending, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool_idle, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&pool_sleep_lock);
+    pthread_cond_signal(&pool_sleep_cond);
+    pthread_mutex_unlock(&pool_sleep_lock);
+  }
+}
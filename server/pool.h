@@ -0,0 +1,33 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Priorities of a task: any high one waiting runs before the normal ones */
+#define POOL_HIGH 0
+#define POOL_NORMAL 1
+#define POOL_PRIORITIES 2
+
+/*
+ * A unit of work, embedded in a larger struct. run is called by one of the
+ * workers, and owns the task from then on.
+ */
+typedef struct poolTask {
+  struct poolTask *next, *prev;
+  int priority;
+  void (*run)(struct poolTask *task);
+} PoolTask;
+
+/*
+ * Work stealing pool.
+ * Each worker has a deque per priority. Tasks are submitted to the deque
+ * of the submitting worker (or, from other threads, of the next worker in
+ * turn); a worker runs its own oldest task and, when it has none, steals
+ * the newest task of another worker, trying every high priority deque
+ * before any normal one. Idle workers sleep until a task is submitted.
+ */
+void pool_init(int workers);
+
+void *pool_worker(void *arg);
+
+void pool_submit(PoolTask *task);
+
+#endif /* POOL_H */
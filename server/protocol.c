@@ -0,0 +1,246 @@
+#include "protocol.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Separators of the text protocol arguments */
+#define TEXT_DELIM " \t\r\n"
+
+/*
+ * Returns the length of the longest component of a path.
+ */
+static int protocol_longest_name(const char *path, int length)
+{
+  int longest = 0, start = 0;
+
+  for (int i = 0; i <= length; i++)
+    if (i == length || path[i] == '/')
+    {
+      if (i - start > longest)
+        longest = i - start;
+      start = i + 1;
+    }
+  return longest;
+}
+
+/*
+ * Checks the length of the paths of a request, and of each of their
+ * components, which must fit the file system's buffers: a name that does
+ * not fit a directory is rejected here, before any operation starts.
+ */
+static void protocol_check_paths(Request *request, int length1, int length2)
+{
+  if (request->data != NULL)
+    length2 = 0; /* not a path */
+  if (length1 >= MAX_PATH_LENGTH || length2 >= MAX_PATH_LENGTH ||
+      protocol_longest_name(request->path1, length1) >= MAX_FILE_NAME ||
+      protocol_longest_name(request->path2, length2) >= MAX_FILE_NAME)
+    request->error = TECNICOFS_ERROR_PATH_TOO_LONG;
+}
+
+/*
+ * Parses a text command ("c /a f") in place.
+ * Input:
+ *  - command: the command, NUL terminated (it is modified)
+ *  - request: where to store the request
+ */
+static void protocol_parse_command(char *command, Request *request)
+{
+  char *save, *arg2;
+
+  request->id = 0;
+  request->error = SUCCESS;
+  request->opcode = command[0];
+  request->arg = '\0';
+  request->path2 = "";
+  request->data = NULL;
+  if (command[0] == '\0' ||
+      (request->path1 = strtok_r(command + 1, TEXT_DELIM, &save)) == NULL)
+  {
+    request->path1 = "";
+    request->error = TECNICOFS_ERROR_OTHER;
+    return;
+  }
+
+  arg2 = strtok_r(NULL, TEXT_DELIM, &save);
+  if (request->opcode == TFS_OP_CREATE || request->opcode == TFS_OP_DELETE)
+    request->arg = arg2 != NULL ? arg2[0] : '\0';
+  else if (request->opcode == TFS_OP_MOVE)
+  {
+    if (arg2 == NULL)
+      request->error = TECNICOFS_ERROR_OTHER;
+    else
+      request->path2 = arg2;
+  }
+  protocol_check_paths(request, strlen(request->path1), strlen(request->path2));
+}
+
+/*
+ * Parses a text batch, "b <count>" followed by count commands, one per line.
+ * Returns: number of requests, or FAIL if the batch is malformed
+ */
+static int protocol_parse_text_batch(char *batch, Request *requests)
+{
+  int count, i;
+  char *commands[MAX_BATCH_SIZE], *save;
+
+  if (sscanf(batch, "b %d", &count) != 1 || count < 1 || count > MAX_BATCH_SIZE)
+    return FAIL;
+
+  /* split it all first, so that a truncated batch executes nothing */
+  strtok_r(batch, "\n", &save); /* skip the header */
+  for (i = 0; i < count; i++)
+  {
+    if ((commands[i] = strtok_r(NULL, "\n", &save)) == NULL)
+      return FAIL;
+  }
+  for (i = 0; i < count; i++)
+    protocol_parse_command(commands[i], &requests[i]);
+  return count;
+}
+
+/*
+ * Takes the arguments of a binary file request from where its second path
+ * would be.
+ * Input:
+ *  - request: the request, with path2 pointing to the arguments
+ *  - length: their length (with the data of a write)
+ */
+static void protocol_parse_file_args(Request *request, int length)
+{
+  TfsFileArgs args;
+
+  request->data = request->path2 + sizeof(TfsFileArgs);
+  request->path2 = "";
+  if (length < sizeof(TfsFileArgs))
+  {
+    request->error = TECNICOFS_ERROR_OTHER;
+    return;
+  }
+  memcpy(&args, request->data - sizeof(TfsFileArgs), sizeof(TfsFileArgs));
+  request->offset = args.offset;
+  request->size = args.size;
+  request->handle = args.handle;
+  if (args.handle > INT_MAX)
+    request->error = TECNICOFS_ERROR_BAD_HANDLE;
+  else if (args.offset > LONG_MAX || args.size > INT_MAX)
+    request->error = TECNICOFS_ERROR_FILE_TOO_BIG;
+  else if ((request->opcode == TFS_OP_WRITE || request->opcode == TFS_OP_APPEND) &&
+           request->arg != TFS_ARG_MEMFD && args.size != length - sizeof(TfsFileArgs))
+    request->error = TECNICOFS_ERROR_OTHER;
+}
+
+/*
+ * Parses binary requests, without copying: the paths are used where they
+ * are in the datagram, after checking they are NUL terminated.
+ * Returns: number of requests, or FAIL if the datagram is malformed
+ */
+static int protocol_parse_binary(char *datagram, int size, Request *requests)
+{
+  TfsHeader *header = (TfsHeader *)datagram;
+  TfsRequest *wire;
+  char *next = datagram + sizeof(TfsHeader), *end = datagram + size;
+  int i;
+
+  if (size < sizeof(TfsHeader) || header->version != TFS_VERSION ||
+      header->count < 1 || header->count > MAX_BATCH_SIZE)
+    return FAIL;
+
+  for (i = 0; i < header->count; i++)
+  {
+    wire = (TfsRequest *)next;
+    if (end - next < sizeof(TfsRequest) ||
+        end - next < TFS_REQUEST_SIZE(wire->length1, wire->length2))
+      return FAIL;
+
+    requests[i].id = wire->id;
+    requests[i].opcode = wire->opcode;
+    requests[i].arg = wire->arg;
+    requests[i].path1 = next + sizeof(TfsRequest);
+    requests[i].path2 = requests[i].path1 + wire->length1 + 1;
+    if (requests[i].path1[wire->length1] != '\0' ||
+        requests[i].path2[wire->length2] != '\0')
+      return FAIL;
+    requests[i].data = NULL;
+    requests[i].error = SUCCESS;
+    if (wire->opcode == TFS_OP_READ || wire->opcode == TFS_OP_WRITE ||
+        wire->opcode == TFS_OP_APPEND || wire->opcode == TFS_OP_TRUNCATE ||
+        wire->opcode == TFS_OP_SEEK || wire->opcode == TFS_OP_CLOSE)
+      protocol_parse_file_args(&requests[i], wire->length2);
+    protocol_check_paths(&requests[i], wire->length1, wire->length2);
+    next += TFS_REQUEST_SIZE(wire->length1, wire->length2);
+  }
+  return header->count;
+}
+
+/*
+ * Parses a request datagram, of either protocol.
+ * Input:
+ *  - datagram: the datagram, aligned to TFS_ALIGN, with room for a NUL after
+ *    its size bytes (it is modified, and the requests point into it)
+ *  - size: its size
+ *  - requests: where to store the requests (room for MAX_BATCH_SIZE)
+ *  - format: where to store its format, also set when it is malformed
+ * Returns: number of requests, or FAIL if the datagram is malformed
+ */
+int protocol_parse(char *datagram, int size, Request *requests,
+                   ProtocolFormat *format)
+{
+  if (size > 0 && (unsigned char)datagram[0] == TFS_MAGIC)
+  {
+    *format = PROTOCOL_BINARY;
+    return protocol_parse_binary(datagram, size, requests);
+  }
+
+  datagram[size] = '\0';
+  if (datagram[0] == 'b')
+  {
+    *format = PROTOCOL_TEXT_BATCH;
+    return protocol_parse_text_batch(datagram, requests);
+  }
+  *format = PROTOCOL_TEXT;
+  protocol_parse_command(datagram, &requests[0]);
+  return 1;
+}
+
+/*
+ * Builds the reply to a datagram.
+ * Input:
+ *  - format: the format of the datagram
+ *  - requests: its requests
+ *  - results: the result of each request
+ *  - count: number of requests, 0 if the datagram was malformed
+ *  - reply: where to build the reply (PROTOCOL_MAX_REPLY bytes)
+ * Returns: size of the reply
+ */
+int protocol_reply(ProtocolFormat format, Request *requests, int *results,
+                   int count, char *reply)
+{
+  TfsHeader *header = (TfsHeader *)reply;
+  TfsResult *wire = (TfsResult *)(reply + sizeof(TfsHeader));
+  int error = TECNICOFS_ERROR_OTHER;
+
+  if (format != PROTOCOL_BINARY)
+  {
+    /* a malformed text datagram gets a single error */
+    if (count == 0)
+    {
+      results = &error;
+      count = 1;
+    }
+    memcpy(reply, results, count * sizeof(int));
+    return count * sizeof(int);
+  }
+
+  /* a malformed binary datagram gets no results */
+  header->magic = TFS_MAGIC;
+  header->version = TFS_VERSION;
+  header->count = count;
+  for (int i = 0; i < count; i++)
+  {
+    wire[i].id = requests[i].id;
+    wire[i].result = results[i];
+  }
+  return sizeof(TfsHeader) + count * sizeof(TfsResult);
+}
@@ -0,0 +1,49 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "tecnicofs-api-constants.h"
+#include "tecnicofs-protocol.h"
+
+#ifndef FAIL
+#define FAIL -1
+#endif
+
+/* Room for the reply to the largest request datagram */
+#define PROTOCOL_MAX_REPLY (sizeof(TfsHeader) + MAX_BATCH_SIZE * sizeof(TfsResult))
+
+/*
+ * Format of a request datagram, which decides the format of its reply
+ */
+typedef enum protocolFormat {
+  PROTOCOL_TEXT,       /* one text command, the reply is an int */
+  PROTOCOL_TEXT_BATCH, /* "b <count>" and commands, the reply is count ints */
+  PROTOCOL_BINARY      /* TfsHeader and TfsRequests, see tecnicofs-protocol.h */
+} ProtocolFormat;
+
+/*
+ * A parsed request. The paths point into the datagram, NUL terminated;
+ * if error is not SUCCESS the request is not to be executed and error is
+ * its result. A file request (binary only) has no second path but its
+ * arguments, and the data of a write, which also points into the datagram;
+ * data is NULL for the other requests.
+ */
+typedef struct request {
+  unsigned int id;
+  char opcode; /* a TfsOpcode, or anything else if invalid */
+  char arg;
+  char *path1;
+  char *path2;
+  long offset; /* of a file request */
+  int size;
+  int handle;
+  char *data;
+  int error;
+} Request;
+
+int protocol_parse(char *datagram, int size, Request *requests,
+                   ProtocolFormat *format);
+
+int protocol_reply(ProtocolFormat format, Request *requests, int *results,
+                   int count, char *reply);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,164 @@
+/* tecnicofs-ring.h */
+#ifndef TECNICOFS_RING_H
+#define TECNICOFS_RING_H
+
+#include "tecnicofs-protocol.h"
+#include "tecnicofs-api-constants.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Shared memory transport, for clients on the same host.
+ *
+ * The client creates a memfd holding a TfsSharedRings, two eventfds and a
+ * pipe, and sends them to the server (SCM_RIGHTS) with a
+ * TFS_OP_SHARED_MEMORY request, over the socket: the memfd, sealed against
+ * shrinking, the eventfds and the pipe's read end, whose write end only the
+ * client keeps, so the server sees it hang up once the client is gone, even
+ * if it never detached. Once that succeeds, it writes its request
+ * datagrams (binary protocol, up to TFS_RING_DATAGRAM bytes) to the
+ * requests ring and a server thread of its own writes the replies to the
+ * replies ring: no system calls, while both sides keep up. Each ring has a
+ * single producer and a single consumer. A consumer with nothing to
+ * consume spins a while, then sleeps on its ring's eventfd, which the
+ * producer only writes to when the consumer says it is sleeping. A request
+ * of size 0 detaches the client.
+ */
+#define TFS_RING_SLOTS 256
+#define TFS_RING_DATAGRAM 4096
+#define TFS_RING_REPLY (sizeof(TfsHeader) + MAX_BATCH_SIZE * sizeof(TfsResult))
+
+/* Times a consumer checks an empty ring before sleeping (on multi-core) */
+#define TFS_RING_SPIN 4000
+
+/*
+ * The indexes of a ring: slots produced and consumed so far (wrapping),
+ * each written by one side only, on cache lines of their own
+ */
+typedef struct tfsRing
+{
+  uint32_t head __attribute__((aligned(64))); /* produced */
+  uint32_t tail __attribute__((aligned(64))); /* consumed */
+  uint32_t sleeping;                           /* the consumer sleeps */
+} TfsRing;
+
+typedef struct tfsRingRequest
+{
+  uint32_t size;
+  char datagram[TFS_RING_DATAGRAM] __attribute__((aligned(TFS_ALIGN)));
+} TfsRingRequest;
+
+typedef struct tfsRingReply
+{
+  uint32_t size;
+  char datagram[TFS_RING_REPLY] __attribute__((aligned(TFS_ALIGN)));
+} TfsRingReply;
+
+typedef struct tfsSharedRings
+{
+  TfsRing requests;
+  TfsRing replies;
+  TfsRingRequest requestSlots[TFS_RING_SLOTS];
+  TfsRingReply replySlots[TFS_RING_SLOTS];
+} TfsSharedRings;
+
+/*
+ * Producer: the slot to write next.
+ * Returns: the slot index, or -1 if the ring is full
+ */
+static inline int tfsRingFree(TfsRing *ring)
+{
+  if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TFS_RING_SLOTS)
+    return -1;
+  return ring->head % TFS_RING_SLOTS;
+}
+
+/*
+ * Producer: publishes the slot written, waking the consumer if it sleeps.
+ * head is stored before sleeping is loaded and the consumer does the
+ * opposite, so at least one of them sees the other's store.
+ */
+static inline void tfsRingProduce(TfsRing *ring, int eventfd)
+{
+  uint64_t one = 1;
+
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST))
+  {
+    if (write(eventfd, &one, sizeof(one)) < 0)
+      return; /* the consumer is gone */
+  }
+}
+
+/*
+ * Consumer: the slot to read next.
+ * Returns: the slot index, or -1 if the ring is empty
+ */
+static inline int tfsRingNext(TfsRing *ring)
+{
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+    return -1;
+  return ring->tail % TFS_RING_SLOTS;
+}
+
+/*
+ * Consumer: done with the slot read, which the producer may reuse.
+ */
+static inline void tfsRingConsume(TfsRing *ring)
+{
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Checks if the other side is gone: hangupfd hung up (for the server, the
+ * client closed the write end of the pipe whose read end it is).
+ */
+static inline int tfsRingHungUp(int hangupfd)
+{
+  struct pollfd pfd = {hangupfd, 0, 0};
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+/*
+ * Consumer: waits for a slot to read.
+ * Input:
+ *  - ring: the ring
+ *  - eventfd: the ring's eventfd
+ *  - hangupfd: see tfsRingHungUp
+ *  - spin: times to check the ring before sleeping
+ * Returns: the slot index, or -1 if the eventfd failed or the other side
+ *  is gone
+ */
+static inline int tfsRingWait(TfsRing *ring, int eventfd, int hangupfd, int spin)
+{
+  struct pollfd pfds[2] = {{eventfd, POLLIN, 0}, {hangupfd, 0, 0}};
+  uint64_t value;
+  int slot;
+
+  for (int i = 0; i < spin; i++)
+  {
+    if ((slot = tfsRingNext(ring)) >= 0)
+      return slot;
+  }
+  while (1)
+  {
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if ((slot = tfsRingNext(ring)) >= 0)
+      break;
+    if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+      break;
+    if (pfds[1].revents & (POLLHUP | POLLERR))
+      break; /* gone */
+    if (!(pfds[0].revents & POLLIN))
+      continue;
+    if (read(eventfd, &value, sizeof(value)) < 0 && errno != EINTR)
+      break;
+  }
+  __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+  return slot;
+}
+
+#endif /* TECNICOFS_RING_H */